@@ -0,0 +1,685 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "blk_cache.h"
+#include "disk_emu.h"
+
+struct blk_cache
+{
+    disk_t *disk;
+    char *frames;          // nframes * block_size bytes of block copies
+    int *frame_block;      // block held by each frame, -1 if unused
+    int *block_frame;      // frame holding each block or extra key, -1 if not cached
+    int *lru_prev, *lru_next;
+    int *pins;             // cache_pin count of each frame; pinned frames are off the LRU list
+    int lru_head, lru_tail; // head is the most recently used frame
+    int nframes, frames_used, block_size, num_blocks, num_keys;
+    unsigned long long hits, misses;
+    cache_verify_fn verify;
+    void *verify_arg;
+
+    /*Write-back state, see cache_set_writeback*/
+    char *dirty;           // frames whose block hasn't reached the disk yet
+    unsigned *wseq;        // bumped by every write to a frame, tells a rewrite during writeback
+    int *wb_blocks;        // dirty blocks of the pass in progress, in address order
+    unsigned *wb_seq;      // wseq of each of them when it was staged
+    char *wb_stage;        // copies of one batch of them, written while the lock is dropped
+    int ndirty, wb_pct, wb_expire_ms;
+    int wb_running, wb_stop, wb_flushing;
+    long long first_dirty_ns; // when the oldest dirty block was written, 0 if none
+    unsigned long long written_back;
+    pthread_t wb_thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wb_wake, wb_idle;
+};
+
+#define WRITEBACK_BATCH 64 // blocks staged per writeback request, at most
+
+/*---------------------------------------------*/
+/*Unlinks a frame from the LRU list            */
+/*---------------------------------------------*/
+static void lru_unlink(blk_cache *c, int f)
+{
+    if (c->lru_prev[f] != -1)
+        c->lru_next[c->lru_prev[f]] = c->lru_next[f];
+    else
+        c->lru_head = c->lru_next[f];
+    if (c->lru_next[f] != -1)
+        c->lru_prev[c->lru_next[f]] = c->lru_prev[f];
+    else
+        c->lru_tail = c->lru_prev[f];
+}
+
+static void lru_push_front(blk_cache *c, int f)
+{
+    c->lru_prev[f] = -1;
+    c->lru_next[f] = c->lru_head;
+    if (c->lru_head != -1)
+        c->lru_prev[c->lru_head] = f;
+    c->lru_head = f;
+    if (c->lru_tail == -1)
+        c->lru_tail = f;
+}
+
+static void lru_push_back(blk_cache *c, int f)
+{
+    c->lru_next[f] = -1;
+    c->lru_prev[f] = c->lru_tail;
+    if (c->lru_tail != -1)
+        c->lru_next[c->lru_tail] = f;
+    c->lru_tail = f;
+    if (c->lru_head == -1)
+        c->lru_head = f;
+}
+
+static void lru_touch(blk_cache *c, int f)
+{
+    if (c->lru_head == f || c->pins[f] > 0)
+        return;
+    lru_unlink(c, f);
+    lru_push_front(c, f);
+}
+
+/*---------------------------------------------------*/
+/*Copies a block into the cache, evicting the least   */
+/*recently used clean frame. Returns the frame, -1 if */
+/*every unpinned frame still waits for writeback.     */
+/*---------------------------------------------------*/
+static int cache_insert(blk_cache *c, int block, const void *data)
+{
+    int f = c->block_frame[block];
+
+    if (f == -1)
+    {
+        if (c->frames_used < c->nframes)
+        {
+            f = c->frames_used++;
+        }
+        else
+        {
+            /*lru_tail == -1 when every frame is pinned, the block goes uncached*/
+            f = c->lru_tail;
+            while (f != -1 && c->dirty[f])
+                f = c->lru_prev[f];
+            if (f == -1)
+                return -1;
+            lru_unlink(c, f);
+            if (c->frame_block[f] != -1)
+                c->block_frame[c->frame_block[f]] = -1;
+        }
+        c->frame_block[f] = block;
+        c->block_frame[block] = f;
+        lru_push_front(c, f);
+    }
+    else
+    {
+        lru_touch(c, f);
+    }
+    memcpy(c->frames + (size_t) f * c->block_size, data, c->block_size);
+    return f;
+}
+
+static long long now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int cmp_block(const void *a, const void *b)
+{
+    return *(const int *) a - *(const int *) b;
+}
+
+/*------------------------------------------------------------*/
+/*Writes every dirty block out in address order, one request   */
+/*per run of consecutive blocks, WRITEBACK_BATCH at a time.    */
+/*Called with the lock held; it is dropped around the writes,  */
+/*and a block written again meanwhile stays dirty. One pass    */
+/*runs at a time. -1 if a write failed, its blocks stay dirty. */
+/*------------------------------------------------------------*/
+static int write_dirty(blk_cache *c)
+{
+    int i, j, k, n = 0, res = 0;
+
+    while (c->wb_flushing)
+        pthread_cond_wait(&c->wb_idle, &c->lock);
+    if (c->ndirty == 0)
+        return 0;
+    c->wb_flushing = 1;
+
+    for (i = 0; i < c->frames_used; i++)
+    {
+        if (c->dirty[i])
+            c->wb_blocks[n++] = c->frame_block[i];
+    }
+    qsort(c->wb_blocks, n, sizeof(int), cmp_block);
+
+    for (i = 0; i < n; i += WRITEBACK_BATCH)
+    {
+        int m = n - i < WRITEBACK_BATCH ? n - i : WRITEBACK_BATCH;
+        int failed = 0;
+
+        /*Dirty frames are never evicted, so each block keeps its frame*/
+        for (j = 0; j < m; j++)
+        {
+            int f = c->block_frame[c->wb_blocks[i + j]];
+            memcpy(c->wb_stage + (size_t) j * c->block_size, c->frames + (size_t) f * c->block_size, c->block_size);
+            c->wb_seq[i + j] = c->wseq[f];
+        }
+        pthread_mutex_unlock(&c->lock);
+        for (j = 0; j < m; j = k)
+        {
+            k = j + 1;
+            while (k < m && c->wb_blocks[i + k] == c->wb_blocks[i + k - 1] + 1)
+                k++;
+            if (write_blocks_r(c->disk, c->wb_blocks[i + j], k - j, c->wb_stage + (size_t) j * c->block_size) != k - j)
+                failed = 1;
+        }
+        pthread_mutex_lock(&c->lock);
+
+        if (failed)
+        {
+            res = -1;
+            continue;
+        }
+        for (j = 0; j < m; j++)
+        {
+            int f = c->block_frame[c->wb_blocks[i + j]];
+            if (c->wseq[f] == c->wb_seq[i + j])
+            {
+                c->dirty[f] = 0;
+                c->ndirty--;
+                c->written_back++;
+            }
+        }
+    }
+
+    c->first_dirty_ns = c->ndirty > 0 ? now_ns() : 0;
+    c->wb_flushing = 0;
+    pthread_cond_broadcast(&c->wb_idle);
+    return res;
+}
+
+static int over_dirty_ratio(blk_cache *c)
+{
+    return c->ndirty * 100 >= c->wb_pct * c->nframes;
+}
+
+/*------------------------------------------------------------*/
+/*The writeback thread: sleeps until the dirty blocks pass the */
+/*ratio or the oldest of them passes the expiry, then writes   */
+/*all of them. After a failed pass it waits one expiry before  */
+/*trying again.                                                */
+/*------------------------------------------------------------*/
+static void *writeback_main(void *arg)
+{
+    blk_cache *c = arg;
+    long long expire_ns, wait_ns;
+    int failed = 0;
+
+    pthread_mutex_lock(&c->lock);
+    while (!c->wb_stop)
+    {
+        expire_ns = (long long) c->wb_expire_ms * 1000000LL;
+        wait_ns = expire_ns;
+        if (!failed && c->first_dirty_ns != 0)
+            wait_ns = c->first_dirty_ns + expire_ns - now_ns();
+        if (failed || (wait_ns > 0 && !over_dirty_ratio(c)))
+        {
+            long long until = now_ns() + wait_ns;
+            struct timespec ts = { until / 1000000000LL, until % 1000000000LL };
+            pthread_cond_timedwait(&c->wb_wake, &c->lock, &ts);
+        }
+        failed = 0;
+        if (c->wb_stop)
+            break;
+        if (c->ndirty > 0 && (over_dirty_ratio(c) || now_ns() - c->first_dirty_ns >= expire_ns))
+            failed = write_dirty(c) != 0;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return NULL;
+}
+
+/*------------------------------------------------------------*/
+/*Creates a cache of n frames in front of a disk of num_blocks */
+/*blocks, plus num_extra keys for derived blocks. n == 0 gives */
+/*a cache that passes everything through.                      */
+/*------------------------------------------------------------*/
+blk_cache *cache_create(disk_t *disk, int n, int block_size, int num_blocks, int num_extra)
+{
+    blk_cache *c = calloc(1, sizeof(blk_cache));
+    pthread_condattr_t attr;
+
+    if (c == NULL)
+        return NULL;
+    c->disk = disk;
+    c->block_size = block_size;
+    c->num_blocks = num_blocks;
+    c->num_keys = num_blocks + num_extra;
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&c->wb_wake, &attr);
+    pthread_cond_init(&c->wb_idle, NULL);
+    pthread_condattr_destroy(&attr);
+    if (n <= 0)
+        return c;
+
+    c->frames = malloc((size_t) n * block_size);
+    c->frame_block = malloc(n * sizeof(int));
+    c->block_frame = malloc(c->num_keys * sizeof(int));
+    c->lru_prev = malloc(n * sizeof(int));
+    c->lru_next = malloc(n * sizeof(int));
+    c->pins = calloc(n, sizeof(int));
+    c->dirty = calloc(n, 1);
+    c->wseq = calloc(n, sizeof(unsigned));
+    c->wb_blocks = malloc(n * sizeof(int));
+    c->wb_seq = malloc(n * sizeof(unsigned));
+    c->wb_stage = malloc((size_t) (n < WRITEBACK_BATCH ? n : WRITEBACK_BATCH) * block_size);
+    if (c->frames == NULL || c->frame_block == NULL || c->block_frame == NULL || c->lru_prev == NULL || c->lru_next == NULL || c->pins == NULL
+            || c->dirty == NULL || c->wseq == NULL || c->wb_blocks == NULL || c->wb_seq == NULL || c->wb_stage == NULL)
+    {
+        printf("Could not allocate a %d block cache\n", n);
+        cache_destroy(c);
+        return NULL;
+    }
+    c->nframes = n;
+    cache_invalidate(c);
+    return c;
+}
+
+/*------------------------------------------------------------*/
+/*Writes back whatever is dirty and frees the cache            */
+/*------------------------------------------------------------*/
+void cache_destroy(blk_cache *c)
+{
+    if (c == NULL)
+        return;
+    cache_set_writeback(c, 0, 0);
+    pthread_mutex_destroy(&c->lock);
+    pthread_cond_destroy(&c->wb_wake);
+    pthread_cond_destroy(&c->wb_idle);
+    free(c->frames);
+    free(c->frame_block);
+    free(c->block_frame);
+    free(c->lru_prev);
+    free(c->lru_next);
+    free(c->pins);
+    free(c->dirty);
+    free(c->wseq);
+    free(c->wb_blocks);
+    free(c->wb_seq);
+    free(c->wb_stage);
+    free(c);
+}
+
+/*---------------------------------------------*/
+/*Writes back and forgets every cached block.  */
+/*Pinned frames keep their contents until they */
+/*are unpinned.                                */
+/*---------------------------------------------*/
+void cache_invalidate(blk_cache *c)
+{
+    int i;
+
+    if (c->nframes == 0)
+        return;
+    pthread_mutex_lock(&c->lock);
+    write_dirty(c);
+    for (i = 0; i < c->num_keys; i++)
+        c->block_frame[i] = -1;
+    c->lru_head = c->lru_tail = -1;
+    for (i = 0; i < c->nframes; i++)
+    {
+        c->frame_block[i] = -1;
+        if (c->dirty[i])
+        {
+            c->dirty[i] = 0;
+            c->ndirty--;
+        }
+        if (i < c->frames_used && c->pins[i] == 0)
+            lru_push_back(c, i);
+    }
+    c->first_dirty_ns = 0;
+    pthread_mutex_unlock(&c->lock);
+}
+
+void cache_set_verify(blk_cache *c, cache_verify_fn fn, void *arg)
+{
+    c->verify = fn;
+    c->verify_arg = arg;
+}
+
+/*------------------------------------------------------------*/
+/*Switches between write-through (dirty_pct == 0) and write-   */
+/*back. In write-back mode writes only land in the cache and a */
+/*thread of the cache's own writes them out once dirty_pct     */
+/*percent of the frames are dirty or the oldest dirty block is */
+/*expire_ms old. Switching writes back what is dirty. -1 if    */
+/*the cache has no frames, the thread can't start or a write   */
+/*failed.                                                      */
+/*------------------------------------------------------------*/
+int cache_set_writeback(blk_cache *c, int dirty_pct, int expire_ms)
+{
+    int res;
+
+    if (c->nframes == 0)
+        return dirty_pct > 0 ? -1 : 0;
+
+    pthread_mutex_lock(&c->lock);
+    if (c->wb_running)
+    {
+        c->wb_stop = 1;
+        pthread_cond_signal(&c->wb_wake);
+        pthread_mutex_unlock(&c->lock);
+        pthread_join(c->wb_thread, NULL);
+        pthread_mutex_lock(&c->lock);
+        c->wb_running = 0;
+        c->wb_stop = 0;
+    }
+    res = write_dirty(c);
+    if (dirty_pct > 0)
+    {
+        c->wb_pct = dirty_pct > 100 ? 100 : dirty_pct;
+        c->wb_expire_ms = expire_ms > 0 ? expire_ms : 1;
+        if (pthread_create(&c->wb_thread, NULL, writeback_main, c) == 0)
+            c->wb_running = 1;
+        else
+            res = -1;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return res;
+}
+
+/*------------------------------------------------------------*/
+/*Writes every dirty block to the disk before returning, -1 if */
+/*any write failed                                             */
+/*------------------------------------------------------------*/
+int cache_flush(blk_cache *c)
+{
+    int res;
+
+    if (c->nframes == 0)
+        return 0;
+    pthread_mutex_lock(&c->lock);
+    res = write_dirty(c);
+    pthread_mutex_unlock(&c->lock);
+    return res;
+}
+
+/*------------------------------------------------------------*/
+/*Runs the verify hook over blocks just read from the disk     */
+/*------------------------------------------------------------*/
+static int verify_blocks(blk_cache *c, int start_address, int nblocks, const char *data)
+{
+    int i, res = 0;
+
+    if (c->verify == NULL)
+        return 0;
+    for (i = 0; i < nblocks; i++)
+    {
+        if (c->verify(c->verify_arg, start_address + i, data + (size_t) i * c->block_size) != 0)
+            res = -1;
+    }
+    return res;
+}
+
+/*------------------------------------------------------------*/
+/*Reads blocks like read_blocks, fetching only the runs of     */
+/*blocks that are not cached. *nmissed receives how many       */
+/*blocks came from the disk. -1 if any of them failed to read  */
+/*or verify; the rest of the buffer is still filled in.        */
+/*------------------------------------------------------------*/
+int cache_read_blocks(blk_cache *c, int start_address, int nblocks, void *buffer, int *nmissed)
+{
+    int i, run_start, missed = 0, bad = 0;
+    char *out = buffer;
+
+    pthread_mutex_lock(&c->lock);
+    if (c->nframes == 0 || start_address < 0 || start_address + nblocks > c->num_blocks)
+    {
+        if (nmissed != NULL)
+            *nmissed = nblocks;
+        c->misses += nblocks;
+        pthread_mutex_unlock(&c->lock);
+        if (read_blocks_r(c->disk, start_address, nblocks, buffer) < 0)
+            return -1;
+        return verify_blocks(c, start_address, nblocks, buffer) == 0 ? nblocks : -1;
+    }
+
+    i = 0;
+    while (i < nblocks)
+    {
+        int f = c->block_frame[start_address + i];
+        if (f != -1)
+        {
+            memcpy(out + (size_t) i * c->block_size, c->frames + (size_t) f * c->block_size, c->block_size);
+            lru_touch(c, f);
+            c->hits++;
+            i++;
+            continue;
+        }
+
+        /*Read the whole run of missing blocks with one request*/
+        run_start = i;
+        while (i < nblocks && c->block_frame[start_address + i] == -1)
+            i++;
+        if (read_blocks_r(c->disk, start_address + run_start, i - run_start, out + (size_t) run_start * c->block_size) < 0)
+        {
+            pthread_mutex_unlock(&c->lock);
+            return -1;
+        }
+        for (int j = run_start; j < i; j++)
+        {
+            /*A block that fails verification is returned but never cached*/
+            if (c->verify != NULL && c->verify(c->verify_arg, start_address + j, out + (size_t) j * c->block_size) != 0)
+                bad = 1;
+            else
+                cache_insert(c, start_address + j, out + (size_t) j * c->block_size);
+        }
+        missed += i - run_start;
+        c->misses += i - run_start;
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    if (nmissed != NULL)
+        *nmissed = missed;
+    return bad ? -1 : nblocks;
+}
+
+/*------------------------------------------------------------*/
+/*Write-through: writes blocks to the disk and keeps a copy of */
+/*each. Write-back: only marks the cached copies dirty. A block*/
+/*that finds no clean frame first makes the caller write back  */
+/*everything dirty, and is written through if there's still    */
+/*none.                                                        */
+/*------------------------------------------------------------*/
+int cache_write_blocks(blk_cache *c, int start_address, int nblocks, void *buffer)
+{
+    int i, s;
+    char *in = buffer;
+
+    pthread_mutex_lock(&c->lock);
+    if (!c->wb_running || start_address < 0 || start_address + nblocks > c->num_blocks)
+    {
+        s = write_blocks_r(c->disk, start_address, nblocks, buffer);
+        if (s >= 0 && c->nframes > 0)
+        {
+            for (i = 0; i < nblocks; i++)
+                cache_insert(c, start_address + i, in + (size_t) i * c->block_size);
+        }
+        pthread_mutex_unlock(&c->lock);
+        return s;
+    }
+
+    s = nblocks;
+    for (i = 0; i < nblocks; i++)
+    {
+        int block = start_address + i;
+        char *data = in + (size_t) i * c->block_size;
+        int f = cache_insert(c, block, data);
+
+        if (f == -1)
+        {
+            write_dirty(c);
+            f = cache_insert(c, block, data);
+        }
+        if (f == -1)
+        {
+            if (write_blocks_r(c->disk, block, 1, data) != 1)
+                s = -1;
+            continue;
+        }
+        c->wseq[f]++;
+        if (!c->dirty[f])
+        {
+            c->dirty[f] = 1;
+            if (c->ndirty++ == 0)
+                c->first_dirty_ns = now_ns();
+        }
+    }
+    if (over_dirty_ratio(c))
+        pthread_cond_signal(&c->wb_wake);
+    pthread_mutex_unlock(&c->lock);
+    return s;
+}
+
+/*------------------------------------------------------------*/
+/*Copies out the derived block kept under key, 1 on a hit      */
+/*------------------------------------------------------------*/
+int cache_get(blk_cache *c, int key, void *buffer)
+{
+    int f;
+
+    if (c->nframes == 0 || key < c->num_blocks || key >= c->num_keys)
+        return 0;
+    pthread_mutex_lock(&c->lock);
+    f = c->block_frame[key];
+    if (f == -1)
+    {
+        c->misses++;
+        pthread_mutex_unlock(&c->lock);
+        return 0;
+    }
+    memcpy(buffer, c->frames + (size_t) f * c->block_size, c->block_size);
+    lru_touch(c, f);
+    c->hits++;
+    pthread_mutex_unlock(&c->lock);
+    return 1;
+}
+
+void cache_put(blk_cache *c, int key, const void *buffer)
+{
+    if (c->nframes == 0 || key < c->num_blocks || key >= c->num_keys)
+        return;
+    pthread_mutex_lock(&c->lock);
+    cache_insert(c, key, buffer);
+    pthread_mutex_unlock(&c->lock);
+}
+
+/*------------------------------------------------------------*/
+/*Drops a derived block; its frame becomes the next to reuse   */
+/*------------------------------------------------------------*/
+void cache_forget(blk_cache *c, int key)
+{
+    int f;
+
+    if (c->nframes == 0 || key < c->num_blocks || key >= c->num_keys)
+        return;
+    pthread_mutex_lock(&c->lock);
+    f = c->block_frame[key];
+    if (f != -1)
+    {
+        c->block_frame[key] = -1;
+        c->frame_block[f] = -1;
+        if (c->pins[f] == 0)
+        {
+            lru_unlink(c, f);
+            lru_push_back(c, f);
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+/*------------------------------------------------------------*/
+/*Pins the frame holding block (or a derived key) and returns  */
+/*its memory, NULL if it isn't cached. A pinned frame is never */
+/*evicted; writes to its block keep updating it in place.      */
+/*Each cache_pin needs a cache_unpin.                          */
+/*------------------------------------------------------------*/
+const void *cache_pin(blk_cache *c, int key)
+{
+    int f;
+
+    if (c->nframes == 0 || key < 0 || key >= c->num_keys)
+        return NULL;
+    pthread_mutex_lock(&c->lock);
+    f = c->block_frame[key];
+    if (f == -1)
+    {
+        pthread_mutex_unlock(&c->lock);
+        return NULL;
+    }
+    if (c->pins[f]++ == 0)
+        lru_unlink(c, f);
+    c->hits++;
+    pthread_mutex_unlock(&c->lock);
+    return c->frames + (size_t) f * c->block_size;
+}
+
+/*------------------------------------------------------------*/
+/*Drops one pin of the frame cache_pin returned. Once the last */
+/*one goes the frame is the most recently used, or the next to */
+/*reuse if its block was forgotten meanwhile.                  */
+/*------------------------------------------------------------*/
+void cache_unpin(blk_cache *c, const void *frame)
+{
+    int f = ((const char *) frame - c->frames) / c->block_size;
+
+    pthread_mutex_lock(&c->lock);
+    if (--c->pins[f] == 0)
+    {
+        if (c->frame_block[f] == -1)
+            lru_push_back(c, f);
+        else
+            lru_push_front(c, f);
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+void cache_counts(blk_cache *c, unsigned long long *hits, unsigned long long *misses)
+{
+    pthread_mutex_lock(&c->lock);
+    if (hits != NULL)
+        *hits = c->hits;
+    if (misses != NULL)
+        *misses = c->misses;
+    pthread_mutex_unlock(&c->lock);
+}
+
+/*------------------------------------------------------------*/
+/*Reports the blocks waiting for writeback and how many blocks */
+/*writeback has written since the last reset                   */
+/*------------------------------------------------------------*/
+void cache_writeback_counts(blk_cache *c, unsigned long long *dirty, unsigned long long *written)
+{
+    pthread_mutex_lock(&c->lock);
+    if (dirty != NULL)
+        *dirty = c->ndirty;
+    if (written != NULL)
+        *written = c->written_back;
+    pthread_mutex_unlock(&c->lock);
+}
+
+void cache_reset_counts(blk_cache *c)
+{
+    pthread_mutex_lock(&c->lock);
+    c->hits = 0;
+    c->misses = 0;
+    c->written_back = 0;
+    pthread_mutex_unlock(&c->lock);
+}
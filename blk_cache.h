@@ -0,0 +1,53 @@
+#ifndef _INCLUDE_BLK_CACHE_H_
+#define _INCLUDE_BLK_CACHE_H_
+
+#include "disk_emu.h"
+
+/*
+ * LRU cache of disk blocks sitting on top of disk_emu. Reads are served
+ * from memory when possible. By default writes go straight through to the
+ * disk and leave a copy of the block behind. nframes == 0 disables caching.
+ * Each cache belongs to one disk and has a lock of its own, so the calls
+ * are safe from any thread.
+ *
+ * cache_set_writeback switches to write-back: writes only dirty the cached
+ * copy and a writeback thread owned by the cache writes dirty blocks out,
+ * in address order and in batches, once they pass a share of the frames
+ * or an age. Dirty frames are never evicted; a write that finds no clean
+ * frame writes everything back itself first. cache_flush writes back all
+ * dirty blocks before it returns, so it belongs before any disk_sync_r or
+ * disk_map_r. cache_destroy flushes as well.
+ *
+ * Blocks derived from disk contents (decompressed data) can share the
+ * frames under keys num_blocks .. num_blocks+num_extra-1 through cache_get,
+ * cache_put and cache_forget. Those never reach the disk.
+ *
+ * A verify hook set with cache_set_verify sees every block that comes from
+ * the disk before it is cached or returned; when it returns non-zero the
+ * read fails and the block stays out of the cache.
+ *
+ * cache_pin hands out the frame holding a block for direct access and keeps
+ * it from being evicted until the matching cache_unpin. While every frame
+ * is pinned, newly read blocks simply go uncached.
+ */
+typedef struct blk_cache blk_cache;
+typedef int (*cache_verify_fn)(void *arg, int block, const void *data);
+
+blk_cache *cache_create(disk_t *disk, int nframes, int block_size, int num_blocks, int num_extra);
+void cache_destroy(blk_cache *c);
+void cache_invalidate(blk_cache *c);
+void cache_set_verify(blk_cache *c, cache_verify_fn fn, void *arg);
+int cache_set_writeback(blk_cache *c, int dirty_pct, int expire_ms);
+int cache_flush(blk_cache *c);
+int cache_read_blocks(blk_cache *c, int start_address, int nblocks, void *buffer, int *nmissed);
+int cache_write_blocks(blk_cache *c, int start_address, int nblocks, void *buffer);
+int cache_get(blk_cache *c, int key, void *buffer);
+void cache_put(blk_cache *c, int key, const void *buffer);
+void cache_forget(blk_cache *c, int key);
+const void *cache_pin(blk_cache *c, int key);
+void cache_unpin(blk_cache *c, const void *frame);
+void cache_counts(blk_cache *c, unsigned long long *hits, unsigned long long *misses);
+void cache_writeback_counts(blk_cache *c, unsigned long long *dirty, unsigned long long *written);
+void cache_reset_counts(blk_cache *c);
+
+#endif //_INCLUDE_BLK_CACHE_H_
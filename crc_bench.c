@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sfs_crc.h"
+#include "sfs_layout.h"
+
+/*
+ * crc_bench: cost of the per-block checksums, one crc32c call per
+ * BLOCK_SIZE block the way the block cache verifies and updates them.
+ *
+ * Checksums a buffer of -m MB block by block, -r times, with the code
+ * crc32c picked for this CPU and with the portable tables, and reports
+ * ns per block, GB/s and the milliseconds one GB of blocks costs. A memcpy
+ * of the same blocks is included for scale. Results go to stdout as a
+ * table, or as JSON with -j.
+ *
+ * usage: crc_bench [-j] [-m MB] [-r reps]
+ */
+
+typedef struct crc_result {
+	const char *name;
+	double seconds;
+	uint64_t bytes;
+	uint32_t check;     // xor of every checksum, so the work can't be skipped
+} crc_result;
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+static void run(crc_result *r, const char *name, uint32_t (*fn)(const void*, size_t), const char *buf, size_t len, int reps) {
+	uint32_t check = 0;
+	uint64_t t = now_ns();
+	for (int i = 0; i < reps; i++) {
+		for (size_t off = 0; off + BLOCK_SIZE <= len; off += BLOCK_SIZE) {
+			check ^= fn(buf + off, BLOCK_SIZE);
+		}
+	}
+	r->name = name;
+	r->seconds = (now_ns() - t)/1e9;
+	r->bytes = (uint64_t) reps*(len/BLOCK_SIZE)*BLOCK_SIZE;
+	r->check = check;
+}
+
+static void run_memcpy(crc_result *r, const char *buf, size_t len, int reps) {
+	char block[BLOCK_SIZE];
+	uint32_t check = 0;
+	uint64_t t = now_ns();
+	for (int i = 0; i < reps; i++) {
+		for (size_t off = 0; off + BLOCK_SIZE <= len; off += BLOCK_SIZE) {
+			memcpy(block, buf + off, BLOCK_SIZE);
+			check ^= block[off % BLOCK_SIZE];
+		}
+	}
+	r->name = "memcpy";
+	r->seconds = (now_ns() - t)/1e9;
+	r->bytes = (uint64_t) reps*(len/BLOCK_SIZE)*BLOCK_SIZE;
+	r->check = check;
+}
+
+int main(int argc, char **argv) {
+	int json = 0, mb = 64, reps = 4;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "jm:r:")) != -1) {
+		switch (opt) {
+		case 'j': json = 1; break;
+		case 'm': mb = atoi(optarg) > 0 ? atoi(optarg) : 1; break;
+		case 'r': reps = atoi(optarg) > 0 ? atoi(optarg) : 1; break;
+		default:
+			fprintf(stderr, "usage: %s [-j] [-m MB] [-r reps]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	size_t len = (size_t) mb*1024*1024;
+	char *buf = malloc(len);
+	if (buf == NULL) {
+		fprintf(stderr, "crc_bench: cannot allocate %d MB\n", mb);
+		return 1;
+	}
+	srand(1);
+	for (size_t i = 0; i < len; i++) {
+		buf[i] = (char) rand();
+	}
+	if (crc32c(buf, len) != crc32c_sw(buf, len)) {
+		fprintf(stderr, "crc_bench: %s and table results differ\n", crc32c_impl());
+		return 1;
+	}
+
+	crc_result results[3];
+	run(&results[0], crc32c_impl(), crc32c, buf, len, reps);
+	run(&results[1], "table", crc32c_sw, buf, len, reps);
+	run_memcpy(&results[2], buf, len, reps);
+
+	if (json) {
+		printf("{\n  \"benchmark\": \"crc_bench\",\n  \"block_size\": %d,\n  \"mb\": %d,\n  \"reps\": %d,\n  \"results\": [\n",
+				BLOCK_SIZE, mb, reps);
+	} else {
+		printf("%-14s %12s %10s %10s\n", "impl", "ns/block", "GB/s", "ms/GB");
+	}
+	for (int i = 0; i < 3; i++) {
+		crc_result *r = &results[i];
+		double blocks = (double) r->bytes/BLOCK_SIZE;
+		double gbps = r->bytes/r->seconds/1e9;
+		if (json) {
+			printf("    {\"impl\": \"%s\", \"ns_per_block\": %.2f, \"gb_per_sec\": %.3f, \"ms_per_gb\": %.2f, \"check\": %u}%s\n",
+					r->name, r->seconds*1e9/blocks, gbps, 1e3/gbps, r->check, i < 2 ? "," : "");
+		} else {
+			printf("%-14s %12.2f %10.3f %10.2f\n", r->name, r->seconds*1e9/blocks, gbps, 1e3/gbps);
+		}
+	}
+	if (json) {
+		printf("  ]\n}\n");
+	}
+	free(buf);
+	return 0;
+}
@@ -3,178 +3,556 @@
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "disk_emu.h"
 
 
-FILE* fp = NULL;
-double L, p;
-double r;
-int BLOCK_SIZE, MAX_BLOCK, MAX_RETRY, lru;
+unsigned long long blocks_read, blocks_written; // running totals over every disk, for disk_io_counts()
+unsigned long long syncs;                        // fsync/fdatasync calls issued to any disk
 
-/*----------------------------------------------------------*/
-/*Close the disk file filled when you don't need it anymore. */
-/*----------------------------------------------------------*/
-int close_disk()
+/*Device performance model, see disk_set_model()*/
+#define MAX_QUEUE_DEPTH 64
+disk_model model;
+int model_set = 0;              // set once the model was chosen explicitly
+pthread_mutex_t model_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*One open disk image. lock covers the file position and the modelled queue.*/
+struct disk
+{
+    FILE *fp;
+    int block_size, max_block;
+    disk_model model;           // the device model in force when the disk was opened
+    long last_block;            // block after the end of the previous request
+    struct timespec channel_free[MAX_QUEUE_DEPTH]; // when each device channel goes idle
+    unsigned long long blocks_read, blocks_written, syncs;
+    pthread_mutex_t lock;
+};
+
+/*The disk used by init_disk/init_fresh_disk and every call without a disk_t*/
+disk_t *default_disk = NULL;
+
+/*-------------------------------------------------------------------*/
+/*Adds nanoseconds to a timespec                                     */
+/*-------------------------------------------------------------------*/
+static void ts_add_ns(struct timespec *ts, double ns)
+{
+    long long total = ts->tv_nsec + (long long) ns;
+    ts->tv_sec += total / 1000000000LL;
+    ts->tv_nsec = total % 1000000000LL;
+}
+
+static int ts_before(const struct timespec *a, const struct timespec *b)
+{
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/*-------------------------------------------------------------------*/
+/*Fills in one of the named device presets, returns -1 if unknown     */
+/*-------------------------------------------------------------------*/
+static int model_preset(const char *name, disk_model *m)
+{
+    memset(m, 0, sizeof(disk_model));
+    m->queue_depth = 1;
+    if (strcmp(name, "none") == 0)
+        return 0;
+    if (strcmp(name, "hdd") == 0)
+    {
+        /*7200 rpm class: half a rotation plus a seek that grows with distance*/
+        m->latency_us = 4000;
+        m->seek_us_per_block = 2;
+        m->max_seek_us = 8000;
+        m->bandwidth_mbps = 150;
+        return 0;
+    }
+    if (strcmp(name, "ssd") == 0)
+    {
+        /*SATA/NVMe class: flat access cost, several requests in flight*/
+        m->latency_us = 80;
+        m->bandwidth_mbps = 1500;
+        m->queue_depth = 8;
+        return 0;
+    }
+    return -1;
+}
+
+/*-------------------------------------------------------------------*/
+/*Parses a model spec: a preset name, optionally followed by          */
+/*comma separated overrides, e.g. "hdd,bw=80" or "lat=100,qd=4".      */
+/*Keys: lat (us), seek (us/block), maxseek (us), bw (MB/s), qd.       */
+/*-------------------------------------------------------------------*/
+int disk_parse_model(const char *spec, disk_model *m)
 {
-    if(NULL != fp)
+    char buf[256];
+    char *tok, *save;
+
+    model_preset("none", m);
+    strncpy(buf, spec, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+
+    for (tok = strtok_r(buf, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save))
     {
-        fclose(fp);
+        char *eq = strchr(tok, '=');
+        if (eq == NULL)
+        {
+            if (model_preset(tok, m) != 0)
+                return -1;
+            continue;
+        }
+        *eq = '\0';
+        double v = atof(eq + 1);
+        if (strcmp(tok, "lat") == 0)
+            m->latency_us = v;
+        else if (strcmp(tok, "seek") == 0)
+            m->seek_us_per_block = v;
+        else if (strcmp(tok, "maxseek") == 0)
+            m->max_seek_us = v;
+        else if (strcmp(tok, "bw") == 0)
+            m->bandwidth_mbps = v;
+        else if (strcmp(tok, "qd") == 0)
+            m->queue_depth = (int) v;
+        else
+            return -1;
     }
     return 0;
 }
 
-/*---------------------------------------*/
-/*Initializes a disk file filled with 0's*/
-/*---------------------------------------*/
-int init_fresh_disk(char *filename, int block_size, int num_blocks)
+/*-------------------------------------------------------------------*/
+/*Sets the device model for disks opened from now on and for the     */
+/*default disk                                                       */
+/*-------------------------------------------------------------------*/
+void disk_set_model(const disk_model *m)
 {
-    int i, j;
-    
-    /*Set up latency at 0.02 second*/
-    L = 00000.f;
-    /*Set up failure at 10%*/
-    p = -1.f;
-    /*Set up max retry attempts after failure to 3*/
-    MAX_RETRY = 3;
-
-    BLOCK_SIZE = block_size;
-    MAX_BLOCK = num_blocks;
-    
-    /*Initializes the random number generator*/
-    srand((unsigned int)(time( 0 )) );
-    /*Creates a new file*/
-    fp = fopen (filename, "w+b");
-
-    if (fp == NULL)
-    {
-        printf("Could not create new disk file %s\n\n", filename);
-        return -1;
+    pthread_mutex_lock(&model_lock);
+    model = *m;
+    if (model.queue_depth < 1)
+        model.queue_depth = 1;
+    if (model.queue_depth > MAX_QUEUE_DEPTH)
+        model.queue_depth = MAX_QUEUE_DEPTH;
+    model_set = 1;
+    if (default_disk != NULL)
+    {
+        pthread_mutex_lock(&default_disk->lock);
+        default_disk->model = model;
+        memset(default_disk->channel_free, 0, sizeof(default_disk->channel_free));
+        pthread_mutex_unlock(&default_disk->lock);
     }
-    
-    /*Fills the file with 0's to its given size*/
-    for (i = 0; i < MAX_BLOCK; i++)
+    pthread_mutex_unlock(&model_lock);
+}
+
+void disk_get_model(disk_model *m)
+{
+    pthread_mutex_lock(&model_lock);
+    *m = model;
+    pthread_mutex_unlock(&model_lock);
+}
+
+static void init_model()
+{
+    disk_model m;
+    const char *spec = getenv("SFS_DISK_MODEL");
+
+    if (model_set)
+        return;
+    if (spec == NULL || disk_parse_model(spec, &m) != 0)
     {
-        for (j = 0; j < BLOCK_SIZE; j++)
+        if (spec != NULL)
+            printf("Ignoring bad SFS_DISK_MODEL \"%s\"\n", spec);
+        model_preset("none", &m);
+    }
+    disk_set_model(&m);
+}
+
+/*-------------------------------------------------------------------*/
+/*Holds the caller until the modelled device would have finished the  */
+/*request. Its transfer is striped over up to queue_depth channels,   */
+/*the ones free soonest, and holds all of them until it is done.      */
+/*-------------------------------------------------------------------*/
+static void model_delay(disk_t *disk, int start_address, int nblocks)
+{
+    struct timespec now, done;
+    double service_ns;
+    long distance;
+    int c, i, best, lanes;
+    int used[MAX_QUEUE_DEPTH];
+
+    if (disk->model.latency_us <= 0 && disk->model.seek_us_per_block <= 0 && disk->model.bandwidth_mbps <= 0)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&disk->lock);
+    distance = labs(start_address - disk->last_block);
+    disk->last_block = start_address + nblocks;
+
+    lanes = nblocks < disk->model.queue_depth ? nblocks : disk->model.queue_depth;
+    if (lanes < 1)
+        lanes = 1;
+    service_ns = disk->model.latency_us * 1000.0;
+    if (disk->model.seek_us_per_block > 0 && distance > 0)
+    {
+        double seek = disk->model.seek_us_per_block * distance;
+        if (disk->model.max_seek_us > 0 && seek > disk->model.max_seek_us)
+            seek = disk->model.max_seek_us;
+        service_ns += seek * 1000.0;
+    }
+    if (disk->model.bandwidth_mbps > 0)
+        service_ns += (double) nblocks * disk->block_size / (disk->model.bandwidth_mbps * 1e6) * 1e9 / lanes;
+
+    /*Take the lanes channels that go idle first; the transfer starts once all of them are*/
+    done = now;
+    memset(used, 0, sizeof(used));
+    for (i = 0; i < lanes; i++)
+    {
+        best = -1;
+        for (c = 0; c < disk->model.queue_depth; c++)
         {
-            fputc(0, fp);
+            if (!used[c] && (best == -1 || ts_before(&disk->channel_free[c], &disk->channel_free[best])))
+                best = c;
         }
+        used[best] = 1;
+        if (ts_before(&done, &disk->channel_free[best]))
+            done = disk->channel_free[best];
+    }
+    ts_add_ns(&done, service_ns);
+    for (c = 0; c < disk->model.queue_depth; c++)
+    {
+        if (used[c])
+            disk->channel_free[c] = done;
     }
+    pthread_mutex_unlock(&disk->lock);
+
+    /*Sleep for the bulk of the wait and spin out the last few microseconds*/
+    done.tv_nsec -= 50000;
+    if (done.tv_nsec < 0)
+    {
+        done.tv_nsec += 1000000000L;
+        done.tv_sec--;
+    }
+    if (ts_before(&now, &done))
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &done, NULL);
+    ts_add_ns(&done, 50000);
+    do
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while (ts_before(&now, &done));
+}
+
+/*-------------------------------------------------------------------*/
+/*Opens the image at filename as a disk of its own. fresh creates the */
+/*image, replacing any file that was there, filled with 0's. Returns  */
+/*NULL if the file can't be opened or sized.                          */
+/*-------------------------------------------------------------------*/
+disk_t *disk_open(const char *filename, int block_size, int num_blocks, int fresh)
+{
+    disk_t *disk;
+    char *zeros;
+    int i;
+
+    /*Pick up SFS_DISK_MODEL unless a model was set through the API*/
+    init_model();
+    disk = calloc(1, sizeof(disk_t));
+    if (disk == NULL)
+        return NULL;
+    disk->block_size = block_size;
+    disk->max_block = num_blocks;
+    pthread_mutex_init(&disk->lock, NULL);
+    pthread_mutex_lock(&model_lock);
+    disk->model = model;
+    pthread_mutex_unlock(&model_lock);
+
+    /*Creates a new file or opens the existing one*/
+    disk->fp = fopen (filename, fresh ? "w+b" : "r+b");
+
+    if (disk->fp == NULL)
+    {
+        if (fresh)
+            printf("Could not create new disk file %s\n\n", filename);
+        else
+            printf("Could not open %s\n\n", filename);
+        disk_close(disk);
+        return NULL;
+    }
+    if (!fresh)
+        return disk;
+
+    /*Extends the empty file to its given size without writing anything, so  */
+    /*the image is sparse and every block reads back as 0's until written    */
+    if (ftruncate(fileno(disk->fp), (off_t) block_size * num_blocks) == 0)
+        return disk;
+
+    /*Filesystems without sparse file support get 0's written block by block*/
+    zeros = calloc(1, block_size);
+    for (i = 0; zeros != NULL && i < num_blocks; i++)
+    {
+        if (fwrite(zeros, block_size, 1, disk->fp) != 1)
+            break;
+    }
+    free(zeros);
+    if (i < num_blocks)
+    {
+        printf("Could not size disk file %s\n\n", filename);
+        disk_close(disk);
+        return NULL;
+    }
+    return disk;
+}
+
+/*----------------------------------------------------------*/
+/*Closes a disk opened with disk_open and frees it           */
+/*----------------------------------------------------------*/
+int disk_close(disk_t *disk)
+{
+    if (disk == NULL)
+        return 0;
+    if (disk->fp != NULL)
+        fclose(disk->fp);
+    pthread_mutex_destroy(&disk->lock);
+    free(disk);
+    return 0;
+}
+
+/*----------------------------------------------------------*/
+/*Close the disk file filled when you don't need it anymore. */
+/*----------------------------------------------------------*/
+int close_disk()
+{
+    disk_close(default_disk);
+    default_disk = NULL;
     return 0;
 }
+
+/*---------------------------------------*/
+/*Initializes a disk file filled with 0's*/
+/*---------------------------------------*/
+int init_fresh_disk(char *filename, int block_size, int num_blocks)
+{
+    close_disk();
+    default_disk = disk_open(filename, block_size, num_blocks, 1);
+    return default_disk != NULL ? 0 : -1;
+}
+
 /*----------------------------*/
 /*Initializes an existing disk*/
 /*----------------------------*/
 int init_disk(char *filename, int block_size, int num_blocks)
 {
-    /*Set up latency at 0.02 second*/
-    L = 00000.f;
-    /*Set up failure at 10%*/
-    p = -1.f;
-    /*Set up max retry attempts after failure to 3*/
-    MAX_RETRY = 3;
-
-    BLOCK_SIZE = block_size;
-    MAX_BLOCK = num_blocks;
-    
-    /*Initializes the random number generator*/
-    srand((unsigned int)(time( 0 )) );
-    
-    /*Opens a file*/
-    fp = fopen (filename, "r+b");
-
-    if (fp == NULL)
-    {
-        printf("Could not open %s\n\n", filename);
-        return -1;
-    }
-    return 0;
+    close_disk();
+    default_disk = disk_open(filename, block_size, num_blocks, 0);
+    return default_disk != NULL ? 0 : -1;
 }
 
 /*-------------------------------------------------------------------*/
 /*Reads a series of blocks from the disk into the buffer             */
 /*-------------------------------------------------------------------*/
-int read_blocks(int start_address, int nblocks, void *buffer)
+int read_blocks_r(disk_t *disk, int start_address, int nblocks, void *buffer)
 {
-    int i, j, e, s;
-    e = 0;
-    s = 0;
-
-    /*Sets up a temporary buffer*/
-    void* blockRead = (void*) malloc(BLOCK_SIZE);
+    int s;
 
     /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
+    if (disk == NULL || start_address < 0 || start_address + nblocks > disk->max_block)
     {
         printf("out of bound error %d\n", start_address);
         return -1;
     }
 
-    /*Goto the data requested from the disk*/
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+    /*Pause until the modelled device has served the request*/
+    model_delay(disk, start_address, nblocks);
 
-    /*For every block requested*/
-    for (i = 0; i < nblocks; ++i)
-    {
-        /*Pause until the latency duration is elapsed*/
-        // usleep(L);
+    pthread_mutex_lock(&disk->lock);
+    /*Goto the data requested from the disk*/
+    fseeko(disk->fp, (off_t) start_address * disk->block_size, SEEK_SET);
 
-        s++;
-        fread(blockRead, BLOCK_SIZE, 1, fp);
+    /*Read every requested block straight into the caller's buffer*/
+    s = fread(buffer, disk->block_size, nblocks, disk->fp);
 
-       for (j = 0; j < BLOCK_SIZE; j++)
-        {
-            memcpy(buffer+(i*BLOCK_SIZE), blockRead, BLOCK_SIZE);  
-        }
+    /*Blocks past the end of a short image were never written and read as 0's*/
+    if (s < nblocks && !ferror(disk->fp))
+    {
+        memset((char *) buffer + (size_t) s * disk->block_size, 0, (size_t) (nblocks - s) * disk->block_size);
+        s = nblocks;
     }
+    clearerr(disk->fp);
+    disk->blocks_read += s;
+    pthread_mutex_unlock(&disk->lock);
+    __atomic_fetch_add(&blocks_read, s, __ATOMIC_RELAXED);
 
-    free(blockRead);
-
-
-    /*If no failure return the number of blocks read, else return the negative number of failures*/
-    if (e == 0)
-        return s;
-    else
-        return e;
+    return s;
 }
 
 /*------------------------------------------------------------------*/
 /*Writes a series of blocks to the disk from the buffer             */
 /*------------------------------------------------------------------*/
-int write_blocks(int start_address, int nblocks, void *buffer)
+int write_blocks_r(disk_t *disk, int start_address, int nblocks, void *buffer)
 {
-    int i, e, s;
-    e = 0;
-    s = 0;
-
-    void* blockWrite = (void*) malloc(BLOCK_SIZE);
+    int s;
 
     /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
+    if (disk == NULL || start_address < 0 || start_address + nblocks > disk->max_block)
     {
-        printf("out of bound error: %d %d %d\n", start_address, nblocks, MAX_BLOCK);
+        printf("out of bound error: %d %d %d\n", start_address, nblocks, disk != NULL ? disk->max_block : 0);
         return -1;
     }
 
+    /*Pause until the modelled device has served the request*/
+    model_delay(disk, start_address, nblocks);
+
+    pthread_mutex_lock(&disk->lock);
     /*Goto where the data is to be written on the disk*/        
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+    fseeko(disk->fp, (off_t) start_address * disk->block_size, SEEK_SET);
 
-    /*For every block requested*/        
-    for (i = 0; i < nblocks; ++i)
-    {
-        /*Pause until the latency duration is elapsed*/
-        usleep(L);
+    /*Write every requested block in one go; disk_flush/disk_sync push it out*/
+    s = fwrite(buffer, disk->block_size, nblocks, disk->fp);
+    disk->blocks_written += s;
+    pthread_mutex_unlock(&disk->lock);
+    __atomic_fetch_add(&blocks_written, s, __ATOMIC_RELAXED);
+
+    return s;
+}
+
+/*------------------------------------------------------------------*/
+/*Maps a series of blocks of the image file into memory, read only.  */
+/*Buffered writes are flushed first so the mapping sees them; later  */
+/*writes show through once they are flushed. Costs one modelled read */
+/*of the blocks. NULL if the blocks can't be mapped, e.g. because    */
+/*they lie past the end of a short image.                            */
+/*------------------------------------------------------------------*/
+const void *disk_map_r(disk_t *disk, int start_address, int nblocks)
+{
+    struct stat st;
+    off_t offset, page_off;
+    char *p;
 
-        memcpy(blockWrite, buffer+(i*BLOCK_SIZE), BLOCK_SIZE);
+    if (disk == NULL || nblocks <= 0 || start_address < 0 || start_address + nblocks > disk->max_block)
+        return NULL;
 
-        fwrite(blockWrite, BLOCK_SIZE, 1, fp);
-        fflush(fp);
-        s++;
+    /*mmap wants a page aligned file offset, the blocks may start inside a page*/
+    offset = (off_t) start_address * disk->block_size;
+    page_off = offset % sysconf(_SC_PAGESIZE);
+
+    pthread_mutex_lock(&disk->lock);
+    if (fflush(disk->fp) != 0 || fstat(fileno(disk->fp), &st) != 0 || st.st_size < offset + (off_t) nblocks * disk->block_size)
+    {
+        pthread_mutex_unlock(&disk->lock);
+        return NULL;
+    }
+    p = mmap(NULL, page_off + (size_t) nblocks * disk->block_size, PROT_READ, MAP_SHARED, fileno(disk->fp), offset - page_off);
+    if (p == MAP_FAILED)
+    {
+        pthread_mutex_unlock(&disk->lock);
+        return NULL;
     }
-    free(blockWrite);
+    disk->blocks_read += nblocks;
+    pthread_mutex_unlock(&disk->lock);
+    __atomic_fetch_add(&blocks_read, nblocks, __ATOMIC_RELAXED);
+
+    model_delay(disk, start_address, nblocks);
+    return p + page_off;
+}
 
-    /*If no failure return the number of blocks written, else return the negative number of failures*/
-    if (e == 0)
-        return s;
-    else
-        return e;
+/*------------------------------------------------------------------*/
+/*Undoes disk_map_r, given the same blocks it was called with        */
+/*------------------------------------------------------------------*/
+int disk_unmap_r(disk_t *disk, const void *addr, int start_address, int nblocks)
+{
+    off_t page_off = (off_t) start_address * disk->block_size % sysconf(_SC_PAGESIZE);
+
+    return munmap((char *) addr - page_off, page_off + (size_t) nblocks * disk->block_size) == 0 ? 0 : -1;
+}
+
+/*------------------------------------------------------------------*/
+/*The image file's descriptor, for callers moving blocks with pread, */
+/*splice or sendfile themselves. Buffered writes only show once they */
+/*are flushed (disk_flush_r or disk_map_r).                          */
+/*------------------------------------------------------------------*/
+int disk_fd_r(disk_t *disk)
+{
+    return disk != NULL ? fileno(disk->fp) : -1;
+}
+
+int read_blocks(int start_address, int nblocks, void *buffer)
+{
+    return read_blocks_r(default_disk, start_address, nblocks, buffer);
+}
+
+int write_blocks(int start_address, int nblocks, void *buffer)
+{
+    return write_blocks_r(default_disk, start_address, nblocks, buffer);
+}
+
+/*------------------------------------------------------------------*/
+/*Reports how many blocks have been read and written since startup, */
+/*summed over every disk                                            */
+/*------------------------------------------------------------------*/
+void disk_io_counts(unsigned long long *nread, unsigned long long *nwritten)
+{
+    if (nread != NULL)
+        *nread = __atomic_load_n(&blocks_read, __ATOMIC_RELAXED);
+    if (nwritten != NULL)
+        *nwritten = __atomic_load_n(&blocks_written, __ATOMIC_RELAXED);
+}
+
+/*------------------------------------------------------------------*/
+/*Reports the blocks read and written and the syncs issued on one   */
+/*disk since it was opened                                          */
+/*------------------------------------------------------------------*/
+void disk_io_counts_r(disk_t *disk, unsigned long long *nread, unsigned long long *nwritten, unsigned long long *nsyncs)
+{
+    pthread_mutex_lock(&disk->lock);
+    if (nread != NULL)
+        *nread = disk->blocks_read;
+    if (nwritten != NULL)
+        *nwritten = disk->blocks_written;
+    if (nsyncs != NULL)
+        *nsyncs = disk->syncs;
+    pthread_mutex_unlock(&disk->lock);
+}
+
+/*------------------------------------------------------------------*/
+/*Hands buffered writes to the OS (page cache only, not durable)    */
+/*------------------------------------------------------------------*/
+int disk_flush_r(disk_t *disk)
+{
+    int res;
+
+    if (disk == NULL)
+        return -1;
+    pthread_mutex_lock(&disk->lock);
+    res = fflush(disk->fp) == 0 ? 0 : -1;
+    pthread_mutex_unlock(&disk->lock);
+    return res;
+}
+
+/*------------------------------------------------------------------*/
+/*Flushes and waits until written blocks are on stable storage.     */
+/*full also syncs file metadata (fsync), otherwise fdatasync.       */
+/*------------------------------------------------------------------*/
+int disk_sync_r(disk_t *disk, int full)
+{
+    int res;
+
+    if (disk_flush_r(disk) != 0)
+        return -1;
+    res = full ? fsync(fileno(disk->fp)) : fdatasync(fileno(disk->fp));
+    pthread_mutex_lock(&disk->lock);
+    disk->syncs++;
+    pthread_mutex_unlock(&disk->lock);
+    __atomic_fetch_add(&syncs, 1, __ATOMIC_RELAXED);
+    return res == 0 ? 0 : -1;
+}
+
+int disk_flush()
+{
+    return disk_flush_r(default_disk);
+}
+
+int disk_sync(int full)
+{
+    return disk_sync_r(default_disk, full);
+}
+
+unsigned long long disk_sync_count()
+{
+    return __atomic_load_n(&syncs, __ATOMIC_RELAXED);
 }
@@ -1,5 +1,54 @@
+#ifndef _INCLUDE_DISK_EMU_H_
+#define _INCLUDE_DISK_EMU_H_
+
+/*
+ * Device performance model applied to every read_blocks/write_blocks call.
+ * A request costs latency_us, plus seek_us_per_block for every block between
+ * it and the end of the previous request (capped at max_seek_us when that is
+ * non-zero), plus its transfer time at bandwidth_mbps (0 = unlimited). The
+ * device has queue_depth channels; a multi-block transfer is striped over up
+ * to that many of them and occupies each until it finishes, so the total
+ * throughput never exceeds bandwidth_mbps. All zeros (the default) adds no
+ * delay.
+ */
+typedef struct disk_model {
+    double latency_us;
+    double seek_us_per_block;
+    double max_seek_us;
+    double bandwidth_mbps;
+    int queue_depth;
+} disk_model;
+
+/*
+ * An open disk image. Each one has its own file, size, modelled device
+ * queue and counters, so separate disks can be used from separate threads
+ * at once. The calls without a disk_t work on one default disk, the one
+ * set up by init_disk/init_fresh_disk.
+ */
+typedef struct disk disk_t;
+
+disk_t *disk_open(const char *filename, int block_size, int num_blocks, int fresh);
+int disk_close(disk_t *disk);
+int read_blocks_r(disk_t *disk, int start_address, int nblocks, void *buffer);
+int write_blocks_r(disk_t *disk, int start_address, int nblocks, void *buffer);
+const void *disk_map_r(disk_t *disk, int start_address, int nblocks);
+int disk_unmap_r(disk_t *disk, const void *addr, int start_address, int nblocks);
+int disk_fd_r(disk_t *disk);
+int disk_flush_r(disk_t *disk);
+int disk_sync_r(disk_t *disk, int full);
+void disk_io_counts_r(disk_t *disk, unsigned long long *nread, unsigned long long *nwritten, unsigned long long *nsyncs);
+
 int init_fresh_disk(char *filename, int block_size, int num_blocks);
 int init_disk(char *filename, int block_size, int num_blocks);
 int read_blocks(int start_address, int nblocks, void *buffer);
 int write_blocks(int start_address, int nblocks, void *buffer);
 int close_disk();
+void disk_io_counts(unsigned long long *nread, unsigned long long *nwritten);
+int disk_flush();
+int disk_sync(int full);
+unsigned long long disk_sync_count();
+void disk_set_model(const disk_model *m);
+void disk_get_model(disk_model *m);
+int disk_parse_model(const char *spec, disk_model *m);
+
+#endif //_INCLUDE_DISK_EMU_H_
@@ -4,14 +4,58 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <dirent.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <sys/ioctl.h>
 #include "disk_emu.h"
 #include "sfs_api.h"
+#include "sfs_layout.h"
+
+/* largest read and write requests asked of the kernel, the most FUSE 2 allows */
+#define SFS_FUSE_MAX_IO (128*1024)
+
+/* read-only file exposing sfs_format_stats(), generated on every read */
+#define STATS_PATH "/.sfs_stats"
+#define STATS_BUF_SIZE (64*1024)
+
+/*
+ * ioctl(dst_fd, SFS_IOC_CLONE, src) makes the open file a clone of src, a
+ * path inside the mount such as "/template.txt", sharing its blocks. The
+ * kernel keeps FICLONE and copy_file_range away from this API version, so
+ * this is the reflink entry point.
+ */
+#define SFS_IOC_CLONE _IOW('S', 1, char[MAXFILENAME])
+
+/*
+ * ioctl(dst_fd, SFS_IOC_COPY_RANGE, &arg) copies len bytes at src_off in
+ * src to dst_off in the open file with sfs_copy_range, standing in for
+ * copy_file_range the same way. Returns the bytes copied.
+ */
+struct sfs_copy_range_arg {
+    char src[MAXFILENAME];
+    int src_off;
+    int dst_off;
+    int len;
+};
+#define SFS_IOC_COPY_RANGE _IOW('S', 2, struct sfs_copy_range_arg)
+
+/*
+ * ioctl(fd, SFS_IOC_DEFRAG, &report) on any file of the mount runs one
+ * sfs_defrag step and fills in its report. It returns the files moved, so
+ * a tool calls it until it returns 0 and other requests get served in
+ * between.
+ */
+#define SFS_IOC_DEFRAG _IOR('S', 3, sfs_defrag_report)
+
+static int is_stats_path(const char *path)
+{
+    return strcmp(path, STATS_PATH) == 0;
+}
 
 static int fuse_getattr(const char *path, struct stat *stbuf)
 {
@@ -23,6 +67,10 @@ static int fuse_getattr(const char *path, struct stat *stbuf)
     if (strcmp(path, "/") == 0) {
         stbuf->st_mode = S_IFDIR | 0755;
         stbuf->st_nlink = 2;
+    } else if (is_stats_path(path)) {
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = sfs_format_stats(NULL, 0);
     } else if((size = sfs_getfilesize(path)) != -1) {
         stbuf->st_mode = S_IFREG | 0666;
         stbuf->st_nlink = 1;
@@ -43,6 +91,7 @@ static int fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     
     filler(buf, ".", NULL, 0);
     filler(buf, "..", NULL, 0);
+    filler(buf, &STATS_PATH[1], NULL, 0);
     
     while(sfs_getnextfilename(file_name)) {
         filler(buf, &file_name[1], NULL, 0);
@@ -56,6 +105,9 @@ static int fuse_unlink(const char *path)
     int res;
     char filename[MAXFILENAME];
     
+    if (is_stats_path(path))
+        return -EACCES;
+    
     strcpy(filename, path);
     res = sfs_remove(filename);
     if (res == -1)
@@ -69,6 +121,14 @@ static int fuse_open(const char *path, struct fuse_file_info *fi)
     int res;
     char filename[MAXFILENAME];
     
+    if (is_stats_path(path)) {
+        if ((fi->flags & O_ACCMODE) != O_RDONLY)
+            return -EACCES;
+        /* contents change between getattr and read, so don't trust st_size */
+        fi->direct_io = 1;
+        return 0;
+    }
+    
     strcpy(filename, path);
     
     res = sfs_fopen(filename);
@@ -87,18 +147,32 @@ static int fuse_read(const char *path, char *buf, size_t size, off_t offset,
     
     char filename[MAXFILENAME];
     
+    if (is_stats_path(path)) {
+        char *text = malloc(STATS_BUF_SIZE);
+        int len;
+        
+        if (text == NULL)
+            return -ENOMEM;
+        len = sfs_format_stats(text, STATS_BUF_SIZE);
+        if (len > STATS_BUF_SIZE - 1)
+            len = STATS_BUF_SIZE - 1;
+        res = 0;
+        if (offset < len) {
+            res = len - offset < size ? len - offset : size;
+            memcpy(buf, text + offset, res);
+        }
+        free(text);
+        return res;
+    }
+    
     strcpy(filename, path);
     
     fd = sfs_fopen(filename);
     if (fd == -1)
         return -errno;
     
-    if(sfs_fseek(fd, offset) == -1)
-        return -errno;
-    
-    res = sfs_fread(fd, buf, size);
-    if (res == -1)
-        return -errno;
+    /* the API takes int offsets, anything past that is past the max file size */
+    res = offset > INT_MAX ? 0 : sfs_pread(fd, buf, size, offset);
     
     sfs_fclose(fd);
     return res;
@@ -112,20 +186,130 @@ static int fuse_write(const char *path, const char *buf, size_t size,
     
     char filename[MAXFILENAME];
     
+    if (is_stats_path(path))
+        return -EACCES;
+    
     strcpy(filename, path);
     
     fd = sfs_fopen(filename);
     if (fd == -1) 
         return -errno;
     
-    if(sfs_fseek(fd, offset) == -1)
-        return -errno;
+    res = offset > INT_MAX ? -EFBIG : sfs_pwrite(fd, buf, size, offset);
     
-    res = sfs_fwrite(fd, buf, size);
-    if (res == -1)
+    sfs_fclose(fd);
+    return res;
+}
+
+/* answers a read from memory filled by fuse_read */
+static int read_buf_copy(const char *path, struct fuse_bufvec **bufp,
+        size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec));
+    char *mem = malloc(size > 0 ? size : 1);
+    int res;
+    
+    if (bufv == NULL || mem == NULL) {
+        free(bufv);
+        free(mem);
+        return -ENOMEM;
+    }
+    res = fuse_read(path, mem, size, offset, fi);
+    if (res < 0) {
+        free(bufv);
+        free(mem);
+        return res;
+    }
+    *bufv = FUSE_BUFVEC_INIT(res);
+    bufv->buf[0].mem = mem;
+    *bufp = bufv;
+    return 0;
+}
+
+/*
+ * Reads answer with the image's own descriptor wherever the file's blocks
+ * lie back to back in it (see sfs_read_extent), so libfuse can splice them
+ * from the image into /dev/fuse without the data passing through here.
+ * The rest of the range is read into memory with sfs_pread. The reply
+ * covers the whole range up to the end of the file, a short one would
+ * read as zeros. The splice happens after this returns, which is safe only
+ * because main runs the mount single threaded.
+ */
+static int fuse_read_buf(const char *path, struct fuse_bufvec **bufp,
+        size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    struct fuse_bufvec *bufv;
+    struct fuse_buf *b;
+    sfs_extent ext;
+    char filename[MAXFILENAME];
+    int fd, n, stop = 0;
+    
+    if (is_stats_path(path) || offset > INT_MAX || size > INT_MAX)
+        return read_buf_copy(path, bufp, size, offset, fi);
+    
+    strcpy(filename, path);
+    
+    fd = sfs_fopen(filename);
+    if (fd == -1)
         return -errno;
     
+    /* every extent holds at least part of a block */
+    bufv = calloc(1, sizeof(struct fuse_bufvec) + (size / BLOCK_SIZE + 2) * sizeof(struct fuse_buf));
+    if (bufv == NULL) {
+        sfs_fclose(fd);
+        return -ENOMEM;
+    }
+    
+    while (!stop && (n = sfs_read_extent(fd, offset, size, &ext)) > 0) {
+        b = &bufv->buf[bufv->count++];
+        b->size = n;
+        b->fd = -1;
+        if (ext.in_place) {
+            b->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+            b->fd = ext.image_fd;
+            b->pos = ext.image_offset;
+        } else {
+            /* a block that can't be read ends the read short, as in fuse_read */
+            b->mem = malloc(n);
+            b->size = b->mem != NULL ? sfs_pread(fd, b->mem, n, offset) : 0;
+            stop = b->size < (size_t) n;
+        }
+        offset += n;
+        size -= n;
+    }
+    if (bufv->count == 0)
+        bufv->count = 1;
+    
     sfs_fclose(fd);
+    *bufp = bufv;
+    return 0;
+}
+
+/*
+ * Writes take the data where libfuse left it. One buffer in memory is
+ * written as it is, whole blocks of it going to the image straight from
+ * there (see sfs_pwrite). Data still in a pipe from /dev/fuse is moved to
+ * memory once first: blocks are checksummed and cached on their way to
+ * the image, so they can't be spliced into it.
+ */
+static int fuse_write_buf(const char *path, struct fuse_bufvec *buf,
+        off_t offset, struct fuse_file_info *fi)
+{
+    size_t size = fuse_buf_size(buf);
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+    struct fuse_buf *b = &buf->buf[buf->idx];
+    ssize_t copied;
+    int res;
+    
+    if (buf->count - buf->idx == 1 && !(b->flags & FUSE_BUF_IS_FD))
+        return fuse_write(path, (char *) b->mem + buf->off, size, offset, fi);
+    
+    dst.buf[0].mem = malloc(size > 0 ? size : 1);
+    if (dst.buf[0].mem == NULL)
+        return -ENOMEM;
+    copied = fuse_buf_copy(&dst, buf, 0);
+    res = copied < 0 ? copied : fuse_write(path, dst.buf[0].mem, copied, offset, fi);
+    free(dst.buf[0].mem);
     return res;
 }
 
@@ -134,6 +318,9 @@ static int fuse_truncate(const char *path, off_t size)
     char filename[MAXFILENAME];
     int fd;
     
+    if (is_stats_path(path))
+        return -EACCES;
+    
     strcpy(filename, path);
     
     fd = sfs_remove(filename);
@@ -145,6 +332,14 @@ static int fuse_truncate(const char *path, off_t size)
     return 0;
 }
 
+static int fuse_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    /* files aren't kept open between calls, so sync the whole image */
+    if (sfs_sync() == -1)
+        return -EIO;
+    return 0;
+}
+
 static int fuse_access(const char *path, int mask)
 {
     return 0;
@@ -160,6 +355,9 @@ static int fuse_create (const char *path, mode_t mode, struct fuse_file_info *fp
     char filename[MAXFILENAME];
     int fd;
     
+    if (is_stats_path(path))
+        return -EEXIST;
+    
     strcpy(filename, path);
     fd = sfs_fopen(filename);
     
@@ -167,6 +365,75 @@ static int fuse_create (const char *path, mode_t mode, struct fuse_file_info *fp
     return 0;
 }
 
+static int fuse_copy_range(const char *path, struct sfs_copy_range_arg *arg)
+{
+    char src[MAXFILENAME];
+    char filename[MAXFILENAME];
+    int srcfd, dstfd;
+    int res;
+    
+    memcpy(src, arg->src, MAXFILENAME);
+    src[MAXFILENAME-1] = '\0';
+    strcpy(filename, path);
+    
+    /* sfs_fopen creates missing files, the source has to exist already */
+    if (sfs_getfilesize(src) == -1)
+        return -ENOENT;
+    srcfd = sfs_fopen(src);
+    if (srcfd == -1)
+        return -EIO;
+    dstfd = sfs_fopen(filename);
+    if (dstfd == -1) {
+        sfs_fclose(srcfd);
+        return -EIO;
+    }
+    
+    res = sfs_copy_range(srcfd, arg->src_off, dstfd, arg->dst_off, arg->len);
+    if (dstfd != srcfd)
+        sfs_fclose(dstfd);
+    sfs_fclose(srcfd);
+    if (res == -1)
+        return -EINVAL;
+    return res;
+}
+
+static int fuse_ioctl(const char *path, int cmd, void *arg,
+        struct fuse_file_info *fi, unsigned int flags, void *data)
+{
+    char src[MAXFILENAME];
+    char filename[MAXFILENAME];
+    int res;
+    
+    if (is_stats_path(path))
+        return -EACCES;
+    
+    switch ((unsigned int) cmd) {
+    case SFS_IOC_CLONE:
+        memcpy(src, data, MAXFILENAME);
+        src[MAXFILENAME-1] = '\0';
+        strcpy(filename, path);
+        if (sfs_clone(src, filename) == -1)
+            return -EINVAL;
+        return 0;
+    case SFS_IOC_COPY_RANGE:
+        return fuse_copy_range(path, data);
+    case SFS_IOC_DEFRAG:
+        res = sfs_defrag(data);
+        return res == -1 ? -EROFS : res;
+    default:
+        return -ENOTTY;
+    }
+}
+
+static void *fuse_init(struct fuse_conn_info *conn)
+{
+    /* replies may be spliced from the image, and writes come in large requests */
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_BIG_WRITES);
+    conn->max_write = SFS_FUSE_MAX_IO;
+    conn->max_readahead = SFS_FUSE_MAX_IO;
+    return NULL;
+}
+
 static struct fuse_operations xmp_oper = {
     .getattr = fuse_getattr,
     .readdir = fuse_readdir,
@@ -176,13 +443,35 @@ static struct fuse_operations xmp_oper = {
     .open = fuse_open, 
     .read = fuse_read, 
     .write = fuse_write, 
+    .read_buf = fuse_read_buf,
+    .write_buf = fuse_write_buf,
+    .fsync = fuse_fsync,
     .access = fuse_access,
     .create = fuse_create,
+    .ioctl = fuse_ioctl,
+    .init = fuse_init,
 };
 
 int main(int argc, char *argv[])
 {
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    char max_read[32];
+    int res;
+    
     mksfs(1);
     
-    return fuse_main(argc, argv, &xmp_oper, NULL);
+    snprintf(max_read, sizeof(max_read), "-omax_read=%d", SFS_FUSE_MAX_IO);
+    if (fuse_opt_add_arg(&args, max_read) == -1)
+        return 1;
+    /*
+     * The sfs core is not safe for overlapping calls on one handle, so
+     * requests have to be served one at a time. That also keeps the image
+     * extents fuse_read_buf hands back in place until libfuse has spliced
+     * them.
+     */
+    if (fuse_opt_add_arg(&args, "-s") == -1)
+        return 1;
+    res = fuse_main(args.argc, args.argv, &xmp_oper, NULL);
+    fuse_opt_free_args(&args);
+    return res;
 }
@@ -1,121 +1,283 @@
 
 #include "sfs_api.h"
+#include "sfs_layout.h"
 #include "bitmap.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <fuse.h>
 #include <strings.h>
 #include "disk_emu.h"
+#include "blk_cache.h"
+#include "sfs_trace.h"
+#include "sfs_capture.h"
+#include "sfs_lz.h"
+#include "sfs_crc.h"
 
 //#define PRINT_ERRORS
-//#define PRINT_FN_CALLS
-//#define PRINT_SFS_FOPEN
-//#define PRINT_SFS_FREAD
-//#define PRINT_SFS_FWRITE
 
 #define CEILING(num, denom) ((num % denom == 0) ? num/denom : num/denom+1)
 #define FLOOR(num, denom) (num/denom)
 
-#define LASTNAME_FIRSTNAME_DISK "sfs_disk.disk"
-#define NUM_BLOCKS 1024  //maximum number of data blocks on the disk.
-#define NUM_INODES 100	//max number of inodes
-#define BLOCK_SIZE 1024
-
-#define NUM_BLOCKS_SUPERBLOCK  1
-#define NUM_BLOCKS_INODET      8
-#define NUM_BLOCKS_FREE_BITMAP 1
-#define BLOCK_INDEX_SUPERBLOCK     0
-#define BLOCK_INDEX_INODET        (BLOCK_INDEX_SUPERBLOCK+NUM_BLOCKS_SUPERBLOCK)
-#define BLOCK_INDEX_DATA_BLOCKS   (BLOCK_INDEX_INODET+NUM_BLOCKS_INODET)
-#define BLOCK_INDEX_FREE_BITMAP   (BLOCK_INDEX_DATA_BLOCKS+NUM_BLOCKS)
-#define NUM_TOTAL_BLOCKS (NUM_BLOCKS_SUPERBLOCK+NUM_BLOCKS_INODET+NUM_BLOCKS+NUM_BLOCKS_FREE_BITMAP)
-
-#define FREE_BM_SIZE (130) // ceiling of NUM_TOTAL_BLOCKS/8
-#define INODE_TABLE_BM_SIZE (13) // ceiling of num inodes/8
-#define FD_TABLE_BM_SIZE (13)     // ceiling of num inodes/8
-#define DIR_ENTRIES_BM_SIZE (13) //ceiling of num inodes/8
-
-file_descriptor fd_table[NUM_INODES];
-inode_t inode_table[NUM_INODES];
-directory_entry rootDir[NUM_INODES];
-superblock_t super_block;
-int inodeIndexForRootDir=0;
-int dirEntryIndexForRootDir=0;
-int dirEntryTrackerIndex;
-
-//initialize all bitmaps to high
-uint8_t free_bit_map[FREE_BM_SIZE] = { [0 ... FREE_BM_SIZE - 1] = UINT8_MAX };
-uint8_t inode_table_bit_map[INODE_TABLE_BM_SIZE] = { [0 ... INODE_TABLE_BM_SIZE - 1] = UINT8_MAX };
-uint8_t dir_entries_bit_map[DIR_ENTRIES_BM_SIZE] = { [0 ... DIR_ENTRIES_BM_SIZE - 1] = UINT8_MAX };
-uint8_t fd_table_bit_map[FD_TABLE_BM_SIZE] = { [0 ... FD_TABLE_BM_SIZE - 1] = UINT8_MAX };
-
-void init_free_bm() {
-	memset(free_bit_map, UINT8_MAX, FREE_BM_SIZE);
-
-	force_set_index(free_bit_map, BLOCK_INDEX_FREE_BITMAP);
-}
-
-void init_fdt() {
+// Files up to INLINE_DATA_SIZE bytes keep their data over the block pointers
+#define IS_INLINE(inode) (SFS_MODE_TYPE((inode)->mode) == SFS_MODE_INLINE)
+#define INLINE_DATA(inode) ((char*) (inode)->data_ptrs)
+
+// Packed files keep their last block as a fragment in a shared tail block
+#define IS_TAIL(inode) (SFS_MODE_TYPE((inode)->mode) == SFS_MODE_TAIL)
+#define SET_MODE_TYPE(inode, type) ((inode)->mode = SFS_MODE_FLAGS((inode)->mode) | (type))
+#define LAST_BLOCK(inode) (((inode)->size-1)/BLOCK_SIZE)
+#define TAIL_MAX_FRAG_SIZE ((BLOCK_SIZE-TAIL_DATA_START)/2) // larger fragments keep their own block
+
+// Compressed clusters are cached decompressed, keyed by their first block
+#define IS_COMPRESS(inode) ((SFS_MODE_FLAGS((inode)->mode) & SFS_MODE_COMPRESS) != 0)
+#define CLUSTER_KEY(first_block, i) (NUM_IMAGE_BLOCKS + (first_block)*CLUSTER_BLOCKS + (i))
+
+// Entry of a data block in the refcount table
+#define REFS(fs, block) ((fs)->refs[(block)-BLOCK_INDEX_DATA_BLOCKS])
+
+// A block some snapshot holds must not be written in place or handed out
+#define IS_HELD(fs, block) (!((fs)->snap_map[(block)/8] & (1 << ((block)%8))))
+
+#define DEFAULT_CACHE_BLOCKS 128 // override with SFS_CACHE_BLOCKS, 0 turns the cache off
+#define COPY_CHUNK_BLOCKS 16     // blocks sfs_copy_range moves per read and write when it has to copy
+#define MAX_VIEWS 64             // sfs_mmap views one instance can have out at once
+
+// What backs an sfs_mmap view
+typedef enum view_kind {
+	VIEW_FRAME,     // a pinned cache frame, for ranges inside one block
+	VIEW_IMAGE,     // blocks of the image file mapped with disk_map_r
+	VIEW_COPY       // a private copy read with do_preadv
+} view_kind;
+
+typedef struct sfs_view {
+	const char *addr;   // what sfs_mmap returned, NULL for a free entry
+	view_kind kind;
+	const void *mem;    // the pinned frame, the mapping or the copy
+	int block, nblocks; // image blocks behind a VIEW_IMAGE
+	int inodeIndex;     // file the view shows
+} sfs_view;
+
+// Small appends a descriptor holds back, see buffer_append
+typedef struct append_buf {
+	int start;          // file offset of data[0], always the inode's size
+	int len;            // 0 when empty
+	int lost;           // a flush dropped bytes earlier calls were told were written
+	char data[BLOCK_SIZE];
+} append_buf;
+
+// Everything one mounted image needs; sfs_mount hands out one of these
+struct sfs {
+	disk_t *disk;
+	blk_cache *cache;
+	file_descriptor fd_table[NUM_INODES];
+	inode_t inode_table[NUM_INODES];
+	directory_entry rootDir[NUM_INODES];
+	superblock_t super_block;
+	int inodeIndexForRootDir;
+	int dirEntryIndexForRootDir;
+	int dirEntryTrackerIndex;
+
+	// in every bitmap a set bit is free
+	uint8_t free_bit_map[FREE_BM_SIZE];
+	uint8_t inode_table_bit_map[INODE_TABLE_BM_SIZE];
+	uint8_t dir_entries_bit_map[DIR_ENTRIES_BM_SIZE];
+	uint8_t fd_table_bit_map[FD_TABLE_BM_SIZE];
+
+	sfs_stats stats;
+
+	sfs_durability durability;
+	int durability_interval_ms;
+	uint64_t write_gen;     // bumped by every block write
+	uint64_t synced_gen;    // write_gen already covered by an fsync
+	uint64_t last_sync_ns;
+	int writeback_pct;      // dirty share of the cache that starts writeback, 0 for write-through
+	int writeback_expire_ms;
+
+	int tail_block;         // tail block new fragments are packed into, -1 for none yet
+	int compress;           // new files get SFS_MODE_COMPRESS
+
+	// shared blocks, see sfs_layout.h
+	uint8_t refs[NUM_BLOCKS];
+	uint16_t dedup_index[DEDUP_INDEX_SLOTS];
+	int refs_dirty;
+	int dedup_index_dirty;
+	int dedup;              // full block writes look for a block to share
+
+	// CRC32C of every block, as in the checksum region (SFS_FEATURE_CHECKSUMS)
+	int checksums;
+	uint32_t csums[NUM_BLOCKS_CHECKSUM*CHECKSUMS_PER_BLOCK];
+	int csum_dirty_lo, csum_dirty_hi; // checksum blocks to write out, lo > hi for none
+
+	// snapshots, see sfs_api.h; snap_map clears every block any of them holds
+	snapshot_entry snapshots[SFS_MAX_SNAPSHOTS];
+	uint8_t snap_map[FREE_BM_SIZE];
+	int readonly;           // a mounted snapshot, nothing may change
+
+	sfs_view views[MAX_VIEWS];
+	int defrag_next;        // directory slot the next sfs_defrag step starts at
+	append_buf appends[NUM_INODES]; // by descriptor
+	int capture_id;         // instance number in workload captures
+};
+
+// Durability picked up by instances mounted from now on, see sfs_set_durability
+sfs_durability default_durability = SFS_DURABILITY_NONE;
+int default_durability_interval_ms = 1000;
+int durability_set = 0;     // chosen through sfs_set_durability, don't read SFS_DURABILITY
+
+// Writeback default for instances mounted from now on, see sfs_set_writeback
+int default_writeback_pct = 0;
+int default_writeback_expire_ms = 1000;
+int writeback_set = 0;      // chosen through sfs_set_writeback, don't read SFS_WRITEBACK
+
+// Compression default for instances mounted from now on, see sfs_set_compression
+int default_compress = 0;
+int compress_set = 0;       // chosen through sfs_set_compression, don't read SFS_COMPRESS
+
+// Dedup default for instances mounted from now on, see sfs_set_dedup
+int default_dedup = 0;
+int dedup_set = 0;          // chosen through sfs_set_dedup, don't read SFS_DEDUP
+
+// The instance mounted by mksfs, used by every call without a handle
+sfs_t *legacy_fs = NULL;
+
+// All block I/O goes through these so it is cached and counted per region
+// Keeps the checksums of blocks being written; the table goes out with write_checksums_to_disk
+static void update_checksums(sfs_t *fs, int start_address, int nblocks, const char *buffer) {
+	for(int i=0; i<nblocks && start_address+i < NUM_TOTAL_BLOCKS; i++) {
+		int block = start_address+i;
+		fs->csums[block] = crc32c(buffer+i*BLOCK_SIZE, BLOCK_SIZE);
+		if(block/CHECKSUMS_PER_BLOCK < fs->csum_dirty_lo) {
+			fs->csum_dirty_lo = block/CHECKSUMS_PER_BLOCK;
+		}
+		if(block/CHECKSUMS_PER_BLOCK > fs->csum_dirty_hi) {
+			fs->csum_dirty_hi = block/CHECKSUMS_PER_BLOCK;
+		}
+	}
+}
+
+// The cache's verify hook: only blocks coming from the device are checked
+static int verify_checksum(void *arg, int block, const void *data) {
+	sfs_t *fs = arg;
+	if(!fs->checksums || block >= NUM_TOTAL_BLOCKS || crc32c(data, BLOCK_SIZE) == fs->csums[block]) {
+		return 0;
+	}
+	fs->stats.checksum_errors++;
+	#ifdef PRINT_ERRORS
+	printf("! sfs: block %d does not match its checksum\n", block);
+	#endif
+	return -1;
+}
+
+int fs_read_blocks(sfs_t *fs, sfs_region region, int start_address, int nblocks, void *buffer) {
+	int nmissed = 0;
+	uint64_t t = SFS_TRACE_START();
+	int res = cache_read_blocks(fs->cache, start_address, nblocks, buffer, &nmissed);
+	SFS_TRACE_IO(block_read, SFS_EV_READ, region, start_address, nblocks, t);
+	stats_record_io(&fs->stats, region, nmissed, 0);
+	return res;
+}
+
+int fs_write_blocks(sfs_t *fs, sfs_region region, int start_address, int nblocks, void *buffer) {
+	uint64_t t = SFS_TRACE_START();
+	int res = cache_write_blocks(fs->cache, start_address, nblocks, buffer);
+	if(fs->checksums) {
+		update_checksums(fs, start_address, nblocks, buffer);
+	}
+	fs->write_gen++;
+	SFS_TRACE_IO(block_write, SFS_EV_WRITE, region, start_address, nblocks, t);
+	stats_record_io(&fs->stats, region, nblocks, 1);
+	return res;
+}
+
+int init_cache(sfs_t *fs) {
+	int nblocks = DEFAULT_CACHE_BLOCKS;
+	char *env = getenv("SFS_CACHE_BLOCKS");
+	if(env != NULL) {
+		nblocks = atoi(env);
+	}
+	fs->cache = cache_create(fs->disk, nblocks, BLOCK_SIZE, NUM_IMAGE_BLOCKS, NUM_TOTAL_BLOCKS*CLUSTER_BLOCKS);
+	if(fs->cache == NULL) {
+		return -1;
+	}
+	cache_set_verify(fs->cache, verify_checksum, fs);
+	if(fs->writeback_pct > 0 && cache_set_writeback(fs->cache, fs->writeback_pct, fs->writeback_expire_ms) != 0) {
+		printf("Cannot start writeback, writing through\n");
+		fs->writeback_pct = 0;
+	}
+	return 0;
+}
+
+void init_free_bm(sfs_t *fs) {
+	memset(fs->free_bit_map, UINT8_MAX, FREE_BM_SIZE);
+
+	force_set_index(fs->free_bit_map, BLOCK_INDEX_FREE_BITMAP);
+}
+
+void init_fdt(sfs_t *fs) {
 	for(int i=0; i<NUM_INODES; i++) {
-		fd_table[i].inode = NULL;
-		fd_table[i].inodeIndex = -1;
-		fd_table[i].rwptr = 0;
+		fs->fd_table[i].inode = NULL;
+		fs->fd_table[i].inodeIndex = -1;
+		fs->fd_table[i].rwptr = 0;
+		fs->fd_table[i].write_gen = 0;
 	}
 	// Initialize bitmap for file descriptor table
-	memset(fd_table_bit_map, UINT8_MAX, FD_TABLE_BM_SIZE);
+	memset(fs->fd_table_bit_map, UINT8_MAX, FD_TABLE_BM_SIZE);
 	
-	dirEntryTrackerIndex=0;
+	fs->dirEntryTrackerIndex=0;
 }
 
-void init_inodet() {
+void init_inodet(sfs_t *fs) {
 	for(int i=0; i<NUM_INODES; i++) {
-		inode_table[i].mode = -1;
-		inode_table[i].link_cnt = -1;
-		inode_table[i].uid = -1;
-		inode_table[i].gid = -1;
-		inode_table[i].size = -1;
-		inode_table[i].indirectPointer = -1;
+		fs->inode_table[i].mode = -1;
+		fs->inode_table[i].link_cnt = -1;
+		fs->inode_table[i].uid = -1;
+		fs->inode_table[i].gid = -1;
+		fs->inode_table[i].size = -1;
+		fs->inode_table[i].indirectPointer = -1;
 		for(int j=0; j<12; j++) {
-			inode_table[i].data_ptrs[j] = -1;
+			fs->inode_table[i].data_ptrs[j] = -1;
 		}
 	}
 	// Initialize bitmap for inode table
-	memset(inode_table_bit_map, UINT8_MAX, INODE_TABLE_BM_SIZE);
+	memset(fs->inode_table_bit_map, UINT8_MAX, INODE_TABLE_BM_SIZE);
 
 	for (int i = 0; i < NUM_BLOCKS_INODET; ++i) {
-		force_set_index(free_bit_map, BLOCK_INDEX_INODET+i);
+		force_set_index(fs->free_bit_map, BLOCK_INDEX_INODET+i);
 	}
 }
 
-void init_super(){
-	super_block.magic = 0xACBD0005;
-	super_block.block_size = BLOCK_SIZE;
-	super_block.fs_size = NUM_TOTAL_BLOCKS;
-	super_block.inode_table_len = 0;
-	super_block.root_dir_inode = 0;
+void init_super(sfs_t *fs){
+	fs->super_block.magic = SFS_MAGIC;
+	fs->super_block.block_size = BLOCK_SIZE;
+	fs->super_block.fs_size = NUM_TOTAL_BLOCKS;
+	fs->super_block.inode_table_len = 0;
+	fs->super_block.root_dir_inode = 0;
+	fs->super_block.refcount_block = 0;
+	fs->super_block.dedup_index_block = 0;
+	fs->super_block.features = SFS_FEATURE_CHECKSUMS;
+	fs->super_block.snapshot_block = 0;
 
-	force_set_index(free_bit_map, BLOCK_INDEX_SUPERBLOCK);
+	force_set_index(fs->free_bit_map, BLOCK_INDEX_SUPERBLOCK);
 }
 
-void init_rootDir(){
+void init_rootDir(sfs_t *fs){
 	// Get free index from inode table bitmap
-	int inodeIndexForRootDir = get_index(inode_table_bit_map);
+	fs->inodeIndexForRootDir = get_index(fs->inode_table_bit_map);
 
 	// Write inode entry for rootDir
-	inode_table[inodeIndexForRootDir].size = 0; // assume directory has 0 size
-	inode_table[inodeIndexForRootDir].data_ptrs[0] = get_index(free_bit_map);
-	inode_table[inodeIndexForRootDir].data_ptrs[1] = get_index(free_bit_map);
-	inode_table[inodeIndexForRootDir].data_ptrs[2] = get_index(free_bit_map);
+	fs->inode_table[fs->inodeIndexForRootDir].size = 0; // assume directory has 0 size
+	fs->inode_table[fs->inodeIndexForRootDir].data_ptrs[0] = get_index(fs->free_bit_map);
+	fs->inode_table[fs->inodeIndexForRootDir].data_ptrs[1] = get_index(fs->free_bit_map);
+	fs->inode_table[fs->inodeIndexForRootDir].data_ptrs[2] = get_index(fs->free_bit_map);
 	
 	// Initialize bit map for dir entry
-	memset(dir_entries_bit_map, UINT8_MAX, DIR_ENTRIES_BM_SIZE);
+	memset(fs->dir_entries_bit_map, UINT8_MAX, DIR_ENTRIES_BM_SIZE);
 	
 	// Initialize directory entries 
 	for(int i=0; i<NUM_INODES; i++) {
-		rootDir[i].num = -1;
+		fs->rootDir[i].num = -1;
 		for(int j=0; j<MAX_FILE_NAME; j++) {
-			rootDir[i].name[j]= '\0';
+			fs->rootDir[i].name[j]= '\0';
 		}
 	}
 	
@@ -125,194 +287,348 @@ void init_rootDir(){
 	//rootDir[dirEntryIndexForRootDir].name[0] = '/';	
 }
 
-void write_superblock_to_disk() {
+void write_superblock_to_disk(sfs_t *fs) {
 	// Initialize buffer
 	char buffer[BLOCK_SIZE];
 	memset(buffer, 0, BLOCK_SIZE);
 	
 	// Put super_block into buffer (need 1 block)
-	memcpy(buffer, &super_block, sizeof(superblock_t));
+	memcpy(buffer, &fs->super_block, sizeof(superblock_t));
 	
 	// Write block to disk
-	write_blocks(BLOCK_INDEX_SUPERBLOCK, 1, buffer);
+	fs_write_blocks(fs, SFS_REGION_SUPERBLOCK, BLOCK_INDEX_SUPERBLOCK, 1, buffer);
 }
 
-void write_rootDir_to_disk() {
-	// Initialize buffer
-	char buffer[3*BLOCK_SIZE];
+// Lays out the root directory and its bitmap the way they sit on disk
+void pack_rootDir(sfs_t *fs, char *buffer) {
 	memset(buffer, 0, 3*BLOCK_SIZE);
 	
 	// Put rootDir and dir_entries_bit_map into buffer (need 3 blocks)
 	unsigned int rootDir_num_bytes = NUM_INODES*sizeof(directory_entry);
 	unsigned int dir_entries_bm_num_bytes = DIR_ENTRIES_BM_SIZE*sizeof(uint8_t);
-	memcpy(buffer+0, rootDir, rootDir_num_bytes);
-	memcpy(buffer+rootDir_num_bytes, dir_entries_bit_map, dir_entries_bm_num_bytes);
+	memcpy(buffer+0, fs->rootDir, rootDir_num_bytes);
+	memcpy(buffer+rootDir_num_bytes, fs->dir_entries_bit_map, dir_entries_bm_num_bytes);
+}
+
+void write_rootDir_to_disk(sfs_t *fs) {
+	char buffer[3*BLOCK_SIZE];
+	pack_rootDir(fs, buffer);
 	
 	// Write buffer blocks to disk
-	write_blocks(inode_table[inodeIndexForRootDir].data_ptrs[0], 1, buffer+0);
-	write_blocks(inode_table[inodeIndexForRootDir].data_ptrs[1], 1, buffer+BLOCK_SIZE);
-	write_blocks(inode_table[inodeIndexForRootDir].data_ptrs[2], 1, buffer+2*BLOCK_SIZE);
+	fs_write_blocks(fs, SFS_REGION_DIRECTORY, fs->inode_table[fs->inodeIndexForRootDir].data_ptrs[0], 1, buffer+0);
+	fs_write_blocks(fs, SFS_REGION_DIRECTORY, fs->inode_table[fs->inodeIndexForRootDir].data_ptrs[1], 1, buffer+BLOCK_SIZE);
+	fs_write_blocks(fs, SFS_REGION_DIRECTORY, fs->inode_table[fs->inodeIndexForRootDir].data_ptrs[2], 1, buffer+2*BLOCK_SIZE);
 	
 }
 
-void write_inodet_to_disk() {
-	// Initialize buffer
-	char buffer[8*BLOCK_SIZE];
+// Lays out the inode table and its bitmap the way they sit on disk
+void pack_inodet(sfs_t *fs, char *buffer) {
 	memset(buffer, 0, 8*BLOCK_SIZE);
 	
 	// Put inode_table and inode_table_bit_map into buffer (need 8 blocks)
 	unsigned int inode_table_num_bytes = NUM_INODES*sizeof(inode_t);
 	unsigned int inode_table_bm_num_bytes = INODE_TABLE_BM_SIZE*sizeof(uint8_t);
-	memcpy(buffer+0, inode_table, inode_table_num_bytes);
-	memcpy(buffer+inode_table_num_bytes, inode_table_bit_map, inode_table_bm_num_bytes);
+	memcpy(buffer+0, fs->inode_table, inode_table_num_bytes);
+	memcpy(buffer+inode_table_num_bytes, fs->inode_table_bit_map, inode_table_bm_num_bytes);
+}
+
+void write_inodet_to_disk(sfs_t *fs) {
+	char buffer[8*BLOCK_SIZE];
+	pack_inodet(fs, buffer);
 	
 	// Write blocks to disk
-	write_blocks(BLOCK_INDEX_INODET, 8, buffer);
+	fs_write_blocks(fs, SFS_REGION_INODE_TABLE, BLOCK_INDEX_INODET, 8, buffer);
+}
+
+// Writes only the inode table block(s) holding one inode
+void write_inode_to_disk(sfs_t *fs, int inodeIndex) {
+	char buffer[8*BLOCK_SIZE];
+	pack_inodet(fs, buffer);
+
+	int first = inodeIndex*sizeof(inode_t)/BLOCK_SIZE;
+	int last = ((inodeIndex+1)*sizeof(inode_t)-1)/BLOCK_SIZE;
+	fs_write_blocks(fs, SFS_REGION_INODE_TABLE, BLOCK_INDEX_INODET+first, last-first+1, buffer+first*BLOCK_SIZE);
 }
 
-void write_free_bm_to_disk() {
+void write_free_bm_to_disk(sfs_t *fs) {
 	// Initialize buffer
 	char buffer[BLOCK_SIZE];
 	memset(buffer, 0, BLOCK_SIZE);
 	
 	// Put free_bit_map into buffer
 	unsigned int free_bm_num_bytes = FREE_BM_SIZE*sizeof(uint8_t);
-	memcpy(buffer+0, free_bit_map, free_bm_num_bytes);
+	memcpy(buffer+0, fs->free_bit_map, free_bm_num_bytes);
 
 	// Write free_bit_map to disk
-	write_blocks(BLOCK_INDEX_FREE_BITMAP, 1, buffer);
+	fs_write_blocks(fs, SFS_REGION_BITMAP, BLOCK_INDEX_FREE_BITMAP, 1, buffer);
 }
 
-void read_superblock_from_disk() {
+void read_superblock_from_disk(sfs_t *fs) {
 	// Initialize buffer
 	char buffer[BLOCK_SIZE];
 	memset(buffer, 0, BLOCK_SIZE);
 	
 	// Read superblock into buffer
-	read_blocks(BLOCK_INDEX_SUPERBLOCK, 1, buffer);
+	fs_read_blocks(fs, SFS_REGION_SUPERBLOCK, BLOCK_INDEX_SUPERBLOCK, 1, buffer);
 	
 	// Copy to super_block struct
-	memcpy(&super_block, buffer+0, sizeof(superblock_t));
+	memcpy(&fs->super_block, buffer+0, sizeof(superblock_t));
 }
 
-void read_inodet_from_disk() {
+// Copies buffer content to inode_table and inode_table_bit_map
+void unpack_inodet(sfs_t *fs, const char *buffer) {
+	unsigned int inode_table_num_bytes = NUM_INODES*sizeof(inode_t);
+	unsigned int inode_table_bm_num_bytes = INODE_TABLE_BM_SIZE*sizeof(uint8_t);
+	memcpy(&fs->inode_table, buffer+0, inode_table_num_bytes);
+	memcpy(&fs->inode_table_bit_map, buffer+inode_table_num_bytes, inode_table_bm_num_bytes);
+}
+
+void read_inodet_from_disk(sfs_t *fs) {
 	// Initialize buffer
 	char buffer[8*BLOCK_SIZE];
 	memset(buffer, 0, 8*BLOCK_SIZE);
 	
 	// Read individual blocks from disk to buffer
-	read_blocks(BLOCK_INDEX_INODET, 8, buffer);
-	
-	// Copy buffer content to inode_table and inode_table_bit_map
-	unsigned int inode_table_num_bytes = NUM_INODES*sizeof(inode_t);
-	unsigned int inode_table_bm_num_bytes = INODE_TABLE_BM_SIZE*sizeof(uint8_t);
-	memcpy(&inode_table, buffer+0, inode_table_num_bytes);
-	memcpy(&inode_table_bit_map, buffer+inode_table_num_bytes, inode_table_bm_num_bytes);
+	fs_read_blocks(fs, SFS_REGION_INODE_TABLE, BLOCK_INDEX_INODET, 8, buffer);
+	unpack_inodet(fs, buffer);
 }
 
-void read_rootDir_from_disk() {
+void read_rootDir_from_disk(sfs_t *fs) {
 	// Initialize buffer
 	char buffer[3*BLOCK_SIZE];
 	memset(buffer, 0, 3*BLOCK_SIZE);
 	
 	// Read individual blocks from disk to buffer
-	read_blocks(inode_table[inodeIndexForRootDir].data_ptrs[0], 1, buffer+0);
-	read_blocks(inode_table[inodeIndexForRootDir].data_ptrs[1], 1, buffer+BLOCK_SIZE);
-	read_blocks(inode_table[inodeIndexForRootDir].data_ptrs[2], 1, buffer+2*BLOCK_SIZE);
+	fs_read_blocks(fs, SFS_REGION_DIRECTORY, fs->inode_table[fs->inodeIndexForRootDir].data_ptrs[0], 1, buffer+0);
+	fs_read_blocks(fs, SFS_REGION_DIRECTORY, fs->inode_table[fs->inodeIndexForRootDir].data_ptrs[1], 1, buffer+BLOCK_SIZE);
+	fs_read_blocks(fs, SFS_REGION_DIRECTORY, fs->inode_table[fs->inodeIndexForRootDir].data_ptrs[2], 1, buffer+2*BLOCK_SIZE);
 	
 	// Copy buffer content to rootDir and dir_entries_bit_map
 	unsigned int rootDir_num_bytes = NUM_INODES*sizeof(directory_entry);
 	unsigned int dir_entries_bm_num_bytes = DIR_ENTRIES_BM_SIZE*sizeof(uint8_t);
-	memcpy(&rootDir, buffer+0, rootDir_num_bytes);
-	memcpy(&dir_entries_bit_map, buffer+rootDir_num_bytes, dir_entries_bm_num_bytes);
+	memcpy(&fs->rootDir, buffer+0, rootDir_num_bytes);
+	memcpy(&fs->dir_entries_bit_map, buffer+rootDir_num_bytes, dir_entries_bm_num_bytes);
 }
 
-void read_free_bm_from_disk() {
+void read_free_bm_from_disk(sfs_t *fs) {
 	// Initialize buffer
 	char buffer[BLOCK_SIZE];
 	memset(buffer, 0, BLOCK_SIZE);
 	
 	// Read data block bitmaps from disk to buffer
-	read_blocks(BLOCK_INDEX_FREE_BITMAP, 1, buffer);
+	fs_read_blocks(fs, SFS_REGION_BITMAP, BLOCK_INDEX_FREE_BITMAP, 1, buffer);
 	
 	// Copy buffer content to free_bit_map
 	unsigned int free_bm_num_bytes = FREE_BM_SIZE*sizeof(uint8_t);
-	memcpy(&free_bit_map, buffer+0, free_bm_num_bytes);
+	memcpy(&fs->free_bit_map, buffer+0, free_bm_num_bytes);
 }
 
-void open_rootDir_in_fdt() {
-	int rootDirIndexForFdtable = get_index(fd_table_bit_map);
-	fd_table[rootDirIndexForFdtable].inode = &inode_table[inodeIndexForRootDir];
-	fd_table[rootDirIndexForFdtable].inodeIndex = dirEntryIndexForRootDir;
-	fd_table[rootDirIndexForFdtable].rwptr = 0;
+// The refcount table and dedup index, left all zero when the image has none yet
+void read_shared_from_disk(sfs_t *fs) {
+	char buffer[BLOCK_SIZE];
+
+	if(IS_DATA_BLOCK(fs->super_block.refcount_block)) {
+		fs_read_blocks(fs, SFS_REGION_REFCOUNT, fs->super_block.refcount_block, 1, buffer);
+		memcpy(fs->refs, buffer, sizeof(fs->refs));
+	}
+	if(IS_DATA_BLOCK(fs->super_block.dedup_index_block)) {
+		fs_read_blocks(fs, SFS_REGION_REFCOUNT, fs->super_block.dedup_index_block, 1, buffer);
+		memcpy(fs->dedup_index, buffer, sizeof(fs->dedup_index));
+	}
 }
 
-void mksfs(int fresh) {
-	init_fdt();
+// Writes out whichever of the refcount table and dedup index changed
+void write_shared_to_disk(sfs_t *fs) {
+	char buffer[BLOCK_SIZE];
+
+	if(fs->refs_dirty && IS_DATA_BLOCK(fs->super_block.refcount_block)) {
+		memset(buffer, 0, BLOCK_SIZE);
+		memcpy(buffer, fs->refs, sizeof(fs->refs));
+		fs_write_blocks(fs, SFS_REGION_REFCOUNT, fs->super_block.refcount_block, 1, buffer);
+	}
+	if(fs->dedup_index_dirty && IS_DATA_BLOCK(fs->super_block.dedup_index_block)) {
+		memset(buffer, 0, BLOCK_SIZE);
+		memcpy(buffer, fs->dedup_index, sizeof(fs->dedup_index));
+		fs_write_blocks(fs, SFS_REGION_REFCOUNT, fs->super_block.dedup_index_block, 1, buffer);
+	}
+	fs->refs_dirty = 0;
+	fs->dedup_index_dirty = 0;
+}
+
+// Every block of a fresh image reads as zeros until it is written
+void init_checksums(sfs_t *fs) {
+	char zeros[BLOCK_SIZE];
+	memset(zeros, 0, BLOCK_SIZE);
+	uint32_t crc = crc32c(zeros, BLOCK_SIZE);
+	for(int i=0; i<NUM_TOTAL_BLOCKS; i++) {
+		fs->csums[i] = crc;
+	}
+	fs->checksums = 1;
+	fs->csum_dirty_lo = 0;
+	fs->csum_dirty_hi = NUM_BLOCKS_CHECKSUM-1;
+}
+
+void read_checksums_from_disk(sfs_t *fs) {
+	fs_read_blocks(fs, SFS_REGION_CHECKSUM, BLOCK_INDEX_CHECKSUM, NUM_BLOCKS_CHECKSUM, fs->csums);
+	fs->checksums = 1;
+}
+
+// Writes the checksum blocks that changed since the last call, in one request
+void write_checksums_to_disk(sfs_t *fs) {
+	if(!fs->checksums || fs->csum_dirty_lo > fs->csum_dirty_hi) {
+		return;
+	}
+	fs_write_blocks(fs, SFS_REGION_CHECKSUM, BLOCK_INDEX_CHECKSUM+fs->csum_dirty_lo, fs->csum_dirty_hi-fs->csum_dirty_lo+1,
+			fs->csums+fs->csum_dirty_lo*CHECKSUMS_PER_BLOCK);
+	fs->csum_dirty_lo = NUM_BLOCKS_CHECKSUM;
+	fs->csum_dirty_hi = -1;
+}
+
+// Clears in snap_map every block some snapshot holds
+void rebuild_snap_map(sfs_t *fs) {
+	memset(fs->snap_map, UINT8_MAX, FREE_BM_SIZE);
+	for(int i=0; i<SFS_MAX_SNAPSHOTS; i++) {
+		if(fs->snapshots[i].name[0] == '\0') {
+			continue;
+		}
+		for(int j=0; j<FREE_BM_SIZE; j++) {
+			fs->snap_map[j] &= fs->snapshots[i].map[j];
+		}
+	}
+}
+
+// The snapshot table, left empty when the image has none yet
+void read_snapshots_from_disk(sfs_t *fs) {
+	char buffer[BLOCK_SIZE];
+
+	memset(fs->snapshots, 0, sizeof(fs->snapshots));
+	if(IS_DATA_BLOCK(fs->super_block.snapshot_block)) {
+		fs_read_blocks(fs, SFS_REGION_SNAPSHOT, fs->super_block.snapshot_block, 1, buffer);
+		memcpy(fs->snapshots, buffer, sizeof(fs->snapshots));
+	}
+	rebuild_snap_map(fs);
+}
+
+void write_snapshots_to_disk(sfs_t *fs) {
+	char buffer[BLOCK_SIZE];
+
+	memset(buffer, 0, BLOCK_SIZE);
+	memcpy(buffer, fs->snapshots, sizeof(fs->snapshots));
+	fs_write_blocks(fs, SFS_REGION_SNAPSHOT, fs->super_block.snapshot_block, 1, buffer);
+}
+
+void open_rootDir_in_fdt(sfs_t *fs) {
+	int rootDirIndexForFdtable = get_index(fs->fd_table_bit_map);
+	fs->fd_table[rootDirIndexForFdtable].inode = &fs->inode_table[fs->inodeIndexForRootDir];
+	fs->fd_table[rootDirIndexForFdtable].inodeIndex = fs->dirEntryIndexForRootDir;
+	fs->fd_table[rootDirIndexForFdtable].rwptr = 0;
+}
+
+static int do_mksfs(sfs_t *fs, const char *path, int fresh) {
+	init_fdt(fs);
+	fs->tail_block = -1;
+	memset(fs->snap_map, UINT8_MAX, FREE_BM_SIZE);
+	fs->checksums = 0;
+	fs->csum_dirty_lo = NUM_BLOCKS_CHECKSUM;
+	fs->csum_dirty_hi = -1;
+	fs->disk = disk_open(path, BLOCK_SIZE, NUM_IMAGE_BLOCKS, fresh==1);
+	if(fs->disk == NULL || init_cache(fs) != 0) {
+		return -1;
+	}
 	if(fresh==1) {
-		init_fresh_disk(LASTNAME_FIRSTNAME_DISK, BLOCK_SIZE, NUM_TOTAL_BLOCKS);
-		init_free_bm();
-		init_inodet();
-		init_super();
-		write_superblock_to_disk();
-		init_rootDir();
+		init_free_bm(fs);
+		init_inodet(fs);
+		init_super(fs);
+		init_checksums(fs);
+		write_superblock_to_disk(fs);
+		init_rootDir(fs);
 		
-		write_rootDir_to_disk();
-		write_inodet_to_disk();
-		write_free_bm_to_disk();
-		open_rootDir_in_fdt();
+		write_rootDir_to_disk(fs);
+		write_inodet_to_disk(fs);
+		write_free_bm_to_disk(fs);
+		open_rootDir_in_fdt(fs);
 	}
 	else {
-		init_disk(LASTNAME_FIRSTNAME_DISK, BLOCK_SIZE, NUM_TOTAL_BLOCKS);
-		read_superblock_from_disk();
-		read_inodet_from_disk();
-		read_rootDir_from_disk();
-		read_free_bm_from_disk();
-		open_rootDir_in_fdt();
+		read_superblock_from_disk(fs);
+		// Refuse anything that isn't an sfs image of this geometry
+		if(fs->super_block.magic != SFS_MAGIC || fs->super_block.block_size != BLOCK_SIZE
+				|| fs->super_block.fs_size != NUM_TOTAL_BLOCKS || fs->super_block.root_dir_inode >= NUM_INODES) {
+			#ifdef PRINT_ERRORS
+			printf("! sfs_mount: %s is not an sfs image\n", path);
+			#endif
+			return -1;
+		}
+		// the superblock was read before there were checksums to check it against
+		if(fs->super_block.features & SFS_FEATURE_CHECKSUMS) {
+			read_checksums_from_disk(fs);
+			char buffer[BLOCK_SIZE];
+			fs_read_blocks(fs, SFS_REGION_SUPERBLOCK, BLOCK_INDEX_SUPERBLOCK, 1, buffer);
+			if(verify_checksum(fs, BLOCK_INDEX_SUPERBLOCK, buffer) != 0) {
+				return -1;
+			}
+		}
+		fs->inodeIndexForRootDir = fs->super_block.root_dir_inode;
+		read_inodet_from_disk(fs);
+		read_rootDir_from_disk(fs);
+		read_free_bm_from_disk(fs);
+		read_shared_from_disk(fs);
+		read_snapshots_from_disk(fs);
+		open_rootDir_in_fdt(fs);
 	}
+	return 0;
 }
 
-int sfs_getnextfilename(char *fname){
+static int do_getnextfilename(sfs_t *fs, char *fname){
 	// Check if pointer is at null file
-	if(dirEntryTrackerIndex < 0 || dirEntryTrackerIndex >= NUM_INODES) {
-		dirEntryTrackerIndex = 0;
+	if(fs->dirEntryTrackerIndex < 0 || fs->dirEntryTrackerIndex >= NUM_INODES) {
+		fs->dirEntryTrackerIndex = 0;
 		return 0;
 	}
 
 	// Find next valid file
-	while (dirEntryTrackerIndex < NUM_INODES) {
-		if (rootDir[dirEntryTrackerIndex].name[0] != '\0') {
-			strcpy(fname, rootDir[dirEntryTrackerIndex].name);
-			dirEntryTrackerIndex++;
+	while (fs->dirEntryTrackerIndex < NUM_INODES) {
+		if (fs->rootDir[fs->dirEntryTrackerIndex].name[0] != '\0') {
+			strcpy(fname, fs->rootDir[fs->dirEntryTrackerIndex].name);
+			fs->dirEntryTrackerIndex++;
 			return 1;
 		} else {
-			dirEntryTrackerIndex++;
+			fs->dirEntryTrackerIndex++;
+		}
+	}
+	fs->dirEntryTrackerIndex = 0;
+	return 0;
+}
+
+// Bytes appended to a file that are still in its descriptor's append buffer
+static int buffered_bytes(sfs_t *fs, int inodeIndex) {
+	for(int i=0; i<NUM_INODES; i++) {
+		if(fs->fd_table[i].inodeIndex == inodeIndex) {
+			return fs->appends[i].len;
 		}
 	}
-	dirEntryTrackerIndex = 0;
 	return 0;
 }
 
-int sfs_getfilesize(const char* path){
+static int do_getfilesize(sfs_t *fs, const char* path){
 	for(int i=0; i<NUM_INODES; i++) {
 		// Found file path in dir entry
-		if(strcmp(rootDir[i].name, path)==0) {
+		if(strcmp(fs->rootDir[i].name, path)==0) {
 			//Check if inode is valid
-			if(rootDir[i].num < 0) {
+			if(fs->rootDir[i].num < 0) {
 				#ifdef PRINT_ERRORS
-				printf("! sfs_getfilesize: found %s at rootDir[%d] but inode %d invalid\n", path, i, rootDir[i].num);
+				printf("! sfs_getfilesize: found %s at rootDir[%d] but inode %d invalid\n", path, i, fs->rootDir[i].num);
 				#endif
 				return -1;
 			}
 			//printf("- sfs_getfilesize(%s): returning inode_table[rootDir[%d].num=%d].size=%d\n", path, i, rootDir[i].num, inode_table[rootDir[i].num].size);
-			return inode_table[rootDir[i].num].size;
+			return fs->inode_table[fs->rootDir[i].num].size + buffered_bytes(fs, fs->rootDir[i].num);
 		}
 	}
 	
 	// No file path found in dir entry
 	#ifdef PRINT_ERRORS
 	printf("! sfs_getfilesize: did not find %s in rootDir\n", path);
-	debug_print_root_dir_entries();
+	debug_print_root_dir_entries(fs);
 	#endif
 	return -1;
 }
@@ -356,39 +672,36 @@ int check_filenamevalidity(char *name) {
 	return 1;
 }
 
-void debug_print_inode_table_entries() {
+void debug_print_inode_table_entries(sfs_t *fs) {
 	printf("--- debug_print_inode_table_entries ---\n");
 	for (int i = 0; i < NUM_INODES; ++i) {
-		if (inode_table[i].size < 0) {
+		if (fs->inode_table[i].size < 0) {
 			//printf("%d: EMPTY\n", i);
 			continue;
 		} else {
-			printf("%d: size=%d ptrs 0 1 11 ind: %d %d %d %d\n", i, inode_table[i].size, inode_table[i].data_ptrs[0], inode_table[i].data_ptrs[1], inode_table[i].data_ptrs[11], inode_table[i].indirectPointer);
+			printf("%d: size=%d ptrs 0 1 11 ind: %d %d %d %d\n", i, fs->inode_table[i].size, fs->inode_table[i].data_ptrs[0], fs->inode_table[i].data_ptrs[1], fs->inode_table[i].data_ptrs[11], fs->inode_table[i].indirectPointer);
 		}
 	}
 	printf("\n");
 }
 
-void debug_print_root_dir_entries() {
+void debug_print_root_dir_entries(sfs_t *fs) {
 	printf("--- debug_print_root_dir_entries ---\n");
 	for(int i=0; i<NUM_INODES; i++) {
-		if (rootDir[i].name[0] == '\0') {
+		if (fs->rootDir[i].name[0] == '\0') {
 			//printf("rootDir[%d]: EMPTY\n", i);
 			continue;
 		} else {
-			printf("rootDir[%d]: %s, %d\n", i, rootDir[i].name, rootDir[i].num);
-			int inodeIndex = rootDir[i].num;
-			printf("- size: %d\n", inode_table[inodeIndex].size);
-			printf("- ptrs 0 1 11 ind: %d %d %d %d\n", (int) inode_table[inodeIndex].data_ptrs[0], (int) inode_table[inodeIndex].data_ptrs[1], (int) inode_table[inodeIndex].data_ptrs[11], (int) inode_table[inodeIndex].indirectPointer);
+			printf("rootDir[%d]: %s, %d\n", i, fs->rootDir[i].name, fs->rootDir[i].num);
+			int inodeIndex = fs->rootDir[i].num;
+			printf("- size: %d\n", fs->inode_table[inodeIndex].size);
+			printf("- ptrs 0 1 11 ind: %d %d %d %d\n", (int) fs->inode_table[inodeIndex].data_ptrs[0], (int) fs->inode_table[inodeIndex].data_ptrs[1], (int) fs->inode_table[inodeIndex].data_ptrs[11], (int) fs->inode_table[inodeIndex].indirectPointer);
 		}
 	}
 	printf("\n");
 }
 
-int sfs_fopen(char *name){
-	#ifdef PRINT_FN_CALLS
-	printf("- sfs_fopen(%s)\n", name);
-	#endif
+static int do_fopen(sfs_t *fs, char *name){
 
 	// Validate format for name
 	int isValid=check_filenamevalidity(name);
@@ -402,8 +715,8 @@ int sfs_fopen(char *name){
 	int inodeNum = -1;
 	// Check if file exists in rootDir
 	for(int i=0; i<NUM_INODES; i++) {
-		if(strcmp(rootDir[i].name,name)==0) {
-			inodeNum = rootDir[i].num;
+		if(strcmp(fs->rootDir[i].name,name)==0) {
+			inodeNum = fs->rootDir[i].num;
 			break;
 		}
 	}
@@ -413,8 +726,8 @@ int sfs_fopen(char *name){
 		// Check if file exists in file descriptor
 		for(int i=0; i<NUM_INODES; i++) {
 			// File already open, set pointer to append mode
-			if(fd_table[i].inodeIndex==inodeNum){
-				fd_table[i].rwptr = inode_table[inodeNum].size;
+			if(fs->fd_table[i].inodeIndex==inodeNum){
+				fs->fd_table[i].rwptr = fs->inode_table[inodeNum].size + fs->appends[i].len;
 				#ifdef PRINT_ERRORS
 				printf("! sfs_fopen: returning opened fileID %d for existing %s\n", i, name);
 				#endif
@@ -423,424 +736,3182 @@ int sfs_fopen(char *name){
 		}
 
 		// File not open so open in file descriptor and set pointer to append mode
-		int fdtIndex = get_index(fd_table_bit_map);
-		fd_table[fdtIndex].rwptr = inode_table[inodeNum].size;
-		fd_table[fdtIndex].inode = &inode_table[inodeNum];
-		fd_table[fdtIndex].inodeIndex = inodeNum;
-		#ifdef PRINT_SFS_FOPEN
-		printf("- sfs_fopen: returning new fd id %d for existing %s\n", fdtIndex, name);
-		#endif
+		int fdtIndex = get_index(fs->fd_table_bit_map);
+		fs->fd_table[fdtIndex].rwptr = fs->inode_table[inodeNum].size;
+		fs->fd_table[fdtIndex].inode = &fs->inode_table[inodeNum];
+		fs->fd_table[fdtIndex].inodeIndex = inodeNum;
+		fs->fd_table[fdtIndex].write_gen = 0;
 		return fdtIndex;
 	}
 	
 	// File does not exist so create inode, add to dir entries, and open in file descriptor
 	else {
-		int inodeTableIndex = get_index(inode_table_bit_map);
+		if(fs->readonly) {
+			#ifdef PRINT_ERRORS
+			printf("! sfs_fopen: refusing to create %s in a snapshot\n", name);
+			#endif
+			return -1;
+		}
+		int inodeTableIndex = get_index(fs->inode_table_bit_map);
 		if (inodeTableIndex < 0 || inodeTableIndex >= NUM_INODES) { // cannot have more than NUM_INODES files total in sfs
 			#ifdef PRINT_ERRORS
 			printf("! sfs_fopen: refusing to create %s since get_index(inode)=%d\n", name, inodeTableIndex);
 			#endif
 			return -1;
 		}
-		inode_table[inodeTableIndex].size = 0;
-		inode_table[inodeTableIndex].indirectPointer = -1;
-		for(int j=0; j<12; j++) {
-			inode_table[inodeTableIndex].data_ptrs[j] = -1;
-		}
+		// New files start inline and move to data blocks once they outgrow the inode
+		fs->inode_table[inodeTableIndex].mode = SFS_MODE_INLINE | (fs->compress ? SFS_MODE_COMPRESS : 0);
+		fs->inode_table[inodeTableIndex].size = 0;
+		memset(INLINE_DATA(&fs->inode_table[inodeTableIndex]), 0, INLINE_DATA_SIZE);
 		
-		int dirEntryIndex = get_index(dir_entries_bit_map);
-		rootDir[dirEntryIndex].num = inodeTableIndex;
-		strcpy(rootDir[dirEntryIndex].name, name);
-		rootDir[dirEntryIndex].name[MAX_FILE_NAME-1] = '\0';
+		int dirEntryIndex = get_index(fs->dir_entries_bit_map);
+		fs->rootDir[dirEntryIndex].num = inodeTableIndex;
+		strcpy(fs->rootDir[dirEntryIndex].name, name);
+		fs->rootDir[dirEntryIndex].name[MAX_FILE_NAME-1] = '\0';
 		
-		int fdtIndex = get_index(fd_table_bit_map);
-		fd_table[fdtIndex].rwptr = inode_table[inodeTableIndex].size;
-		fd_table[fdtIndex].inode = &inode_table[inodeTableIndex];
-		fd_table[fdtIndex].inodeIndex = inodeTableIndex;
+		int fdtIndex = get_index(fs->fd_table_bit_map);
+		fs->fd_table[fdtIndex].rwptr = fs->inode_table[inodeTableIndex].size;
+		fs->fd_table[fdtIndex].inode = &fs->inode_table[inodeTableIndex];
+		fs->fd_table[fdtIndex].inodeIndex = inodeTableIndex;
 		
-		write_inodet_to_disk();
-		write_rootDir_to_disk();
+		write_inodet_to_disk(fs);
+		write_rootDir_to_disk(fs);
+		fs->fd_table[fdtIndex].write_gen = fs->write_gen;
 		
-		#ifdef PRINT_SFS_FOPEN
-		printf("- sfs_fopen: returned fd id %d for newly created %s, with inode_table[%d].inodeIndex=%d\n", fdtIndex, name, fdtIndex, inodeTableIndex);
-		#endif
 		return fdtIndex;	
 	}
 }
 
-int sfs_fclose(int fileID) {
-	#ifdef PRINT_FN_CALLS
-	printf("- sfs_fclose(%d)\n", fileID);
-	#endif
-	
-	if(fileID<0 || fileID>=NUM_INODES) {
-		return -1;
+// Takes a data block that is free and no snapshot holds, -1 when the disk is full
+static int alloc_block(sfs_t *fs) {
+	for(int i=0; i<FREE_BM_SIZE; i++) {
+		uint8_t avail = fs->free_bit_map[i] & fs->snap_map[i];
+		if(avail == 0) {
+			continue;
+		}
+		int new_index = i*8 + ffs(avail)-1;
+		if(!IS_DATA_BLOCK(new_index)) {
+			return -1;
+		}
+		force_set_index(fs->free_bit_map, new_index);
+		return new_index;
+	}
+	return -1;
+}
+
+// Whether alloc_block would find a block right now
+static int has_free_block(sfs_t *fs) {
+	for(int i=0; i<FREE_BM_SIZE; i++) {
+		uint8_t avail = fs->free_bit_map[i] & fs->snap_map[i];
+		if(avail != 0) {
+			return IS_DATA_BLOCK(i*8 + ffs(avail)-1);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Gives the image its refcount table and dedup index the first time a block
+ * is shared, so their later updates always have somewhere to go.
+ */
+static int reserve_shared_blocks(sfs_t *fs) {
+	if(IS_DATA_BLOCK(fs->super_block.refcount_block) && IS_DATA_BLOCK(fs->super_block.dedup_index_block)) {
+		return 0;
 	}
-	if (fd_table[fileID].inodeIndex == -1) {
+	int refcount_block = alloc_block(fs);
+	int index_block = alloc_block(fs);
+	if(refcount_block < 0 || index_block < 0) {
+		if(refcount_block >= 0) {
+			rm_index(fs->free_bit_map, refcount_block);
+		}
+		if(index_block >= 0) {
+			rm_index(fs->free_bit_map, index_block);
+		}
 		return -1;
 	}
-	rm_index(fd_table_bit_map, fileID);
-	fd_table[fileID].rwptr = 0;
-	fd_table[fileID].inode = NULL;
-	fd_table[fileID].inodeIndex = -1;
+	fs->super_block.refcount_block = refcount_block;
+	fs->super_block.dedup_index_block = index_block;
+	fs->refs_dirty = 1;
+	fs->dedup_index_dirty = 1;
+	write_shared_to_disk(fs);
+	write_superblock_to_disk(fs);
+	write_free_bm_to_disk(fs);
 	return 0;
 }
 
-int sfs_fread(int fileID, char *buf, int length) {
-	#ifdef PRINT_FN_CALLS
-	printf("- sfs_fread(%d, buf, %d)\n", fileID, length);
-	#endif
+// Drops one pointer to a file data block; the block is freed with its last one
+static void release_block(sfs_t *fs, unsigned int block) {
+	if(REFS(fs, block) > 0) {
+		REFS(fs, block)--;
+		fs->refs_dirty = 1;
+		if(REFS(fs, block) > 0) {
+			return;
+		}
+	}
+	rm_index(fs->free_bit_map, block);
+}
 
-	// validate inputs
-	if(fileID < 0 || fileID>=NUM_INODES || length < 0) {
-		#ifdef PRINT_ERRORS
-		printf("! sfs_fread INVALID INPUTS\n");
-		#endif
+/*
+ * Makes the block *ptr names safe to write in place. A block others still
+ * share, or a snapshot holds, is swapped for a fresh one (copy on write,
+ * the caller writes the whole block); one that only this pointer holds
+ * just stops being tracked. Returns 1 if *ptr changed, 0 if not and -1
+ * when the disk is full.
+ */
+static int unshare_block(sfs_t *fs, unsigned int *ptr) {
+	if(REFS(fs, *ptr) == 0 && !IS_HELD(fs, *ptr)) {
 		return 0;
 	}
-	
-	int inodeIndex = fd_table[fileID].inodeIndex;
-	if (inodeIndex <0) {
-		#ifdef PRINT_ERRORS
-		printf("- sfs_fread: trying to read from non-open fd entry %d\n", fileID);
-		#endif
+	if(REFS(fs, *ptr) == 1 && !IS_HELD(fs, *ptr)) {
+		REFS(fs, *ptr) = 0;
+		fs->refs_dirty = 1;
 		return 0;
 	}
-	
-	// Check if reading more than file size
-	if(fd_table[fileID].rwptr+length > inode_table[inodeIndex].size){
-		length = inode_table[inodeIndex].size - fd_table[fileID].rwptr;
+	int new_index = alloc_block(fs);
+	if(new_index < 0) {
+		return -1;
 	}
-	
+	release_block(fs, *ptr);
+	*ptr = new_index;
+	return 1;
+}
+
+// FNV-1a over 32 bit words; only picks the index slot, matches are compared byte for byte
+static uint32_t block_hash(const char *block) {
+	uint32_t h = 2166136261u;
+	for(int i=0; i<BLOCK_SIZE; i+=sizeof(uint32_t)) {
+		uint32_t w;
+		memcpy(&w, block+i, sizeof(w));
+		h = (h ^ w)*16777619u;
+	}
+	// the low bits alone only ever saw the low bits of each word
+	return h ^ (h >> 16);
+}
+
+/*
+ * Stores one full block of file data at *ptr (a hole or a block of the
+ * file). If the dedup index knows a block with the same bytes, *ptr shares
+ * it and nothing is written; otherwise the data goes to a block of its own
+ * that becomes the index entry for its content. Returns 1 if *ptr changed,
+ * 0 if not and -1 when the disk is full.
+ */
+static int dedup_write(sfs_t *fs, unsigned int *ptr, const char *data) {
+	unsigned int old = *ptr;
+	int slot = block_hash(data) % DEDUP_INDEX_SLOTS;
+	unsigned int match = fs->dedup_index[slot];
 	char tempBlock[BLOCK_SIZE];
-	unsigned int indirPtrList[BLOCK_SIZE/sizeof(unsigned int)];
-	// If I need to access indirect Pointer data, read from disk to indirptrlist 
-	if(CEILING(fd_table[fileID].rwptr+length, BLOCK_SIZE) > 12){
-		read_blocks(inode_table[inodeIndex].indirectPointer, 1, (char*) indirPtrList);
-		#ifdef PRINT_SFS_FREAD
-		printf("- sfs_fread: reading indPtrList from inode.indirectPointer %d\n", inode_table[inodeIndex].indirectPointer);
-		#endif
+
+	// only tracked blocks are shared, anything else in the slot is stale
+	if(IS_DATA_BLOCK(match) && REFS(fs, match) > 0 && REFS(fs, match) < REFCOUNT_MAX) {
+		fs_read_blocks(fs, SFS_REGION_DATA, match, 1, tempBlock);
+		if(memcmp(tempBlock, data, BLOCK_SIZE) == 0) {
+			if(match == old) {
+				return 0;
+			}
+			if(IS_DATA_BLOCK(old)) {
+				release_block(fs, old);
+			}
+			REFS(fs, match)++;
+			fs->refs_dirty = 1;
+			fs->stats.dedup_hits++;
+			*ptr = match;
+			return 1;
+		}
 	}
-	
-	int num_bytes_read = 0;
-	while(num_bytes_read < length) {
-	  // compute current block based on rwptr
-	  int dataBlockIndex = FLOOR(fd_table[fileID].rwptr, BLOCK_SIZE);
-	  #ifdef PRINT_SFS_FREAD
-	  printf("- sfs_fread: dataBlockIndex: %d, fd_table[fileID].rwptr: %ld\n", dataBlockIndex, fd_table[fileID].rwptr);
-	  #endif
-	  
-	  // compute byteOffset based on current block and rwptr
-	  int byteOffset = fd_table[fileID].rwptr - dataBlockIndex*BLOCK_SIZE;
-	  
-	  // If accessing indirect pointer data, load a block to tempblock 
-	  if(dataBlockIndex>=12) {
-		read_blocks(indirPtrList[dataBlockIndex-12], 1, tempBlock);
-		#ifdef PRINT_SFS_FREAD
-		printf("- sfs_fread: loading from indPtrList[%d], block=%d, first/last entry: %d %d\n", dataBlockIndex-12, indirPtrList[dataBlockIndex-12], tempBlock[0], tempBlock[255]);
-		#endif
-	  }
-	  // If accessing direct pointer data, load a block to tempblock
-	  else {
-		read_blocks(inode_table[inodeIndex].data_ptrs[dataBlockIndex], 1, tempBlock);
-		#ifdef PRINT_SFS_FREAD
-		printf("- sfs_fread: loading from data_ptrs[%d], block=%d, first/last entry: %d %d\n", dataBlockIndex, inode_table[inodeIndex].data_ptrs[dataBlockIndex], tempBlock[0], tempBlock[255]);
-		#endif
-	  }
-	  
-	  int num_bytes_to_read = length-num_bytes_read;
-	  if (num_bytes_to_read > BLOCK_SIZE - byteOffset) {
-		  num_bytes_to_read = BLOCK_SIZE - byteOffset;
-	  }
-	  #ifdef PRINT_SFS_FREAD
-	  printf("- sfs_fread: num_bytes_to_read: %d\n", num_bytes_to_read);
-	  #endif
-      memcpy(buf+num_bytes_read, tempBlock+byteOffset, num_bytes_to_read);
-	  num_bytes_read += num_bytes_to_read;
-	  fd_table[fileID].rwptr += num_bytes_to_read;
-	  #ifdef PRINT_SFS_FREAD
-	  printf("- sfs_fread: num_bytes_read: %d, fd_table[fileID].rwptr: %ld\n", num_bytes_read, fd_table[fileID].rwptr);
-	  #endif
+
+	unsigned int block = old;
+	if(!IS_DATA_BLOCK(old) || REFS(fs, old) > 1 || IS_HELD(fs, old)) {
+		int new_index = alloc_block(fs);
+		if(new_index < 0) {
+			return -1;
+		}
+		if(IS_DATA_BLOCK(old)) {
+			release_block(fs, old);
+		}
+		block = new_index;
 	}
-	
-	return length;
- 
+	fs_write_blocks(fs, SFS_REGION_DATA, block, 1, (void*) data);
+	REFS(fs, block) = 1;
+	fs->refs_dirty = 1;
+	fs->dedup_index[slot] = block;
+	fs->dedup_index_dirty = 1;
+	*ptr = block;
+	return block != old;
 }
 
-int sfs_fwrite(int fileID, const char *buf, int length) {
-	#ifdef PRINT_FN_CALLS
-	printf("- sfs_fwrite(%d, buf, %d)\n", fileID, length);
-	#endif
-	
-	// Validate inputs
-	if(fileID < 0 || fileID>=NUM_INODES || length < 0) {
-		return 0;
+/*
+ * Returns where the pointer to file block blockIndex lives, reading the
+ * indirect block into indirPtrList when the pointer is in there. NULL when
+ * the file has no indirect block.
+ */
+static unsigned int *block_ptr(sfs_t *fs, inode_t *inode, int blockIndex, unsigned int *indirPtrList) {
+	if(blockIndex < NUM_DIRECT_PTRS) {
+		return &inode->data_ptrs[blockIndex];
 	}
-	
-	unsigned int indirPtrList[BLOCK_SIZE/sizeof(unsigned int)];
-	for (int i = 0; i < BLOCK_SIZE/sizeof(unsigned int); ++i) indirPtrList[i] = -1;
-	
-	// If more space is needed, pre-allocate blocks
-	int inodeIndex = fd_table[fileID].inodeIndex;
-	int file_size = inode_table[inodeIndex].size;
-	int numFullBlocks = FLOOR(file_size, BLOCK_SIZE);
-	int numBytesInLastBlock = file_size - BLOCK_SIZE*numFullBlocks;
-	int numFreeBytesInLastBlock = BLOCK_SIZE - numBytesInLastBlock;
-	int numBytesToAppend = fd_table[fileID].rwptr+length-file_size;
-	int numBytesToAppendNeedingNewBlocks = numBytesToAppend - numFreeBytesInLastBlock;
-	int numBlocksNeeded = CEILING(numBytesToAppendNeedingNewBlocks, BLOCK_SIZE);
-	
-	int totalBlocks = CEILING((file_size+numBytesToAppend), BLOCK_SIZE);
-
-	// If we need more than 12 direct pointers, check if indirect pointer is initialized
-	// If indirect pointer is not initialized then we create indirect pointer list (size = BLOCK_SIZE)
-	if(totalBlocks > 12 && inode_table[inodeIndex].indirectPointer==-1) {
-		int new_index = get_index(free_bit_map);
-		if (new_index >= NUM_TOTAL_BLOCKS || new_index < 0) {
-			#ifdef PRINT_ERRORS
-			printf("! sfs_fwrite: refusing to write more because out of free blocks needed for indirPtrList\n");
-			#endif
-			return 0;
-		}
-		inode_table[inodeIndex].indirectPointer = new_index;
-		#ifdef PRINT_SFS_FWRITE
-		printf("- sfs_fwrite: allocating block %d for inode[%d].indirPtrList\n", inode_table[inodeIndex].indirectPointer, inodeIndex);
-		#endif
-		for(int i=0; i<(BLOCK_SIZE/sizeof(unsigned int)); i++) {
-			indirPtrList[i] = -1;
-		}
-	} 
-	else if (totalBlocks > 12 && inode_table[inodeIndex].indirectPointer != -1) {
-		// Read from block and into indirPointer		
-		read_blocks(inode_table[inodeIndex].indirectPointer, 1, (char*) indirPtrList);
-		#ifdef PRINT_SFS_FWRITE
-		printf("- fwrite: read block %d for inode[%d].indirPtrList into memory (%d %d %d %d)\n", inode_table[inodeIndex].indirectPointer, inodeIndex, indirPtrList[0], indirPtrList[1], indirPtrList[254], indirPtrList[255]);
-		#endif
+	if(!IS_DATA_BLOCK(inode->indirectPointer)) {
+		return NULL;
 	}
-	
-	// For each block allocate data block bm index into inode
-	if(numBlocksNeeded > 0) {
-		int numBlockExisting = CEILING(file_size, BLOCK_SIZE);
-		#ifdef PRINT_SFS_FWRITE
-		printf("- existing file_size: %d\n", file_size);
-		printf("- numBlocksNeeded: %d\n", numBlocksNeeded);
-		printf("- numBlockExisting: %d\n", numBlockExisting);
-		printf("- totalBlocks: %d\n", totalBlocks);
-		#endif
-		if(totalBlocks <=12) {
-			for(int i=numBlockExisting; i<totalBlocks; i++) {
-				int new_index = get_index(free_bit_map);
-				if (new_index < 0 || new_index >= NUM_TOTAL_BLOCKS) {
-					#ifdef PRINT_ERRORS
-					printf("! sfs_fwrite: refusing to write more because out of free blocks needed for inode[%d].data_ptrs[%d]\n", inodeIndex, i);
-					#endif
-					return 0;
-				}
-				inode_table[inodeIndex].data_ptrs[i] = new_index;
-				#ifdef PRINT_SFS_FWRITE
-				printf("- fwrite: allocating block %d for inode[%d].data_ptrs[%d]\n", inode_table[inodeIndex].data_ptrs[i], inodeIndex, i);
-				#endif
-			}
+	fs_read_blocks(fs, SFS_REGION_INDIRECT, inode->indirectPointer, 1, (char*) indirPtrList);
+	return &indirPtrList[blockIndex-NUM_DIRECT_PTRS];
+}
+
+// Slot of an inode's fragment in a tail block, -1 if the block doesn't hold one
+static int tail_lookup(tail_index *idx, int inodeIndex) {
+	if(idx->magic != TAIL_MAGIC) {
+		return -1;
+	}
+	for(int i=0; i<idx->count && i<TAIL_MAX_FRAGS; i++) {
+		if(idx->frags[i].inode == inodeIndex) {
+			return i;
 		}
-		else{
-			for(int i=numBlockExisting; i<totalBlocks; i++) {
-				if (i < 12) {
-					int new_index = get_index(free_bit_map);
-					if (new_index < 0 || new_index >= NUM_TOTAL_BLOCKS) {
-						#ifdef PRINT_ERRORS
-						printf("- sfs_fwrite: refusing to write more because out of free blocks needed for inode[%d].data_ptrs[%d]\n", inodeIndex, i);
-						#endif
-						return 0;
-					}
-					inode_table[inodeIndex].data_ptrs[i] = new_index;
-					#ifdef PRINT_SFS_FWRITE
-					printf("- fwrite: allocating block %d for inode[%d].data_ptrs[%d]\n", inode_table[inodeIndex].data_ptrs[i], inodeIndex, i);
-					#endif
-				}
-				else {
-					int new_index = get_index(free_bit_map);
-					if (new_index < 0 || new_index >= NUM_TOTAL_BLOCKS) {
-						#ifdef PRINT_ERRORS
-						printf("- sfs_fwrite: refusing to write more because out of free blocks needed for inode[%d].indirPtrList[%d]\n", inodeIndex, i-12);
-						#endif
-						return 0;
-					}
-					indirPtrList[i-12] = new_index;
-					#ifdef PRINT_SFS_FWRITE
-					printf("- fwrite: allocating block %d for inode[%d].indirPtrList[%d]\n", indirPtrList[i-12], inodeIndex, i-12);
-					#endif
-				}
-			}
+	}
+	return -1;
+}
+
+// First offset where length bytes fit between the fragments, -1 if nowhere
+static int tail_find_space(tail_index *idx, int length) {
+	if(idx->count >= TAIL_MAX_FRAGS) {
+		return -1;
+	}
+	int off = TAIL_DATA_START;
+	for(int i=0; i<idx->count; i++) {
+		if(idx->frags[i].offset - off >= length) {
+			return off;
 		}
+		off = idx->frags[i].offset + idx->frags[i].length;
 	}
+	return BLOCK_SIZE - off >= length ? off : -1;
+}
 
-	char tempBlock[BLOCK_SIZE];
-	memset(tempBlock, 0, BLOCK_SIZE);
-	
-	// while there are more blocks of content to be written:
-	unsigned int num_bytes_written = 0;
-	while(num_bytes_written < length) {
-		// compute the data block index corresponding to rwptr
-		int dataBlockIndex = FLOOR(fd_table[fileID].rwptr, BLOCK_SIZE);
-		
-		// load that data block into local memory from the disk
-		if(dataBlockIndex>=12) {
-			read_blocks(indirPtrList[dataBlockIndex-12], 1, tempBlock);
-			#ifdef PRINT_SFS_FWRITE
-			printf("- sfs_fwrite: while(%d < %d) read ind_ptr[%d] (=%d) into tempBlock (%d %d | %d %d)\n", num_bytes_written, length, dataBlockIndex-12, indirPtrList[dataBlockIndex-12], tempBlock[0], tempBlock[1], tempBlock[254], tempBlock[255]);
-			#endif
+// True if inode n is a packed file whose last block is this tail block
+static int tail_owner(sfs_t *fs, unsigned int block, int n) {
+	unsigned int indirPtrList[NUM_INDIRECT_PTRS];
+	if(n >= NUM_INODES || !IS_TAIL(&fs->inode_table[n]) || fs->inode_table[n].size == (unsigned int) -1
+			|| fs->inode_table[n].size == 0) {
+		return 0;
+	}
+	unsigned int *ptr = block_ptr(fs, &fs->inode_table[n], LAST_BLOCK(&fs->inode_table[n]), indirPtrList);
+	return ptr != NULL && *ptr == block;
+}
+
+/*
+ * Takes an inode's fragment out of a tail block, copying it zero padded into
+ * out when out isn't NULL. A tail block left empty goes back to the free
+ * bitmap; the caller writes the bitmap out. A block a snapshot holds keeps
+ * its fragments as they are and is let go once no live file packs into it;
+ * fragments it was left with are dropped the next time it is rewritten.
+ */
+static void tail_remove(sfs_t *fs, unsigned int block, int inodeIndex, char *out) {
+	char tailBlock[BLOCK_SIZE];
+	tail_index *idx = (tail_index*) tailBlock;
+
+	fs_read_blocks(fs, SFS_REGION_DATA, block, 1, tailBlock);
+	int i = tail_lookup(idx, inodeIndex);
+	if(out != NULL) {
+		memset(out, 0, BLOCK_SIZE);
+		if(i >= 0) {
+			memcpy(out, tailBlock+idx->frags[i].offset, idx->frags[i].length);
 		}
-		else {
-			read_blocks(inode_table[inodeIndex].data_ptrs[dataBlockIndex], 1, tempBlock);
-			#ifdef PRINT_SFS_FWRITE
-			printf("- sfs_fwrite: while(%d < %d) read data_ptr[%d] (=%d) into tempBlock (%d %d | %d %d)\n", num_bytes_written, length, dataBlockIndex, inode_table[inodeIndex].data_ptrs[dataBlockIndex], tempBlock[0], tempBlock[1], tempBlock[254], tempBlock[255]);
-			#endif
+	}
+	if(i < 0) {
+		return;
+	}
+	int n = 0;
+	for(int j=0; j<idx->count && j<TAIL_MAX_FRAGS; j++) {
+		if(j != i && tail_owner(fs, block, idx->frags[j].inode)) {
+			idx->frags[n++] = idx->frags[j];
 		}
-		
-		// compute byte-offset within this block based on rwptr
-		int byteOffset = fd_table[fileID].rwptr - dataBlockIndex*BLOCK_SIZE;
-		
-		// starting from byte-offset, write N bytes from buf to data block, where N = min(1024-(byte-offset), length-of-buf-left-to-be-written)
-		int num_bytes_to_write = length-num_bytes_written;
-		if (num_bytes_to_write > BLOCK_SIZE-byteOffset) {
-			num_bytes_to_write = BLOCK_SIZE-byteOffset;
+	}
+	if(IS_HELD(fs, block)) {
+		if(n == 0) {
+			rm_index(fs->free_bit_map, block);
+		}
+		if(fs->tail_block == block) {
+			fs->tail_block = -1;
+		}
+		return;
+	}
+	idx->count = n;
+	if(idx->count == 0) {
+		rm_index(fs->free_bit_map, block);
+		if(fs->tail_block == block) {
+			fs->tail_block = -1;
+		}
+	} else {
+		fs_write_blocks(fs, SFS_REGION_DATA, block, 1, tailBlock);
+	}
+}
+
+/*
+ * Moves the partial last block of a file being closed into the current tail
+ * block and frees the block it had, so small and medium files don't each
+ * waste most of a block. Appending later gives the file a block back.
+ */
+static void pack_tail(sfs_t *fs, int fileID) {
+	int inodeIndex = fs->fd_table[fileID].inodeIndex;
+	inode_t *inode = &fs->inode_table[inodeIndex];
+	int fragment = inode->size % BLOCK_SIZE;
+
+	if(inodeIndex == fs->inodeIndexForRootDir || IS_INLINE(inode) || IS_TAIL(inode)
+			|| fragment == 0 || fragment > TAIL_MAX_FRAG_SIZE) {
+		return;
+	}
+	unsigned int indirPtrList[NUM_INDIRECT_PTRS];
+	int lastBlock = LAST_BLOCK(inode);
+	unsigned int *ptr = block_ptr(fs, inode, lastBlock, indirPtrList);
+	if(ptr == NULL || !IS_DATA_BLOCK(*ptr)) {
+		return;
+	}
+
+	char tailBlock[BLOCK_SIZE];
+	tail_index *idx = (tail_index*) tailBlock;
+	int off = -1;
+	if(fs->tail_block != -1 && !IS_HELD(fs, fs->tail_block)) {
+		fs_read_blocks(fs, SFS_REGION_DATA, fs->tail_block, 1, tailBlock);
+		off = tail_find_space(idx, fragment);
+	}
+	if(off < 0) {
+		int new_index = alloc_block(fs);
+		if(new_index < 0) {
+			return;
+		}
+		fs->tail_block = new_index;
+		memset(tailBlock, 0, BLOCK_SIZE);
+		idx->magic = TAIL_MAGIC;
+		off = TAIL_DATA_START;
+	}
+	// the pointer changes below, so an indirect block a snapshot holds moves first
+	if(lastBlock >= NUM_DIRECT_PTRS && unshare_block(fs, &inode->indirectPointer) < 0) {
+		if(idx->count == 0) {
+			rm_index(fs->free_bit_map, fs->tail_block);
+			fs->tail_block = -1;
+		}
+		return;
+	}
+
+	// keep the index sorted by offset
+	int i = idx->count;
+	while(i > 0 && idx->frags[i-1].offset > off) {
+		idx->frags[i] = idx->frags[i-1];
+		i--;
+	}
+	idx->frags[i].inode = inodeIndex;
+	idx->frags[i].offset = off;
+	idx->frags[i].length = fragment;
+	idx->count++;
+	char tempBlock[BLOCK_SIZE];
+	fs_read_blocks(fs, SFS_REGION_DATA, *ptr, 1, tempBlock);
+	memcpy(tailBlock+off, tempBlock, fragment);
+	fs_write_blocks(fs, SFS_REGION_DATA, fs->tail_block, 1, tailBlock);
+
+	release_block(fs, *ptr);
+	*ptr = fs->tail_block;
+	if(lastBlock >= NUM_DIRECT_PTRS) {
+		fs_write_blocks(fs, SFS_REGION_INDIRECT, inode->indirectPointer, 1, (char*) indirPtrList);
+	}
+	SET_MODE_TYPE(inode, SFS_MODE_TAIL);
+	write_inode_to_disk(fs, inodeIndex);
+	write_free_bm_to_disk(fs);
+	write_shared_to_disk(fs);
+	fs->fd_table[fileID].write_gen = fs->write_gen;
+}
+
+// Where the pointer to file block idx lives, given the loaded indirect list
+static unsigned int *file_slot(inode_t *inode, unsigned int *indirPtrList, int idx) {
+	return idx >= NUM_DIRECT_PTRS ? &indirPtrList[idx-NUM_DIRECT_PTRS] : &inode->data_ptrs[idx];
+}
+
+static int is_compressed(inode_t *inode, unsigned int *indirPtrList, int idx) {
+	int last = (idx/CLUSTER_BLOCKS)*CLUSTER_BLOCKS + CLUSTER_BLOCKS-1;
+	return *file_slot(inode, indirPtrList, last) == SFS_COMPRESSED;
+}
+
+// Reads and decompresses a whole cluster into out (CLUSTER_BLOCKS blocks)
+static int read_cluster(sfs_t *fs, inode_t *inode, unsigned int *indirPtrList, int cluster, char *out) {
+	char packed[CLUSTER_BLOCKS*BLOCK_SIZE];
+	cluster_header *h = (cluster_header*) packed;
+	int first = cluster*CLUSTER_BLOCKS;
+	int n = 0;
+
+	while(n < CLUSTER_BLOCKS && *file_slot(inode, indirPtrList, first+n) != SFS_COMPRESSED) {
+		unsigned int block = *file_slot(inode, indirPtrList, first+n);
+		if(!IS_DATA_BLOCK(block) || fs_read_blocks(fs, SFS_REGION_DATA, block, 1, packed+n*BLOCK_SIZE) < 0) {
+			return -1;
 		}
-		memcpy(tempBlock+byteOffset, buf+num_bytes_written, num_bytes_to_write);
-		#ifdef PRINT_SFS_FWRITE
-		printf("- sfs_fwrite: ... memcpy buf+%d -> tempBlock+%d for %d bytes\n", num_bytes_written, byteOffset, num_bytes_to_write);
+		n++;
+	}
+	if(n == 0 || h->magic != CLUSTER_MAGIC || sizeof(cluster_header)+h->clen > n*BLOCK_SIZE) {
+		return -1;
+	}
+	if(lz_decompress(packed+sizeof(cluster_header), h->clen, out, CLUSTER_BLOCKS*BLOCK_SIZE) != CLUSTER_BLOCKS*BLOCK_SIZE) {
+		return -1;
+	}
+	return 0;
+}
+
+// One decompressed block of a compressed cluster, from the cache when it is hot; -1 if it is unreadable
+static int read_compressed_block(sfs_t *fs, inode_t *inode, unsigned int *indirPtrList, int idx, char *out) {
+	char plain[CLUSTER_BLOCKS*BLOCK_SIZE];
+	int cluster = idx/CLUSTER_BLOCKS;
+	unsigned int first_block = *file_slot(inode, indirPtrList, cluster*CLUSTER_BLOCKS);
+
+	if(IS_DATA_BLOCK(first_block) && cache_get(fs->cache, CLUSTER_KEY(first_block, idx%CLUSTER_BLOCKS), out)) {
+		return 0;
+	}
+	if(read_cluster(fs, inode, indirPtrList, cluster, plain) != 0) {
+		#ifdef PRINT_ERRORS
+		printf("! sfs_fread: compressed cluster %d is unreadable or corrupt\n", cluster);
 		#endif
-		num_bytes_written += num_bytes_to_write;
-		fd_table[fileID].rwptr += num_bytes_to_write;
-		
-		// write the local data block back into disk
-		if(dataBlockIndex>=12) {
-			if (indirPtrList[dataBlockIndex-12] < 0 || indirPtrList[dataBlockIndex-12] >= NUM_TOTAL_BLOCKS) {
-				#ifdef PRINT_ERRORS
-				printf("! sfs_fwrite: !!!!!ERROR!!!!! trying to write_blocks(indirPtrList[%d] with invalid start address: %d\n", dataBlockIndex-12, indirPtrList[dataBlockIndex-12]);
-				#endif
-				return 0; // IDEALLY: fix this bug instead of force-returning 0 half-way
-			}
-			
-			
-			write_blocks(indirPtrList[dataBlockIndex-12], 1, tempBlock);
-			#ifdef PRINT_SFS_FWRITE
-			printf("- sfs_fwrite: ... wrote tempBlock (%d %d | %d %d) back to ind_ptr[%d] (=%d)\n", tempBlock[0], tempBlock[1], tempBlock[254], tempBlock[255], dataBlockIndex-12, indirPtrList[dataBlockIndex-12]);
-			#endif
+		return -1;
+	}
+	for(int i=0; i<CLUSTER_BLOCKS; i++) {
+		cache_put(fs->cache, CLUSTER_KEY(first_block, i), plain+i*BLOCK_SIZE);
+	}
+	memcpy(out, plain+(idx%CLUSTER_BLOCKS)*BLOCK_SIZE, BLOCK_SIZE);
+	return 0;
+}
+
+/*
+ * Compresses a cluster of plain blocks in place: the stream goes to its
+ * first blocks and the rest are freed. Returns 1 if it did, 0 when the
+ * cluster isn't all plain blocks or wouldn't save a block. Blocks with a
+ * refcount are left alone: others may share them or dedup may later. So
+ * are blocks a snapshot holds.
+ */
+static int compress_cluster(sfs_t *fs, inode_t *inode, unsigned int *indirPtrList, int cluster) {
+	char plain[CLUSTER_BLOCKS*BLOCK_SIZE];
+	char packed[CLUSTER_BLOCKS*BLOCK_SIZE];
+	cluster_header *h = (cluster_header*) packed;
+	unsigned int *slots[CLUSTER_BLOCKS];
+
+	for(int i=0; i<CLUSTER_BLOCKS; i++) {
+		slots[i] = file_slot(inode, indirPtrList, cluster*CLUSTER_BLOCKS+i);
+		if(!IS_DATA_BLOCK(*slots[i]) || REFS(fs, *slots[i]) > 0 || IS_HELD(fs, *slots[i])) {
+			return 0;
 		}
-		else {
-			if (inode_table[inodeIndex].data_ptrs[dataBlockIndex] < 0 || inode_table[inodeIndex].data_ptrs[dataBlockIndex] >= NUM_TOTAL_BLOCKS) {
-				#ifdef PRINT_ERRORS
-				printf("! sfs_fwrite: !!!!!ERROR!!!!! trying to write_blocks(inode_table[%d].data_ptrs[%d]) with invalid start address: %d\n", inodeIndex, dataBlockIndex, inode_table[inodeIndex].data_ptrs[dataBlockIndex]);
-				#endif
-				return 0; // IDEALLY: fix this bug instead of force-returning 0 half-way
+		fs_read_blocks(fs, SFS_REGION_DATA, *slots[i], 1, plain+i*BLOCK_SIZE);
+	}
+	int clen = lz_compress(plain, sizeof(plain), packed+sizeof(cluster_header), (CLUSTER_BLOCKS-1)*BLOCK_SIZE-sizeof(cluster_header));
+	if(clen < 0) {
+		return 0;
+	}
+	h->magic = CLUSTER_MAGIC;
+	h->clen = clen;
+	h->reserved = 0;
+	int used = sizeof(cluster_header)+clen;
+	int n = CEILING(used, BLOCK_SIZE);
+	memset(packed+used, 0, n*BLOCK_SIZE-used);
+
+	for(int i=0; i<n; i++) {
+		fs_write_blocks(fs, SFS_REGION_DATA, *slots[i], 1, packed+i*BLOCK_SIZE);
+	}
+	for(int i=n; i<CLUSTER_BLOCKS; i++) {
+		rm_index(fs->free_bit_map, *slots[i]);
+		*slots[i] = SFS_COMPRESSED;
+	}
+	// also replaces whatever an earlier cluster starting at this block left cached
+	for(int i=0; i<CLUSTER_BLOCKS; i++) {
+		cache_put(fs->cache, CLUSTER_KEY(*slots[0], i), plain+i*BLOCK_SIZE);
+	}
+	return 1;
+}
+
+/*
+ * Turns a compressed cluster back into plain blocks before it is modified.
+ * Blocks of the stream a snapshot holds or a clone shares are replaced
+ * rather than rewritten.
+ */
+static int expand_cluster(sfs_t *fs, inode_t *inode, unsigned int *indirPtrList, int cluster) {
+	char plain[CLUSTER_BLOCKS*BLOCK_SIZE];
+	unsigned int *slots[CLUSTER_BLOCKS];
+	unsigned int old[CLUSTER_BLOCKS];
+
+	if(read_cluster(fs, inode, indirPtrList, cluster, plain) != 0) {
+		#ifdef PRINT_ERRORS
+		printf("! sfs_fwrite: compressed cluster %d is corrupt, replacing it with zeros\n", cluster);
+		#endif
+		memset(plain, 0, sizeof(plain));
+	}
+	for(int i=0; i<CLUSTER_BLOCKS; i++) {
+		slots[i] = file_slot(inode, indirPtrList, cluster*CLUSTER_BLOCKS+i);
+	}
+	unsigned int first_block = *slots[0];
+	for(int i=0; i<CLUSTER_BLOCKS; i++) {
+		old[i] = *slots[i];
+		if(old[i] != SFS_COMPRESSED && !IS_HELD(fs, old[i]) && REFS(fs, old[i]) <= 1) {
+			continue;
+		}
+		int new_index = alloc_block(fs);
+		if(new_index < 0) {
+			// give back what this call took, the cluster stays compressed
+			for(int j=0; j<i; j++) {
+				if(*slots[j] != old[j]) {
+					rm_index(fs->free_bit_map, *slots[j]);
+					*slots[j] = old[j];
+				}
 			}
+			return -1;
+		}
+		*slots[i] = new_index;
+	}
+	for(int i=0; i<CLUSTER_BLOCKS; i++) {
+		if(old[i] != SFS_COMPRESSED && old[i] != *slots[i]) {
+			release_block(fs, old[i]);
+		}
+	}
+	for(int i=0; i<CLUSTER_BLOCKS; i++) {
+		fs_write_blocks(fs, SFS_REGION_DATA, *slots[i], 1, plain+i*BLOCK_SIZE);
+		cache_forget(fs->cache, CLUSTER_KEY(first_block, i));
+	}
+	return 0;
+}
 
-			write_blocks(inode_table[inodeIndex].data_ptrs[dataBlockIndex], 1, tempBlock);
-			#ifdef PRINT_SFS_FWRITE
-			printf("- sfs_fwrite: ... wrote tempBlock (%d %d | %d %d) back to data_ptr[%d] (=%d)\n", tempBlock[0], tempBlock[1], tempBlock[254], tempBlock[255], dataBlockIndex, inode_table[inodeIndex].data_ptrs[dataBlockIndex]);
-			#endif
+/*
+ * Compresses every full cluster of a file being closed if the file has
+ * SFS_MODE_COMPRESS. Clusters that are already compressed or don't shrink
+ * are left alone.
+ */
+static void compress_file(sfs_t *fs, int fileID) {
+	int inodeIndex = fs->fd_table[fileID].inodeIndex;
+	inode_t *inode = &fs->inode_table[inodeIndex];
+	unsigned int indirPtrList[NUM_INDIRECT_PTRS];
+	int nclusters = inode->size/(CLUSTER_BLOCKS*BLOCK_SIZE);
+	int changed = 0, indirect_dirty = 0;
+
+	if(!IS_COMPRESS(inode) || IS_INLINE(inode) || inodeIndex == fs->inodeIndexForRootDir) {
+		return;
+	}
+	// a held or shared indirect block only points at held or shared blocks, which stay as they are
+	int have_indirect = nclusters*CLUSTER_BLOCKS > NUM_DIRECT_PTRS && IS_DATA_BLOCK(inode->indirectPointer)
+			&& !IS_HELD(fs, inode->indirectPointer) && REFS(fs, inode->indirectPointer) <= 1;
+	if(have_indirect) {
+		fs_read_blocks(fs, SFS_REGION_INDIRECT, inode->indirectPointer, 1, (char*) indirPtrList);
+	}
+	for(int c=0; c<nclusters; c++) {
+		int indirect = c*CLUSTER_BLOCKS >= NUM_DIRECT_PTRS;
+		if(indirect && !have_indirect) {
+			break;
+		}
+		if(compress_cluster(fs, inode, indirPtrList, c)) {
+			changed = 1;
+			indirect_dirty |= indirect;
 		}
-	}	  
-	
-	// Update the file size in the inode table entry
-	inode_table[inodeIndex].size += numBytesToAppend;
-	
-	if(inode_table[inodeIndex].indirectPointer != -1) {
-		// Write back indirPtrList into data block
-		write_blocks(inode_table[inodeIndex].indirectPointer, 1, (char*) indirPtrList);
-		#ifdef PRINT_SFS_FWRITE
-		printf("- fwrite: wrote back indirPtrList to block %d (list entries: %d %d %d %d)\n", inode_table[inodeIndex].indirectPointer, indirPtrList[0], indirPtrList[1], indirPtrList[254], indirPtrList[255]);
-		#endif
 	}
-	
-	write_inodet_to_disk();
-	write_free_bm_to_disk();
-	
-	return length;
+	if(indirect_dirty) {
+		fs_write_blocks(fs, SFS_REGION_INDIRECT, inode->indirectPointer, 1, (char*) indirPtrList);
+	}
+	if(changed) {
+		write_inode_to_disk(fs, inodeIndex);
+		write_free_bm_to_disk(fs);
+		write_shared_to_disk(fs);
+		fs->fd_table[fileID].write_gen = fs->write_gen;
+	}
 }
 
-int sfs_fseek(int fileID, int loc) {
-	#ifdef PRINT_FN_CALLS
-	printf("- sfs_fseek(%d, %d)\n", fileID, loc);
-	#endif
+static int do_fclose(sfs_t *fs, int fileID) {
 	
 	if(fileID<0 || fileID>=NUM_INODES) {
 		return -1;
 	}
-	int inodeIndex = fd_table[fileID].inodeIndex;
-	if(loc > inode_table[inodeIndex].size || loc<0) {
+	if (fs->fd_table[fileID].inodeIndex == -1) {
 		return -1;
 	}
-	fd_table[fileID].rwptr = loc;
+	rm_index(fs->fd_table_bit_map, fileID);
+	fs->appends[fileID].len = 0;
+	fs->appends[fileID].lost = 0;
+	fs->fd_table[fileID].rwptr = 0;
+	fs->fd_table[fileID].inode = NULL;
+	fs->fd_table[fileID].inodeIndex = -1;
+	fs->fd_table[fileID].write_gen = 0;
 	return 0;
 }
 
-int sfs_remove(char *file) {
-	#ifdef PRINT_FN_CALLS
-	printf("- sfs_fremove(%s)\n", file);
-	#endif
-	
-	int fileExists = 0;
-	int inodeIndex;
-	for(int i=0; i<NUM_INODES; i++) {
-		if(strcmp(rootDir[i].name, file) == 0) {
-			fileExists=1;
-			inodeIndex=rootDir[i].num;
-			rootDir[i].num = -1;
-			for(int j=0; j<MAX_FILE_NAME; j++) {
-				rootDir[i].name[j]= '\0';
-			}
-			break;
+// Walks the segments of an iovec array as one run of bytes
+typedef struct iov_cursor {
+	const struct iovec *iov;
+	int idx;                // segment being walked
+	size_t off;             // bytes of it already used
+} iov_cursor;
+
+// Total bytes of the segments, -1 if there are too many of them to count in an int
+static int iov_length(const struct iovec *iov, int iovcnt) {
+	size_t total = 0;
+	if(iovcnt < 0 || (iovcnt > 0 && iov == NULL)) {
+		return -1;
+	}
+	for(int i=0; i<iovcnt; i++) {
+		total += iov[i].iov_len;
+		if(iov[i].iov_len > INT32_MAX || total > INT32_MAX) {
+			return -1;
 		}
 	}
-	if(!fileExists) {
+	return total;
+}
+
+// Copies the next n bytes of the segments into out
+static void iov_gather(iov_cursor *cur, char *out, int n) {
+	while(n > 0) {
+		const struct iovec *v = &cur->iov[cur->idx];
+		int m = v->iov_len-cur->off < (size_t) n ? v->iov_len-cur->off : (size_t) n;
+		memcpy(out, (char*) v->iov_base+cur->off, m);
+		out += m;
+		n -= m;
+		cur->off += m;
+		if(cur->off == v->iov_len) {
+			cur->idx++;
+			cur->off = 0;
+		}
+	}
+}
+
+// Fills the next n bytes of the segments from in, or with zeros when in is NULL
+static void iov_scatter(iov_cursor *cur, const char *in, int n) {
+	while(n > 0) {
+		const struct iovec *v = &cur->iov[cur->idx];
+		int m = v->iov_len-cur->off < (size_t) n ? v->iov_len-cur->off : (size_t) n;
+		if(in != NULL) {
+			memcpy((char*) v->iov_base+cur->off, in, m);
+			in += m;
+		} else {
+			memset((char*) v->iov_base+cur->off, 0, m);
+		}
+		n -= m;
+		cur->off += m;
+		if(cur->off == v->iov_len) {
+			cur->idx++;
+			cur->off = 0;
+		}
+	}
+}
+
+// The next n bytes where they lie, if one segment holds all of them, moving past them; NULL otherwise
+static const char *iov_take(iov_cursor *cur, int n) {
+	const struct iovec *v = &cur->iov[cur->idx];
+	if(v->iov_len-cur->off < (size_t) n) {
+		return NULL;
+	}
+	const char *p = (char*) v->iov_base+cur->off;
+	cur->off += n;
+	if(cur->off == v->iov_len) {
+		cur->idx++;
+		cur->off = 0;
+	}
+	return p;
+}
+
+/*
+ * Reads into the segments in order from offset pos, as one read of their
+ * total length would: each block is read once however many segments it
+ * spans. The descriptor's rwptr is left alone.
+ */
+static int do_preadv(sfs_t *fs, int fileID, const struct iovec *iov, int iovcnt, int pos) {
+	int length = iov_length(iov, iovcnt);
+	iov_cursor cur = { iov, 0, 0 };
+
+	// validate inputs
+	if(fileID < 0 || fileID>=NUM_INODES || length < 0 || pos < 0) {
 		#ifdef PRINT_ERRORS
-		printf("! sfs_fremove failed: file does not exist\n");
+		printf("! sfs_fread INVALID INPUTS\n");
 		#endif
-		return -1;
+		return 0;
 	}
-  
-	for(int i=0; i<NUM_INODES; i++) {
-		if(fd_table[i].inodeIndex == inodeIndex) {
-			sfs_fclose(i);
-			break;
-		}
+	
+	int inodeIndex = fs->fd_table[fileID].inodeIndex;
+	if (inodeIndex <0) {
+		#ifdef PRINT_ERRORS
+		printf("- sfs_fread: trying to read from non-open fd entry %d\n", fileID);
+		#endif
+		return 0;
 	}
-	unsigned int indirPtrList[BLOCK_SIZE/sizeof(unsigned int)];
-	if(inode_table[inodeIndex].indirectPointer != -1) {
-		read_blocks(inode_table[inodeIndex].indirectPointer, 1, (char*) indirPtrList);
-		for(int i=0; i<BLOCK_SIZE/sizeof(unsigned int); i++) {
-			if(indirPtrList[i] != -1) {
-				rm_index(free_bit_map, indirPtrList[i]);
+	
+	// Check if reading more than file size (pos may sit past the end); bytes
+	// still in the append buffer come right after the stored ones
+	int size = fs->inode_table[inodeIndex].size;
+	int buffered = fs->appends[fileID].len;
+	if(pos >= size+buffered) {
+		length = 0;
+	} else if(length > size+buffered - pos){
+		length = size+buffered - pos;
+	}
+	int bufOffset = pos > size ? pos-size : 0;
+	int from_buffer = pos+length > size ? pos+length - size - bufOffset : 0;
+	length -= from_buffer;
+	
+	// Inline files are served straight from the inode table
+	if(IS_INLINE(&fs->inode_table[inodeIndex])) {
+		iov_scatter(&cur, INLINE_DATA(&fs->inode_table[inodeIndex])+pos, length);
+		iov_scatter(&cur, fs->appends[fileID].data+bufOffset, from_buffer);
+		return length+from_buffer;
+	}
+	
+	char tempBlock[BLOCK_SIZE];
+	unsigned int indirPtrList[NUM_INDIRECT_PTRS];
+	// If I need to access indirect Pointer data, read from disk to indirptrlist 
+	int end = pos+length;
+	if(CEILING(end, BLOCK_SIZE) > NUM_DIRECT_PTRS) {
+		if(IS_DATA_BLOCK(fs->inode_table[inodeIndex].indirectPointer)) {
+			if(fs_read_blocks(fs, SFS_REGION_INDIRECT, fs->inode_table[inodeIndex].indirectPointer, 1, (char*) indirPtrList) < 0) {
+				return 0;
 			}
+		} else {
+			// the whole indirect range is a hole
+			memset(indirPtrList, 0xff, sizeof(indirPtrList));
 		}
-		rm_index(free_bit_map, inode_table[inodeIndex].indirectPointer);
-		inode_table[inodeIndex].indirectPointer = -1;
 	}
 	
-	for(int i=0; i<12; i++) {
-		if(inode_table[inodeIndex].data_ptrs[i] != -1) {
-			rm_index(free_bit_map, inode_table[inodeIndex].data_ptrs[i]);
-			inode_table[inodeIndex].data_ptrs[i] = -1;
+	// A block that can't be read (or fails its checksum) ends the read short
+	int num_bytes_read = 0;
+	while(num_bytes_read < length) {
+	  // compute current block based on pos
+	  int dataBlockIndex = FLOOR(pos, BLOCK_SIZE);
+	  
+	  // compute byteOffset based on current block and pos
+	  int byteOffset = pos - dataBlockIndex*BLOCK_SIZE;
+	  
+	  int num_bytes_to_read = length-num_bytes_read;
+	  if (num_bytes_to_read > BLOCK_SIZE - byteOffset) {
+		  num_bytes_to_read = BLOCK_SIZE - byteOffset;
+	  }
+	  
+	  unsigned int block = *file_slot(&fs->inode_table[inodeIndex], indirPtrList, dataBlockIndex);
+	  if(is_compressed(&fs->inode_table[inodeIndex], indirPtrList, dataBlockIndex)) {
+		if(read_compressed_block(fs, &fs->inode_table[inodeIndex], indirPtrList, dataBlockIndex, tempBlock) != 0) {
+			break;
+		}
+		iov_scatter(&cur, tempBlock+byteOffset, num_bytes_to_read);
+	  }
+	  // Holes read as zeros without going to the disk
+	  else if(IS_DATA_BLOCK(block)) {
+		if(fs_read_blocks(fs, SFS_REGION_DATA, block, 1, tempBlock) < 0) {
+			#ifdef PRINT_ERRORS
+			printf("! sfs_fread: cannot read block %d of inode[%d], stopping after %d bytes\n", dataBlockIndex, inodeIndex, num_bytes_read);
+			#endif
+			break;
+		}
+		// A packed last block is a fragment somewhere inside the tail block
+		if(IS_TAIL(&fs->inode_table[inodeIndex]) && dataBlockIndex == LAST_BLOCK(&fs->inode_table[inodeIndex])) {
+			int i = tail_lookup((tail_index*) tempBlock, inodeIndex);
+			if(i < 0) {
+				iov_scatter(&cur, NULL, num_bytes_to_read);
+			} else {
+				iov_scatter(&cur, tempBlock+((tail_index*) tempBlock)->frags[i].offset+byteOffset, num_bytes_to_read);
+			}
+		} else {
+			iov_scatter(&cur, tempBlock+byteOffset, num_bytes_to_read);
 		}
+	  } else {
+		iov_scatter(&cur, NULL, num_bytes_to_read);
+	  }
+	  num_bytes_read += num_bytes_to_read;
+	  pos += num_bytes_to_read;
+	}
+	if(num_bytes_read == length) {
+		iov_scatter(&cur, fs->appends[fileID].data+bufOffset, from_buffer);
+		num_bytes_read += from_buffer;
 	}
-	inode_table[inodeIndex].size = -1;
 	
-	rm_index(inode_table_bit_map, inodeIndex);
+	return num_bytes_read;
+ 
+}
 
-	// Write data blocks bitmap back to disk since I freed a bunch of data blocks
-	write_free_bm_to_disk();
-	// Write inode table back to disk (since I removed the inode)
-	write_inodet_to_disk();
-	// Write rootDir back to disk (since I modified dir_entries)
-	write_rootDir_to_disk();
-	
+// Reads at the descriptor's rwptr and moves it past what was read
+static int do_freadv(sfs_t *fs, int fileID, const struct iovec *iov, int iovcnt) {
+	if(fileID < 0 || fileID>=NUM_INODES) {
+		return 0;
+	}
+	int res = do_preadv(fs, fileID, iov, iovcnt, fs->fd_table[fileID].rwptr);
+	fs->fd_table[fileID].rwptr += res;
+	return res;
+}
+
+static int do_fread(sfs_t *fs, int fileID, char *buf, int length) {
+	struct iovec iov = { buf, length < 0 ? 0 : length };
+	return do_freadv(fs, fileID, &iov, 1);
+}
+
+/*
+ * Maps length bytes of the file from offset, which must lie inside the
+ * file. A range inside one block is served from its cache frame, pinned
+ * until sfs_munmap. A longer range whose blocks lie back to back on disk
+ * is mapped straight from the image. Anything else (holes, inline, packed
+ * or compressed data, blocks scattered over the disk) gets a copy of its own.
+ */
+static const char *do_mmap(sfs_t *fs, int fileID, int offset, int length) {
+	// validate inputs
+	if(fileID < 0 || fileID >= NUM_INODES || fs->fd_table[fileID].inodeIndex == -1 || offset < 0 || length <= 0) {
+		return NULL;
+	}
+	int inodeIndex = fs->fd_table[fileID].inodeIndex;
+	inode_t *inode = &fs->inode_table[inodeIndex];
+	if(offset >= inode->size || length > inode->size - offset) {
+		#ifdef PRINT_ERRORS
+		printf("! sfs_mmap: %d bytes at %d are not inside inode[%d]\n", length, offset, inodeIndex);
+		#endif
+		return NULL;
+	}
+	int v = 0;
+	while(v < MAX_VIEWS && fs->views[v].addr != NULL) {
+		v++;
+	}
+	if(v == MAX_VIEWS) {
+		#ifdef PRINT_ERRORS
+		printf("! sfs_mmap: all %d views are in use\n", MAX_VIEWS);
+		#endif
+		return NULL;
+	}
+	sfs_view *view = &fs->views[v];
+	view->inodeIndex = inodeIndex;
+
+	// Only plain blocks lying back to back can be handed out in place
+	int first = offset/BLOCK_SIZE, last = (offset+length-1)/BLOCK_SIZE;
+	int in_place = !IS_INLINE(inode) && !(IS_TAIL(inode) && last == LAST_BLOCK(inode));
+	unsigned int indirPtrList[NUM_INDIRECT_PTRS];
+	if(in_place && last >= NUM_DIRECT_PTRS) {
+		in_place = IS_DATA_BLOCK(inode->indirectPointer)
+				&& fs_read_blocks(fs, SFS_REGION_INDIRECT, inode->indirectPointer, 1, (char*) indirPtrList) >= 0;
+	}
+	unsigned int block = in_place ? *file_slot(inode, indirPtrList, first) : 0;
+	for(int i=first; in_place && i<=last; i++) {
+		in_place = IS_DATA_BLOCK(*file_slot(inode, indirPtrList, i)) && *file_slot(inode, indirPtrList, i) == block+(i-first)
+				&& !is_compressed(inode, indirPtrList, i);
+	}
+
+	if(in_place && first == last) {
+		const char *frame = cache_pin(fs->cache, block);
+		char tempBlock[BLOCK_SIZE];
+		if(frame == NULL && fs_read_blocks(fs, SFS_REGION_DATA, block, 1, tempBlock) >= 0) {
+			frame = cache_pin(fs->cache, block);
+		}
+		if(frame != NULL) {
+			view->kind = VIEW_FRAME;
+			view->mem = frame;
+			view->addr = frame + offset%BLOCK_SIZE;
+			return view->addr;
+		}
+	} else if(in_place) {
+		int n = last-first+1;
+		const char *map = cache_flush(fs->cache) == 0 ? disk_map_r(fs->disk, block, n) : NULL;
+		if(map != NULL) {
+			stats_record_io(&fs->stats, SFS_REGION_DATA, n, 0);
+			// the mapping bypasses the cache, so its blocks are checked here
+			for(int i=0; i<n; i++) {
+				if(verify_checksum(fs, block+i, map+i*BLOCK_SIZE) != 0) {
+					disk_unmap_r(fs->disk, map, block, n);
+					return NULL;
+				}
+			}
+			view->kind = VIEW_IMAGE;
+			view->mem = map;
+			view->block = block;
+			view->nblocks = n;
+			view->addr = map + offset%BLOCK_SIZE;
+			return view->addr;
+		}
+	}
+
+	char *copy = malloc(length);
+	struct iovec iov = { copy, length };
+	if(copy == NULL || do_preadv(fs, fileID, &iov, 1, offset) < length) {
+		free(copy);
+		return NULL;
+	}
+	view->kind = VIEW_COPY;
+	view->mem = copy;
+	view->addr = copy;
+	return view->addr;
+}
+
+// Whether any view shows the inode, which keeps sfs_fclose from relaying it out
+static int has_views(sfs_t *fs, int inodeIndex) {
+	for(int v=0; v<MAX_VIEWS; v++) {
+		if(fs->views[v].addr != NULL && fs->views[v].inodeIndex == inodeIndex) {
+			return 1;
+		}
+	}
 	return 0;
 }
 
+static void release_view(sfs_t *fs, sfs_view *view) {
+	switch(view->kind) {
+	case VIEW_FRAME:
+		cache_unpin(fs->cache, view->mem);
+		break;
+	case VIEW_IMAGE:
+		disk_unmap_r(fs->disk, view->mem, view->block, view->nblocks);
+		break;
+	case VIEW_COPY:
+		free((void*) view->mem);
+		break;
+	}
+	view->addr = NULL;
+}
+
+static int do_munmap(sfs_t *fs, const char *addr) {
+	for(int v=0; v<MAX_VIEWS; v++) {
+		if(addr != NULL && fs->views[v].addr == addr) {
+			release_view(fs, &fs->views[v]);
+			return 0;
+		}
+	}
+	return -1;
+}
 
+// Whether file block idx is a plain block of its own on disk, one sfs_read_extent can hand out in place
+static int block_in_image(inode_t *inode, unsigned int *indirPtrList, int idx) {
+	return IS_DATA_BLOCK(*file_slot(inode, indirPtrList, idx)) && !is_compressed(inode, indirPtrList, idx)
+			&& !(IS_TAIL(inode) && idx == LAST_BLOCK(inode));
+}
 
+/*
+ * Describes the bytes of the file from offset on (at most length of them,
+ * never past the end) for a reader holding the image's descriptor. The
+ * extent runs from the first block through every following one in the
+ * same state: plain blocks lying back to back in the image, written out
+ * and checked against their checksums, or blocks that have to go through
+ * sfs_pread (holes, inline, packed or compressed data, or blocks failing
+ * their checksum). Returns the bytes covered, 0 at the end of the file.
+ */
+static int do_read_extent(sfs_t *fs, int fileID, int offset, int length, sfs_extent *ext) {
+	memset(ext, 0, sizeof(sfs_extent));
+	ext->image_fd = -1;
+	if(fileID < 0 || fileID >= NUM_INODES || fs->fd_table[fileID].inodeIndex == -1 || offset < 0 || length < 0) {
+		return -1;
+	}
+	inode_t *inode = &fs->inode_table[fs->fd_table[fileID].inodeIndex];
+	if(offset >= (int) inode->size || length == 0) {
+		return 0;
+	}
+	if(length > (int) inode->size - offset) {
+		length = inode->size - offset;
+	}
+	if(IS_INLINE(inode)) {
+		ext->length = length;
+		return length;
+	}
 
+	int first = offset/BLOCK_SIZE, last = (offset+length-1)/BLOCK_SIZE;
+	unsigned int indirPtrList[NUM_INDIRECT_PTRS];
+	if((last/CLUSTER_BLOCKS+1)*CLUSTER_BLOCKS > NUM_DIRECT_PTRS) {
+		if(!IS_DATA_BLOCK(inode->indirectPointer)) {
+			memset(indirPtrList, 0xff, sizeof(indirPtrList));
+		} else if(fs_read_blocks(fs, SFS_REGION_INDIRECT, inode->indirectPointer, 1, (char*) indirPtrList) < 0) {
+			return -1;
+		}
+	}
+	int in_place = block_in_image(inode, indirPtrList, first);
+	unsigned int block = *file_slot(inode, indirPtrList, first);
+	int i = first+1;
+	while(i <= last && block_in_image(inode, indirPtrList, i) == in_place
+			&& (!in_place || *file_slot(inode, indirPtrList, i) == block+(i-first))) {
+		i++;
+	}
+	ext->length = (i*BLOCK_SIZE < offset+length ? i*BLOCK_SIZE : offset+length) - offset;
 
+	if(in_place) {
+		// the image has to hold what the cache still does, and the reader bypasses the checksums
+		int n = i-first;
+		const char *map = cache_flush(fs->cache) == 0 ? disk_map_r(fs->disk, block, n) : NULL;
+		for(int j=0; map != NULL && j<n; j++) {
+			if(verify_checksum(fs, block+j, map+j*BLOCK_SIZE) != 0) {
+				in_place = 0;
+			}
+		}
+		if(map == NULL) {
+			in_place = 0;
+		} else {
+			disk_unmap_r(fs->disk, map, block, n);
+			stats_record_io(&fs->stats, SFS_REGION_DATA, n, 0);
+		}
+	}
+	if(in_place) {
+		ext->in_place = 1;
+		ext->image_fd = disk_fd_r(fs->disk);
+		ext->image_offset = (int64_t) block*BLOCK_SIZE + offset%BLOCK_SIZE;
+	}
+	return ext->length;
+}
 
+// Writes into an inline file at pos, which must still fit in the inode afterwards
+static int write_inline(sfs_t *fs, int fileID, int pos, const char *buf, int length) {
+	int inodeIndex = fs->fd_table[fileID].inodeIndex;
+	inode_t *inode = &fs->inode_table[inodeIndex];
+	char *data = INLINE_DATA(inode);
 
+	// bytes a seek skipped over read back as zeros
+	if(pos > inode->size) {
+		memset(data+inode->size, 0, pos-inode->size);
+	}
+	memcpy(data+pos, buf, length);
+	if(pos+length > inode->size) {
+		inode->size = pos+length;
+	}
+	write_inode_to_disk(fs, inodeIndex);
+	fs->fd_table[fileID].write_gen = fs->write_gen;
+	return length;
+}
+
+// Gives a packed file its own last block again so it can be written in place
+static int unpack_tail(sfs_t *fs, int inodeIndex) {
+	inode_t *inode = &fs->inode_table[inodeIndex];
+	unsigned int indirPtrList[NUM_INDIRECT_PTRS];
+	char tempBlock[BLOCK_SIZE];
+
+	int lastBlock = LAST_BLOCK(inode);
+	unsigned int *ptr = block_ptr(fs, inode, lastBlock, indirPtrList);
+	if(ptr != NULL && IS_DATA_BLOCK(*ptr)) {
+		int new_index = alloc_block(fs);
+		if(new_index < 0) {
+			return -1;
+		}
+		if(lastBlock >= NUM_DIRECT_PTRS && unshare_block(fs, &inode->indirectPointer) < 0) {
+			rm_index(fs->free_bit_map, new_index);
+			return -1;
+		}
+		tail_remove(fs, *ptr, inodeIndex, tempBlock);
+		fs_write_blocks(fs, SFS_REGION_DATA, new_index, 1, tempBlock);
+		*ptr = new_index;
+		if(lastBlock >= NUM_DIRECT_PTRS) {
+			fs_write_blocks(fs, SFS_REGION_INDIRECT, inode->indirectPointer, 1, (char*) indirPtrList);
+		}
+	}
+	SET_MODE_TYPE(inode, SFS_MODE_REGULAR);
+	return 0;
+}
+
+// Moves an inline file's bytes into a data block so it can grow past INLINE_DATA_SIZE
+static int unpack_inline(sfs_t *fs, int inodeIndex) {
+	inode_t *inode = &fs->inode_table[inodeIndex];
+	unsigned int block = -1;
+	char tempBlock[BLOCK_SIZE];
+
+	if(inode->size > 0) {
+		int new_index = alloc_block(fs);
+		if(new_index < 0) {
+			return -1;
+		}
+		memset(tempBlock, 0, BLOCK_SIZE);
+		memcpy(tempBlock, INLINE_DATA(inode), inode->size);
+		fs_write_blocks(fs, SFS_REGION_DATA, new_index, 1, tempBlock);
+		block = new_index;
+	}
+	SET_MODE_TYPE(inode, SFS_MODE_REGULAR);
+	inode->indirectPointer = -1;
+	for(int j=0; j<NUM_DIRECT_PTRS; j++) {
+		inode->data_ptrs[j] = -1;
+	}
+	inode->data_ptrs[0] = block;
+	return 0;
+}
+
+/*
+ * Gets bytes [start, end) of a file ready to be written block by block: an
+ * inline file or a packed last block the range reaches gets a block of its
+ * own, the indirect block is loaded into indirPtrList (created, or moved
+ * if it is shared or held) when the range needs it, and compressed clusters
+ * in the range are expanded. Sets *allocated and *indirect_dirty as the
+ * caller's commit needs them; -1 when the disk is full, after which nothing
+ * may be written but what changed still has to go out.
+ */
+static int prepare_write(sfs_t *fs, int inodeIndex, int start, int end, unsigned int *indirPtrList, int *allocated, int *indirect_dirty) {
+	inode_t *inode = &fs->inode_table[inodeIndex];
+
+	if(IS_INLINE(inode)) {
+		if(unpack_inline(fs, inodeIndex) != 0) {
+			#ifdef PRINT_ERRORS
+			printf("! sfs_fwrite: out of free blocks to move inline inode[%d] into\n", inodeIndex);
+			#endif
+			return -1;
+		}
+		*allocated = 1;
+	}
+	// Writing into or past a packed last block takes the fragment back out first
+	if(IS_TAIL(inode) && end > LAST_BLOCK(inode)*BLOCK_SIZE) {
+		if(unpack_tail(fs, inodeIndex) != 0) {
+			#ifdef PRINT_ERRORS
+			printf("! sfs_fwrite: out of free blocks to unpack the tail of inode[%d]\n", inodeIndex);
+			#endif
+			return -1;
+		}
+		*allocated = 1;
+	}
+
+	// If the write reaches past the direct pointers, load the indirect pointer list,
+	// creating it (size = BLOCK_SIZE) if the file doesn't have one yet
+	if(CEILING(end, BLOCK_SIZE) > NUM_DIRECT_PTRS) {
+		if(IS_DATA_BLOCK(inode->indirectPointer)) {
+			fs_read_blocks(fs, SFS_REGION_INDIRECT, inode->indirectPointer, 1, (char*) indirPtrList);
+			// one a snapshot holds or a clone shares moves now, the pointers in it may change below
+			int res = unshare_block(fs, &inode->indirectPointer);
+			if(res < 0) {
+				#ifdef PRINT_ERRORS
+				printf("! sfs_fwrite: out of free blocks to copy the indirect block of inode[%d]\n", inodeIndex);
+				#endif
+				return -1;
+			}
+			if(res > 0) {
+				*allocated = 1;
+				*indirect_dirty = 1;
+			}
+		} else {
+			int new_index = alloc_block(fs);
+			if (new_index < 0) {
+				#ifdef PRINT_ERRORS
+				printf("! sfs_fwrite: refusing to write more because out of free blocks needed for indirPtrList\n");
+				#endif
+				return -1;
+			}
+			inode->indirectPointer = new_index;
+			memset(indirPtrList, 0xff, NUM_INDIRECT_PTRS*sizeof(unsigned int));
+			*allocated = 1;
+			*indirect_dirty = 1;
+		}
+	}
+
+	// Compressed clusters the write lands in go back to plain blocks first
+	int firstCluster = FLOOR(start, BLOCK_SIZE)/CLUSTER_BLOCKS;
+	int lastCluster = ((end-1)/BLOCK_SIZE)/CLUSTER_BLOCKS;
+	for(int c=firstCluster; c<=lastCluster; c++) {
+		if(!is_compressed(inode, indirPtrList, c*CLUSTER_BLOCKS)) {
+			continue;
+		}
+		if(expand_cluster(fs, inode, indirPtrList, c) != 0) {
+			#ifdef PRINT_ERRORS
+			printf("! sfs_fwrite: out of free blocks to expand cluster %d of inode[%d]\n", c, inodeIndex);
+			#endif
+			return -1;
+		}
+		*allocated = 1;
+		if(c*CLUSTER_BLOCKS >= NUM_DIRECT_PTRS) {
+			*indirect_dirty = 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Writes the segments in order at offset pos, as one write of their total
+ * length would: each block is read, filled and written once and the
+ * metadata goes out once however many segments there are. The
+ * descriptor's rwptr is left alone.
+ */
+static int do_pwritev(sfs_t *fs, int fileID, const struct iovec *iov, int iovcnt, int pos) {
+	int length = iov_length(iov, iovcnt);
+	iov_cursor cur = { iov, 0, 0 };
+	
+	// Validate inputs
+	if(fileID < 0 || fileID>=NUM_INODES || length < 0 || pos < 0) {
+		return 0;
+	}
+	if (fs->fd_table[fileID].inodeIndex == -1 || fs->readonly) {
+		return 0;
+	}
+	
+	// Never grow a file past what the direct and indirect pointers can address
+	if(length > (int) MAX_FILE_SIZE - pos) {
+		length = MAX_FILE_SIZE - pos;
+		if(length <= 0) {
+			#ifdef PRINT_ERRORS
+			printf("! sfs_fwrite: refusing to write past max file size %d\n", (int) MAX_FILE_SIZE);
+			#endif
+			return 0;
+		}
+	}
+	
+	int inodeIndex = fs->fd_table[fileID].inodeIndex;
+	inode_t *inode = &fs->inode_table[inodeIndex];
+	unsigned int old_size = inode->size;
+	int allocated = 0;       // took blocks from the free bitmap
+	int indirect_dirty = 0;  // indirPtrList changed and must be written back
+	int dedup = fs->dedup && reserve_shared_blocks(fs) == 0;
+
+	int end = pos+length;
+	if(IS_INLINE(inode) && end <= INLINE_DATA_SIZE) {
+		char inlineBuf[INLINE_DATA_SIZE];
+		iov_gather(&cur, inlineBuf, length);
+		return write_inline(fs, fileID, pos, inlineBuf, length);
+	}
+	unsigned int indirPtrList[NUM_INDIRECT_PTRS];
+	if(prepare_write(fs, inodeIndex, pos, end, indirPtrList, &allocated, &indirect_dirty) != 0) {
+		length = 0; // nothing is written, but what changed so far still goes out
+	}
+
+	char tempBlock[BLOCK_SIZE];
+	// Whole blocks lying back to back both in the caller's memory and on
+	// disk go out as one write, straight from that memory
+	const char *run_src = NULL;
+	unsigned int run_block = 0;
+	int run_len = 0;
+	
+	// while there are more blocks of content to be written:
+	// Only the blocks this write touches are allocated, so a range skipped
+	// over by seeking past the end stays a hole that costs no blocks
+	int num_bytes_written = 0;
+	while(num_bytes_written < length) {
+		// compute the data block index corresponding to pos
+		int dataBlockIndex = FLOOR(pos, BLOCK_SIZE);
+		unsigned int *ptr = file_slot(inode, indirPtrList, dataBlockIndex);
+		
+		// compute byte-offset within this block based on pos
+		int byteOffset = pos - dataBlockIndex*BLOCK_SIZE;
+		
+		// starting from byte-offset, write N bytes from buf to data block, where N = min(1024-(byte-offset), length-of-buf-left-to-be-written)
+		int num_bytes_to_write = length-num_bytes_written;
+		if (num_bytes_to_write > BLOCK_SIZE-byteOffset) {
+			num_bytes_to_write = BLOCK_SIZE-byteOffset;
+		}
+		
+		// Full blocks may be stored as a reference to an identical block
+		if(dedup && num_bytes_to_write == BLOCK_SIZE) {
+			iov_gather(&cur, tempBlock, BLOCK_SIZE);
+			int res = dedup_write(fs, ptr, tempBlock);
+			if(res < 0) {
+				#ifdef PRINT_ERRORS
+				printf("! sfs_fwrite: out of free blocks for inode[%d] block %d, stopping after %d bytes\n", inodeIndex, dataBlockIndex, num_bytes_written);
+				#endif
+				break;
+			}
+			if(res > 0) {
+				allocated = 1;
+				if(dataBlockIndex >= NUM_DIRECT_PTRS) {
+					indirect_dirty = 1;
+				}
+			}
+			num_bytes_written += num_bytes_to_write;
+			pos += num_bytes_to_write;
+			continue;
+		}
+		
+		// load that data block into local memory, unless it is new or fully overwritten
+		if(!IS_DATA_BLOCK(*ptr)) {
+			int new_index = alloc_block(fs);
+			if (new_index < 0) {
+				#ifdef PRINT_ERRORS
+				printf("! sfs_fwrite: out of free blocks for inode[%d] block %d, stopping after %d bytes\n", inodeIndex, dataBlockIndex, num_bytes_written);
+				#endif
+				break;
+			}
+			*ptr = new_index;
+			allocated = 1;
+			if(dataBlockIndex >= NUM_DIRECT_PTRS) {
+				indirect_dirty = 1;
+			}
+			memset(tempBlock, 0, BLOCK_SIZE);
+		} else {
+			if(num_bytes_to_write < BLOCK_SIZE) {
+				fs_read_blocks(fs, SFS_REGION_DATA, *ptr, 1, tempBlock);
+				// whatever lies past the old end of file is stale and must read back as zeros
+				int blockStart = dataBlockIndex*BLOCK_SIZE;
+				if(old_size < blockStart+BLOCK_SIZE) {
+					int keep = old_size > blockStart ? old_size-blockStart : 0;
+					memset(tempBlock+keep, 0, BLOCK_SIZE-keep);
+				}
+			}
+			// a block other files share is copied instead of changed under them
+			int res = unshare_block(fs, ptr);
+			if(res < 0) {
+				#ifdef PRINT_ERRORS
+				printf("! sfs_fwrite: out of free blocks to copy shared block %d of inode[%d], stopping after %d bytes\n", dataBlockIndex, inodeIndex, num_bytes_written);
+				#endif
+				break;
+			}
+			if(res > 0) {
+				allocated = 1;
+				if(dataBlockIndex >= NUM_DIRECT_PTRS) {
+					indirect_dirty = 1;
+				}
+			}
+		}
+		
+		const char *src = num_bytes_to_write == BLOCK_SIZE ? iov_take(&cur, BLOCK_SIZE) : NULL;
+		if(src != NULL) {
+			if(run_len > 0 && (*ptr != run_block+run_len || src != run_src+run_len*BLOCK_SIZE)) {
+				fs_write_blocks(fs, SFS_REGION_DATA, run_block, run_len, (char*) run_src);
+				run_len = 0;
+			}
+			if(run_len == 0) {
+				run_block = *ptr;
+				run_src = src;
+			}
+			run_len++;
+			num_bytes_written += num_bytes_to_write;
+			pos += num_bytes_to_write;
+			continue;
+		}
+		
+		iov_gather(&cur, tempBlock+byteOffset, num_bytes_to_write);
+		num_bytes_written += num_bytes_to_write;
+		pos += num_bytes_to_write;
+		
+		// write the local data block back into disk
+		fs_write_blocks(fs, SFS_REGION_DATA, *ptr, 1, tempBlock);
+	}	  
+	if(run_len > 0) {
+		fs_write_blocks(fs, SFS_REGION_DATA, run_block, run_len, (char*) run_src);
+	}
+	
+	// Update the file size in the inode table entry (overwrites inside the file don't shrink it)
+	if(pos > inode->size) {
+		inode->size = pos;
+	}
+	
+	if(indirect_dirty) {
+		// Write back indirPtrList into data block
+		fs_write_blocks(fs, SFS_REGION_INDIRECT, inode->indirectPointer, 1, (char*) indirPtrList);
+	}
+	
+	// Plain overwrites leave the metadata alone
+	if(allocated || inode->size != old_size) {
+		write_inode_to_disk(fs, inodeIndex);
+	}
+	if(allocated) {
+		write_free_bm_to_disk(fs);
+	}
+	write_shared_to_disk(fs);
+	fs->fd_table[fileID].write_gen = fs->write_gen;
+	
+	return num_bytes_written;
+}
+
+// Writes out what the descriptor's append buffer holds; -1 if any of it never made it to disk
+static int flush_append(sfs_t *fs, int fileID) {
+	if(fileID < 0 || fileID >= NUM_INODES) {
+		return 0;
+	}
+	append_buf *ab = &fs->appends[fileID];
+	int res = ab->lost ? -1 : 0;
+	ab->lost = 0;
+	if(ab->len > 0) {
+		struct iovec iov = { ab->data, ab->len };
+		ab->len = 0;
+		if(do_pwritev(fs, fileID, &iov, 1, ab->start) != (int) iov.iov_len) {
+			res = -1;
+		}
+	}
+	return res;
+}
+
+// Flushes every descriptor's append buffer, for calls that look at the whole image
+static int flush_appends(sfs_t *fs) {
+	int res = 0;
+	for(int i=0; i<NUM_INODES; i++) {
+		if(flush_append(fs, i) != 0) {
+			res = -1;
+		}
+	}
+	return res;
+}
+
+/*
+ * A write shorter than a block that appends at the end of the file is held
+ * in the descriptor's append buffer instead of reading, rewriting and
+ * committing the last block every time. The buffer goes out in one write
+ * once it fills up to the end of a block, and before any call that writes
+ * the file some other way, seeks, syncs or closes it. Until then reads
+ * through the descriptor and sfs_getfilesize see it (the bytes are
+ * past inode->size). Returns the bytes taken, or -1 for a write that has
+ * to go through do_pwritev. A buffer is only started while a free block is
+ * left for its flush; should other files take it meanwhile, the flush
+ * fails and only the bytes that made it out count. Losing bytes of earlier
+ * calls that way is reported by the next flush, so by sfs_fseek, sfs_fsync
+ * or sfs_fclose at the latest.
+ */
+static int buffer_append(sfs_t *fs, int fileID, const struct iovec *iov, int iovcnt) {
+	append_buf *ab = &fs->appends[fileID];
+	int length = iov_length(iov, iovcnt);
+	int inodeIndex = fs->fd_table[fileID].inodeIndex;
+	iov_cursor cur = { iov, 0, 0 };
+
+	// every write of a SYNC instance has to be on disk when it returns
+	if(inodeIndex < 0 || fs->readonly || fs->durability == SFS_DURABILITY_SYNC || length <= 0 || length >= BLOCK_SIZE) {
+		return -1;
+	}
+	int size = fs->inode_table[inodeIndex].size;
+	int pos = fs->fd_table[fileID].rwptr;
+	if(pos != size+ab->len || length > (int) MAX_FILE_SIZE - pos || (ab->len == 0 && !has_free_block(fs))) {
+		return -1;
+	}
+	ab->start = size;
+
+	// fill up to the end of the block, write that out, keep the rest
+	int room = BLOCK_SIZE - size%BLOCK_SIZE - ab->len;
+	int n = length < room ? length : room;
+	iov_gather(&cur, ab->data+ab->len, n);
+	ab->len += n;
+	if(n < room) {
+		return n;
+	}
+	int held = ab->len-n;
+	struct iovec out = { ab->data, ab->len };
+	ab->len = 0;
+	int res = do_pwritev(fs, fileID, &out, 1, ab->start);
+	if(res < (int) out.iov_len) {
+		ab->lost = res < held;
+		return res > held ? res-held : 0;
+	}
+	ab->start += res;
+	if(length > n && !has_free_block(fs)) {
+		return n;
+	}
+	ab->len = length-n;
+	iov_gather(&cur, ab->data, ab->len);
+	return length;
+}
+
+// Writes at the descriptor's rwptr and moves it past what was written
+static int do_fwritev(sfs_t *fs, int fileID, const struct iovec *iov, int iovcnt) {
+	if(fileID < 0 || fileID>=NUM_INODES) {
+		return 0;
+	}
+	int res = buffer_append(fs, fileID, iov, iovcnt);
+	if(res < 0) {
+		res = flush_append(fs, fileID) == 0 ? do_pwritev(fs, fileID, iov, iovcnt, fs->fd_table[fileID].rwptr) : 0;
+	}
+	fs->fd_table[fileID].rwptr += res;
+	return res;
+}
+
+static int do_fwrite(sfs_t *fs, int fileID, const char *buf, int length) {
+	struct iovec iov = { (void*) buf, length < 0 ? 0 : length };
+	return do_fwritev(fs, fileID, &iov, 1);
+}
+
+// Seeking past the end is allowed; a later write there leaves a hole behind it
+static int do_fseek(sfs_t *fs, int fileID, int loc) {
+	
+	if(fileID<0 || fileID>=NUM_INODES) {
+		return -1;
+	}
+	if (fs->fd_table[fileID].inodeIndex == -1) {
+		return -1;
+	}
+	if(loc > MAX_FILE_SIZE || loc<0) {
+		return -1;
+	}
+	if(flush_append(fs, fileID) != 0) {
+		return -1;
+	}
+	fs->fd_table[fileID].rwptr = loc;
+	return 0;
+}
+
+/*
+ * Finds the first offset >= loc that is backed by a block (want_data) or
+ * is inside a hole (!want_data). Past the last block the file ends in an
+ * implicit hole, so a hole is always found and data may not be (-1).
+ */
+static int find_extent(sfs_t *fs, int inodeIndex, int loc, int want_data) {
+	inode_t *inode = &fs->inode_table[inodeIndex];
+	unsigned int indirPtrList[NUM_INDIRECT_PTRS];
+	int numBlocks = CEILING(inode->size, BLOCK_SIZE);
+
+	if(IS_INLINE(inode)) {
+		return want_data ? loc : (int) inode->size;
+	}
+	memset(indirPtrList, 0xff, sizeof(indirPtrList));
+	if(numBlocks > NUM_DIRECT_PTRS && IS_DATA_BLOCK(inode->indirectPointer)) {
+		fs_read_blocks(fs, SFS_REGION_INDIRECT, inode->indirectPointer, 1, (char*) indirPtrList);
+	}
+	for(int i=FLOOR(loc, BLOCK_SIZE); i<numBlocks; i++) {
+		unsigned int block = *file_slot(inode, indirPtrList, i);
+		if((IS_DATA_BLOCK(block) || block == SFS_COMPRESSED) == want_data) {
+			return i*BLOCK_SIZE > loc ? i*BLOCK_SIZE : loc;
+		}
+	}
+	return want_data ? -1 : (int) inode->size;
+}
+
+// Turns compression on or off for one open file; takes effect when it is closed
+static int do_fcompress(sfs_t *fs, int fileID, int on) {
+	if(fileID<0 || fileID>=NUM_INODES) {
+		return -1;
+	}
+	int inodeIndex = fs->fd_table[fileID].inodeIndex;
+	if (inodeIndex < 0 || inodeIndex == fs->inodeIndexForRootDir || fs->readonly) {
+		return -1;
+	}
+	inode_t *inode = &fs->inode_table[inodeIndex];
+	unsigned int flags = SFS_MODE_FLAGS(inode->mode) & ~SFS_MODE_COMPRESS;
+	inode->mode = flags | (on ? SFS_MODE_COMPRESS : 0) | SFS_MODE_TYPE(inode->mode);
+	write_inode_to_disk(fs, inodeIndex);
+	fs->fd_table[fileID].write_gen = fs->write_gen;
+	return 0;
+}
+
+static int do_lseek(sfs_t *fs, int fileID, int loc, int whence) {
+
+	if(fileID<0 || fileID>=NUM_INODES) {
+		return -1;
+	}
+	int inodeIndex = fs->fd_table[fileID].inodeIndex;
+	if (inodeIndex < 0 || flush_append(fs, fileID) != 0) {
+		return -1;
+	}
+	int size = fs->inode_table[inodeIndex].size;
+	switch(whence) {
+	case SFS_SEEK_SET:
+		break;
+	case SFS_SEEK_CUR:
+		loc += fs->fd_table[fileID].rwptr;
+		break;
+	case SFS_SEEK_END:
+		loc += size;
+		break;
+	case SFS_SEEK_DATA:
+	case SFS_SEEK_HOLE:
+		// like lseek, asking from at or past the end fails
+		if(loc < 0 || loc >= size) {
+			return -1;
+		}
+		loc = find_extent(fs, inodeIndex, loc, whence == SFS_SEEK_DATA);
+		break;
+	default:
+		return -1;
+	}
+	if(do_fseek(fs, fileID, loc) != 0) {
+		return -1;
+	}
+	return loc;
+}
+
+// Lets go of every block a file points at; the caller writes the bitmap and refcounts out
+static void release_file_blocks(sfs_t *fs, int inodeIndex) {
+	unsigned int indirPtrList[BLOCK_SIZE/sizeof(unsigned int)];
+	// An inline file owns no blocks, its pointers are file data
+	if(IS_INLINE(&fs->inode_table[inodeIndex])) {
+		memset(INLINE_DATA(&fs->inode_table[inodeIndex]), 0xff, INLINE_DATA_SIZE);
+	}
+	// A packed last block is shared, only the fragment goes
+	unsigned int tail = -1;
+	if(IS_TAIL(&fs->inode_table[inodeIndex])) {
+		unsigned int *ptr = block_ptr(fs, &fs->inode_table[inodeIndex], LAST_BLOCK(&fs->inode_table[inodeIndex]), indirPtrList);
+		if(ptr != NULL && IS_DATA_BLOCK(*ptr)) {
+			tail = *ptr;
+			tail_remove(fs, tail, inodeIndex, NULL);
+		}
+	}
+	// Damaged pointers must not free metadata or bits past the end of the disk
+	if(IS_DATA_BLOCK(fs->inode_table[inodeIndex].indirectPointer)) {
+		fs_read_blocks(fs, SFS_REGION_INDIRECT, fs->inode_table[inodeIndex].indirectPointer, 1, (char*) indirPtrList);
+		for(int i=0; i<BLOCK_SIZE/sizeof(unsigned int); i++) {
+			if(IS_DATA_BLOCK(indirPtrList[i]) && indirPtrList[i] != tail) {
+				release_block(fs, indirPtrList[i]);
+			}
+		}
+		release_block(fs, fs->inode_table[inodeIndex].indirectPointer);
+	}
+	fs->inode_table[inodeIndex].indirectPointer = -1;
+	
+	for(int i=0; i<12; i++) {
+		if(IS_DATA_BLOCK(fs->inode_table[inodeIndex].data_ptrs[i]) && fs->inode_table[inodeIndex].data_ptrs[i] != tail) {
+			release_block(fs, fs->inode_table[inodeIndex].data_ptrs[i]);
+		}
+		fs->inode_table[inodeIndex].data_ptrs[i] = -1;
+	}
+}
+
+static int do_remove(sfs_t *fs, char *file) {
+	
+	if(fs->readonly) {
+		return -1;
+	}
+	int fileExists = 0;
+	int inodeIndex;
+	for(int i=0; i<NUM_INODES; i++) {
+		if(strcmp(fs->rootDir[i].name, file) == 0) {
+			fileExists=1;
+			inodeIndex=fs->rootDir[i].num;
+			fs->rootDir[i].num = -1;
+			for(int j=0; j<MAX_FILE_NAME; j++) {
+				fs->rootDir[i].name[j]= '\0';
+			}
+			rm_index(fs->dir_entries_bit_map, i);
+			break;
+		}
+	}
+	if(!fileExists) {
+		#ifdef PRINT_ERRORS
+		printf("! sfs_fremove failed: file does not exist\n");
+		#endif
+		return -1;
+	}
+  
+	for(int i=0; i<NUM_INODES; i++) {
+		if(fs->fd_table[i].inodeIndex == inodeIndex) {
+			do_fclose(fs, i);
+			break;
+		}
+	}
+	release_file_blocks(fs, inodeIndex);
+	fs->inode_table[inodeIndex].size = -1;
+	fs->inode_table[inodeIndex].mode = -1;
+	
+	rm_index(fs->inode_table_bit_map, inodeIndex);
+
+	// Write data blocks bitmap back to disk since I freed a bunch of data blocks
+	write_free_bm_to_disk(fs);
+	// Shared blocks only lost a reference
+	write_shared_to_disk(fs);
+	// Write inode table back to disk (since I removed the inode)
+	write_inodet_to_disk(fs);
+	// Write rootDir back to disk (since I modified dir_entries)
+	write_rootDir_to_disk(fs);
+	
+	return 0;
+}
+
+/*
+ * Makes dst a copy of src that shares all of src's blocks, its indirect
+ * block included, so only metadata is written. Every pointer to a block is
+ * counted in the refcount table and whichever file writes to a shared block
+ * first gets a copy of its own (see unshare_block). A packed last block is
+ * the one thing copied: dst gets a block of its own for it, and an indirect
+ * block of its own if the pointer sits in there. A dst that exists keeps
+ * its inode and loses its old contents.
+ */
+static int do_clone(sfs_t *fs, char *src, char *dst) {
+	if(fs->readonly || src == NULL || src[0] == '\0' || !check_filenamevalidity(dst) || flush_appends(fs) != 0) {
+		return -1;
+	}
+	int srcIndex = -1, dstIndex = -1;
+	for(int i=0; i<NUM_INODES; i++) {
+		if(fs->rootDir[i].name[0] == '\0') {
+			continue;
+		}
+		if(strcmp(fs->rootDir[i].name, src) == 0) {
+			srcIndex = fs->rootDir[i].num;
+		}
+		if(strcmp(fs->rootDir[i].name, dst) == 0) {
+			dstIndex = fs->rootDir[i].num;
+		}
+	}
+	if(srcIndex < 0 || srcIndex == dstIndex || srcIndex == fs->inodeIndexForRootDir) {
+		#ifdef PRINT_ERRORS
+		printf("! sfs_clone: cannot clone %s to %s\n", src, dst);
+		#endif
+		return -1;
+	}
+	inode_t *inode = &fs->inode_table[srcIndex];
+	unsigned int indirPtrList[NUM_INDIRECT_PTRS];
+	uint16_t adds[NUM_BLOCKS];  // pointers dst adds to each block
+	int tailSlot = IS_TAIL(inode) && inode->size > 0 ? LAST_BLOCK(inode) : -1;
+	int has_indirect = !IS_INLINE(inode) && IS_DATA_BLOCK(inode->indirectPointer);
+	int own_indirect = has_indirect && tailSlot >= NUM_DIRECT_PTRS;
+	int nshared = 0;
+
+	memset(adds, 0, sizeof(adds));
+	memset(indirPtrList, 0xff, sizeof(indirPtrList));
+	if(has_indirect && fs_read_blocks(fs, SFS_REGION_INDIRECT, inode->indirectPointer, 1, (char*) indirPtrList) < 0) {
+		return -1;
+	}
+	if(has_indirect && !own_indirect) {
+		adds[inode->indirectPointer-BLOCK_INDEX_DATA_BLOCKS]++;
+	}
+	for(int i=0; i<NUM_DIRECT_PTRS+NUM_INDIRECT_PTRS && !IS_INLINE(inode); i++) {
+		unsigned int block = *file_slot(inode, indirPtrList, i);
+		if(IS_DATA_BLOCK(block) && i != tailSlot) {
+			adds[block-BLOCK_INDEX_DATA_BLOCKS]++;
+		}
+	}
+	// an untracked block goes from one owner to two
+	for(int b=0; b<NUM_BLOCKS; b++) {
+		if(adds[b] == 0) {
+			continue;
+		}
+		if((fs->refs[b] > 0 ? fs->refs[b] : 1) + adds[b] > REFCOUNT_MAX) {
+			#ifdef PRINT_ERRORS
+			printf("! sfs_clone: block %d of %s is shared too often to clone\n", b+BLOCK_INDEX_DATA_BLOCKS, src);
+			#endif
+			return -1;
+		}
+		nshared++;
+	}
+	if(nshared > 0 && reserve_shared_blocks(fs) < 0) {
+		return -1;
+	}
+
+	// take every block and inode needed before dst changes
+	unsigned int tailPtr = tailSlot >= 0 ? *file_slot(inode, indirPtrList, tailSlot) : (unsigned int) -1;
+	int tailCopy = -1, indirectCopy = -1;
+	if(IS_DATA_BLOCK(tailPtr) && (tailCopy = alloc_block(fs)) < 0) {
+		return -1;
+	}
+	if(own_indirect && (indirectCopy = alloc_block(fs)) < 0) {
+		if(tailCopy >= 0) {
+			rm_index(fs->free_bit_map, tailCopy);
+		}
+		return -1;
+	}
+	int created = dstIndex < 0;
+	if(created) {
+		dstIndex = get_index(fs->inode_table_bit_map);
+		if(dstIndex < 0 || dstIndex >= NUM_INODES) {
+			if(tailCopy >= 0) {
+				rm_index(fs->free_bit_map, tailCopy);
+			}
+			if(indirectCopy >= 0) {
+				rm_index(fs->free_bit_map, indirectCopy);
+			}
+			return -1;
+		}
+		int dirEntryIndex = get_index(fs->dir_entries_bit_map);
+		fs->rootDir[dirEntryIndex].num = dstIndex;
+		strcpy(fs->rootDir[dirEntryIndex].name, dst);
+		fs->rootDir[dirEntryIndex].name[MAX_FILE_NAME-1] = '\0';
+	} else {
+		release_file_blocks(fs, dstIndex);
+	}
+
+	inode_t *copy = &fs->inode_table[dstIndex];
+	*copy = *inode;
+	for(int b=0; b<NUM_BLOCKS; b++) {
+		if(adds[b] > 0) {
+			fs->refs[b] = (fs->refs[b] > 0 ? fs->refs[b] : 1) + adds[b];
+			fs->refs_dirty = 1;
+		}
+	}
+	if(tailCopy >= 0) {
+		char tailBlock[BLOCK_SIZE];
+		char tempBlock[BLOCK_SIZE];
+		tail_index *idx = (tail_index*) tailBlock;
+		memset(tempBlock, 0, BLOCK_SIZE);
+		fs_read_blocks(fs, SFS_REGION_DATA, tailPtr, 1, tailBlock);
+		int i = tail_lookup(idx, srcIndex);
+		if(i >= 0) {
+			memcpy(tempBlock, tailBlock+idx->frags[i].offset, idx->frags[i].length);
+		}
+		fs_write_blocks(fs, SFS_REGION_DATA, tailCopy, 1, tempBlock);
+		*file_slot(copy, indirPtrList, tailSlot) = tailCopy;
+		SET_MODE_TYPE(copy, SFS_MODE_REGULAR);
+	}
+	if(indirectCopy >= 0) {
+		fs_write_blocks(fs, SFS_REGION_INDIRECT, indirectCopy, 1, (char*) indirPtrList);
+		copy->indirectPointer = indirectCopy;
+	}
+
+	if(created) {
+		write_inodet_to_disk(fs);
+		write_rootDir_to_disk(fs);
+	} else {
+		write_inode_to_disk(fs, dstIndex);
+	}
+	write_free_bm_to_disk(fs);
+	write_shared_to_disk(fs);
+	return 0;
+}
+
+// Copies len bytes between two open files through a buffer of the filesystem's own
+static int copy_bytes(sfs_t *fs, int srcFd, int srcOff, int dstFd, int dstOff, int len) {
+	char buffer[COPY_CHUNK_BLOCKS*BLOCK_SIZE];
+	int done = 0;
+
+	while(done < len) {
+		struct iovec iov = { buffer, len-done < (int) sizeof(buffer) ? len-done : (int) sizeof(buffer) };
+		int got = do_preadv(fs, srcFd, &iov, 1, srcOff+done);
+		if(got <= 0) {
+			break;
+		}
+		iov.iov_len = got;
+		int put = do_pwritev(fs, dstFd, &iov, 1, dstOff+done);
+		done += put;
+		if(put < got) {
+			break;
+		}
+	}
+	return done;
+}
+
+/*
+ * Points nblocks blocks of dst, from block dstFirst on, at the blocks src
+ * has from srcFirst on, counting each new pointer in the refcount table.
+ * Holes in src punch holes in dst. Compressed clusters are shared whole
+ * when they land on a cluster of dst; blocks that can't be shared (part of
+ * a cluster, a packed last block, a count at REFCOUNT_MAX) are flagged in
+ * copy[] for the caller to copy. Returns -1 when dst could not
+ * be made ready and nothing was shared.
+ */
+static int share_blocks(sfs_t *fs, int srcFd, int srcFirst, int dstFd, int dstFirst, int nblocks, char *copy) {
+	int srcIndex = fs->fd_table[srcFd].inodeIndex;
+	int dstIndex = fs->fd_table[dstFd].inodeIndex;
+	inode_t *src = &fs->inode_table[srcIndex];
+	inode_t *dst = &fs->inode_table[dstIndex];
+	unsigned int srcList[NUM_INDIRECT_PTRS];
+	unsigned int indirPtrList[NUM_INDIRECT_PTRS];
+	unsigned int old_size = dst->size;
+	int allocated = 0, indirect_dirty = 0;
+
+	if(IS_INLINE(src) || reserve_shared_blocks(fs) < 0) {
+		return -1;
+	}
+	memset(srcList, 0xff, sizeof(srcList));
+	if(srcFirst+nblocks > NUM_DIRECT_PTRS && IS_DATA_BLOCK(src->indirectPointer)
+			&& fs_read_blocks(fs, SFS_REGION_INDIRECT, src->indirectPointer, 1, (char*) srcList) < 0) {
+		return -1;
+	}
+	int start = dstFirst*BLOCK_SIZE, end = (dstFirst+nblocks)*BLOCK_SIZE;
+	if(prepare_write(fs, dstIndex, start, end, indirPtrList, &allocated, &indirect_dirty) != 0) {
+		nblocks = 0;
+	}
+
+	for(int i=0; i<nblocks; ) {
+		int idx = srcFirst+i;
+		int n = 1;
+		int shareable = !(IS_TAIL(src) && idx == LAST_BLOCK(src));
+		// a whole compressed cluster landing on a cluster of dst is shared as it is
+		if(is_compressed(src, srcList, idx)) {
+			n = CLUSTER_BLOCKS - idx%CLUSTER_BLOCKS < nblocks-i ? CLUSTER_BLOCKS - idx%CLUSTER_BLOCKS : nblocks-i;
+			shareable = idx%CLUSTER_BLOCKS == 0 && (dstFirst+i)%CLUSTER_BLOCKS == 0 && n == CLUSTER_BLOCKS;
+		}
+		for(int j=0; j<n && shareable; j++) {
+			unsigned int block = *file_slot(src, srcList, idx+j);
+			shareable = !IS_DATA_BLOCK(block) || REFS(fs, block) < REFCOUNT_MAX;
+		}
+		for(int j=0; j<n; j++) {
+			unsigned int block = *file_slot(src, srcList, idx+j);
+			unsigned int *ptr = file_slot(dst, indirPtrList, dstFirst+i+j);
+			copy[i+j] = !shareable;
+			if(!shareable || *ptr == block) {
+				continue;
+			}
+			if(IS_DATA_BLOCK(*ptr)) {
+				release_block(fs, *ptr);
+				allocated = 1;
+			}
+			if(IS_DATA_BLOCK(block)) {
+				if(REFS(fs, block) == 0) {
+					REFS(fs, block) = 1;
+				}
+				REFS(fs, block)++;
+				fs->refs_dirty = 1;
+			}
+			*ptr = IS_DATA_BLOCK(block) || block == SFS_COMPRESSED ? block : (unsigned int) -1;
+			if(dstFirst+i+j >= NUM_DIRECT_PTRS) {
+				indirect_dirty = 1;
+			}
+		}
+		i += n;
+	}
+	if(nblocks > 0 && (unsigned int) end > dst->size) {
+		dst->size = end;
+	}
+
+	if(indirect_dirty) {
+		fs_write_blocks(fs, SFS_REGION_INDIRECT, dst->indirectPointer, 1, (char*) indirPtrList);
+	}
+	if(allocated || dst->size != old_size) {
+		write_inode_to_disk(fs, dstIndex);
+	}
+	if(allocated) {
+		write_free_bm_to_disk(fs);
+	}
+	write_shared_to_disk(fs);
+	fs->fd_table[dstFd].write_gen = fs->write_gen;
+	return nblocks > 0 ? 0 : -1;
+}
+
+/*
+ * Copies len bytes at srcOff in one open file to dstOff in another (or the
+ * same one, if the ranges don't overlap) without a caller buffer. When both
+ * offsets sit at the same place in a block, the whole blocks in between are
+ * shared with src like sfs_clone shares them, so only pointers are
+ * written; the partial blocks at either end are copied. Neither rwptr
+ * moves. Returns the bytes copied, fewer at the end of src or when the disk
+ * fills, and -1 for bad arguments.
+ */
+static int do_copy_range(sfs_t *fs, int srcFd, int srcOff, int dstFd, int dstOff, int len) {
+	if(srcFd < 0 || srcFd >= NUM_INODES || dstFd < 0 || dstFd >= NUM_INODES || srcOff < 0 || dstOff < 0 || len < 0) {
+		return -1;
+	}
+	int srcIndex = fs->fd_table[srcFd].inodeIndex;
+	int dstIndex = fs->fd_table[dstFd].inodeIndex;
+	if(srcIndex < 0 || dstIndex < 0 || fs->readonly) {
+		return -1;
+	}
+	if(flush_append(fs, srcFd) != 0 || flush_append(fs, dstFd) != 0) {
+		return -1;
+	}
+	int size = fs->inode_table[srcIndex].size;
+	if(len > size-srcOff) {
+		len = size-srcOff > 0 ? size-srcOff : 0;
+	}
+	if(len > MAX_FILE_SIZE-dstOff) {
+		len = MAX_FILE_SIZE-dstOff > 0 ? MAX_FILE_SIZE-dstOff : 0;
+	}
+	if(srcIndex == dstIndex && srcOff < dstOff+len && dstOff < srcOff+len) {
+		#ifdef PRINT_ERRORS
+		printf("! sfs_copy_range: source and destination ranges overlap\n");
+		#endif
+		return -1;
+	}
+	int done = 0;
+
+	int head = (BLOCK_SIZE - srcOff%BLOCK_SIZE) % BLOCK_SIZE;
+	int nblocks = srcOff%BLOCK_SIZE == dstOff%BLOCK_SIZE && len > head ? (len-head)/BLOCK_SIZE : 0;
+	if(nblocks == 0) {
+		done = copy_bytes(fs, srcFd, srcOff, dstFd, dstOff, len);
+	} else {
+		char copy[NUM_DIRECT_PTRS+NUM_INDIRECT_PTRS];
+		int srcFirst = (srcOff+head)/BLOCK_SIZE;
+		int dstFirst = (dstOff+head)/BLOCK_SIZE;
+		done = copy_bytes(fs, srcFd, srcOff, dstFd, dstOff, head);
+		if(done == head && share_blocks(fs, srcFd, srcFirst, dstFd, dstFirst, nblocks, copy) == 0) {
+			for(int i=0; i<nblocks; i++) {
+				int off = (srcFirst+i)*BLOCK_SIZE - srcOff;
+				if(copy[i] && copy_bytes(fs, srcFd, srcOff+off, dstFd, dstOff+off, BLOCK_SIZE) != BLOCK_SIZE) {
+					nblocks = i;
+					break;
+				}
+			}
+			done += nblocks*BLOCK_SIZE;
+		} else if(done == head) {
+			done += copy_bytes(fs, srcFd, srcOff+done, dstFd, dstOff+done, nblocks*BLOCK_SIZE);
+		}
+		if(done == head+nblocks*BLOCK_SIZE) {
+			done += copy_bytes(fs, srcFd, srcOff+done, dstFd, dstOff+done, len-done);
+		}
+	}
+	return done;
+}
+
+#define IS_USABLE(fs, block) (((fs)->free_bit_map[(block)/8] & (fs)->snap_map[(block)/8] & (1 << ((block)%8))) != 0)
+#define DEFRAG_FILES_PER_CALL 4 // bounds how long one sfs_defrag call holds the instance
+
+/*
+ * Lists the data blocks of a file in file order into blocks and returns how
+ * many runs of adjacent blocks they form. Holes and compression markers
+ * are skipped, and so is a last block packed into a tail block. Returns -1
+ * if the indirect block can't be read.
+ */
+static int file_runs(sfs_t *fs, int inodeIndex, unsigned int *indirPtrList, unsigned int *blocks, int *nblocks) {
+	inode_t *inode = &fs->inode_table[inodeIndex];
+	int n = 0, runs = 0;
+
+	*nblocks = 0;
+	if(IS_INLINE(inode) || inode->size == 0) {
+		return 0;
+	}
+	int count = CEILING(inode->size, BLOCK_SIZE);
+	if(IS_TAIL(inode)) {
+		count--;
+	}
+	if(count > NUM_DIRECT_PTRS) {
+		if(!IS_DATA_BLOCK(inode->indirectPointer)) {
+			memset(indirPtrList, 0xff, NUM_INDIRECT_PTRS*sizeof(unsigned int));
+		} else if(fs_read_blocks(fs, SFS_REGION_INDIRECT, inode->indirectPointer, 1, (char*) indirPtrList) < 0) {
+			return -1;
+		}
+	}
+	for(int i=0; i<count; i++) {
+		unsigned int block = *file_slot(inode, indirPtrList, i);
+		if(!IS_DATA_BLOCK(block)) {
+			continue;
+		}
+		if(n == 0 || block != blocks[n-1]+1) {
+			runs++;
+		}
+		blocks[n++] = block;
+	}
+	*nblocks = n;
+	return runs;
+}
+
+// Counts the runs of blocks that are free for new data and the longest one
+static int free_runs(sfs_t *fs, int *largest, int *total) {
+	int runs = 0, len = 0;
+
+	*largest = *total = 0;
+	for(int b=BLOCK_INDEX_DATA_BLOCKS; b<BLOCK_INDEX_FREE_BITMAP; b++) {
+		if(!IS_USABLE(fs, b)) {
+			len = 0;
+			continue;
+		}
+		if(len++ == 0) {
+			runs++;
+		}
+		(*total)++;
+		if(len > *largest) {
+			*largest = len;
+		}
+	}
+	return runs;
+}
+
+// Start of the shortest free run of at least need blocks, -1 if there is none
+static int find_free_run(sfs_t *fs, int need) {
+	int best = -1, best_len = 0;
+
+	for(int b=BLOCK_INDEX_DATA_BLOCKS; b<BLOCK_INDEX_FREE_BITMAP; ) {
+		int len = 0;
+		while(b+len < BLOCK_INDEX_FREE_BITMAP && IS_USABLE(fs, b+len)) {
+			len++;
+		}
+		if(len >= need && (best < 0 || len < best_len)) {
+			best = b;
+			best_len = len;
+		}
+		b += len+1;
+	}
+	return best;
+}
+
+/*
+ * Moves every block of a file into one free run: its indirect block first,
+ * then the data blocks in file order. The copies and the new indirect
+ * block are written before the inode points at them, and the old blocks
+ * are only freed after that, so a crash at any point leaves either layout
+ * whole (plus blocks fsck reclaims). Writeback would write the cached
+ * blocks in address order instead, inode table first, so the cache is
+ * flushed before each of the last two steps. Blocks that are shared or held by a
+ * snapshot can't move, and neither can files with sfs_mmap views out.
+ * Returns 1 if the file moved, 0 if it stayed where it is.
+ */
+static int relocate_file(sfs_t *fs, int inodeIndex, int *moved) {
+	inode_t *inode = &fs->inode_table[inodeIndex];
+	unsigned int indirPtrList[NUM_INDIRECT_PTRS];
+	unsigned int blocks[NUM_DIRECT_PTRS+NUM_INDIRECT_PTRS];
+	int nblocks;
+
+	if(file_runs(fs, inodeIndex, indirPtrList, blocks, &nblocks) <= 1 || has_views(fs, inodeIndex)) {
+		return 0;
+	}
+	int have_indirect = CEILING(inode->size, BLOCK_SIZE) - IS_TAIL(inode) > NUM_DIRECT_PTRS && IS_DATA_BLOCK(inode->indirectPointer);
+	if(have_indirect && (REFS(fs, inode->indirectPointer) > 0 || IS_HELD(fs, inode->indirectPointer))) {
+		return 0;
+	}
+	for(int i=0; i<nblocks; i++) {
+		if(REFS(fs, blocks[i]) > 0 || IS_HELD(fs, blocks[i])) {
+			return 0;
+		}
+	}
+	int need = nblocks + have_indirect;
+	int start = find_free_run(fs, need);
+	if(start < 0) {
+		return 0;
+	}
+	char *data = malloc(nblocks*BLOCK_SIZE);
+	if(data == NULL) {
+		return 0;
+	}
+	for(int i=0; i<nblocks; i++) {
+		if(fs_read_blocks(fs, SFS_REGION_DATA, blocks[i], 1, data+i*BLOCK_SIZE) < 0) {
+			#ifdef PRINT_ERRORS
+			printf("! sfs_defrag: cannot read block %d of inode[%d], leaving it in place\n", blocks[i], inodeIndex);
+			#endif
+			free(data);
+			return 0;
+		}
+	}
+	for(int i=0; i<need; i++) {
+		force_set_index(fs->free_bit_map, start+i);
+	}
+	write_free_bm_to_disk(fs);
+
+	// point a copy of the inode and indirect list at the new run
+	inode_t updated = *inode;
+	int first = start + have_indirect;
+	int count = CEILING(inode->size, BLOCK_SIZE) - IS_TAIL(inode);
+	for(int i=0, k=0; i<count; i++) {
+		unsigned int *slot = file_slot(&updated, indirPtrList, i);
+		if(IS_DATA_BLOCK(*slot)) {
+			// a compressed cluster's decompressed copy is cached under its first block
+			if(is_compressed(inode, indirPtrList, i) && (i%CLUSTER_BLOCKS) == 0) {
+				for(int j=0; j<CLUSTER_BLOCKS; j++) {
+					cache_forget(fs->cache, CLUSTER_KEY(*slot, j));
+				}
+			}
+			*slot = first + k++;
+		}
+	}
+	fs_write_blocks(fs, SFS_REGION_DATA, first, nblocks, data);
+	if(have_indirect) {
+		updated.indirectPointer = start;
+		fs_write_blocks(fs, SFS_REGION_INDIRECT, start, 1, (char*) indirPtrList);
+	}
+	if(cache_flush(fs->cache) != 0) {
+		for(int i=0; i<need; i++) {
+			rm_index(fs->free_bit_map, start+i);
+		}
+		write_free_bm_to_disk(fs);
+		free(data);
+		return 0;
+	}
+	unsigned int old_indirect = inode->indirectPointer;
+	*inode = updated;
+	write_inode_to_disk(fs, inodeIndex);
+
+	// should the inode not make it out, the old blocks stay allocated for fsck to reclaim
+	if(cache_flush(fs->cache) != 0) {
+		free(data);
+		*moved += need;
+		return 1;
+	}
+	for(int i=0; i<nblocks; i++) {
+		rm_index(fs->free_bit_map, blocks[i]);
+	}
+	if(have_indirect) {
+		rm_index(fs->free_bit_map, old_indirect);
+	}
+	write_free_bm_to_disk(fs);
+	free(data);
+	*moved += need;
+	return 1;
+}
+
+// Runs and fragmented files summed over every file
+static void count_file_runs(sfs_t *fs, int *files, int *fragmented, int *runs) {
+	unsigned int indirPtrList[NUM_INDIRECT_PTRS];
+	unsigned int blocks[NUM_DIRECT_PTRS+NUM_INDIRECT_PTRS];
+	int nblocks;
+
+	*files = *fragmented = *runs = 0;
+	for(int i=0; i<NUM_INODES; i++) {
+		if(fs->rootDir[i].name[0] == '\0') {
+			continue;
+		}
+		int r = file_runs(fs, fs->rootDir[i].num, indirPtrList, blocks, &nblocks);
+		if(r > 0) {
+			(*files)++;
+			*fragmented += r > 1;
+			*runs += r;
+		}
+	}
+}
+
+/*
+ * One step of making fragmented files contiguous while the image stays
+ * mounted: walks the directory from where the last step stopped and moves
+ * files with relocate_file until DEFRAG_FILES_PER_CALL of them moved or
+ * every slot was looked at once. Going round again retries files an
+ * earlier step had to skip, since the blocks a move frees can make room
+ * for them. Returns how many files moved, 0 once a whole round found
+ * nothing left to move, -1 on a read only mount.
+ */
+static int do_defrag(sfs_t *fs, sfs_defrag_report *report) {
+	sfs_defrag_report r;
+
+	if(fs->readonly || flush_appends(fs) != 0) {
+		return -1;
+	}
+	memset(&r, 0, sizeof(r));
+	count_file_runs(fs, &r.files, &r.fragmented_before, &r.runs_before);
+	r.free_runs_before = free_runs(fs, &r.largest_free_before, &r.free_blocks);
+
+	int moved_files = 0;
+	for(int n=0; n<NUM_INODES && moved_files<DEFRAG_FILES_PER_CALL; n++) {
+		int i = fs->defrag_next;
+		fs->defrag_next = (i+1) % NUM_INODES;
+		if(fs->rootDir[i].name[0] != '\0' && fs->rootDir[i].num != fs->inodeIndexForRootDir) {
+			moved_files += relocate_file(fs, fs->rootDir[i].num, &r.blocks_moved);
+		}
+	}
+	write_checksums_to_disk(fs);
+
+	count_file_runs(fs, &r.files, &r.fragmented_after, &r.runs_after);
+	r.free_runs_after = free_runs(fs, &r.largest_free_after, &r.free_blocks);
+	if(report != NULL) {
+		*report = r;
+	}
+	return moved_files;
+}
+
+static int find_snapshot(sfs_t *fs, const char *name) {
+	for(int i=0; i<SFS_MAX_SNAPSHOTS; i++) {
+		if(fs->snapshots[i].name[0] != '\0' && strncmp(fs->snapshots[i].name, name, MAX_FILE_NAME) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Freezes the live tree under name. Only the inode table and root directory
+ * are copied, into blocks of the snapshot's own; everything else they reach
+ * is held where it is. The live tree moves a held block the next time it
+ * writes to it, so the snapshot keeps seeing the old contents.
+ */
+static int do_snapshot(sfs_t *fs, const char *name) {
+	unsigned int copies[NUM_BLOCKS_INODET+NUM_BLOCKS_ROOTDIR];
+	int ncopies = NUM_BLOCKS_INODET+NUM_BLOCKS_ROOTDIR;
+
+	if(fs->readonly || name == NULL || name[0] == '\0' || strlen(name) >= MAX_FILE_NAME || find_snapshot(fs, name) >= 0) {
+		return -1;
+	}
+	if(flush_appends(fs) != 0) {
+		return -1;
+	}
+	int slot;
+	for(slot=0; slot<SFS_MAX_SNAPSHOTS && fs->snapshots[slot].name[0] != '\0'; slot++) {
+	}
+	if(slot == SFS_MAX_SNAPSHOTS) {
+		#ifdef PRINT_ERRORS
+		printf("! sfs_snapshot: all %d snapshots are taken\n", SFS_MAX_SNAPSHOTS);
+		#endif
+		return -1;
+	}
+	int table_new = !IS_DATA_BLOCK(fs->super_block.snapshot_block);
+	if(table_new) {
+		int table_block = alloc_block(fs);
+		if(table_block < 0) {
+			return -1;
+		}
+		fs->super_block.snapshot_block = table_block;
+	}
+	for(int i=0; i<ncopies; i++) {
+		int new_index = alloc_block(fs);
+		if(new_index < 0) {
+			for(int j=0; j<i; j++) {
+				rm_index(fs->free_bit_map, copies[j]);
+			}
+			if(table_new) {
+				rm_index(fs->free_bit_map, fs->super_block.snapshot_block);
+				fs->super_block.snapshot_block = 0;
+			}
+			return -1;
+		}
+		copies[i] = new_index;
+	}
+
+	// the snapshot holds every block in use except metadata the live tree rewrites in place
+	snapshot_entry *snap = &fs->snapshots[slot];
+	inode_t *root = &fs->inode_table[fs->inodeIndexForRootDir];
+	memset(snap, 0, sizeof(snapshot_entry));
+	memset(snap->map, UINT8_MAX, FREE_BM_SIZE);
+	for(int b=BLOCK_INDEX_DATA_BLOCKS; b<BLOCK_INDEX_FREE_BITMAP; b++) {
+		if((fs->free_bit_map[b/8] & (1 << (b%8))) || b == root->data_ptrs[0] || b == root->data_ptrs[1]
+				|| b == root->data_ptrs[2] || b == fs->super_block.refcount_block
+				|| b == fs->super_block.dedup_index_block || b == fs->super_block.snapshot_block) {
+			continue;
+		}
+		force_set_index(snap->map, b);
+	}
+
+	// the copied inode table points the root inode at the copied directory
+	char buffer[NUM_BLOCKS_INODET*BLOCK_SIZE];
+	inode_t live_root = *root;
+	for(int i=0; i<NUM_BLOCKS_ROOTDIR; i++) {
+		root->data_ptrs[i] = copies[NUM_BLOCKS_INODET+i];
+	}
+	pack_inodet(fs, buffer);
+	*root = live_root;
+	for(int i=0; i<NUM_BLOCKS_INODET; i++) {
+		fs_write_blocks(fs, SFS_REGION_SNAPSHOT, copies[i], 1, buffer+i*BLOCK_SIZE);
+		snap->inodet[i] = copies[i];
+	}
+	pack_rootDir(fs, buffer);
+	for(int i=0; i<NUM_BLOCKS_ROOTDIR; i++) {
+		fs_write_blocks(fs, SFS_REGION_SNAPSHOT, copies[NUM_BLOCKS_INODET+i], 1, buffer+i*BLOCK_SIZE);
+		snap->dir[i] = copies[NUM_BLOCKS_INODET+i];
+	}
+	// the copies belong to the snapshot alone
+	for(int i=0; i<ncopies; i++) {
+		rm_index(fs->free_bit_map, copies[i]);
+	}
+	strcpy(snap->name, name);
+	rebuild_snap_map(fs);
+	// fragments are packed into a fresh tail block from now on
+	fs->tail_block = -1;
+
+	write_snapshots_to_disk(fs);
+	write_free_bm_to_disk(fs);
+	if(table_new) {
+		write_superblock_to_disk(fs);
+	}
+	return 0;
+}
+
+// Lets go of a snapshot; the blocks only it held become free
+static int do_snapshot_delete(sfs_t *fs, const char *name) {
+	if(fs->readonly || name == NULL || name[0] == '\0') {
+		return -1;
+	}
+	int slot = find_snapshot(fs, name);
+	if(slot < 0) {
+		#ifdef PRINT_ERRORS
+		printf("! sfs_snapshot_delete: no snapshot named %s\n", name);
+		#endif
+		return -1;
+	}
+	memset(&fs->snapshots[slot], 0, sizeof(snapshot_entry));
+	rebuild_snap_map(fs);
+	write_snapshots_to_disk(fs);
+	return 0;
+}
+
+// Swaps the live inode table and root directory of a mounted image for a snapshot's
+static int do_load_snapshot(sfs_t *fs, const char *name) {
+	char buffer[NUM_BLOCKS_INODET*BLOCK_SIZE];
+
+	int slot = find_snapshot(fs, name);
+	if(slot < 0) {
+		#ifdef PRINT_ERRORS
+		printf("! sfs_mount_snapshot: no snapshot named %s\n", name);
+		#endif
+		return -1;
+	}
+	for(int i=0; i<NUM_BLOCKS_INODET; i++) {
+		unsigned int block = fs->snapshots[slot].inodet[i];
+		if(!IS_DATA_BLOCK(block) || fs_read_blocks(fs, SFS_REGION_SNAPSHOT, block, 1, buffer+i*BLOCK_SIZE) < 0) {
+			return -1;
+		}
+	}
+	unpack_inodet(fs, buffer);
+	for(int i=0; i<NUM_BLOCKS_ROOTDIR; i++) {
+		if(!IS_DATA_BLOCK(fs->inode_table[fs->inodeIndexForRootDir].data_ptrs[i])) {
+			return -1;
+		}
+	}
+	read_rootDir_from_disk(fs);
+	fs->readonly = 1;
+	fs->compress = 0;
+	fs->dedup = 0;
+	return 0;
+}
+
+int sfs_parse_durability(const char *spec, sfs_durability *policy, int *interval_ms) {
+	if(strcmp(spec, "none") == 0) {
+		*policy = SFS_DURABILITY_NONE;
+	} else if(strcmp(spec, "close") == 0) {
+		*policy = SFS_DURABILITY_ON_CLOSE;
+	} else if(strcmp(spec, "sync") == 0) {
+		*policy = SFS_DURABILITY_SYNC;
+	} else if(strncmp(spec, "periodic", 8) == 0 && (spec[8] == '\0' || spec[8] == ':')) {
+		*policy = SFS_DURABILITY_PERIODIC;
+		if(spec[8] == ':') {
+			*interval_ms = atoi(spec+9);
+		}
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+void sfs_set_durability_r(sfs_t *fs, sfs_durability policy, int interval_ms) {
+	if(fs == NULL) {
+		return;
+	}
+	uint64_t t = SFS_CAPTURE_START();
+	fs->durability = policy;
+	if(interval_ms > 0) {
+		fs->durability_interval_ms = interval_ms;
+	}
+	SFS_CAPTURE(fs->capture_id, SFS_CAP_SET_DURABILITY, -1, policy, interval_ms, 0, 0, 0, t);
+}
+
+// Sets the policy for the mksfs instance and for every instance mounted later
+void sfs_set_durability(sfs_durability policy, int interval_ms) {
+	default_durability = policy;
+	if(interval_ms > 0) {
+		default_durability_interval_ms = interval_ms;
+	}
+	durability_set = 1;
+	sfs_set_durability_r(legacy_fs, policy, interval_ms);
+}
+
+// SFS_DURABILITY=none|close|periodic[:ms]|sync picks the policy unless the program set one
+void init_durability(sfs_t *fs) {
+	char *env = getenv("SFS_DURABILITY");
+	sfs_durability policy = SFS_DURABILITY_NONE;
+	int interval = default_durability_interval_ms;
+
+	fs->durability = default_durability;
+	fs->durability_interval_ms = default_durability_interval_ms;
+	if(durability_set || env == NULL) {
+		return;
+	}
+	if(sfs_parse_durability(env, &policy, &interval) != 0) {
+		printf("Ignoring bad SFS_DURABILITY \"%s\"\n", env);
+		return;
+	}
+	fs->durability = policy;
+	fs->durability_interval_ms = interval > 0 ? interval : default_durability_interval_ms;
+}
+
+// Parses "off" or pct[:ms] for sfs_set_writeback, e.g. SFS_WRITEBACK=25:500
+int sfs_parse_writeback(const char *spec, int *dirty_pct, int *expire_ms) {
+	char *end;
+
+	if(strcmp(spec, "off") == 0) {
+		*dirty_pct = 0;
+		return 0;
+	}
+	long pct = strtol(spec, &end, 10);
+	if(end == spec || pct < 0 || pct > 100 || (*end != '\0' && *end != ':')) {
+		return -1;
+	}
+	*dirty_pct = pct;
+	if(*end == ':') {
+		*expire_ms = atoi(end+1);
+	}
+	return 0;
+}
+
+/*
+ * Switches the instance's cache to writeback (dirty_pct > 0) or back to
+ * writing through. -1 if the cache has no frames, the writeback thread
+ * can't start or writing out the dirty blocks failed; the instance then
+ * writes through.
+ */
+int sfs_set_writeback_r(sfs_t *fs, int dirty_pct, int expire_ms) {
+	if(fs == NULL) {
+		return -1;
+	}
+	uint64_t t = SFS_CAPTURE_START();
+	fs->writeback_pct = dirty_pct > 0 ? dirty_pct : 0;
+	if(expire_ms > 0) {
+		fs->writeback_expire_ms = expire_ms;
+	}
+	int res = cache_set_writeback(fs->cache, fs->writeback_pct, fs->writeback_expire_ms);
+	if(res != 0) {
+		fs->writeback_pct = 0;
+	}
+	SFS_CAPTURE(fs->capture_id, SFS_CAP_SET_WRITEBACK, -1, dirty_pct, expire_ms, 0, 0, res, t);
+	return res;
+}
+
+// Sets writeback for the mksfs instance and for every instance mounted later
+int sfs_set_writeback(int dirty_pct, int expire_ms) {
+	default_writeback_pct = dirty_pct > 0 ? dirty_pct : 0;
+	if(expire_ms > 0) {
+		default_writeback_expire_ms = expire_ms;
+	}
+	writeback_set = 1;
+	return legacy_fs == NULL ? 0 : sfs_set_writeback_r(legacy_fs, dirty_pct, expire_ms);
+}
+
+// SFS_WRITEBACK=off|pct[:ms] picks writeback unless the program set it
+void init_writeback(sfs_t *fs) {
+	char *env = getenv("SFS_WRITEBACK");
+	int pct = 0, expire = default_writeback_expire_ms;
+
+	fs->writeback_pct = default_writeback_pct;
+	fs->writeback_expire_ms = default_writeback_expire_ms;
+	if(writeback_set || env == NULL) {
+		return;
+	}
+	if(sfs_parse_writeback(env, &pct, &expire) != 0) {
+		printf("Ignoring bad SFS_WRITEBACK \"%s\"\n", env);
+		return;
+	}
+	fs->writeback_pct = pct;
+	fs->writeback_expire_ms = expire > 0 ? expire : default_writeback_expire_ms;
+}
+
+void sfs_set_compression_r(sfs_t *fs, int on) {
+	if(fs == NULL) {
+		return;
+	}
+	uint64_t t = SFS_CAPTURE_START();
+	fs->compress = on != 0;
+	SFS_CAPTURE(fs->capture_id, SFS_CAP_SET_COMPRESSION, -1, on, 0, 0, 0, 0, t);
+}
+
+// Sets whether new files are compressed, for the mksfs instance and every instance mounted later
+void sfs_set_compression(int on) {
+	default_compress = on != 0;
+	compress_set = 1;
+	sfs_set_compression_r(legacy_fs, on);
+}
+
+// SFS_COMPRESS=1 compresses new files unless the program decided
+void init_compression(sfs_t *fs) {
+	char *env = getenv("SFS_COMPRESS");
+
+	fs->compress = default_compress;
+	if(!compress_set && env != NULL) {
+		fs->compress = atoi(env) != 0;
+	}
+}
+
+void sfs_set_dedup_r(sfs_t *fs, int on) {
+	if(fs == NULL) {
+		return;
+	}
+	uint64_t t = SFS_CAPTURE_START();
+	fs->dedup = on != 0;
+	SFS_CAPTURE(fs->capture_id, SFS_CAP_SET_DEDUP, -1, on, 0, 0, 0, 0, t);
+}
+
+// Sets whether full block writes are deduplicated, for the mksfs instance and every instance mounted later
+void sfs_set_dedup(int on) {
+	default_dedup = on != 0;
+	dedup_set = 1;
+	sfs_set_dedup_r(legacy_fs, on);
+}
+
+// SFS_DEDUP=1 deduplicates unless the program decided
+void init_dedup(sfs_t *fs) {
+	char *env = getenv("SFS_DEDUP");
+
+	fs->dedup = default_dedup;
+	if(!dedup_set && env != NULL) {
+		fs->dedup = atoi(env) != 0;
+	}
+}
+
+// One fsync/fdatasync covering every block written up to now, skipped if gen is already covered
+int sync_through(sfs_t *fs, uint64_t gen, int full) {
+	if(gen <= fs->synced_gen && !full) {
+		return 0;
+	}
+	if(fs->write_gen == fs->synced_gen) {
+		return 0;
+	}
+	uint64_t covered = fs->write_gen;
+	if(cache_flush(fs->cache) != 0 || disk_sync_r(fs->disk, full) != 0) {
+		return -1;
+	}
+	fs->synced_gen = covered;
+	fs->last_sync_ns = stats_now_ns();
+	fs->stats.syncs++;
+	return 0;
+}
+
+// Run at the end of every modifying call: hand writes to the OS, then fsync if the policy says so
+void apply_durability(sfs_t *fs) {
+	write_checksums_to_disk(fs);
+	disk_flush_r(fs->disk);
+	if(fs->durability == SFS_DURABILITY_SYNC) {
+		sync_through(fs, fs->write_gen, 0);
+	} else if(fs->durability == SFS_DURABILITY_PERIODIC
+			&& stats_now_ns() - fs->last_sync_ns >= (uint64_t) fs->durability_interval_ms*1000000) {
+		sync_through(fs, fs->write_gen, 0);
+	}
+}
+
+int is_open_fd(sfs_t *fs, int fileID) {
+	return fileID >= 0 && fileID < NUM_INODES && fs->fd_table[fileID].inodeIndex != -1;
+}
+
+// Mounts the image at path, then switches to the named snapshot unless snapshot is NULL
+static sfs_t *mount_image(const char *path, int fresh, const char *snapshot) {
+	trace_init_from_env();
+	capture_init_from_env();
+	sfs_t *fs = calloc(1, sizeof(sfs_t));
+	if(fs == NULL) {
+		return NULL;
+	}
+	init_durability(fs);
+	init_writeback(fs);
+	init_compression(fs);
+	init_dedup(fs);
+	uint64_t t = stats_now_ns();
+	SFS_TRACE_ENTER(mksfs, SFS_OP_MKSFS, fresh, 0);
+	int res = do_mksfs(fs, path, fresh);
+	if(res == 0 && snapshot != NULL) {
+		res = do_load_snapshot(fs, snapshot);
+	}
+	if(res == 0) {
+		apply_durability(fs);
+	}
+	SFS_TRACE_EXIT(mksfs, SFS_OP_MKSFS, res);
+	fs->capture_id = capture_new_instance();
+	SFS_CAPTURE(fs->capture_id, SFS_CAP_MOUNT, -1, capture_name_id(path), fresh, capture_name_id(snapshot), 0, res, t);
+	if(res != 0) {
+		cache_destroy(fs->cache);
+		disk_close(fs->disk);
+		free(fs);
+		return NULL;
+	}
+	stats_record_op(&fs->stats, SFS_OP_MKSFS, t, 0, 0);
+	return fs;
+}
+
+/*
+ * Mounts the image at path as an instance of its own, formatting it first
+ * when fresh is 1. Returns NULL if the image can't be opened or isn't an
+ * sfs image.
+ */
+sfs_t *sfs_mount(const char *path, int fresh) {
+	return mount_image(path, fresh, NULL);
+}
+
+/*
+ * Mounts the snapshot called name of the image at path, read only: files
+ * read back as they were when it was taken and calls that would change
+ * anything fail. The live image may be mounted and written at the same
+ * time, but the snapshot must not be deleted while it is mounted.
+ */
+sfs_t *sfs_mount_snapshot(const char *path, const char *name) {
+	if(name == NULL) {
+		return NULL;
+	}
+	return mount_image(path, 0, name);
+}
+
+// Writes everything out (synced unless the policy is NONE) and frees the instance
+int sfs_unmount(sfs_t *fs) {
+	int res = 0;
+	if(fs == NULL) {
+		return -1;
+	}
+	uint64_t t = SFS_CAPTURE_START();
+	if(flush_appends(fs) != 0) {
+		res = -1;
+	}
+	for(int v=0; v<MAX_VIEWS; v++) {
+		if(fs->views[v].addr != NULL) {
+			release_view(fs, &fs->views[v]);
+		}
+	}
+	write_checksums_to_disk(fs);
+	if(cache_flush(fs->cache) != 0) {
+		res = -1;
+	}
+	disk_flush_r(fs->disk);
+	if(fs->durability != SFS_DURABILITY_NONE && sync_through(fs, fs->write_gen, 1) != 0) {
+		res = -1;
+	}
+	int id = fs->capture_id;
+	cache_destroy(fs->cache);
+	disk_close(fs->disk);
+	free(fs);
+	SFS_CAPTURE(id, SFS_CAP_UNMOUNT, -1, 0, 0, 0, 0, res, t);
+	return res;
+}
+
+/*
+ * Public entry points. Each one times the call, counts it in the instance's
+ * stats and fires the entry/return trace probes around the do_* implementation.
+ */
+int sfs_getnextfilename_r(sfs_t *fs, char *fname) {
+	if(fs == NULL) {
+		return 0;
+	}
+	uint64_t t = stats_now_ns();
+	SFS_TRACE_ENTER(getnextfilename, SFS_OP_GETNEXTFILENAME, 0, 0);
+	int res = do_getnextfilename(fs, fname);
+	SFS_TRACE_EXIT(getnextfilename, SFS_OP_GETNEXTFILENAME, res);
+	stats_record_op(&fs->stats, SFS_OP_GETNEXTFILENAME, t, 0, 0);
+	SFS_CAPTURE(fs->capture_id, SFS_CAP_GETNEXTFILENAME, -1, 0, 0, 0, 0, res, t);
+	return res;
+}
+
+int sfs_getfilesize_r(sfs_t *fs, const char* path) {
+	if(fs == NULL) {
+		return -1;
+	}
+	uint64_t t = stats_now_ns();
+	SFS_TRACE_ENTER(getfilesize, SFS_OP_GETFILESIZE, 0, 0);
+	int res = do_getfilesize(fs, path);
+	SFS_TRACE_EXIT(getfilesize, SFS_OP_GETFILESIZE, res);
+	stats_record_op(&fs->stats, SFS_OP_GETFILESIZE, t, res < 0, 0);
+	SFS_CAPTURE(fs->capture_id, SFS_CAP_GETFILESIZE, -1, capture_name_id(path), 0, 0, 0, res, t);
+	return res;
+}
+
+int sfs_fopen_r(sfs_t *fs, char *name) {
+	if(fs == NULL) {
+		return -1;
+	}
+	uint64_t t = stats_now_ns();
+	SFS_TRACE_ENTER(fopen, SFS_OP_FOPEN, 0, 0);
+	int res = do_fopen(fs, name);
+	apply_durability(fs);
+	SFS_TRACE_EXIT(fopen, SFS_OP_FOPEN, res);
+	stats_record_op(&fs->stats, SFS_OP_FOPEN, t, res < 0, 0);
+	SFS_CAPTURE(fs->capture_id, SFS_CAP_FOPEN, -1, capture_name_id(name), 0, 0, 0, res, t);
+	return res;
+}
+
+int sfs_fclose_r(sfs_t *fs, int fileID) {
+	if(fs == NULL) {
+		return -1;
+	}
+	uint64_t t = stats_now_ns();
+	SFS_TRACE_ENTER(fclose, SFS_OP_FCLOSE, fileID, 0);
+	int flushed = flush_append(fs, fileID);
+	if(is_open_fd(fs, fileID) && !fs->readonly && !has_views(fs, fs->fd_table[fileID].inodeIndex)) {
+		compress_file(fs, fileID);
+		pack_tail(fs, fileID);
+		write_checksums_to_disk(fs);
+	}
+	if(fs->durability == SFS_DURABILITY_ON_CLOSE && is_open_fd(fs, fileID)) {
+		disk_flush_r(fs->disk);
+		sync_through(fs, fs->fd_table[fileID].write_gen, 0);
+	}
+	int res = do_fclose(fs, fileID);
+	if(flushed != 0) {
+		res = -1;
+	}
+	SFS_TRACE_EXIT(fclose, SFS_OP_FCLOSE, res);
+	stats_record_op(&fs->stats, SFS_OP_FCLOSE, t, res != 0, 0);
+	SFS_CAPTURE(fs->capture_id, SFS_CAP_FCLOSE, fileID, 0, 0, 0, 0, res, t);
+	return res;
+}
+
+int sfs_fread_r(sfs_t *fs, int fileID, char *buf, int length) {
+	if(fs == NULL) {
+		return 0;
+	}
+	uint64_t t = stats_now_ns();
+	int failed = !is_open_fd(fs, fileID);
+	SFS_TRACE_ENTER(fread, SFS_OP_FREAD, fileID, length);
+	int res = do_fread(fs, fileID, buf, length);
+	SFS_TRACE_EXIT(fread, SFS_OP_FREAD, res);
+	stats_record_op(&fs->stats, SFS_OP_FREAD, t, failed, res);
+	SFS_CAPTURE(fs->capture_id, SFS_CAP_FREAD, fileID, length, 0, 0, 0, res, t);
+	return res;
+}
+
+int sfs_fwrite_r(sfs_t *fs, int fileID, const char *buf, int length) {
+	if(fs == NULL) {
+		return 0;
+	}
+	uint64_t t = stats_now_ns();
+	SFS_TRACE_ENTER(fwrite, SFS_OP_FWRITE, fileID, length);
+	int res = do_fwrite(fs, fileID, buf, length);
+	apply_durability(fs);
+	SFS_TRACE_EXIT(fwrite, SFS_OP_FWRITE, res);
+	stats_record_op(&fs->stats, SFS_OP_FWRITE, t, res < length, res);
+	SFS_CAPTURE(fs->capture_id, SFS_CAP_FWRITE, fileID, length, 0, 0, 0, res, t);
+	return res;
+}
+
+// Reads at offset without moving rwptr, so one descriptor can serve reads at many offsets
+int sfs_pread_r(sfs_t *fs, int fileID, char *buf, int length, int offset) {
+	if(fs == NULL) {
+		return 0;
+	}
+	struct iovec iov = { buf, length < 0 ? 0 : length };
+	uint64_t t = stats_now_ns();
+	int failed = !is_open_fd(fs, fileID);
+	SFS_TRACE_ENTER3(pread, SFS_OP_PREAD, fileID, length, offset);
+	int res = do_preadv(fs, fileID, &iov, 1, offset);
+	SFS_TRACE_EXIT(pread, SFS_OP_PREAD, res);
+	stats_record_op(&fs->stats, SFS_OP_PREAD, t, failed, res);
+	SFS_CAPTURE(fs->capture_id, SFS_CAP_PREAD, fileID, length, offset, 0, 0, res, t);
+	return res;
+}
+
+// Writes at offset without moving rwptr
+int sfs_pwrite_r(sfs_t *fs, int fileID, const char *buf, int length, int offset) {
+	if(fs == NULL) {
+		return 0;
+	}
+	struct iovec iov = { (void*) buf, length < 0 ? 0 : length };
+	uint64_t t = stats_now_ns();
+	SFS_TRACE_ENTER3(pwrite, SFS_OP_PWRITE, fileID, length, offset);
+	int res = flush_append(fs, fileID) == 0 ? do_pwritev(fs, fileID, &iov, 1, offset) : 0;
+	apply_durability(fs);
+	SFS_TRACE_EXIT(pwrite, SFS_OP_PWRITE, res);
+	stats_record_op(&fs->stats, SFS_OP_PWRITE, t, res < length, res);
+	SFS_CAPTURE(fs->capture_id, SFS_CAP_PWRITE, fileID, length, offset, 0, 0, res, t);
+	return res;
+}
+
+/*
+ * Hands out length bytes of the file from offset as memory, without a copy
+ * where the layout allows it (see do_mmap). The view stays readable until
+ * sfs_munmap or sfs_unmount, also after the file is closed; closing a file
+ * with views out leaves its compression and tail packing for a later close.
+ * Writing or removing the file meanwhile leaves what the view shows undefined.
+ */
+const char *sfs_mmap_r(sfs_t *fs, int fileID, int offset, int length) {
+	if(fs == NULL) {
+		return NULL;
+	}
+	uint64_t t = stats_now_ns();
+	SFS_TRACE_ENTER3(mmap, SFS_OP_MMAP, fileID, length, offset);
+	const char *res = flush_append(fs, fileID) == 0 ? do_mmap(fs, fileID, offset, length) : NULL;
+	SFS_TRACE_EXIT(mmap, SFS_OP_MMAP, res != NULL ? length : -1);
+	stats_record_op(&fs->stats, SFS_OP_MMAP, t, res == NULL, res != NULL ? length : 0);
+	SFS_CAPTURE(fs->capture_id, SFS_CAP_MMAP, fileID, offset, length, capture_view_id(res), 0, res != NULL ? 0 : -1, t);
+	return res;
+}
+
+int sfs_munmap_r(sfs_t *fs, const char *addr) {
+	if(fs == NULL) {
+		return -1;
+	}
+	uint64_t t = stats_now_ns();
+	SFS_TRACE_ENTER(munmap, SFS_OP_MUNMAP, (int64_t) (uintptr_t) addr, 0);
+	int res = do_munmap(fs, addr);
+	SFS_TRACE_EXIT(munmap, SFS_OP_MUNMAP, res);
+	stats_record_op(&fs->stats, SFS_OP_MUNMAP, t, res != 0, 0);
+	SFS_CAPTURE(fs->capture_id, SFS_CAP_MUNMAP, -1, capture_view_id(addr), 0, 0, 0, res, t);
+	return res;
+}
+
+// Where the next bytes of a file can be read from by whoever holds the image's descriptor, see do_read_extent
+int sfs_read_extent_r(sfs_t *fs, int fileID, int offset, int length, sfs_extent *ext) {
+	if(fs == NULL || ext == NULL) {
+		return -1;
+	}
+	uint64_t t = stats_now_ns();
+	SFS_TRACE_ENTER3(read_extent, SFS_OP_READ_EXTENT, fileID, length, offset);
+	int res = flush_append(fs, fileID) == 0 ? do_read_extent(fs, fileID, offset, length, ext) : -1;
+	SFS_TRACE_EXIT(read_extent, SFS_OP_READ_EXTENT, res);
+	stats_record_op(&fs->stats, SFS_OP_READ_EXTENT, t, res < 0, res > 0 ? res : 0);
+	SFS_CAPTURE(fs->capture_id, SFS_CAP_READ_EXTENT, fileID, offset, length, 0, 0, res, t);
+	return res;
+}
+
+// Reads into each segment in turn with one pass over the blocks, see do_freadv
+int sfs_freadv_r(sfs_t *fs, int fileID, const struct iovec *iov, int iovcnt) {
+	if(fs == NULL) {
+		return 0;
+	}
+	uint64_t t = stats_now_ns();
+	int failed = !is_open_fd(fs, fileID);
+	SFS_TRACE_ENTER(freadv, SFS_OP_READV, fileID, iov_length(iov, iovcnt));
+	int res = do_freadv(fs, fileID, iov, iovcnt);
+	SFS_TRACE_EXIT(freadv, SFS_OP_READV, res);
+	stats_record_op(&fs->stats, SFS_OP_READV, t, failed, res);
+	SFS_CAPTURE(fs->capture_id, SFS_CAP_FREADV, fileID, iov_length(iov, iovcnt), iovcnt, 0, 0, res, t);
+	return res;
+}
+
+// Writes each segment in turn, committing the metadata once, see do_fwritev
+int sfs_fwritev_r(sfs_t *fs, int fileID, const struct iovec *iov, int iovcnt) {
+	if(fs == NULL) {
+		return 0;
+	}
+	uint64_t t = stats_now_ns();
+	int length = iov_length(iov, iovcnt);
+	SFS_TRACE_ENTER(fwritev, SFS_OP_WRITEV, fileID, length);
+	int res = do_fwritev(fs, fileID, iov, iovcnt);
+	apply_durability(fs);
+	SFS_TRACE_EXIT(fwritev, SFS_OP_WRITEV, res);
+	stats_record_op(&fs->stats, SFS_OP_WRITEV, t, res < length, res);
+	SFS_CAPTURE(fs->capture_id, SFS_CAP_FWRITEV, fileID, length, iovcnt, 0, 0, res, t);
+	return res;
+}
+
+int sfs_fseek_r(sfs_t *fs, int fileID, int loc) {
+	if(fs == NULL) {
+		return -1;
+	}
+	uint64_t t = stats_now_ns();
+	SFS_TRACE_ENTER(fseek, SFS_OP_FSEEK, fileID, loc);
+	int res = do_fseek(fs, fileID, loc);
+	SFS_TRACE_EXIT(fseek, SFS_OP_FSEEK, res);
+	stats_record_op(&fs->stats, SFS_OP_FSEEK, t, res != 0, 0);
+	SFS_CAPTURE(fs->capture_id, SFS_CAP_FSEEK, fileID, loc, 0, 0, 0, res, t);
+	return res;
+}
+
+int sfs_lseek_r(sfs_t *fs, int fileID, int loc, int whence) {
+	if(fs == NULL) {
+		return -1;
+	}
+	uint64_t t = stats_now_ns();
+	SFS_TRACE_ENTER3(lseek, SFS_OP_LSEEK, fileID, loc, whence);
+	int res = do_lseek(fs, fileID, loc, whence);
+	SFS_TRACE_EXIT(lseek, SFS_OP_LSEEK, res);
+	stats_record_op(&fs->stats, SFS_OP_LSEEK, t, res < 0, 0);
+	SFS_CAPTURE(fs->capture_id, SFS_CAP_LSEEK, fileID, loc, whence, 0, 0, res, t);
+	return res;
+}
+
+int sfs_fcompress_r(sfs_t *fs, int fileID, int on) {
+	if(fs == NULL) {
+		return -1;
+	}
+	uint64_t t = stats_now_ns();
+	SFS_TRACE_ENTER(fcompress, SFS_OP_FCOMPRESS, fileID, on);
+	int res = do_fcompress(fs, fileID, on);
+	apply_durability(fs);
+	SFS_TRACE_EXIT(fcompress, SFS_OP_FCOMPRESS, res);
+	stats_record_op(&fs->stats, SFS_OP_FCOMPRESS, t, res != 0, 0);
+	SFS_CAPTURE(fs->capture_id, SFS_CAP_FCOMPRESS, fileID, on, 0, 0, 0, res, t);
+	return res;
+}
+
+int sfs_remove_r(sfs_t *fs, char *file) {
+	if(fs == NULL) {
+		return -1;
+	}
+	uint64_t t = stats_now_ns();
+	SFS_TRACE_ENTER(remove, SFS_OP_REMOVE, 0, 0);
+	int res = do_remove(fs, file);
+	apply_durability(fs);
+	SFS_TRACE_EXIT(remove, SFS_OP_REMOVE, res);
+	stats_record_op(&fs->stats, SFS_OP_REMOVE, t, res != 0, 0);
+	SFS_CAPTURE(fs->capture_id, SFS_CAP_REMOVE, -1, capture_name_id(file), 0, 0, 0, res, t);
+	return res;
+}
+
+// Copies src to dst by sharing its blocks; either file copies a block when it first writes to it
+int sfs_clone_r(sfs_t *fs, char *src, char *dst) {
+	if(fs == NULL) {
+		return -1;
+	}
+	uint64_t t = stats_now_ns();
+	SFS_TRACE_ENTER(clone, SFS_OP_CLONE, 0, 0);
+	int res = do_clone(fs, src, dst);
+	apply_durability(fs);
+	SFS_TRACE_EXIT(clone, SFS_OP_CLONE, res);
+	stats_record_op(&fs->stats, SFS_OP_CLONE, t, res != 0, 0);
+	SFS_CAPTURE(fs->capture_id, SFS_CAP_CLONE, -1, capture_name_id(src), capture_name_id(dst), 0, 0, res, t);
+	return res;
+}
+
+// Copies a range from one open file to another inside the image, see do_copy_range
+int sfs_copy_range_r(sfs_t *fs, int srcFd, int srcOff, int dstFd, int dstOff, int len) {
+	if(fs == NULL) {
+		return -1;
+	}
+	uint64_t t = stats_now_ns();
+	SFS_TRACE_ENTER(copy_range, SFS_OP_COPY_RANGE, dstFd, len);
+	int res = do_copy_range(fs, srcFd, srcOff, dstFd, dstOff, len);
+	apply_durability(fs);
+	SFS_TRACE_EXIT(copy_range, SFS_OP_COPY_RANGE, res);
+	stats_record_op(&fs->stats, SFS_OP_COPY_RANGE, t, res < len, res > 0 ? res : 0);
+	SFS_CAPTURE(fs->capture_id, SFS_CAP_COPY_RANGE, srcFd, srcOff, dstFd, dstOff, len, res, t);
+	return res;
+}
+
+// Moves a few files into contiguous runs of blocks, see do_defrag
+int sfs_defrag_r(sfs_t *fs, sfs_defrag_report *report) {
+	if(fs == NULL) {
+		return -1;
+	}
+	uint64_t t = stats_now_ns();
+	SFS_TRACE_ENTER(defrag, SFS_OP_DEFRAG, 0, 0);
+	int res = do_defrag(fs, report);
+	apply_durability(fs);
+	SFS_TRACE_EXIT(defrag, SFS_OP_DEFRAG, res);
+	stats_record_op(&fs->stats, SFS_OP_DEFRAG, t, res < 0, 0);
+	SFS_CAPTURE(fs->capture_id, SFS_CAP_DEFRAG, -1, 0, 0, 0, 0, res, t);
+	return res;
+}
+
+// Freezes the image as it is now under name, see snapshot_entry in sfs_api.h
+int sfs_snapshot_r(sfs_t *fs, const char *name) {
+	if(fs == NULL) {
+		return -1;
+	}
+	uint64_t t = stats_now_ns();
+	SFS_TRACE_ENTER(snapshot, SFS_OP_SNAPSHOT, 0, 0);
+	int res = do_snapshot(fs, name);
+	// sfs_mount_snapshot reads the image file, so nothing may stay behind in the cache
+	if(res == 0 && cache_flush(fs->cache) != 0) {
+		res = -1;
+	}
+	apply_durability(fs);
+	SFS_TRACE_EXIT(snapshot, SFS_OP_SNAPSHOT, res);
+	stats_record_op(&fs->stats, SFS_OP_SNAPSHOT, t, res != 0, 0);
+	SFS_CAPTURE(fs->capture_id, SFS_CAP_SNAPSHOT, -1, capture_name_id(name), 0, 0, 0, res, t);
+	return res;
+}
+
+int sfs_snapshot_delete_r(sfs_t *fs, const char *name) {
+	if(fs == NULL) {
+		return -1;
+	}
+	uint64_t t = stats_now_ns();
+	SFS_TRACE_ENTER(snapshot_delete, SFS_OP_SNAPSHOT_DELETE, 0, 0);
+	int res = do_snapshot_delete(fs, name);
+	apply_durability(fs);
+	SFS_TRACE_EXIT(snapshot_delete, SFS_OP_SNAPSHOT_DELETE, res);
+	stats_record_op(&fs->stats, SFS_OP_SNAPSHOT_DELETE, t, res != 0, 0);
+	SFS_CAPTURE(fs->capture_id, SFS_CAP_SNAPSHOT_DELETE, -1, capture_name_id(name), 0, 0, 0, res, t);
+	return res;
+}
+
+// Makes everything written through fileID durable; one fdatasync covers all pending blocks
+int sfs_fsync_r(sfs_t *fs, int fileID) {
+	if(fs == NULL) {
+		return -1;
+	}
+	uint64_t t = stats_now_ns();
+	SFS_TRACE_ENTER(fsync, SFS_OP_FSYNC, fileID, 0);
+	int res = -1;
+	if(is_open_fd(fs, fileID) && flush_append(fs, fileID) == 0) {
+		disk_flush_r(fs->disk);
+		res = sync_through(fs, fs->fd_table[fileID].write_gen, 0);
+	}
+	SFS_TRACE_EXIT(fsync, SFS_OP_FSYNC, res);
+	stats_record_op(&fs->stats, SFS_OP_FSYNC, t, res != 0, 0);
+	SFS_CAPTURE(fs->capture_id, SFS_CAP_FSYNC, fileID, 0, 0, 0, 0, res, t);
+	return res;
+}
+
+// Makes every write so far durable, including the image's own metadata
+int sfs_sync_r(sfs_t *fs) {
+	if(fs == NULL) {
+		return -1;
+	}
+	uint64_t t = stats_now_ns();
+	SFS_TRACE_ENTER(sync, SFS_OP_SYNC, 0, 0);
+	int flushed = flush_appends(fs);
+	disk_flush_r(fs->disk);
+	int res = sync_through(fs, fs->write_gen, 1);
+	if(flushed != 0) {
+		res = -1;
+	}
+	SFS_TRACE_EXIT(sync, SFS_OP_SYNC, res);
+	stats_record_op(&fs->stats, SFS_OP_SYNC, t, res != 0, 0);
+	SFS_CAPTURE(fs->capture_id, SFS_CAP_SYNC, -1, 0, 0, 0, 0, res, t);
+	return res;
+}
+
+// Data blocks that are free and no snapshot holds
+static uint64_t count_free_blocks(sfs_t *fs) {
+	uint64_t n = 0;
+	for(int b=BLOCK_INDEX_DATA_BLOCKS; b<BLOCK_INDEX_FREE_BITMAP; b++) {
+		n += (fs->free_bit_map[b/8] & fs->snap_map[b/8] & (1 << (b%8))) != 0;
+	}
+	return n;
+}
+
+int sfs_get_stats_r(sfs_t *fs, sfs_stats *out) {
+	unsigned long long hits, misses, dirty, written;
+	uint64_t device_bytes = 0;
+	uint64_t written_bytes;
+
+	if(out == NULL) {
+		return -1;
+	}
+	if(fs == NULL) {
+		memset(out, 0, sizeof(sfs_stats));
+		return -1;
+	}
+	*out = fs->stats;
+	out->free_blocks = count_free_blocks(fs);
+	cache_counts(fs->cache, &hits, &misses);
+	out->cache_hits = hits;
+	out->cache_misses = misses;
+	cache_writeback_counts(fs->cache, &dirty, &written);
+	out->dirty_blocks = dirty;
+	out->writeback_blocks = written;
+	for(int r=0; r<SFS_NUM_REGIONS; r++) {
+		device_bytes += fs->stats.blocks_written[r]*BLOCK_SIZE;
+	}
+	written_bytes = fs->stats.ops[SFS_OP_FWRITE].bytes + fs->stats.ops[SFS_OP_WRITEV].bytes + fs->stats.ops[SFS_OP_PWRITE].bytes;
+	if(written_bytes > 0) {
+		out->write_amplification = (double) device_bytes/written_bytes;
+	}
+	return 0;
+}
+
+void sfs_reset_stats_r(sfs_t *fs) {
+	if(fs == NULL) {
+		return;
+	}
+	memset(&fs->stats, 0, sizeof(fs->stats));
+	cache_reset_counts(fs->cache);
+}
+
+int sfs_format_stats_r(sfs_t *fs, char *buf, int len) {
+	sfs_stats snapshot;
+	sfs_get_stats_r(fs, &snapshot);
+	return stats_format(&snapshot, buf, len);
+}
+
+/*
+ * The original single-image API: mksfs mounts LASTNAME_FIRSTNAME_DISK
+ * (unmounting whatever it mounted before) and every other call works on
+ * that instance.
+ */
+void mksfs(int fresh) {
+	sfs_unmount(legacy_fs);
+	legacy_fs = sfs_mount(LASTNAME_FIRSTNAME_DISK, fresh);
+}
+
+int sfs_getnextfilename(char *fname) {
+	return sfs_getnextfilename_r(legacy_fs, fname);
+}
+
+int sfs_getfilesize(const char* path) {
+	return sfs_getfilesize_r(legacy_fs, path);
+}
+
+int sfs_fopen(char *name) {
+	return sfs_fopen_r(legacy_fs, name);
+}
+
+int sfs_fclose(int fileID) {
+	return sfs_fclose_r(legacy_fs, fileID);
+}
+
+int sfs_fread(int fileID, char *buf, int length) {
+	return sfs_fread_r(legacy_fs, fileID, buf, length);
+}
+
+int sfs_fwrite(int fileID, const char *buf, int length) {
+	return sfs_fwrite_r(legacy_fs, fileID, buf, length);
+}
+
+int sfs_pread(int fileID, char *buf, int length, int offset) {
+	return sfs_pread_r(legacy_fs, fileID, buf, length, offset);
+}
+
+int sfs_pwrite(int fileID, const char *buf, int length, int offset) {
+	return sfs_pwrite_r(legacy_fs, fileID, buf, length, offset);
+}
+
+const char *sfs_mmap(int fileID, int offset, int length) {
+	return sfs_mmap_r(legacy_fs, fileID, offset, length);
+}
+
+int sfs_munmap(const char *addr) {
+	return sfs_munmap_r(legacy_fs, addr);
+}
+
+int sfs_read_extent(int fileID, int offset, int length, sfs_extent *ext) {
+	return sfs_read_extent_r(legacy_fs, fileID, offset, length, ext);
+}
+
+int sfs_freadv(int fileID, const struct iovec *iov, int iovcnt) {
+	return sfs_freadv_r(legacy_fs, fileID, iov, iovcnt);
+}
+
+int sfs_fwritev(int fileID, const struct iovec *iov, int iovcnt) {
+	return sfs_fwritev_r(legacy_fs, fileID, iov, iovcnt);
+}
+
+int sfs_fseek(int fileID, int loc) {
+	return sfs_fseek_r(legacy_fs, fileID, loc);
+}
+
+int sfs_lseek(int fileID, int loc, int whence) {
+	return sfs_lseek_r(legacy_fs, fileID, loc, whence);
+}
+
+int sfs_fcompress(int fileID, int on) {
+	return sfs_fcompress_r(legacy_fs, fileID, on);
+}
+
+int sfs_remove(char *file) {
+	return sfs_remove_r(legacy_fs, file);
+}
+
+int sfs_clone(char *src, char *dst) {
+	return sfs_clone_r(legacy_fs, src, dst);
+}
+
+int sfs_copy_range(int srcFd, int srcOff, int dstFd, int dstOff, int len) {
+	return sfs_copy_range_r(legacy_fs, srcFd, srcOff, dstFd, dstOff, len);
+}
+
+int sfs_defrag(sfs_defrag_report *report) {
+	return sfs_defrag_r(legacy_fs, report);
+}
+
+int sfs_snapshot(const char *name) {
+	return sfs_snapshot_r(legacy_fs, name);
+}
+
+int sfs_snapshot_delete(const char *name) {
+	return sfs_snapshot_delete_r(legacy_fs, name);
+}
+
+int sfs_fsync(int fileID) {
+	return sfs_fsync_r(legacy_fs, fileID);
+}
+
+int sfs_sync() {
+	return sfs_sync_r(legacy_fs);
+}
+
+int sfs_get_stats(sfs_stats *out) {
+	return sfs_get_stats_r(legacy_fs, out);
+}
+
+void sfs_reset_stats() {
+	sfs_reset_stats_r(legacy_fs);
+}
+
+int sfs_format_stats(char *buf, int len) {
+	return sfs_format_stats_r(legacy_fs, buf, len);
+}
@@ -2,6 +2,8 @@
 #define _INCLUDE_SFS_API_H_
 
 #include <stdint.h>
+#include <sys/uio.h>
+#include "sfs_stats.h"
 
 #define MAX_FILE_NAME 21
 #define MAXFILENAME MAX_FILE_NAME
@@ -13,6 +15,10 @@ typedef struct superblock_t{
     uint64_t fs_size;
     uint64_t inode_table_len;
     uint64_t root_dir_inode;
+    uint64_t refcount_block;    // see sfs_layout.h, 0 for none
+    uint64_t dedup_index_block;
+    uint64_t features;          // SFS_FEATURE_* bits, 0 on older images
+    uint64_t snapshot_block;    // snapshot table, 0 for none
 } superblock_t;
 
 typedef struct inode_t {
@@ -25,17 +31,139 @@ typedef struct inode_t {
     unsigned int indirectPointer; // points to a data block that points to other data blocks (Single indirect)
 } inode_t;
 
+/*
+ * Tail blocks pack the partial last blocks of several files. The index at
+ * the start of the block lists each fragment, sorted by offset; fragment
+ * bytes follow from TAIL_DATA_START on.
+ */
+#define TAIL_MAGIC 0x5441494C
+#define TAIL_MAX_FRAGS 16
+
+typedef struct tail_frag {
+    uint16_t inode;
+    uint16_t offset;
+    uint16_t length;
+} tail_frag;
+
+typedef struct tail_index {
+    uint32_t magic;
+    uint16_t count;
+    uint16_t reserved;
+    tail_frag frags[TAIL_MAX_FRAGS];
+} tail_index;
+
+#define TAIL_DATA_START sizeof(tail_index)
+
+/* Start of the first block of a compressed cluster, the LZ stream follows */
+#define CLUSTER_MAGIC 0x4C5A4331
+
+typedef struct cluster_header {
+    uint32_t magic;
+    uint16_t clen;      // bytes of compressed data after the header
+    uint16_t reserved;
+} cluster_header;
+
+/*
+ * A snapshot freezes the inode table and root directory as they were when
+ * it was taken. Its copies of them sit in blocks of their own, and map
+ * clears the bit (as the free bitmap does) of every block the frozen tree
+ * uses, the copies included. A block any snapshot holds is never written
+ * or handed out again until that snapshot is deleted, so taking one copies
+ * no file data. The table lives in the data block the superblock names.
+ */
+#define SFS_MAX_SNAPSHOTS 5
+
+typedef struct snapshot_entry {
+    char name[MAX_FILE_NAME];   // "" for a free entry
+    uint8_t reserved;
+    uint16_t inodet[8];         // copy of the inode table and its bitmap
+    uint16_t dir[3];            // copy of the root directory
+    uint8_t map[130];           // blocks held, same size as the free bitmap
+} snapshot_entry;
+
 /*
  * inodeIndex    which inode this entry describes
  * inode  pointer towards the inode in the inode table
  *rwptr    where in the file to start   
+ *write_gen    write generation of the last write through this descriptor
  */
 typedef struct file_descriptor {
     uint64_t inodeIndex;
     inode_t* inode; // 
     uint64_t rwptr;
+    uint64_t write_gen;
 } file_descriptor;
 
+/*
+ * When written blocks are forced to stable storage. Every policy hands
+ * writes to the OS page cache at the end of each call, except small appends
+ * held in a descriptor's append buffer until a block fills or the file is
+ * sought, synced or closed (SYNC holds none), and blocks held back by
+ * writeback (see sfs_set_writeback) until the thread writes them; every
+ * fsync below writes those out first.
+ * NONE      never fsync on its own, only on sfs_fsync/sfs_sync
+ * ON_CLOSE  fdatasync in sfs_fclose if the descriptor wrote anything
+ * PERIODIC  fdatasync after a call once interval_ms passed since the last one
+ * SYNC      fdatasync before every modifying call returns
+ */
+typedef enum sfs_durability {
+    SFS_DURABILITY_NONE,
+    SFS_DURABILITY_ON_CLOSE,
+    SFS_DURABILITY_PERIODIC,
+    SFS_DURABILITY_SYNC
+} sfs_durability;
+
+/*
+ * Writeback (sfs_set_writeback, SFS_WRITEBACK=pct[:ms]) keeps written
+ * blocks, data and metadata alike, dirty in the block cache and leaves it
+ * to a background thread to write them in address order and in batches:
+ * once dirty_pct percent of the cache is dirty or the oldest dirty block
+ * is expire_ms old (default 1000), and on every fsync, unmount, snapshot
+ * and sfs_mmap that maps the image. sfs_fwrite no longer waits for the
+ * device unless the cache runs out of clean blocks. dirty_pct 0 (the
+ * default, or "off") writes through. SFS_CACHE_BLOCKS sets the cache size.
+ */
+
+/*
+ * whence for sfs_lseek. DATA and HOLE move to the next offset backed by a
+ * block or inside a hole, with the same values as Linux SEEK_DATA/SEEK_HOLE.
+ */
+#define SFS_SEEK_SET  0
+#define SFS_SEEK_CUR  1
+#define SFS_SEEK_END  2
+#define SFS_SEEK_DATA 3
+#define SFS_SEEK_HOLE 4
+
+/*
+ * What one sfs_defrag call found and did. sfs_defrag moves a few files per
+ * call so the instance is never held for long; call it until it returns 0.
+ * A run is a stretch of blocks that lie next to each other on disk; a file
+ * in more than one run is fragmented. Free space counts the blocks new
+ * data can go to, free_blocks of them.
+ */
+typedef struct sfs_defrag_report {
+    int files;              // files with data blocks
+    int fragmented_before, fragmented_after;
+    int runs_before, runs_after;            // summed over every file
+    int blocks_moved;       // data and indirect blocks
+    int free_blocks;
+    int free_runs_before, free_runs_after;
+    int largest_free_before, largest_free_after;
+} sfs_defrag_report;
+
+/*
+ * What sfs_read_extent found at an offset. An in_place extent is length
+ * bytes lying back to back at image_offset of the image file image_fd,
+ * for pread, splice or sendfile to take from directly until the file is
+ * next written. Any other extent (holes, inline, packed or compressed
+ * data) has to be read with sfs_pread.
+ */
+typedef struct sfs_extent {
+    int length;
+    int in_place;
+    int image_fd;
+    int64_t image_offset;
+} sfs_extent;
 
 typedef struct directory_entry{
     int num; // represents the inode number of the entery. 
@@ -43,6 +171,52 @@ typedef struct directory_entry{
 }directory_entry;
 
 
+/*
+ * A mounted image. sfs_mount opens (fresh == 1: formats) the image at path
+ * and every *_r call works on that instance alone, so one process can serve
+ * many images. Calls on one handle must not overlap, sfs_pread and
+ * sfs_pwrite included: they save the seek, they don't make the handle
+ * safe for many threads. Separate handles can be used from separate
+ * threads at the same time.
+ */
+typedef struct sfs sfs_t;
+
+sfs_t *sfs_mount(const char *path, int fresh);
+sfs_t *sfs_mount_snapshot(const char *path, const char *name);
+int sfs_unmount(sfs_t *fs);
+int sfs_getnextfilename_r(sfs_t *fs, char *fname);
+int sfs_getfilesize_r(sfs_t *fs, const char* path);
+int sfs_fopen_r(sfs_t *fs, char *name);
+int sfs_fclose_r(sfs_t *fs, int fileID);
+int sfs_fread_r(sfs_t *fs, int fileID, char *buf, int length);
+int sfs_fwrite_r(sfs_t *fs, int fileID, const char *buf, int length);
+int sfs_pread_r(sfs_t *fs, int fileID, char *buf, int length, int offset);
+int sfs_pwrite_r(sfs_t *fs, int fileID, const char *buf, int length, int offset);
+const char *sfs_mmap_r(sfs_t *fs, int fileID, int offset, int length);
+int sfs_munmap_r(sfs_t *fs, const char *addr);
+int sfs_read_extent_r(sfs_t *fs, int fileID, int offset, int length, sfs_extent *ext);
+int sfs_freadv_r(sfs_t *fs, int fileID, const struct iovec *iov, int iovcnt);
+int sfs_fwritev_r(sfs_t *fs, int fileID, const struct iovec *iov, int iovcnt);
+int sfs_fseek_r(sfs_t *fs, int fileID, int loc);
+int sfs_lseek_r(sfs_t *fs, int fileID, int loc, int whence);
+int sfs_fcompress_r(sfs_t *fs, int fileID, int on);
+void sfs_set_compression_r(sfs_t *fs, int on);
+void sfs_set_dedup_r(sfs_t *fs, int on);
+int sfs_remove_r(sfs_t *fs, char *file);
+int sfs_clone_r(sfs_t *fs, char *src, char *dst);
+int sfs_copy_range_r(sfs_t *fs, int srcFd, int srcOff, int dstFd, int dstOff, int len);
+int sfs_fsync_r(sfs_t *fs, int fileID);
+int sfs_sync_r(sfs_t *fs);
+void sfs_set_durability_r(sfs_t *fs, sfs_durability policy, int interval_ms);
+int sfs_set_writeback_r(sfs_t *fs, int dirty_pct, int expire_ms);
+int sfs_defrag_r(sfs_t *fs, sfs_defrag_report *report);
+int sfs_snapshot_r(sfs_t *fs, const char *name);
+int sfs_snapshot_delete_r(sfs_t *fs, const char *name);
+int sfs_get_stats_r(sfs_t *fs, sfs_stats *stats);
+void sfs_reset_stats_r(sfs_t *fs);
+int sfs_format_stats_r(sfs_t *fs, char *buf, int len);
+
+/* The original API, working on the one instance mksfs mounts */
 void mksfs(int fresh);
 int sfs_getnextfilename(char *fname);
 int sfs_getfilesize(const char* path);
@@ -50,11 +224,33 @@ int sfs_fopen(char *name);
 int sfs_fclose(int fileID);
 int sfs_fread(int fileID, char *buf, int length);
 int sfs_fwrite(int fileID, const char *buf, int length);
+int sfs_pread(int fileID, char *buf, int length, int offset);
+int sfs_pwrite(int fileID, const char *buf, int length, int offset);
+const char *sfs_mmap(int fileID, int offset, int length);
+int sfs_munmap(const char *addr);
+int sfs_read_extent(int fileID, int offset, int length, sfs_extent *ext);
+int sfs_freadv(int fileID, const struct iovec *iov, int iovcnt);
+int sfs_fwritev(int fileID, const struct iovec *iov, int iovcnt);
 int sfs_fseek(int fileID, int loc);
+int sfs_lseek(int fileID, int loc, int whence);
+int sfs_fcompress(int fileID, int on);
+void sfs_set_compression(int on);
+void sfs_set_dedup(int on);
 int sfs_remove(char *file);
+int sfs_clone(char *src, char *dst);
+int sfs_copy_range(int srcFd, int srcOff, int dstFd, int dstOff, int len);
 int check_filenamevalidity(char *name);
+int sfs_fsync(int fileID);
+int sfs_sync();
+void sfs_set_durability(sfs_durability policy, int interval_ms);
+int sfs_set_writeback(int dirty_pct, int expire_ms);
+int sfs_defrag(sfs_defrag_report *report);
+int sfs_snapshot(const char *name);
+int sfs_snapshot_delete(const char *name);
+int sfs_parse_durability(const char *spec, sfs_durability *policy, int *interval_ms);
+int sfs_parse_writeback(const char *spec, int *dirty_pct, int *expire_ms);
 
-void debug_print_root_dir_entries();
-void debug_print_inode_table_entries();
+void debug_print_root_dir_entries(sfs_t *fs);
+void debug_print_inode_table_entries(sfs_t *fs);
 
 #endif //_INCLUDE_SFS_API_H_
@@ -0,0 +1,637 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "sfs_api.h"
+#include "disk_emu.h"
+#include "sfs_layout.h"
+
+/*
+ * sfs_bench: end-to-end throughput and latency benchmark for the sfs API.
+ *
+ * Every phase formats a fresh disk, times each public call individually and
+ * reports ops/s, MB/s, block I/Os per operation and p50/p99/p999 latency.
+ * Results go to stdout as a table, or as JSON with -j. -m selects a
+ * disk_emu device model (see disk_parse_model), e.g. -m hdd or -m ssd,qd=4.
+ * -d selects the durability policy: none, close, periodic[:ms] or sync.
+ * -w turns on writeback (see sfs_set_writeback) as pct[:ms], e.g. -w 50:500;
+ * seq_write's p99 shows whether flushes still stall sfs_fwrite.
+ * -c compresses new files (see sfs_set_compression), -D deduplicates full
+ * block writes (see sfs_set_dedup); template_write shows what dedup saves.
+ * record_write and record_writev append batches of small records with one
+ * sfs_fwrite per record or one sfs_fwritev per batch; their chunk column is
+ * the bytes per batch.
+ * index_pread and index_mmap fetch small entries at random offsets,
+ * with one sfs_pread each or from one sfs_mmap view of the whole file set
+ * up before the phase starts.
+ * The sharded_write phase writes 1, 2, 4, ... up to -t images at once, each
+ * mounted with sfs_mount and driven by its own thread; its chunk column is
+ * the number of images.
+ *
+ * usage: sfs_bench [-j] [-o file] [-r reps] [-s seed] [-f filter] [-m model] [-d policy] [-w writeback] [-c] [-D] [-t shards]
+ */
+
+#define BENCH_FILE_BYTES (256*1024) // stays under the 268 block max file size
+#define BENCH_NUM_SMALL_FILES 90      // leaves room under NUM_INODES for the root dir
+#define BENCH_SMALL_FILE_BYTES 45
+#define BENCH_TEMPLATE_FILES 40
+#define BENCH_TEMPLATE_BYTES (16*1024)
+#define BENCH_RECORD_BYTES 40         // one serialized record
+#define BENCH_RECORDS_PER_BATCH 32    // records a writer has ready at once
+#define BENCH_LOOKUP_BYTES 16         // one index entry
+#define BENCH_LOOKUPS 4096
+#define BENCH_MAX_RESULTS 64
+#define BENCH_MAX_SHARDS 64
+#define BENCH_SCRATCH_IMAGE "sfs_bench_scratch.disk"
+
+static int chunk_sizes[] = { 64, 256, 1024, 4096, 16384 };
+#define NUM_CHUNK_SIZES (sizeof(chunk_sizes)/sizeof(chunk_sizes[0]))
+
+typedef struct bench_result {
+	char name[48];
+	int chunk;             // bytes per call, 0 when not applicable
+	uint64_t ops;
+	uint64_t bytes;
+	double seconds;
+	uint64_t blocks_read;
+	uint64_t blocks_written;
+	double p50_us, p99_us, p999_us;
+} bench_result;
+
+/* One phase in flight: per-op latencies plus counters at its start */
+typedef struct bench_phase {
+	uint64_t *lat_ns;
+	uint64_t nlat;
+	uint64_t cap;
+	uint64_t bytes;
+	unsigned long long rd0, wr0;
+	uint64_t t0;
+} bench_phase;
+
+static bench_result results[BENCH_MAX_RESULTS];
+static int num_results = 0;
+static int reps = 1;
+static const char *filter = NULL;
+static const char *model_spec = NULL; // NULL leaves it to SFS_DISK_MODEL
+static const char *durability_spec = NULL; // NULL leaves it to SFS_DURABILITY
+static const char *writeback_spec = NULL;  // NULL leaves it to SFS_WRITEBACK
+static int compress = 0;
+static int dedup = 0;
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+	return (x > y) - (x < y);
+}
+
+static double percentile_us(uint64_t *sorted, uint64_t n, double pct) {
+	if (n == 0) {
+		return 0;
+	}
+	uint64_t idx = (uint64_t) (pct/100.0*(n-1) + 0.5);
+	return sorted[idx]/1000.0;
+}
+
+static void phase_begin(bench_phase *ph, uint64_t expected_ops) {
+	ph->cap = expected_ops > 0 ? expected_ops : 1;
+	ph->lat_ns = malloc(ph->cap*sizeof(uint64_t));
+	ph->nlat = 0;
+	ph->bytes = 0;
+	disk_io_counts(&ph->rd0, &ph->wr0);
+	ph->t0 = now_ns();
+}
+
+static void phase_record(bench_phase *ph, uint64_t start_ns, int bytes) {
+	uint64_t dt = now_ns() - start_ns;
+	if (ph->nlat == ph->cap) {
+		ph->cap *= 2;
+		ph->lat_ns = realloc(ph->lat_ns, ph->cap*sizeof(uint64_t));
+	}
+	ph->lat_ns[ph->nlat++] = dt;
+	if (bytes > 0) {
+		ph->bytes += bytes;
+	}
+}
+
+static void phase_end(bench_phase *ph, const char *name, int chunk) {
+	uint64_t elapsed = now_ns() - ph->t0;
+	unsigned long long rd, wr;
+	disk_io_counts(&rd, &wr);
+
+	if (num_results < BENCH_MAX_RESULTS) {
+		bench_result *r = &results[num_results++];
+		snprintf(r->name, sizeof(r->name), "%s", name);
+		r->chunk = chunk;
+		r->ops = ph->nlat;
+		r->bytes = ph->bytes;
+		r->seconds = elapsed/1e9;
+		r->blocks_read = rd - ph->rd0;
+		r->blocks_written = wr - ph->wr0;
+		qsort(ph->lat_ns, ph->nlat, sizeof(uint64_t), cmp_u64);
+		r->p50_us = percentile_us(ph->lat_ns, ph->nlat, 50);
+		r->p99_us = percentile_us(ph->lat_ns, ph->nlat, 99);
+		r->p999_us = percentile_us(ph->lat_ns, ph->nlat, 99.9);
+	}
+	free(ph->lat_ns);
+	ph->lat_ns = NULL;
+}
+
+/* Formats a fresh disk; mksfs unmounts whatever the previous phase left */
+static void fresh_fs() {
+	mksfs(1);
+}
+
+static int selected(const char *name) {
+	return filter == NULL || strstr(name, filter) != NULL;
+}
+
+static void fill_pattern(char *buf, int len, int seed) {
+	for (int i = 0; i < len; i++) {
+		buf[i] = (char) (seed + i);
+	}
+}
+
+/* Creates a file of BENCH_FILE_BYTES with 4 KB writes, untimed. It is closed
+ * and reopened so close-time work like compression is already done. */
+static int make_file(char *name) {
+	char buf[4096];
+	int fd = sfs_fopen(name);
+	if (fd < 0) {
+		return -1;
+	}
+	for (int off = 0; off < BENCH_FILE_BYTES; off += sizeof(buf)) {
+		fill_pattern(buf, sizeof(buf), off);
+		if (sfs_fwrite(fd, buf, sizeof(buf)) != sizeof(buf)) {
+			fprintf(stderr, "sfs_bench: setup write failed at %d\n", off);
+			return -1;
+		}
+	}
+	sfs_fclose(fd);
+	return sfs_fopen(name);
+}
+
+static void bench_seq_write(int chunk) {
+	char name[] = "seqwrite.dat";
+	char *buf = malloc(chunk);
+	bench_phase ph;
+
+	fresh_fs();
+	int fd = sfs_fopen(name);
+	phase_begin(&ph, BENCH_FILE_BYTES/chunk*reps);
+	for (int r = 0; r < reps; r++) {
+		sfs_fseek(fd, 0);
+		for (int off = 0; off < BENCH_FILE_BYTES; off += chunk) {
+			fill_pattern(buf, chunk, off);
+			uint64_t t = now_ns();
+			int n = sfs_fwrite(fd, buf, chunk);
+			phase_record(&ph, t, n);
+		}
+	}
+	phase_end(&ph, "seq_write", chunk);
+	sfs_fclose(fd);
+	free(buf);
+}
+
+static void bench_seq_read(int chunk) {
+	char name[] = "seqread.dat";
+	char *buf = malloc(chunk);
+	bench_phase ph;
+
+	fresh_fs();
+	int fd = make_file(name);
+	phase_begin(&ph, BENCH_FILE_BYTES/chunk*reps);
+	for (int r = 0; r < reps; r++) {
+		sfs_fseek(fd, 0);
+		for (int off = 0; off < BENCH_FILE_BYTES; off += chunk) {
+			uint64_t t = now_ns();
+			int n = sfs_fread(fd, buf, chunk);
+			phase_record(&ph, t, n);
+		}
+	}
+	phase_end(&ph, "seq_read", chunk);
+	sfs_fclose(fd);
+	free(buf);
+}
+
+/* Random-offset reads and overwrites; each op is an fseek plus the transfer */
+static void bench_rand(int chunk, int do_write) {
+	char name[] = "random.dat";
+	char *buf = malloc(chunk);
+	int nops = BENCH_FILE_BYTES/chunk;
+	int nslots = BENCH_FILE_BYTES/chunk;
+	bench_phase ph;
+
+	if (nops < 64) {
+		nops = 64;
+	}
+	fresh_fs();
+	int fd = make_file(name);
+	phase_begin(&ph, nops*reps);
+	for (int i = 0; i < nops*reps; i++) {
+		int off = (rand() % nslots)*chunk;
+		if (do_write) {
+			fill_pattern(buf, chunk, off);
+		}
+		uint64_t t = now_ns();
+		sfs_fseek(fd, off);
+		int n = do_write ? sfs_fwrite(fd, buf, chunk) : sfs_fread(fd, buf, chunk);
+		phase_record(&ph, t, n);
+	}
+	phase_end(&ph, do_write ? "rand_write" : "rand_read", chunk);
+	sfs_fclose(fd);
+	free(buf);
+}
+
+/* Appends batches of small records, each batch one timed op */
+static void bench_records(int vectored) {
+	char name[] = "records.dat";
+	char recs[BENCH_RECORDS_PER_BATCH][BENCH_RECORD_BYTES];
+	struct iovec iov[BENCH_RECORDS_PER_BATCH];
+	int batch = BENCH_RECORDS_PER_BATCH*BENCH_RECORD_BYTES;
+	int nbatches = BENCH_FILE_BYTES/batch;
+	bench_phase ph;
+
+	for (int i = 0; i < BENCH_RECORDS_PER_BATCH; i++) {
+		fill_pattern(recs[i], BENCH_RECORD_BYTES, i);
+		iov[i].iov_base = recs[i];
+		iov[i].iov_len = BENCH_RECORD_BYTES;
+	}
+	fresh_fs();
+	int fd = sfs_fopen(name);
+	phase_begin(&ph, nbatches*reps);
+	for (int r = 0; r < reps; r++) {
+		sfs_fseek(fd, 0);
+		for (int b = 0; b < nbatches; b++) {
+			uint64_t t = now_ns();
+			int n = 0;
+			if (vectored) {
+				n = sfs_fwritev(fd, iov, BENCH_RECORDS_PER_BATCH);
+			} else {
+				for (int i = 0; i < BENCH_RECORDS_PER_BATCH; i++) {
+					n += sfs_fwrite(fd, recs[i], BENCH_RECORD_BYTES);
+				}
+			}
+			phase_record(&ph, t, n);
+		}
+	}
+	phase_end(&ph, vectored ? "record_writev" : "record_write", batch);
+	sfs_fclose(fd);
+}
+
+/* Random small lookups into an index file, through sfs_pread or a view */
+static void bench_lookup(int mapped) {
+	char name[] = "index.dat";
+	char entry[BENCH_LOOKUP_BYTES];
+	int nslots = BENCH_FILE_BYTES/BENCH_LOOKUP_BYTES;
+	const char *view = NULL;
+	bench_phase ph;
+
+	fresh_fs();
+	int fd = make_file(name);
+	if (mapped && (view = sfs_mmap(fd, 0, BENCH_FILE_BYTES)) == NULL) {
+		fprintf(stderr, "sfs_bench: cannot map %s\n", name);
+		sfs_fclose(fd);
+		return;
+	}
+	phase_begin(&ph, BENCH_LOOKUPS*reps);
+	for (int i = 0; i < BENCH_LOOKUPS*reps; i++) {
+		int off = (rand() % nslots)*BENCH_LOOKUP_BYTES;
+		uint64_t t = now_ns();
+		int n = BENCH_LOOKUP_BYTES;
+		if (mapped) {
+			memcpy(entry, view + off, BENCH_LOOKUP_BYTES);
+		} else {
+			n = sfs_pread(fd, entry, BENCH_LOOKUP_BYTES, off);
+		}
+		phase_record(&ph, t, n);
+	}
+	phase_end(&ph, mapped ? "index_mmap" : "index_pread", BENCH_LOOKUP_BYTES);
+	if (mapped) {
+		sfs_munmap(view);
+	}
+	sfs_fclose(fd);
+}
+
+static void bench_small_files() {
+	char names[BENCH_NUM_SMALL_FILES][MAX_FILE_NAME];
+	char payload[BENCH_SMALL_FILE_BYTES];
+	bench_phase create, stat, rm;
+
+	fill_pattern(payload, sizeof(payload), 'a');
+	fresh_fs();
+	for (int i = 0; i < BENCH_NUM_SMALL_FILES; i++) {
+		snprintf(names[i], MAX_FILE_NAME, "small%04d.txt", i);
+	}
+
+	phase_begin(&create, BENCH_NUM_SMALL_FILES);
+	for (int i = 0; i < BENCH_NUM_SMALL_FILES; i++) {
+		uint64_t t = now_ns();
+		int fd = sfs_fopen(names[i]);
+		int n = sfs_fwrite(fd, payload, sizeof(payload));
+		sfs_fclose(fd);
+		phase_record(&create, t, n);
+	}
+	phase_end(&create, "small_create", BENCH_SMALL_FILE_BYTES);
+
+	phase_begin(&stat, BENCH_NUM_SMALL_FILES*reps);
+	for (int r = 0; r < reps; r++) {
+		for (int i = 0; i < BENCH_NUM_SMALL_FILES; i++) {
+			uint64_t t = now_ns();
+			sfs_getfilesize(names[i]);
+			phase_record(&stat, t, 0);
+		}
+	}
+	phase_end(&stat, "small_stat", 0);
+
+	phase_begin(&rm, BENCH_NUM_SMALL_FILES);
+	for (int i = 0; i < BENCH_NUM_SMALL_FILES; i++) {
+		uint64_t t = now_ns();
+		sfs_remove(names[i]);
+		phase_record(&rm, t, 0);
+	}
+	phase_end(&rm, "small_remove", 0);
+}
+
+/* The same template written into many files with 4 KB writes, as in a
+ * dataset of near identical files */
+static void bench_template_write() {
+	char name[MAX_FILE_NAME];
+	char buf[4096];
+	bench_phase ph;
+
+	fresh_fs();
+	phase_begin(&ph, BENCH_TEMPLATE_FILES*(BENCH_TEMPLATE_BYTES/sizeof(buf)));
+	for (int i = 0; i < BENCH_TEMPLATE_FILES; i++) {
+		snprintf(name, MAX_FILE_NAME, "tmpl%04d.dat", i);
+		int fd = sfs_fopen(name);
+		for (int off = 0; off < BENCH_TEMPLATE_BYTES; off += sizeof(buf)) {
+			fill_pattern(buf, sizeof(buf), off);
+			uint64_t t = now_ns();
+			int n = sfs_fwrite(fd, buf, sizeof(buf));
+			phase_record(&ph, t, n);
+		}
+		sfs_fclose(fd);
+	}
+	phase_end(&ph, "template_write", sizeof(buf));
+}
+
+/* Each op is one full pass of sfs_getnextfilename over a populated root dir */
+static void bench_list_dir() {
+	char name[MAX_FILE_NAME];
+	bench_phase ph;
+
+	fresh_fs();
+	for (int i = 0; i < BENCH_NUM_SMALL_FILES; i++) {
+		snprintf(name, MAX_FILE_NAME, "entry%04d", i);
+		sfs_fclose(sfs_fopen(name));
+	}
+	phase_begin(&ph, 100*reps);
+	for (int i = 0; i < 100*reps; i++) {
+		uint64_t t = now_ns();
+		while (sfs_getnextfilename(name)) {
+		}
+		phase_record(&ph, t, 0);
+	}
+	phase_end(&ph, "list_dir", 0);
+}
+
+/* Mounts the image the legacy instance just filled; only the mount is timed */
+static void bench_mount() {
+	char name[MAX_FILE_NAME];
+	bench_phase ph;
+
+	fresh_fs();
+	for (int i = 0; i < BENCH_NUM_SMALL_FILES/2; i++) {
+		snprintf(name, MAX_FILE_NAME, "mount%04d", i);
+		int fd = sfs_fopen(name);
+		sfs_fwrite(fd, name, strlen(name));
+		sfs_fclose(fd);
+	}
+	phase_begin(&ph, 50*reps);
+	for (int i = 0; i < 50*reps; i++) {
+		uint64_t t = now_ns();
+		sfs_t *fs = sfs_mount(LASTNAME_FIRSTNAME_DISK, 0);
+		phase_record(&ph, t, 0);
+		sfs_unmount(fs);
+	}
+	phase_end(&ph, "mount", 0);
+}
+
+static void bench_mkfs() {
+	bench_phase ph;
+
+	phase_begin(&ph, 50*reps);
+	for (int i = 0; i < 50*reps; i++) {
+		uint64_t t = now_ns();
+		sfs_t *fs = sfs_mount(BENCH_SCRATCH_IMAGE, 1);
+		phase_record(&ph, t, 0);
+		sfs_unmount(fs);
+	}
+	phase_end(&ph, "mkfs", 0);
+	unlink(BENCH_SCRATCH_IMAGE);
+}
+
+/* One shard of bench_sharded: its own image, written by its own thread */
+typedef struct shard {
+	pthread_t thread;
+	int id;
+	uint64_t *lat_ns;
+	uint64_t nlat;
+	uint64_t bytes;
+} shard;
+
+static void *shard_main(void *arg) {
+	shard *sh = arg;
+	char image[64], buf[4096];
+	char name[] = "shard.dat";
+
+	snprintf(image, sizeof(image), "sfs_bench_shard%d.disk", sh->id);
+	for (int r = 0; r < reps; r++) {
+		sfs_t *fs = sfs_mount(image, 1);
+		int fd = sfs_fopen_r(fs, name);
+		for (int off = 0; off < BENCH_FILE_BYTES; off += sizeof(buf)) {
+			fill_pattern(buf, sizeof(buf), off + sh->id);
+			uint64_t t = now_ns();
+			int n = sfs_fwrite_r(fs, fd, buf, sizeof(buf));
+			sh->lat_ns[sh->nlat++] = now_ns() - t;
+			sh->bytes += n > 0 ? n : 0;
+		}
+		sfs_fclose_r(fs, fd);
+		sfs_unmount(fs);
+	}
+	unlink(image);
+	return NULL;
+}
+
+/* Sequential 4 KB writes to nshards images at once, one thread per image */
+static void bench_sharded(int nshards) {
+	shard shards[BENCH_MAX_SHARDS];
+	uint64_t per_shard = (uint64_t) reps*(BENCH_FILE_BYTES/4096);
+	bench_phase ph;
+
+	phase_begin(&ph, per_shard*nshards);
+	for (int i = 0; i < nshards; i++) {
+		shards[i].id = i;
+		shards[i].lat_ns = malloc(per_shard*sizeof(uint64_t));
+		shards[i].nlat = 0;
+		shards[i].bytes = 0;
+		pthread_create(&shards[i].thread, NULL, shard_main, &shards[i]);
+	}
+	for (int i = 0; i < nshards; i++) {
+		pthread_join(shards[i].thread, NULL);
+		memcpy(ph.lat_ns + ph.nlat, shards[i].lat_ns, shards[i].nlat*sizeof(uint64_t));
+		ph.nlat += shards[i].nlat;
+		ph.bytes += shards[i].bytes;
+		free(shards[i].lat_ns);
+	}
+	phase_end(&ph, "sharded_write", nshards);
+}
+
+static void print_table(FILE *out) {
+	fprintf(out, "%-14s %6s %9s %12s %9s %9s %9s %10s %10s %10s\n",
+			"phase", "chunk", "ops", "ops/s", "MB/s", "rd/op", "wr/op", "p50(us)", "p99(us)", "p999(us)");
+	for (int i = 0; i < num_results; i++) {
+		bench_result *r = &results[i];
+		double ops = r->ops > 0 ? r->ops : 1;
+		fprintf(out, "%-14s %6d %9llu %12.1f %9.2f %9.2f %9.2f %10.2f %10.2f %10.2f\n",
+				r->name, r->chunk, (unsigned long long) r->ops,
+				r->ops/r->seconds, r->bytes/r->seconds/(1024.0*1024.0),
+				r->blocks_read/ops, r->blocks_written/ops,
+				r->p50_us, r->p99_us, r->p999_us);
+	}
+}
+
+static void print_json(FILE *out) {
+	fprintf(out, "{\n  \"benchmark\": \"sfs_bench\",\n  \"reps\": %d,\n  \"model\": \"%s\",\n  \"durability\": \"%s\",\n  \"writeback\": \"%s\",\n  \"compress\": %d,\n  \"dedup\": %d,\n  \"results\": [\n",
+			reps, model_spec, durability_spec != NULL ? durability_spec : "default",
+			writeback_spec != NULL ? writeback_spec : "default", compress, dedup);
+	for (int i = 0; i < num_results; i++) {
+		bench_result *r = &results[i];
+		double ops = r->ops > 0 ? r->ops : 1;
+		fprintf(out, "    {\"name\": \"%s\", \"chunk\": %d, \"ops\": %llu, \"bytes\": %llu, "
+				"\"seconds\": %.6f, \"ops_per_sec\": %.1f, \"mb_per_sec\": %.3f, "
+				"\"blocks_read_per_op\": %.3f, \"blocks_written_per_op\": %.3f, "
+				"\"p50_us\": %.3f, \"p99_us\": %.3f, \"p999_us\": %.3f}%s\n",
+				r->name, r->chunk, (unsigned long long) r->ops, (unsigned long long) r->bytes,
+				r->seconds, r->ops/r->seconds, r->bytes/r->seconds/(1024.0*1024.0),
+				r->blocks_read/ops, r->blocks_written/ops,
+				r->p50_us, r->p99_us, r->p999_us, i+1 < num_results ? "," : "");
+	}
+	fprintf(out, "  ]\n}\n");
+}
+
+int main(int argc, char **argv) {
+	int json = 0;
+	int seed = 1;
+	int shards = 4;
+	const char *outfile = NULL;
+	int opt;
+
+	disk_model model;
+
+	while ((opt = getopt(argc, argv, "jo:r:s:f:m:d:w:cDt:")) != -1) {
+		switch (opt) {
+		case 'j': json = 1; break;
+		case 'o': outfile = optarg; break;
+		case 'r': reps = atoi(optarg) > 0 ? atoi(optarg) : 1; break;
+		case 's': seed = atoi(optarg); break;
+		case 'f': filter = optarg; break;
+		case 'm': model_spec = optarg; break;
+		case 'd': durability_spec = optarg; break;
+		case 'w': writeback_spec = optarg; break;
+		case 'c': compress = 1; break;
+		case 'D': dedup = 1; break;
+		case 't':
+			shards = atoi(optarg);
+			shards = shards < 1 ? 1 : shards > BENCH_MAX_SHARDS ? BENCH_MAX_SHARDS : shards;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-j] [-o file] [-r reps] [-s seed] [-f filter] [-m model] [-d policy] [-w writeback] [-c] [-D] [-t shards]\n", argv[0]);
+			return 2;
+		}
+	}
+	if (model_spec == NULL) {
+		model_spec = getenv("SFS_DISK_MODEL") != NULL ? getenv("SFS_DISK_MODEL") : "none";
+	}
+	if (disk_parse_model(model_spec, &model) != 0) {
+		fprintf(stderr, "sfs_bench: bad device model \"%s\"\n", model_spec);
+		return 2;
+	}
+	disk_set_model(&model);
+	if (durability_spec != NULL) {
+		sfs_durability policy;
+		int interval_ms = 0;
+		if (sfs_parse_durability(durability_spec, &policy, &interval_ms) != 0) {
+			fprintf(stderr, "sfs_bench: bad durability policy \"%s\"\n", durability_spec);
+			return 2;
+		}
+		sfs_set_durability(policy, interval_ms);
+	}
+	if (writeback_spec != NULL) {
+		int dirty_pct, expire_ms = 0;
+		if (sfs_parse_writeback(writeback_spec, &dirty_pct, &expire_ms) != 0) {
+			fprintf(stderr, "sfs_bench: bad writeback setting \"%s\"\n", writeback_spec);
+			return 2;
+		}
+		if (sfs_set_writeback(dirty_pct, expire_ms) != 0) {
+			fprintf(stderr, "sfs_bench: cannot turn on writeback\n");
+			return 2;
+		}
+	}
+	if (compress) {
+		sfs_set_compression(1);
+	}
+	if (dedup) {
+		sfs_set_dedup(1);
+	}
+	srand(seed);
+
+	for (int i = 0; i < NUM_CHUNK_SIZES; i++) {
+		if (selected("seq_write")) bench_seq_write(chunk_sizes[i]);
+	}
+	for (int i = 0; i < NUM_CHUNK_SIZES; i++) {
+		if (selected("seq_read")) bench_seq_read(chunk_sizes[i]);
+	}
+	for (int i = 0; i < NUM_CHUNK_SIZES; i++) {
+		if (selected("rand_read")) bench_rand(chunk_sizes[i], 0);
+	}
+	for (int i = 0; i < NUM_CHUNK_SIZES; i++) {
+		if (selected("rand_write")) bench_rand(chunk_sizes[i], 1);
+	}
+	if (selected("record_write")) bench_records(0);
+	if (selected("record_writev")) bench_records(1);
+	if (selected("index_pread")) bench_lookup(0);
+	if (selected("index_mmap")) bench_lookup(1);
+	if (selected("small")) bench_small_files();
+	if (selected("template")) bench_template_write();
+	if (selected("list_dir")) bench_list_dir();
+	if (selected("mount")) bench_mount();
+	if (selected("mkfs")) bench_mkfs();
+	for (int n = 1; n <= shards; n *= 2) {
+		if (selected("sharded")) bench_sharded(n);
+	}
+
+	FILE *out = stdout;
+	if (outfile != NULL && (out = fopen(outfile, "w")) == NULL) {
+		fprintf(stderr, "sfs_bench: cannot open %s\n", outfile);
+		return 1;
+	}
+	if (json) {
+		print_json(out);
+	} else {
+		print_table(out);
+	}
+	if (out != stdout) {
+		fclose(out);
+	}
+	return 0;
+}
@@ -0,0 +1,169 @@
+// workload capture: one binary record per public call, see sfs_capture.h
+
+#include "sfs_capture.h"
+#include "sfs_stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+int sfs_capture_on = 0;
+static FILE *out = NULL;
+static uint64_t capture_epoch_ns = 0;
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+static int next_instance = 0;
+
+// names seen during this capture; the id is the index
+static char **names = NULL;
+static int num_names = 0, cap_names = 0;
+
+static const char *op_names[SFS_CAP_NUM_OPS] = {
+	"mount", "unmount", "getnextfilename", "getfilesize", "fopen", "fclose",
+	"fread", "fwrite", "pread", "pwrite", "freadv", "fwritev", "mmap", "munmap",
+	"fseek", "lseek", "fcompress", "remove", "clone", "copy_range", "defrag",
+	"snapshot", "snapshot_delete", "fsync", "sync", "set_durability",
+	"set_compression", "set_dedup", "set_writeback", "read_extent",
+};
+
+const char *sfs_capture_op_name(int op) {
+	return op >= 0 && op < SFS_CAP_NUM_OPS ? op_names[op] : "unknown";
+}
+
+static void forget_names() {
+	for (int i = 0; i < num_names; i++) {
+		free(names[i]);
+	}
+	free(names);
+	names = NULL;
+	num_names = cap_names = 0;
+}
+
+/*
+ * Starts writing a capture to path, replacing the file. A capture that is
+ * already running is stopped first. Returns -1 if the file can't be opened.
+ */
+int sfs_capture_start(const char *path) {
+	sfs_capture_header h = { SFS_CAPTURE_MAGIC, SFS_CAPTURE_VERSION, sizeof(sfs_capture_rec), 0 };
+
+	sfs_capture_stop();
+	FILE *f = fopen(path, "wb");
+	if (f == NULL) {
+		return -1;
+	}
+	if (fwrite(&h, sizeof(h), 1, f) != 1) {
+		fclose(f);
+		return -1;
+	}
+	pthread_mutex_lock(&capture_lock);
+	out = f;
+	capture_epoch_ns = stats_now_ns();
+	__atomic_store_n(&sfs_capture_on, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&capture_lock);
+	return 0;
+}
+
+int sfs_capture_stop() {
+	int res = 0;
+
+	pthread_mutex_lock(&capture_lock);
+	__atomic_store_n(&sfs_capture_on, 0, __ATOMIC_RELEASE);
+	if (out != NULL) {
+		res = fclose(out) == 0 ? 0 : -1;
+		out = NULL;
+	}
+	forget_names();
+	pthread_mutex_unlock(&capture_lock);
+	return res;
+}
+
+static void stop_at_exit() {
+	sfs_capture_stop();
+}
+
+static void init_from_env_once() {
+	char *path = getenv("SFS_CAPTURE");
+	if (path == NULL || path[0] == '\0') {
+		return;
+	}
+	if (sfs_capture_start(path) != 0) {
+		printf("Could not open capture file %s\n", path);
+		return;
+	}
+	atexit(stop_at_exit);
+}
+
+// every mount calls this, possibly from several threads at once
+void capture_init_from_env() {
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_once(&once, init_from_env_once);
+}
+
+// Numbers every mount, captured or not, so records of different images can be told apart
+int capture_new_instance() {
+	return __atomic_fetch_add(&next_instance, 1, __ATOMIC_RELAXED);
+}
+
+// The id of a name in this capture, handing out the next one the first time it is seen
+int capture_name_id(const char *name) {
+	int id;
+
+	if (name == NULL) {
+		return -1;
+	}
+	pthread_mutex_lock(&capture_lock);
+	for (id = 0; id < num_names; id++) {
+		if (strcmp(names[id], name) == 0) {
+			break;
+		}
+	}
+	if (id == num_names) {
+		if (num_names == cap_names) {
+			int cap = cap_names > 0 ? 2*cap_names : 64;
+			char **grown = realloc(names, cap*sizeof(char*));
+			if (grown == NULL) {
+				pthread_mutex_unlock(&capture_lock);
+				return -1;
+			}
+			names = grown;
+			cap_names = cap;
+		}
+		names[num_names] = strdup(name);
+		num_names += names[num_names] != NULL;
+		if (names[id] == NULL) {
+			id = -1;
+		}
+	}
+	pthread_mutex_unlock(&capture_lock);
+	return id;
+}
+
+// An sfs_mmap view is known by the low bits of its address; two live views never share them
+int capture_view_id(const void *addr) {
+	return (int) (uint32_t) (uintptr_t) addr;
+}
+
+void capture_record(int instance, sfs_capture_op op, int fd, int a0, int a1, int a2, int a3, int res, uint64_t start_ns) {
+	sfs_capture_rec r;
+	uint64_t now = stats_now_ns();
+
+	memset(&r, 0, sizeof(r));
+	r.dur_ns = now - start_ns > UINT32_MAX ? UINT32_MAX : now - start_ns;
+	r.res = res;
+	r.arg[0] = a0;
+	r.arg[1] = a1;
+	r.arg[2] = a2;
+	r.arg[3] = a3;
+	r.instance = instance;
+	r.fd = fd;
+	r.op = op;
+
+	pthread_mutex_lock(&capture_lock);
+	if (out != NULL) {
+		r.start_ns = start_ns > capture_epoch_ns ? start_ns - capture_epoch_ns : 0;
+		fwrite(&r, sizeof(r), 1, out);
+		if (op == SFS_CAP_UNMOUNT) {
+			fflush(out);
+		}
+	}
+	pthread_mutex_unlock(&capture_lock);
+}
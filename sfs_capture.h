@@ -0,0 +1,99 @@
+#ifndef _INCLUDE_SFS_CAPTURE_H_
+#define _INCLUDE_SFS_CAPTURE_H_
+
+#include <stdint.h>
+
+/*
+ * Workload capture. While a capture runs, every public sfs call appends one
+ * fixed size record to a binary file: the call, the mount and descriptor it
+ * went to, its offsets and lengths, its result, when it started and how
+ * long it took. No file data is kept, and names (of images, files and
+ * snapshots) are replaced by the order they were first seen in, so a
+ * capture can be shared where the data can't. sfs_replay runs one again.
+ *
+ * sfs_capture_start/sfs_capture_stop bracket a capture. Setting
+ * SFS_CAPTURE=<file> in the environment starts one at the first mount and
+ * stops it at exit. The stats and capture calls themselves are not recorded.
+ *
+ * The file is a sfs_capture_header followed by records in the order the
+ * calls returned, in host byte order.
+ */
+
+#define SFS_CAPTURE_MAGIC 0x50414353 // "SCAP"
+#define SFS_CAPTURE_VERSION 1
+
+/* what each record's arg[] holds; names are ids, -1 for a NULL name */
+typedef enum sfs_capture_op {
+	SFS_CAP_MOUNT,          // image id, fresh, snapshot id or -1; res 0 or -1
+	SFS_CAP_UNMOUNT,
+	SFS_CAP_GETNEXTFILENAME,
+	SFS_CAP_GETFILESIZE,    // name id
+	SFS_CAP_FOPEN,          // name id; res is the descriptor
+	SFS_CAP_FCLOSE,
+	SFS_CAP_FREAD,          // length
+	SFS_CAP_FWRITE,         // length
+	SFS_CAP_PREAD,          // length, offset
+	SFS_CAP_PWRITE,         // length, offset
+	SFS_CAP_FREADV,         // length, iovcnt
+	SFS_CAP_FWRITEV,        // length, iovcnt
+	SFS_CAP_MMAP,           // offset, length, view id; res 0 or -1
+	SFS_CAP_MUNMAP,         // view id
+	SFS_CAP_FSEEK,          // loc
+	SFS_CAP_LSEEK,          // loc, whence
+	SFS_CAP_FCOMPRESS,      // on
+	SFS_CAP_REMOVE,         // name id
+	SFS_CAP_CLONE,          // src name id, dst name id
+	SFS_CAP_COPY_RANGE,     // src offset, dst descriptor, dst offset, length; fd is the src
+	SFS_CAP_DEFRAG,
+	SFS_CAP_SNAPSHOT,       // name id
+	SFS_CAP_SNAPSHOT_DELETE, // name id
+	SFS_CAP_FSYNC,
+	SFS_CAP_SYNC,
+	SFS_CAP_SET_DURABILITY, // policy, interval_ms
+	SFS_CAP_SET_COMPRESSION, // on
+	SFS_CAP_SET_DEDUP,      // on
+	SFS_CAP_SET_WRITEBACK,  // dirty_pct, expire_ms
+	SFS_CAP_READ_EXTENT,    // offset, length; res is the bytes covered
+	SFS_CAP_NUM_OPS
+} sfs_capture_op;
+
+typedef struct sfs_capture_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t record_size;   // sizeof(sfs_capture_rec)
+	uint64_t reserved;
+} sfs_capture_header;
+
+typedef struct sfs_capture_rec {
+	uint64_t start_ns;      // since the capture started
+	uint32_t dur_ns;        // saturates at about 4.3 s
+	int32_t res;
+	int32_t arg[4];         // see sfs_capture_op, unused ones are 0
+	uint16_t instance;      // which mount, numbered in the order they happened
+	int16_t fd;
+	uint8_t op;
+	uint8_t reserved[3];
+} sfs_capture_rec;
+
+extern int sfs_capture_on;
+
+int sfs_capture_start(const char *path);
+int sfs_capture_stop();
+const char *sfs_capture_op_name(int op);
+
+/* helpers for the recording side, used by sfs_api.c */
+void capture_init_from_env();
+int capture_new_instance();
+int capture_name_id(const char *name);
+int capture_view_id(const void *addr);
+void capture_record(int instance, sfs_capture_op op, int fd, int a0, int a1, int a2, int a3, int res, uint64_t start_ns);
+
+// start_ns for calls that don't time themselves for the stats anyway
+#define SFS_CAPTURE_START() (__builtin_expect(sfs_capture_on, 0) ? stats_now_ns() : 0)
+
+// arguments are only evaluated while a capture runs
+#define SFS_CAPTURE(instance, op, fd, a0, a1, a2, a3, res, start_ns) do { \
+	if (__builtin_expect(sfs_capture_on, 0)) capture_record(instance, op, fd, a0, a1, a2, a3, res, start_ns); \
+} while (0)
+
+#endif //_INCLUDE_SFS_CAPTURE_H_
@@ -0,0 +1,166 @@
+// CRC32C for block checksums: SSE4.2/PCLMUL when the CPU has them, tables otherwise
+
+#include "sfs_crc.h"
+#include <pthread.h>
+#include <string.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define CRC_HAVE_X86 1
+#endif
+
+#define CRC_POLY 0x82f63b78     // Castagnoli, bit reflected
+#define CRC_STRIDE 336          // bytes per stream; three of them cover most of a 1 KB block
+
+static uint32_t table[8][256];
+static uint32_t shift_stride, shift_stride2; // x^(8*n-33) for one and two strides
+static uint32_t (*update)(uint32_t crc, const uint8_t *p, size_t len);
+static const char *impl_name = "table";
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+// a*b modulo the polynomial, both bit reflected
+static uint32_t multmodp(uint32_t a, uint32_t b) {
+	uint32_t m = (uint32_t) 1 << 31, p = 0;
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0) {
+				break;
+			}
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ CRC_POLY : b >> 1;
+	}
+	return p;
+}
+
+// x^k modulo the polynomial
+static uint32_t xpow(uint64_t k) {
+	uint32_t r = (uint32_t) 1 << 31, sq = (uint32_t) 1 << 30;
+	while (k > 0) {
+		if (k & 1) {
+			r = multmodp(sq, r);
+		}
+		sq = multmodp(sq, sq);
+		k >>= 1;
+	}
+	return r;
+}
+
+// slicing-by-8 on the raw register (no inversion); loads assume little endian
+static uint32_t update_table(uint32_t crc, const uint8_t *p, size_t len) {
+	while (len > 0 && ((uintptr_t) p & 7) != 0) {
+		crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+	while (len >= 8) {
+		uint64_t v;
+		memcpy(&v, p, sizeof(v));
+		v ^= crc;
+		crc = table[7][v & 0xff] ^ table[6][(v >> 8) & 0xff] ^ table[5][(v >> 16) & 0xff] ^ table[4][(v >> 24) & 0xff]
+				^ table[3][(v >> 32) & 0xff] ^ table[2][(v >> 40) & 0xff] ^ table[1][(v >> 48) & 0xff] ^ table[0][v >> 56];
+		p += 8;
+		len -= 8;
+	}
+	while (len-- > 0) {
+		crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+#ifdef CRC_HAVE_X86
+__attribute__((target("sse4.2")))
+static uint32_t update_sse42(uint32_t crc, const uint8_t *p, size_t len) {
+	uint64_t c = crc;
+	while (len > 0 && ((uintptr_t) p & 7) != 0) {
+		c = _mm_crc32_u8(c, *p++);
+		len--;
+	}
+	while (len >= 8) {
+		uint64_t v;
+		memcpy(&v, p, sizeof(v));
+		c = _mm_crc32_u64(c, v);
+		p += 8;
+		len -= 8;
+	}
+	while (len-- > 0) {
+		c = _mm_crc32_u8(c, *p++);
+	}
+	return c;
+}
+
+// crc*x^(8*n) given k = x^(8*n-33): clmul leaves the product one bit up, crc32 adds x^32
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t shift_clmul(uint32_t crc, uint32_t k) {
+	__m128i prod = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc), _mm_cvtsi32_si128(k), 0);
+	return _mm_crc32_u64(0, _mm_cvtsi128_si64(prod));
+}
+
+/*
+ * The crc32 instruction has a latency of 3 cycles but a throughput of one
+ * per cycle, so three independent streams keep it busy. Each stream starts
+ * from 0 and the results are shifted into place and xored together.
+ */
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t update_sse42_clmul(uint32_t crc, const uint8_t *p, size_t len) {
+	while (len >= 3*CRC_STRIDE) {
+		uint64_t a = crc, b = 0, c = 0;
+		for (int i = 0; i < CRC_STRIDE; i += 8) {
+			uint64_t va, vb, vc;
+			memcpy(&va, p + i, 8);
+			memcpy(&vb, p + CRC_STRIDE + i, 8);
+			memcpy(&vc, p + 2*CRC_STRIDE + i, 8);
+			a = _mm_crc32_u64(a, va);
+			b = _mm_crc32_u64(b, vb);
+			c = _mm_crc32_u64(c, vc);
+		}
+		crc = shift_clmul(a, shift_stride2) ^ shift_clmul(b, shift_stride) ^ (uint32_t) c;
+		p += 3*CRC_STRIDE;
+		len -= 3*CRC_STRIDE;
+	}
+	return update_sse42(crc, p, len);
+}
+#endif
+
+static void crc_init() {
+	for (int n = 0; n < 256; n++) {
+		uint32_t c = n;
+		for (int k = 0; k < 8; k++) {
+			c = c & 1 ? (c >> 1) ^ CRC_POLY : c >> 1;
+		}
+		table[0][n] = c;
+	}
+	for (int n = 0; n < 256; n++) {
+		for (int t = 1; t < 8; t++) {
+			table[t][n] = table[0][table[t-1][n] & 0xff] ^ (table[t-1][n] >> 8);
+		}
+	}
+	shift_stride = xpow(8*CRC_STRIDE - 33);
+	shift_stride2 = xpow(8*2*CRC_STRIDE - 33);
+
+	update = update_table;
+#ifdef CRC_HAVE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul")) {
+		update = update_sse42_clmul;
+		impl_name = "sse4.2+pclmul";
+	} else if (__builtin_cpu_supports("sse4.2")) {
+		update = update_sse42;
+		impl_name = "sse4.2";
+	}
+#endif
+}
+
+uint32_t crc32c(const void *buf, size_t len) {
+	pthread_once(&init_once, crc_init);
+	return ~update(~(uint32_t) 0, buf, len);
+}
+
+uint32_t crc32c_sw(const void *buf, size_t len) {
+	pthread_once(&init_once, crc_init);
+	return ~update_table(~(uint32_t) 0, buf, len);
+}
+
+const char *crc32c_impl() {
+	pthread_once(&init_once, crc_init);
+	return impl_name;
+}
@@ -0,0 +1,21 @@
+#ifndef _INCLUDE_SFS_CRC_H_
+#define _INCLUDE_SFS_CRC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CRC32C (Castagnoli, the iSCSI/ext4 polynomial) with the usual ~0 initial
+ * value and final inversion. On x86-64 CPUs with SSE4.2 and PCLMUL it runs
+ * three interleaved crc32 instruction streams and joins them with a
+ * carry-less multiply; elsewhere it falls back to slicing-by-8 tables.
+ */
+uint32_t crc32c(const void *buf, size_t len);
+
+/* Same result through the portable tables only, for tests and benchmarks */
+uint32_t crc32c_sw(const void *buf, size_t len);
+
+/* "sse4.2+pclmul", "sse4.2" or "table": what crc32c uses on this CPU */
+const char *crc32c_impl();
+
+#endif //_INCLUDE_SFS_CRC_H_
@@ -0,0 +1,851 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "sfs_api.h"
+#include "sfs_layout.h"
+#include "bitmap.h"
+#include "disk_emu.h"
+#include "sfs_crc.h"
+
+/*
+ * sfs_fsck: offline consistency checker for sfs disk images.
+ *
+ * Rebuilds the free block, inode table and directory entry bitmaps from what
+ * the root directory and the inodes actually reference and compares them
+ * with the copies on disk. Reports dangling and duplicate directory entries,
+ * orphaned inodes, pointers outside the data region, blocks claimed twice,
+ * leaked blocks and referenced blocks marked free. The last blocks of packed
+ * files may share a tail block; any other pointer into one is a double
+ * allocation. Blocks with a count in the refcount table (data blocks, and
+ * indirect blocks of cloned files) may be shared by that many pointers, and
+ * the count must match them. Blocks that only
+ * snapshots hold are free in the bitmap, which tracks the live tree alone.
+ * On images with checksums every block in use or held by a snapshot must
+ * match its CRC32C. With -r it repairs all
+ * of them and writes the fixed metadata back: bad pointers and the later of
+ * two claims on a block are cleared, orphans are reconnected as
+ * lost+found.<n>, refcounts are recounted, the bitmaps are rewritten and
+ * checksums are recomputed (the block's contents can't be recovered).
+ *
+ * Metadata is read with a few large sequential requests: the superblock and
+ * inode table in one, then the directory and indirect blocks sorted by
+ * address and coalesced into runs. The per-inode passes only touch memory
+ * and run on -j threads (default: one per CPU).
+ *
+ * Exit status follows fsck(8): 0 clean, 1 problems fixed, 4 problems left,
+ * 8 operational error.
+ *
+ * usage: sfs_fsck [-r] [-q] [-j threads] [image]
+ */
+
+#define FSCK_MAX_THREADS 64
+#define FSCK_MAX_GAP 8      // unneeded blocks read to join two runs into one request
+#define FSCK_MAX_RUN 256    // largest single read request, in blocks
+#define FSCK_SLOT_INDIRECT NUM_DIRECT_PTRS // slot of the indirect pointer itself
+#define FSCK_SLOTS_PER_INODE (NUM_DIRECT_PTRS+1+NUM_INDIRECT_PTRS)
+#define FSCK_UNCLAIMED UINT32_MAX
+
+typedef enum fsck_problem {
+	FSCK_BAD_POINTER,       // pointer outside the data region
+	FSCK_DOUBLE_ALLOC,      // block already claimed by a lower inode or slot
+	FSCK_BAD_SIZE,          // size past MAX_FILE_SIZE, or past INLINE_DATA_SIZE for inline files
+	FSCK_DANGLING_ENTRY,    // directory entry naming a missing inode
+	FSCK_DUPLICATE_ENTRY,   // second entry for the same inode or name
+	FSCK_ORPHAN_INODE,      // inode in use but not in the directory
+	FSCK_INODE_BITMAP,      // inode table bitmap disagrees with the directory
+	FSCK_ENTRY_BITMAP,      // directory entry bitmap disagrees with the entries
+	FSCK_LEAKED_BLOCKS,     // blocks marked in use that nothing references
+	FSCK_FREE_BLOCKS_IN_USE,// referenced blocks marked free
+	FSCK_BAD_REFCOUNT,      // refcount that doesn't match the pointers to a shared block
+	FSCK_BAD_CHECKSUM,      // block in use whose contents don't match its checksum
+	FSCK_NUM_PROBLEMS
+} fsck_problem;
+
+static const char *problem_names[FSCK_NUM_PROBLEMS] = {
+	"bad pointers", "double allocations", "bad sizes", "dangling entries",
+	"duplicate entries", "orphaned inodes", "inode bitmap errors",
+	"entry bitmap errors", "leaked block runs", "free block runs in use",
+	"bad refcounts", "bad checksums",
+};
+
+typedef struct fsck_report {
+	int inode;      // sort key, NUM_INODES for problems not tied to an inode
+	int slot;       // second sort key
+	int fixed;
+	fsck_problem kind;
+	char msg[160];
+} fsck_report;
+
+static int repair = 0;
+static int quiet = 0;
+static int nthreads = 1;
+
+// on-disk metadata, as read and as repaired
+static superblock_t sb;
+static inode_t inodes[NUM_INODES];
+static uint8_t inode_bm[INODE_TABLE_BM_SIZE];
+static directory_entry dir[NUM_INODES];
+static uint8_t dir_bm[DIR_ENTRIES_BM_SIZE];
+static uint8_t free_bm[FREE_BM_SIZE];
+static int root_inode;
+
+static int live[NUM_INODES];                 // reached from the directory, or the root
+static unsigned int *indirect[NUM_INODES];   // copy of each live inode's indirect block
+static int indirect_dirty[NUM_INODES];
+static char *indirect_buf = NULL;
+static uint32_t owner[NUM_TOTAL_BLOCKS];     // lowest slot reference claiming each block
+static uint8_t in_use[NUM_TOTAL_BLOCKS];     // referenced by a pointer that is kept
+static uint8_t shared_tail[NUM_TOTAL_BLOCKS];// tail block holding packed last blocks
+static uint8_t refs[NUM_TOTAL_BLOCKS];       // refcount table, indexed by block number
+static uint32_t nrefs[NUM_TOTAL_BLOCKS];     // kept pointers to each block
+static uint32_t csums[NUM_BLOCKS_CHECKSUM*CHECKSUMS_PER_BLOCK]; // checksum region
+static uint8_t held[NUM_TOTAL_BLOCKS];       // held by a snapshot
+static int inodes_dirty = 0, dir_dirty = 0, free_bm_dirty = 0, refs_dirty = 0, csums_dirty = 0;
+
+static fsck_report *reports = NULL;
+static int num_reports = 0, reports_cap = 0;
+static pthread_mutex_t reports_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+static void problem(fsck_problem kind, int inode, int slot, int fixed, const char *fmt, ...) {
+	va_list ap;
+	pthread_mutex_lock(&reports_lock);
+	if (num_reports == reports_cap) {
+		reports_cap = reports_cap > 0 ? 2*reports_cap : 64;
+		reports = realloc(reports, reports_cap*sizeof(fsck_report));
+	}
+	fsck_report *r = &reports[num_reports++];
+	r->inode = inode;
+	r->slot = slot;
+	r->fixed = fixed;
+	r->kind = kind;
+	va_start(ap, fmt);
+	vsnprintf(r->msg, sizeof(r->msg), fmt, ap);
+	va_end(ap);
+	pthread_mutex_unlock(&reports_lock);
+}
+
+static int cmp_reports(const void *a, const void *b) {
+	const fsck_report *x = a, *y = b;
+	if (x->inode != y->inode) return x->inode - y->inode;
+	if (x->slot != y->slot) return x->slot - y->slot;
+	return (int) x->kind - (int) y->kind;
+}
+
+static int bit_used(const uint8_t *bm, int index) {
+	return !(bm[index/8] & (1 << (index%8)));
+}
+
+static void set_bit(uint8_t *bm, int index, int used) {
+	if (used) {
+		force_set_index(bm, index);
+	} else {
+		rm_index(bm, index);
+	}
+}
+
+/*------------------------------------------------------------*/
+/* Reads n blocks, given in any order, into out[i*BLOCK_SIZE].  */
+/* The addresses are sorted and read as coalesced runs so the   */
+/* device sees a few large sequential requests.                 */
+/*------------------------------------------------------------*/
+static const unsigned int *sort_keys;
+static int cmp_by_block(const void *a, const void *b) {
+	unsigned int x = sort_keys[*(const int*) a], y = sort_keys[*(const int*) b];
+	return (x > y) - (x < y);
+}
+
+static int read_scattered(const unsigned int *blocks, int n, char *out) {
+	int *order = malloc(n*sizeof(int));
+	char *run = malloc((size_t) FSCK_MAX_RUN*BLOCK_SIZE);
+	int i, j, res = 0;
+
+	if (order == NULL || run == NULL) {
+		free(order);
+		free(run);
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		order[i] = i;
+	}
+	sort_keys = blocks;
+	qsort(order, n, sizeof(int), cmp_by_block);
+
+	for (i = 0; i < n; i = j) {
+		unsigned int first = blocks[order[i]];
+		for (j = i+1; j < n; j++) {
+			unsigned int next = blocks[order[j]];
+			if (next - blocks[order[j-1]] > FSCK_MAX_GAP+1 || next - first >= FSCK_MAX_RUN) {
+				break;
+			}
+		}
+		int span = blocks[order[j-1]] - first + 1;
+		if (read_blocks(first, span, run) != span) {
+			res = -1;
+			break;
+		}
+		for (int k = i; k < j; k++) {
+			memcpy(out + (size_t) order[k]*BLOCK_SIZE, run + (size_t) (blocks[order[k]] - first)*BLOCK_SIZE, BLOCK_SIZE);
+		}
+	}
+	free(order);
+	free(run);
+	return res;
+}
+
+/*------------------------------------------------------------*/
+/* Loads the superblock, inode table, free bitmap and root      */
+/* directory. Returns -1 if the image is not an sfs image.      */
+/*------------------------------------------------------------*/
+static int load_metadata() {
+	static char head[BLOCK_INDEX_DATA_BLOCKS*BLOCK_SIZE];
+	char buffer[NUM_BLOCKS_ROOTDIR*BLOCK_SIZE];
+
+	// superblock and inode table are adjacent, fetch them together
+	if (read_blocks(BLOCK_INDEX_SUPERBLOCK, BLOCK_INDEX_DATA_BLOCKS, head) != BLOCK_INDEX_DATA_BLOCKS) {
+		fprintf(stderr, "sfs_fsck: cannot read the inode table\n");
+		return -1;
+	}
+	memcpy(&sb, head, sizeof(superblock_t));
+	if (sb.magic != SFS_MAGIC || sb.block_size != BLOCK_SIZE || sb.fs_size != NUM_TOTAL_BLOCKS
+			|| sb.root_dir_inode >= NUM_INODES) {
+		fprintf(stderr, "sfs_fsck: bad superblock (magic %llx, block size %llu, %llu blocks)\n",
+				(unsigned long long) sb.magic, (unsigned long long) sb.block_size, (unsigned long long) sb.fs_size);
+		return -1;
+	}
+	memcpy(inodes, head + BLOCK_INDEX_INODET*BLOCK_SIZE, sizeof(inodes));
+	memcpy(inode_bm, head + BLOCK_INDEX_INODET*BLOCK_SIZE + sizeof(inodes), sizeof(inode_bm));
+
+	if (read_blocks(BLOCK_INDEX_FREE_BITMAP, 1, buffer) != 1) {
+		fprintf(stderr, "sfs_fsck: cannot read the free block bitmap\n");
+		return -1;
+	}
+	memcpy(free_bm, buffer, sizeof(free_bm));
+
+	root_inode = sb.root_dir_inode;
+	for (int i = 0; i < NUM_BLOCKS_ROOTDIR; i++) {
+		if (!IS_DATA_BLOCK(inodes[root_inode].data_ptrs[i])) {
+			fprintf(stderr, "sfs_fsck: root directory block %d points at %d, outside the data region\n",
+					i, (int) inodes[root_inode].data_ptrs[i]);
+			return -1;
+		}
+	}
+	if (read_scattered(inodes[root_inode].data_ptrs, NUM_BLOCKS_ROOTDIR, buffer) != 0) {
+		fprintf(stderr, "sfs_fsck: cannot read the root directory\n");
+		return -1;
+	}
+	memcpy(dir, buffer, sizeof(dir));
+	memcpy(dir_bm, buffer + sizeof(dir), sizeof(dir_bm));
+
+	// older images have no refcount table, nothing is shared there
+	if (sb.refcount_block != 0 || sb.dedup_index_block != 0) {
+		if (!IS_DATA_BLOCK(sb.refcount_block) || !IS_DATA_BLOCK(sb.dedup_index_block)
+				|| sb.refcount_block == sb.dedup_index_block) {
+			fprintf(stderr, "sfs_fsck: refcount table at %llu or dedup index at %llu is outside the data region\n",
+					(unsigned long long) sb.refcount_block, (unsigned long long) sb.dedup_index_block);
+			return -1;
+		}
+		if (read_blocks(sb.refcount_block, 1, buffer) != 1) {
+			fprintf(stderr, "sfs_fsck: cannot read the refcount table\n");
+			return -1;
+		}
+		memcpy(refs + BLOCK_INDEX_DATA_BLOCKS, buffer, NUM_BLOCKS);
+	}
+	// snapshots only matter here for the blocks they keep from being reused
+	if (sb.snapshot_block != 0) {
+		snapshot_entry snaps[SFS_MAX_SNAPSHOTS];
+		if (!IS_DATA_BLOCK(sb.snapshot_block) || read_blocks(sb.snapshot_block, 1, buffer) != 1) {
+			fprintf(stderr, "sfs_fsck: cannot read the snapshot table at %llu\n", (unsigned long long) sb.snapshot_block);
+			return -1;
+		}
+		memcpy(snaps, buffer, sizeof(snaps));
+		for (int i = 0; i < SFS_MAX_SNAPSHOTS; i++) {
+			if (snaps[i].name[0] == '\0') {
+				continue;
+			}
+			for (int b = BLOCK_INDEX_DATA_BLOCKS; b < BLOCK_INDEX_FREE_BITMAP; b++) {
+				held[b] |= bit_used(snaps[i].map, b);
+			}
+		}
+	}
+	if ((sb.features & SFS_FEATURE_CHECKSUMS)
+			&& read_blocks(BLOCK_INDEX_CHECKSUM, NUM_BLOCKS_CHECKSUM, csums) != NUM_BLOCKS_CHECKSUM) {
+		fprintf(stderr, "sfs_fsck: cannot read the checksum region\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* The refcount table, dedup index and snapshot table are owned by the superblock */
+static int is_shared_meta(unsigned int block) {
+	return block != 0 && (block == sb.refcount_block || block == sb.dedup_index_block || block == sb.snapshot_block);
+}
+
+static void clear_entry(int e) {
+	dir[e].num = -1;
+	memset(dir[e].name, 0, MAX_FILE_NAME);
+	dir_dirty = 1;
+}
+
+static int find_entry(const char *name) {
+	for (int e = 0; e < NUM_INODES; e++) {
+		if (dir[e].name[0] != '\0' && strncmp(dir[e].name, name, MAX_FILE_NAME) == 0) {
+			return e;
+		}
+	}
+	return -1;
+}
+
+// Links an orphaned inode back into the directory, returns 0 on success
+static int reconnect(int inode, char *name) {
+	int e;
+	for (e = 0; e < NUM_INODES; e++) {
+		if (dir[e].name[0] == '\0' && dir[e].num == -1) {
+			break;
+		}
+	}
+	if (e == NUM_INODES) {
+		return -1;
+	}
+	snprintf(name, MAX_FILE_NAME, "lost+found.%d", inode);
+	for (int k = 1; find_entry(name) != -1 && k < 100; k++) {
+		snprintf(name, MAX_FILE_NAME, "lost+found%d.%d", k, inode);
+	}
+	if (find_entry(name) != -1) {
+		return -1;
+	}
+	dir[e].num = inode;
+	strcpy(dir[e].name, name);
+	dir_dirty = 1;
+	return 0;
+}
+
+/*------------------------------------------------------------*/
+/* Validates the directory entries and works out which inodes   */
+/* are live. Runs before the inode passes since they only look  */
+/* at live inodes.                                              */
+/*------------------------------------------------------------*/
+static void check_directory() {
+	int named_by[NUM_INODES];
+
+	for (int i = 0; i < NUM_INODES; i++) {
+		named_by[i] = -1;
+	}
+	live[root_inode] = 1;
+
+	for (int e = 0; e < NUM_INODES; e++) {
+		directory_entry *d = &dir[e];
+		int n = d->num;
+		if (d->name[0] == '\0' && n == -1) {
+			continue;
+		}
+		if (d->name[0] == '\0' || memchr(d->name, '\0', MAX_FILE_NAME) == NULL) {
+			problem(FSCK_DANGLING_ENTRY, NUM_INODES, e, repair, "entry %d: unnamed entry for inode %d", e, n);
+		} else if (n < 0 || n >= NUM_INODES || n == root_inode || inodes[n].size == (unsigned int) -1) {
+			problem(FSCK_DANGLING_ENTRY, NUM_INODES, e, repair, "entry %d (\"%s\"): inode %d does not exist", e, d->name, n);
+		} else if (named_by[n] != -1) {
+			problem(FSCK_DUPLICATE_ENTRY, n, e, repair, "entry %d (\"%s\"): inode %d is already named \"%s\"",
+					e, d->name, n, dir[named_by[n]].name);
+		} else if (find_entry(d->name) != e) {
+			problem(FSCK_DUPLICATE_ENTRY, n, e, repair, "entry %d (\"%s\"): name already used by entry %d",
+					e, d->name, find_entry(d->name));
+		} else {
+			named_by[n] = e;
+			live[n] = 1;
+			continue;
+		}
+		if (repair) {
+			clear_entry(e);
+		}
+	}
+
+	// an inode marked used with a plausible size but no name still owns its blocks
+	for (int i = 0; i < NUM_INODES; i++) {
+		if (live[i] || !bit_used(inode_bm, i) || inodes[i].size == (unsigned int) -1) {
+			continue;
+		}
+		live[i] = 1;
+		char name[MAX_FILE_NAME];
+		if (!repair) {
+			problem(FSCK_ORPHAN_INODE, i, -1, 0, "inode %d (%u bytes) is in use but has no directory entry",
+					i, inodes[i].size);
+		} else if (reconnect(i, name) == 0) {
+			problem(FSCK_ORPHAN_INODE, i, -1, 1, "inode %d (%u bytes) is in use but has no directory entry, reconnected as \"%s\"",
+					i, inodes[i].size, name);
+		} else {
+			problem(FSCK_ORPHAN_INODE, i, -1, 0, "inode %d (%u bytes) is in use but has no directory entry and no entry is free",
+					i, inodes[i].size);
+		}
+	}
+}
+
+static int load_indirect_blocks() {
+	unsigned int blocks[NUM_INODES];
+	int owners[NUM_INODES];
+	int n = 0;
+
+	for (int i = 0; i < NUM_INODES; i++) {
+		if (live[i] && SFS_MODE_TYPE(inodes[i].mode) != SFS_MODE_INLINE && IS_DATA_BLOCK(inodes[i].indirectPointer)) {
+			blocks[n] = inodes[i].indirectPointer;
+			owners[n++] = i;
+		}
+	}
+	if (n == 0) {
+		return 0;
+	}
+	indirect_buf = malloc((size_t) n*BLOCK_SIZE);
+	if (indirect_buf == NULL || read_scattered(blocks, n, indirect_buf) != 0) {
+		fprintf(stderr, "sfs_fsck: cannot read the indirect blocks\n");
+		return -1;
+	}
+	for (int k = 0; k < n; k++) {
+		indirect[owners[k]] = (unsigned int*) (indirect_buf + (size_t) k*BLOCK_SIZE);
+	}
+	return 0;
+}
+
+/* Returns the pointer held in a slot, NULL once past the last slot of the inode */
+static unsigned int *slot_ptr(int inode, int slot) {
+	if (SFS_MODE_TYPE(inodes[inode].mode) == SFS_MODE_INLINE) {
+		return NULL; // the pointers hold file data
+	}
+	if (slot < NUM_DIRECT_PTRS) {
+		return &inodes[inode].data_ptrs[slot];
+	}
+	if (slot == FSCK_SLOT_INDIRECT) {
+		return &inodes[inode].indirectPointer;
+	}
+	if (indirect[inode] == NULL || slot >= FSCK_SLOTS_PER_INODE) {
+		return NULL;
+	}
+	return &indirect[inode][slot - FSCK_SLOT_INDIRECT - 1];
+}
+
+/* Slot of a packed inode's last block, which may share its tail block; -1 for none */
+static int tail_slot(int inode) {
+	if (SFS_MODE_TYPE(inodes[inode].mode) != SFS_MODE_TAIL || inodes[inode].size == 0 || inodes[inode].size > MAX_FILE_SIZE) {
+		return -1;
+	}
+	int last = (inodes[inode].size - 1)/BLOCK_SIZE;
+	return last < NUM_DIRECT_PTRS ? last : last + 1;
+}
+
+static void slot_name(int slot, char *buf, int len) {
+	if (slot < NUM_DIRECT_PTRS) {
+		snprintf(buf, len, "direct[%d]", slot);
+	} else if (slot == FSCK_SLOT_INDIRECT) {
+		snprintf(buf, len, "indirect");
+	} else {
+		snprintf(buf, len, "indirect[%d]", slot - FSCK_SLOT_INDIRECT - 1);
+	}
+}
+
+static void clear_slot(int inode, int slot, unsigned int *p) {
+	*p = -1;
+	if (slot > FSCK_SLOT_INDIRECT) {
+		indirect_dirty[inode] = 1;
+	} else {
+		inodes_dirty = 1;
+	}
+	if (slot == FSCK_SLOT_INDIRECT) {
+		indirect[inode] = NULL;
+		indirect_dirty[inode] = 0;
+	}
+}
+
+/*------------------------------------------------------------*/
+/* Pass 1: check every pointer of an inode and claim its block. */
+/* Claims keep the lowest (inode, slot) reference so the winner */
+/* of a double allocation doesn't depend on thread timing.      */
+/*------------------------------------------------------------*/
+static void claim_blocks(int inode) {
+	char name[24];
+	unsigned int *p;
+
+	if (inodes[inode].size != (unsigned int) -1 && inodes[inode].size > MAX_FILE_SIZE) {
+		problem(FSCK_BAD_SIZE, inode, -1, repair, "inode %d: size %u is past the %d byte maximum",
+				inode, inodes[inode].size, (int) MAX_FILE_SIZE);
+		if (repair) {
+			inodes[inode].size = MAX_FILE_SIZE;
+			inodes_dirty = 1;
+		}
+	}
+	if (SFS_MODE_TYPE(inodes[inode].mode) == SFS_MODE_INLINE && inodes[inode].size != (unsigned int) -1 && inodes[inode].size > INLINE_DATA_SIZE) {
+		problem(FSCK_BAD_SIZE, inode, -1, repair, "inode %d: inline size %u is past the %d byte maximum",
+				inode, inodes[inode].size, (int) INLINE_DATA_SIZE);
+		if (repair) {
+			inodes[inode].size = INLINE_DATA_SIZE;
+			inodes_dirty = 1;
+		}
+	}
+	for (int slot = 0; (p = slot_ptr(inode, slot)) != NULL; slot++) {
+		if (*p == (unsigned int) -1 || *p == SFS_COMPRESSED) {
+			continue;
+		}
+		if (!IS_DATA_BLOCK(*p)) {
+			slot_name(slot, name, sizeof(name));
+			problem(FSCK_BAD_POINTER, inode, slot, repair, "inode %d %s: block %d is outside the data region",
+					inode, name, (int) *p);
+			if (repair) {
+				clear_slot(inode, slot, p);
+			}
+			continue;
+		}
+		if (slot == tail_slot(inode)) {
+			__atomic_store_n(&shared_tail[*p], 1, __ATOMIC_RELAXED);
+			continue;
+		}
+		uint32_t ref = (uint32_t) inode*FSCK_SLOTS_PER_INODE + slot;
+		uint32_t cur = __atomic_load_n(&owner[*p], __ATOMIC_RELAXED);
+		while (ref < cur && !__atomic_compare_exchange_n(&owner[*p], &cur, ref, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		}
+	}
+}
+
+/* Pass 2: every pointer that lost its block to a lower claim is a double allocation */
+static void check_claims(int inode) {
+	char name[24];
+	unsigned int *p;
+
+	for (int slot = 0; (p = slot_ptr(inode, slot)) != NULL; slot++) {
+		if (!IS_DATA_BLOCK(*p) || slot == tail_slot(inode)) {
+			continue;
+		}
+		uint32_t ref = (uint32_t) inode*FSCK_SLOTS_PER_INODE + slot;
+		uint32_t winner = owner[*p];
+		if (shared_tail[*p] || is_shared_meta(*p)) {
+			slot_name(slot, name, sizeof(name));
+			problem(FSCK_DOUBLE_ALLOC, inode, slot, repair, "inode %d %s: block %d is also a %s",
+					inode, name, (int) *p, shared_tail[*p] ? "shared tail block" : "refcount, dedup index or snapshot table block");
+			if (repair) {
+				clear_slot(inode, slot, p);
+			}
+			continue;
+		}
+		// a block with a refcount, indirect blocks of clones included, may have several owners
+		if (winner == ref || refs[*p] > 0) {
+			continue;
+		}
+		char other[24];
+		slot_name(slot, name, sizeof(name));
+		slot_name(winner % FSCK_SLOTS_PER_INODE, other, sizeof(other));
+		problem(FSCK_DOUBLE_ALLOC, inode, slot, repair, "inode %d %s: block %d is also inode %d %s",
+				inode, name, (int) *p, (int) (winner / FSCK_SLOTS_PER_INODE), other);
+		if (repair) {
+			clear_slot(inode, slot, p);
+		}
+	}
+}
+
+/* Pass 3: mark the blocks still referenced once repairs are applied */
+static void mark_in_use(int inode) {
+	unsigned int *p;
+
+	for (int slot = 0; (p = slot_ptr(inode, slot)) != NULL; slot++) {
+		if (IS_DATA_BLOCK(*p)) {
+			__atomic_store_n(&in_use[*p], 1, __ATOMIC_RELAXED);
+			if (slot != tail_slot(inode)) {
+				__atomic_fetch_add(&nrefs[*p], 1, __ATOMIC_RELAXED);
+			}
+		}
+	}
+}
+
+static void (*pass_fn)(int inode);
+static int next_inode;
+
+static void *pass_worker(void *arg) {
+	int i;
+	while ((i = __atomic_fetch_add(&next_inode, 1, __ATOMIC_RELAXED)) < NUM_INODES) {
+		if (live[i]) {
+			pass_fn(i);
+		}
+	}
+	return NULL;
+}
+
+// Runs fn on every live inode across nthreads threads, the caller included
+static void run_pass(void (*fn)(int inode)) {
+	pthread_t threads[FSCK_MAX_THREADS];
+	int started = 0;
+
+	pass_fn = fn;
+	next_inode = 0;
+	for (int t = 1; t < nthreads; t++) {
+		if (pthread_create(&threads[started], NULL, pass_worker, NULL) == 0) {
+			started++;
+		}
+	}
+	pass_worker(NULL);
+	for (int t = 0; t < started; t++) {
+		pthread_join(threads[t], NULL);
+	}
+}
+
+/* Each tracked block's count must be the number of pointers still holding it */
+static void check_refcounts() {
+	for (int b = BLOCK_INDEX_DATA_BLOCKS; b < BLOCK_INDEX_FREE_BITMAP; b++) {
+		if (refs[b] == 0 || refs[b] == nrefs[b]) {
+			continue;
+		}
+		uint32_t want = nrefs[b] < REFCOUNT_MAX ? nrefs[b] : REFCOUNT_MAX;
+		problem(FSCK_BAD_REFCOUNT, NUM_INODES, NUM_INODES + b, repair, "block %d has refcount %d but %u references",
+				b, refs[b], nrefs[b]);
+		if (repair) {
+			refs[b] = want;
+			refs_dirty = 1;
+		}
+	}
+}
+
+/* Every block the image uses or a snapshot holds must match its checksum; free blocks hold nothing */
+static int check_checksums() {
+	if (!(sb.features & SFS_FEATURE_CHECKSUMS)) {
+		return 0;
+	}
+	char *image = malloc((size_t) NUM_TOTAL_BLOCKS*BLOCK_SIZE);
+	if (image == NULL || read_blocks(0, NUM_TOTAL_BLOCKS, image) != NUM_TOTAL_BLOCKS) {
+		fprintf(stderr, "sfs_fsck: cannot read the image to verify checksums\n");
+		free(image);
+		return -1;
+	}
+	for (int b = 0; b < NUM_TOTAL_BLOCKS; b++) {
+		if (IS_DATA_BLOCK(b) && !in_use[b] && !shared_tail[b] && !is_shared_meta(b) && !held[b]) {
+			continue;
+		}
+		uint32_t crc = crc32c(image + (size_t) b*BLOCK_SIZE, BLOCK_SIZE);
+		if (crc == csums[b]) {
+			continue;
+		}
+		problem(FSCK_BAD_CHECKSUM, NUM_INODES, NUM_INODES + b, repair, "block %d does not match its checksum (%08x, stored %08x)",
+				b, crc, csums[b]);
+		if (repair) {
+			csums[b] = crc;
+			csums_dirty = 1;
+		}
+	}
+	free(image);
+	return 0;
+}
+
+/* write_blocks that keeps the checksum region in step with what it writes */
+static int write_checked(int block, int nblocks, void *buffer) {
+	if (sb.features & SFS_FEATURE_CHECKSUMS) {
+		for (int i = 0; i < nblocks; i++) {
+			csums[block + i] = crc32c((char*) buffer + (size_t) i*BLOCK_SIZE, BLOCK_SIZE);
+		}
+		csums_dirty = 1;
+	}
+	return write_blocks(block, nblocks, buffer);
+}
+
+/*------------------------------------------------------------*/
+/* Compares the on-disk bitmaps with the ones rebuilt from the  */
+/* directory and inodes. Block problems are reported as runs.   */
+/*------------------------------------------------------------*/
+static void check_bitmaps() {
+	for (int i = 0; i < NUM_INODES; i++) {
+		if (bit_used(inode_bm, i) != live[i]) {
+			problem(FSCK_INODE_BITMAP, i, -1, repair, "inode %d is marked %s in the inode bitmap",
+					i, live[i] ? "free" : "in use");
+			if (repair) {
+				set_bit(inode_bm, i, live[i]);
+				inodes_dirty = 1;
+			}
+		}
+	}
+	for (int e = 0; e < NUM_INODES; e++) {
+		int used = dir[e].name[0] != '\0';
+		if (bit_used(dir_bm, e) != used) {
+			problem(FSCK_ENTRY_BITMAP, NUM_INODES, e, repair, "entry %d is marked %s in the entry bitmap",
+					e, used ? "free" : "in use");
+			if (repair) {
+				set_bit(dir_bm, e, used);
+				dir_dirty = 1;
+			}
+		}
+	}
+
+	int b = 0;
+	while (b < NUM_TOTAL_BLOCKS) {
+		int expected = !IS_DATA_BLOCK(b) || in_use[b] || is_shared_meta(b);
+		if (bit_used(free_bm, b) == expected) {
+			b++;
+			continue;
+		}
+		int first = b;
+		while (b < NUM_TOTAL_BLOCKS && bit_used(free_bm, b) != (!IS_DATA_BLOCK(b) || in_use[b] || is_shared_meta(b))
+				&& (!IS_DATA_BLOCK(b) || in_use[b] || is_shared_meta(b)) == expected) {
+			if (repair) {
+				set_bit(free_bm, b, expected);
+			}
+			b++;
+		}
+		if (expected) {
+			problem(FSCK_FREE_BLOCKS_IN_USE, NUM_INODES, NUM_INODES + first, repair,
+					"blocks %d-%d are referenced but marked free", first, b-1);
+		} else {
+			problem(FSCK_LEAKED_BLOCKS, NUM_INODES, NUM_INODES + first, repair,
+					"blocks %d-%d are marked in use but nothing references them", first, b-1);
+		}
+		free_bm_dirty |= repair;
+	}
+}
+
+/* Writes back whatever the repairs touched and syncs the image */
+static int write_repairs() {
+	static char head[NUM_BLOCKS_INODET*BLOCK_SIZE];
+	char buffer[NUM_BLOCKS_ROOTDIR*BLOCK_SIZE];
+
+	for (int i = 0; i < NUM_INODES; i++) {
+		if (indirect_dirty[i] && indirect[i] != NULL
+				&& write_checked(inodes[i].indirectPointer, 1, indirect[i]) != 1) {
+			return -1;
+		}
+	}
+	if (inodes_dirty) {
+		memset(head, 0, sizeof(head));
+		memcpy(head, inodes, sizeof(inodes));
+		memcpy(head + sizeof(inodes), inode_bm, sizeof(inode_bm));
+		if (write_checked(BLOCK_INDEX_INODET, NUM_BLOCKS_INODET, head) != NUM_BLOCKS_INODET) {
+			return -1;
+		}
+	}
+	if (dir_dirty) {
+		memset(buffer, 0, sizeof(buffer));
+		memcpy(buffer, dir, sizeof(dir));
+		memcpy(buffer + sizeof(dir), dir_bm, sizeof(dir_bm));
+		for (int i = 0; i < NUM_BLOCKS_ROOTDIR; i++) {
+			if (write_checked(inodes[root_inode].data_ptrs[i], 1, buffer + i*BLOCK_SIZE) != 1) {
+				return -1;
+			}
+		}
+	}
+	if (free_bm_dirty) {
+		memset(buffer, 0, BLOCK_SIZE);
+		memcpy(buffer, free_bm, sizeof(free_bm));
+		if (write_checked(BLOCK_INDEX_FREE_BITMAP, 1, buffer) != 1) {
+			return -1;
+		}
+	}
+	if (refs_dirty) {
+		memset(buffer, 0, BLOCK_SIZE);
+		memcpy(buffer, refs + BLOCK_INDEX_DATA_BLOCKS, NUM_BLOCKS);
+		if (write_checked(sb.refcount_block, 1, buffer) != 1) {
+			return -1;
+		}
+	}
+	if (csums_dirty && write_blocks(BLOCK_INDEX_CHECKSUM, NUM_BLOCKS_CHECKSUM, csums) != NUM_BLOCKS_CHECKSUM) {
+		return -1;
+	}
+	return disk_sync(1);
+}
+
+int main(int argc, char **argv) {
+	char *image = LASTNAME_FIRSTNAME_DISK;
+	int opt;
+
+	nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "rqj:")) != -1) {
+		switch (opt) {
+		case 'r': repair = 1; break;
+		case 'q': quiet = 1; break;
+		case 'j': nthreads = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-r] [-q] [-j threads] [image]\n", argv[0]);
+			return 8;
+		}
+	}
+	if (optind < argc) {
+		image = argv[optind];
+	}
+	if (nthreads < 1) {
+		nthreads = 1;
+	} else if (nthreads > FSCK_MAX_THREADS) {
+		nthreads = FSCK_MAX_THREADS;
+	}
+
+	uint64_t t0 = now_ns();
+	if (access(image, R_OK | (repair ? W_OK : 0)) != 0 || init_disk(image, BLOCK_SIZE, NUM_IMAGE_BLOCKS) != 0) {
+		fprintf(stderr, "sfs_fsck: cannot open %s\n", image);
+		return 8;
+	}
+	if (load_metadata() != 0) {
+		close_disk();
+		return 8;
+	}
+	check_directory();
+	if (load_indirect_blocks() != 0) {
+		close_disk();
+		return 8;
+	}
+
+	for (int b = 0; b < NUM_TOTAL_BLOCKS; b++) {
+		owner[b] = FSCK_UNCLAIMED;
+	}
+	run_pass(claim_blocks);
+	run_pass(check_claims);
+	run_pass(mark_in_use);
+	check_refcounts();
+	check_bitmaps();
+	if (check_checksums() != 0) {
+		close_disk();
+		return 8;
+	}
+
+	int status = 0;
+	if (repair && num_reports > 0 && write_repairs() != 0) {
+		fprintf(stderr, "sfs_fsck: writing repairs to %s failed\n", image);
+		status = 8;
+	}
+	close_disk();
+
+	int counts[FSCK_NUM_PROBLEMS] = { 0 };
+	int unfixed = 0, files = 0, blocks = 0;
+	qsort(reports, num_reports, sizeof(fsck_report), cmp_reports);
+	for (int i = 0; i < num_reports; i++) {
+		counts[reports[i].kind]++;
+		unfixed += !reports[i].fixed;
+		if (!quiet) {
+			printf("%s%s\n", reports[i].msg, reports[i].fixed ? " [fixed]" : "");
+		}
+	}
+	for (int i = 0; i < NUM_INODES; i++) {
+		files += live[i] && i != root_inode;
+	}
+	for (int b = 0; b < NUM_TOTAL_BLOCKS; b++) {
+		blocks += in_use[b];
+	}
+
+	printf("%s: %d files, %d/%d data blocks in use, %d problems", image, files, blocks, NUM_BLOCKS, num_reports);
+	if (num_reports > 0) {
+		printf(" (");
+		for (int k = 0, first = 1; k < FSCK_NUM_PROBLEMS; k++) {
+			if (counts[k] > 0) {
+				printf("%s%d %s", first ? "" : ", ", counts[k], problem_names[k]);
+				first = 0;
+			}
+		}
+		printf(")");
+	}
+	printf(", %d fixed, checked in %.2f ms with %d threads\n",
+			num_reports - unfixed, (now_ns() - t0)/1e6, nthreads);
+
+	free(indirect_buf);
+	free(reports);
+	if (status != 0) {
+		return status;
+	}
+	return num_reports == 0 ? 0 : unfixed == 0 ? 1 : 4;
+}
@@ -0,0 +1,87 @@
+#ifndef _INCLUDE_SFS_LAYOUT_H_
+#define _INCLUDE_SFS_LAYOUT_H_
+
+/*
+ * On-disk layout shared by sfs_api.c and the offline tools.
+ *
+ * block 0            superblock
+ * blocks 1-8         inode table followed by the inode table bitmap
+ * blocks 9-1032      data blocks (the root directory takes the first three)
+ * block 1033         free block bitmap
+ * blocks 1034-1038   checksum region: CRC32C of each of blocks 0-1033, on
+ *                    images formatted with SFS_FEATURE_CHECKSUMS
+ *
+ * In every bitmap a set bit means free, a cleared bit means in use.
+ * Unused block pointers hold (unsigned) -1. Inside a file's size such a
+ * pointer (or a missing indirect block) is a hole that reads as zeros.
+ */
+
+#define LASTNAME_FIRSTNAME_DISK "sfs_disk.disk"
+#define SFS_MAGIC 0xACBD0005
+#define NUM_BLOCKS 1024  //maximum number of data blocks on the disk.
+#define NUM_INODES 100	//max number of inodes
+#define BLOCK_SIZE 1024
+
+#define NUM_BLOCKS_SUPERBLOCK  1
+#define NUM_BLOCKS_INODET      8
+#define NUM_BLOCKS_FREE_BITMAP 1
+#define NUM_BLOCKS_ROOTDIR     3
+#define BLOCK_INDEX_SUPERBLOCK     0
+#define BLOCK_INDEX_INODET        (BLOCK_INDEX_SUPERBLOCK+NUM_BLOCKS_SUPERBLOCK)
+#define BLOCK_INDEX_DATA_BLOCKS   (BLOCK_INDEX_INODET+NUM_BLOCKS_INODET)
+#define BLOCK_INDEX_FREE_BITMAP   (BLOCK_INDEX_DATA_BLOCKS+NUM_BLOCKS)
+#define NUM_TOTAL_BLOCKS (NUM_BLOCKS_SUPERBLOCK+NUM_BLOCKS_INODET+NUM_BLOCKS+NUM_BLOCKS_FREE_BITMAP)
+
+// The checksum region sits past the blocks the superblock's fs_size counts,
+// so older (shorter) images still check out; their missing tail reads as 0's
+#define CHECKSUMS_PER_BLOCK (BLOCK_SIZE/4)
+#define NUM_BLOCKS_CHECKSUM ((NUM_TOTAL_BLOCKS+CHECKSUMS_PER_BLOCK-1)/CHECKSUMS_PER_BLOCK)
+#define BLOCK_INDEX_CHECKSUM NUM_TOTAL_BLOCKS
+#define NUM_IMAGE_BLOCKS (NUM_TOTAL_BLOCKS+NUM_BLOCKS_CHECKSUM)
+
+// superblock feature bits
+#define SFS_FEATURE_CHECKSUMS 0x1
+
+#define FREE_BM_SIZE (130) // ceiling of NUM_TOTAL_BLOCKS/8
+#define INODE_TABLE_BM_SIZE (13) // ceiling of num inodes/8
+#define FD_TABLE_BM_SIZE (13)     // ceiling of num inodes/8
+#define DIR_ENTRIES_BM_SIZE (13) //ceiling of num inodes/8
+
+#define NUM_DIRECT_PTRS 12
+#define NUM_INDIRECT_PTRS (BLOCK_SIZE/sizeof(unsigned int))
+#define MAX_FILE_SIZE ((NUM_DIRECT_PTRS+NUM_INDIRECT_PTRS)*BLOCK_SIZE) // 12 direct + one indirect block
+
+// inode mode: a layout type in the low byte plus flags. Older images leave
+// -1 there, which reads as a regular file without flags.
+#define SFS_MODE_REGULAR 0
+#define SFS_MODE_INLINE  1  // data lives in data_ptrs/indirectPointer, no blocks
+#define SFS_MODE_TAIL    2  // the last block is a fragment inside a shared tail block
+#define SFS_MODE_COMPRESS 0x100 // full clusters are compressed when the file is closed
+#define SFS_MODE_TYPE(m)  ((m) == (unsigned int) -1 ? SFS_MODE_REGULAR : (m) & 0xff)
+#define SFS_MODE_FLAGS(m) ((m) == (unsigned int) -1 ? 0 : (m) & ~0xffu)
+
+// Compression works on aligned clusters of file blocks (NUM_DIRECT_PTRS is a
+// multiple, so a cluster never straddles the indirect block). A compressed
+// cluster keeps its blocks in its first pointer slots and SFS_COMPRESSED in
+// the rest.
+#define CLUSTER_BLOCKS 4
+#define SFS_COMPRESSED ((unsigned int) -2)
+#define INLINE_DATA_SIZE ((NUM_DIRECT_PTRS+1)*sizeof(unsigned int)) // 52 bytes
+
+// Data blocks may be shared by several pointers (dedup). The refcount table
+// is one byte per data block: the number of pointers to a block whose count
+// is tracked, 0 for an ordinary block with a single owner. A tracked block
+// is never written in place while others share it. The dedup index maps a
+// content hash slot to a tracked block with that content. Both live in data
+// blocks named by the superblock, 0 until the image first shares a block.
+#define REFCOUNT_MAX 255
+#define DEDUP_INDEX_SLOTS (BLOCK_SIZE/2) // 16 bit block numbers
+
+// Snapshots (see snapshot_entry in sfs_api.h) hold blocks the free bitmap
+// may already show as free: the bitmap only tracks the live tree, and a
+// block is handed out only when no snapshot holds it either.
+
+// true for block numbers that may be handed out to files
+#define IS_DATA_BLOCK(b) ((b) >= BLOCK_INDEX_DATA_BLOCKS && (b) < BLOCK_INDEX_FREE_BITMAP)
+
+#endif //_INCLUDE_SFS_LAYOUT_H_
@@ -0,0 +1,164 @@
+// LZ4-style block compression for compressed file clusters
+
+#include "sfs_lz.h"
+#include <stdint.h>
+#include <string.h>
+
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5      // the stream always ends in this many literals
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 10
+
+static uint32_t read32(const uint8_t *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static int hash4(uint32_t v) {
+	return (v*2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// lengths that don't fit in a token nibble continue in 255 steps
+static uint8_t *put_length(uint8_t *op, uint8_t *oend, int len) {
+	while (len >= 255) {
+		if (op >= oend) {
+			return NULL;
+		}
+		*op++ = 255;
+		len -= 255;
+	}
+	if (op >= oend) {
+		return NULL;
+	}
+	*op++ = len;
+	return op;
+}
+
+// emits lit literals and, when mlen > 0, a match of mlen bytes at offset
+static uint8_t *put_sequence(uint8_t *op, uint8_t *oend, const uint8_t *lits, int lit, int offset, int mlen) {
+	uint8_t *token = op++;
+	if (op > oend) {
+		return NULL;
+	}
+	*token = (lit < 15 ? lit : 15) << 4;
+	if (lit >= 15 && (op = put_length(op, oend, lit - 15)) == NULL) {
+		return NULL;
+	}
+	if (oend - op < lit) {
+		return NULL;
+	}
+	memcpy(op, lits, lit);
+	op += lit;
+	if (mlen == 0) {
+		return op;
+	}
+
+	if (oend - op < 2) {
+		return NULL;
+	}
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+	mlen -= LZ_MIN_MATCH;
+	*token |= mlen < 15 ? mlen : 15;
+	if (mlen >= 15 && (op = put_length(op, oend, mlen - 15)) == NULL) {
+		return NULL;
+	}
+	return op;
+}
+
+int lz_compress(const void *src, int len, void *dst, int cap) {
+	const uint8_t *in = src, *ip = in, *anchor = in, *iend = in + len;
+	uint8_t *op = dst, *oend = op + cap;
+	int table[1 << LZ_HASH_BITS];
+
+	memset(table, 0xff, sizeof(table));
+	while (iend - ip >= LZ_MIN_MATCH + LZ_LAST_LITERALS) {
+		uint32_t seq = read32(ip);
+		int h = hash4(seq);
+		int cand = table[h];
+		table[h] = ip - in;
+		if (cand < 0 || (ip - in) - cand > LZ_MAX_OFFSET || read32(in + cand) != seq) {
+			ip++;
+			continue;
+		}
+
+		const uint8_t *match = in + cand;
+		int mlen = LZ_MIN_MATCH;
+		while (ip + mlen < iend - LZ_LAST_LITERALS && ip[mlen] == match[mlen]) {
+			mlen++;
+		}
+		op = put_sequence(op, oend, anchor, ip - anchor, ip - match, mlen);
+		if (op == NULL) {
+			return -1;
+		}
+		ip += mlen;
+		anchor = ip;
+	}
+	op = put_sequence(op, oend, anchor, iend - anchor, 0, 0);
+	return op != NULL ? op - (uint8_t*) dst : -1;
+}
+
+// reads the 255-step continuation of a length, -1 if the input ends first
+static int get_length(const uint8_t **ip, const uint8_t *iend) {
+	int len = 0;
+	uint8_t b;
+	do {
+		if (*ip >= iend) {
+			return -1;
+		}
+		b = *(*ip)++;
+		len += b;
+	} while (b == 255);
+	return len;
+}
+
+int lz_decompress(const void *src, int len, void *dst, int cap) {
+	const uint8_t *ip = src, *iend = ip + len;
+	uint8_t *op = dst, *oend = op + cap;
+
+	while (ip < iend) {
+		int token = *ip++;
+		int lit = token >> 4;
+		if (lit == 15) {
+			int more = get_length(&ip, iend);
+			if (more < 0) {
+				return -1;
+			}
+			lit += more;
+		}
+		if (iend - ip < lit || oend - op < lit) {
+			return -1;
+		}
+		memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+		if (ip == iend) {
+			break; // the last sequence has no match
+		}
+
+		if (iend - ip < 2) {
+			return -1;
+		}
+		int offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		int mlen = token & 15;
+		if (mlen == 15) {
+			int more = get_length(&ip, iend);
+			if (more < 0) {
+				return -1;
+			}
+			mlen += more;
+		}
+		mlen += LZ_MIN_MATCH;
+		if (offset == 0 || offset > op - (uint8_t*) dst || oend - op < mlen) {
+			return -1;
+		}
+		// byte by byte, matches may overlap what they produce
+		const uint8_t *m = op - offset;
+		while (mlen-- > 0) {
+			*op++ = *m++;
+		}
+	}
+	return op - (uint8_t*) dst;
+}
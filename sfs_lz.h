@@ -0,0 +1,17 @@
+#ifndef _INCLUDE_SFS_LZ_H_
+#define _INCLUDE_SFS_LZ_H_
+
+/*
+ * Small LZ77 block codec in the LZ4 sequence format: a token byte with the
+ * literal and match lengths, the literals, then a 2 byte little endian
+ * match offset. Greedy matching through a 4 KB hash table, so it is fast
+ * and needs no allocation, at the cost of some ratio.
+ */
+
+/* Returns the compressed length, or -1 if it would not fit in cap bytes */
+int lz_compress(const void *src, int len, void *dst, int cap);
+
+/* Returns the decompressed length, or -1 if src is corrupt or dst too small */
+int lz_decompress(const void *src, int len, void *dst, int cap);
+
+#endif //_INCLUDE_SFS_LZ_H_
@@ -0,0 +1,467 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sfs_api.h"
+#include "sfs_capture.h"
+#include "disk_emu.h"
+#include "sfs_layout.h"
+
+/*
+ * sfs_replay: runs a workload capture (see sfs_capture.h) again and reports
+ * throughput and latency per call.
+ *
+ * Every image the capture mounted is replayed on a scratch image of its
+ * own, sfs_replay_<id>.disk in the current directory, formatted the first
+ * time it is mounted whatever the capture did; later mounts of it follow
+ * the capture. Files and snapshots get names made from their ids. Writes
+ * carry a fixed pseudo-random pattern. Calls run one at a time in the order
+ * they returned in the capture, as fast as possible or, with -p, each one
+ * no earlier than it started in the capture.
+ *
+ * A replayed call whose result differs from the captured one counts as
+ * diverged, e.g. a read of data that was on the image before the capture
+ * started. Compression, dedup, durability and writeback set through the
+ * environment were not captured; set them the same way for the replay.
+ * -m selects a disk_emu device model, -k keeps the scratch images. Results
+ * go to stdout as a table, or as JSON with -j.
+ *
+ * usage: sfs_replay [-j] [-p] [-k] [-m model] capture
+ */
+
+#define REPLAY_MAX_INSTANCES 64
+#define REPLAY_MAX_VIEWS 64
+#define REPLAY_MAX_IMAGES 1024
+#define REPLAY_PATTERN_BYTES (64*1024) // writes start at varying offsets into the pattern
+
+typedef struct replay_instance {
+	int id;                 // captured instance, -1 for a free slot
+	sfs_t *fs;
+	int fds[NUM_INODES];    // captured descriptor to replayed one, -1 when not open
+	int view_ids[REPLAY_MAX_VIEWS];
+	const char *views[REPLAY_MAX_VIEWS];
+} replay_instance;
+
+/* Latencies of one kind of call, replayed and as captured */
+typedef struct op_result {
+	uint64_t *lat_ns;
+	uint64_t *captured_ns;
+	uint64_t n, cap;
+	uint64_t diverged;
+	uint64_t bytes;
+} op_result;
+
+static replay_instance instances[REPLAY_MAX_INSTANCES];
+static op_result results[SFS_CAP_NUM_OPS];
+static char image_seen[REPLAY_MAX_IMAGES];
+static char lazy_seen[UINT16_MAX + 1];
+static char *data = NULL;
+static int data_len = 0;
+static uint64_t calls = 0;
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+	return (x > y) - (x < y);
+}
+
+static double percentile_us(uint64_t *sorted, uint64_t n, double pct) {
+	if (n == 0) {
+		return 0;
+	}
+	uint64_t idx = (uint64_t) (pct/100.0*(n-1) + 0.5);
+	return sorted[idx]/1000.0;
+}
+
+static void record(int op, uint64_t lat_ns, uint32_t captured_ns, int diverged, int bytes) {
+	op_result *r = &results[op];
+	if (r->n == r->cap) {
+		r->cap = r->cap > 0 ? 2*r->cap : 1024;
+		r->lat_ns = realloc(r->lat_ns, r->cap*sizeof(uint64_t));
+		r->captured_ns = realloc(r->captured_ns, r->cap*sizeof(uint64_t));
+	}
+	r->lat_ns[r->n] = lat_ns;
+	r->captured_ns[r->n] = captured_ns;
+	r->n++;
+	r->diverged += diverged;
+	if (bytes > 0) {
+		r->bytes += bytes;
+	}
+}
+
+static char *name_of(int id, char *buf) {
+	if (id < 0) {
+		return NULL;
+	}
+	snprintf(buf, MAX_FILE_NAME, "f%d", id);
+	return buf;
+}
+
+static void image_path(char *buf, int len, int image) {
+	snprintf(buf, len, "sfs_replay_%d.disk", image);
+}
+
+static void lazy_path(char *buf, int len, int instance) {
+	snprintf(buf, len, "sfs_replay_i%d.disk", instance);
+}
+
+// A buffer of at least len bytes: write data, or room for what is read
+static char *buffer_for(int len) {
+	if (data == NULL || len > data_len) {
+		char *grown = realloc(data, len + REPLAY_PATTERN_BYTES);
+		if (grown == NULL) {
+			return NULL;
+		}
+		data = grown;
+		for (int i = data_len; i < len + REPLAY_PATTERN_BYTES; i++) {
+			data[i] = (char) rand();
+		}
+		data_len = len;
+	}
+	return data + (calls*4093) % REPLAY_PATTERN_BYTES;
+}
+
+static replay_instance *find_instance(int id) {
+	replay_instance *free_slot = NULL;
+	for (int i = 0; i < REPLAY_MAX_INSTANCES; i++) {
+		if (instances[i].id == id) {
+			return &instances[i];
+		}
+		if (instances[i].id == -1 && free_slot == NULL) {
+			free_slot = &instances[i];
+		}
+	}
+	if (free_slot != NULL) {
+		free_slot->id = id;
+		free_slot->fs = NULL;
+		memset(free_slot->fds, 0xff, sizeof(free_slot->fds));
+		memset(free_slot->views, 0, sizeof(free_slot->views));
+	}
+	return free_slot;
+}
+
+// The image behind a call on an instance whose mount was not captured
+static sfs_t *lazy_mount(replay_instance *in) {
+	char path[64];
+	if (in->fs == NULL) {
+		lazy_path(path, sizeof(path), in->id);
+		in->fs = sfs_mount(path, 1);
+		lazy_seen[in->id] = 1;
+	}
+	return in->fs;
+}
+
+static int fd_of(replay_instance *in, int fd) {
+	return fd >= 0 && fd < NUM_INODES && in->fds[fd] >= 0 ? in->fds[fd] : fd;
+}
+
+/* Replays one call; returns its result in the captured call's terms */
+static int replay(replay_instance *in, const sfs_capture_rec *r, int *bytes) {
+	char name[MAX_FILE_NAME], name2[MAX_FILE_NAME], path[64];
+	const int *a = r->arg;
+	sfs_t *fs = r->op == SFS_CAP_MOUNT ? NULL : lazy_mount(in);
+	int fd = fd_of(in, r->fd);
+	int res = 0;
+
+	*bytes = 0;
+	switch (r->op) {
+	case SFS_CAP_MOUNT:
+		if (a[0] < 0 || a[0] >= REPLAY_MAX_IMAGES) {
+			return -1;
+		}
+		if (in->fs != NULL) {
+			sfs_unmount(in->fs);
+		}
+		image_path(path, sizeof(path), a[0]);
+		if (a[2] >= 0) {
+			in->fs = sfs_mount_snapshot(path, name_of(a[2], name));
+		} else {
+			in->fs = sfs_mount(path, a[1] || !image_seen[a[0]]);
+			image_seen[a[0]] = 1;
+		}
+		return in->fs != NULL ? 0 : -1;
+	case SFS_CAP_UNMOUNT:
+		res = sfs_unmount(in->fs);
+		in->fs = NULL;
+		in->id = -1;
+		return res;
+	case SFS_CAP_GETNEXTFILENAME:
+		return sfs_getnextfilename_r(fs, name);
+	case SFS_CAP_GETFILESIZE:
+		return sfs_getfilesize_r(fs, name_of(a[0], name));
+	case SFS_CAP_FOPEN:
+		res = sfs_fopen_r(fs, name_of(a[0], name));
+		if (r->res >= 0 && r->res < NUM_INODES) {
+			in->fds[r->res] = res;
+		}
+		return res;
+	case SFS_CAP_FCLOSE:
+		res = sfs_fclose_r(fs, fd);
+		if (r->fd >= 0 && r->fd < NUM_INODES) {
+			in->fds[r->fd] = -1;
+		}
+		return res;
+	case SFS_CAP_FREAD:
+	case SFS_CAP_FWRITE:
+	case SFS_CAP_PREAD:
+	case SFS_CAP_PWRITE: {
+		char *buf = buffer_for(a[0] > 0 ? a[0] : 0);
+		if (buf == NULL) {
+			return -1;
+		}
+		if (r->op == SFS_CAP_FREAD) {
+			res = sfs_fread_r(fs, fd, buf, a[0]);
+		} else if (r->op == SFS_CAP_FWRITE) {
+			res = sfs_fwrite_r(fs, fd, buf, a[0]);
+		} else if (r->op == SFS_CAP_PREAD) {
+			res = sfs_pread_r(fs, fd, buf, a[0], a[1]);
+		} else {
+			res = sfs_pwrite_r(fs, fd, buf, a[0], a[1]);
+		}
+		*bytes = res;
+		return res;
+	}
+	case SFS_CAP_FREADV:
+	case SFS_CAP_FWRITEV: {
+		// the segment sizes weren't captured, the length is split evenly
+		int n = a[1] > 0 && a[1] <= 1024 ? a[1] : 1;
+		struct iovec iov[1024];
+		char *buf = buffer_for(a[0] > 0 ? a[0] : 0);
+		if (buf == NULL) {
+			return -1;
+		}
+		for (int i = 0, off = 0; i < n; i++) {
+			int len = a[0] > 0 ? a[0]/n + (i < a[0]%n) : 0;
+			iov[i].iov_base = buf + off;
+			iov[i].iov_len = len;
+			off += len;
+		}
+		res = r->op == SFS_CAP_FREADV ? sfs_freadv_r(fs, fd, iov, n) : sfs_fwritev_r(fs, fd, iov, n);
+		*bytes = res;
+		return res;
+	}
+	case SFS_CAP_MMAP: {
+		const char *view = sfs_mmap_r(fs, fd, a[0], a[1]);
+		for (int i = 0; view != NULL && i < REPLAY_MAX_VIEWS; i++) {
+			if (in->views[i] == NULL) {
+				in->views[i] = view;
+				in->view_ids[i] = a[2];
+				break;
+			}
+		}
+		*bytes = view != NULL ? a[1] : 0;
+		return view != NULL ? 0 : -1;
+	}
+	case SFS_CAP_MUNMAP:
+		for (int i = 0; i < REPLAY_MAX_VIEWS; i++) {
+			if (in->views[i] != NULL && in->view_ids[i] == a[0]) {
+				res = sfs_munmap_r(fs, in->views[i]);
+				in->views[i] = NULL;
+				return res;
+			}
+		}
+		return sfs_munmap_r(fs, NULL);
+	case SFS_CAP_FSEEK:
+		return sfs_fseek_r(fs, fd, a[0]);
+	case SFS_CAP_LSEEK:
+		return sfs_lseek_r(fs, fd, a[0], a[1]);
+	case SFS_CAP_FCOMPRESS:
+		return sfs_fcompress_r(fs, fd, a[0]);
+	case SFS_CAP_REMOVE:
+		return sfs_remove_r(fs, name_of(a[0], name));
+	case SFS_CAP_CLONE:
+		return sfs_clone_r(fs, name_of(a[0], name), name_of(a[1], name2));
+	case SFS_CAP_COPY_RANGE:
+		res = sfs_copy_range_r(fs, fd, a[0], fd_of(in, a[1]), a[2], a[3]);
+		*bytes = res;
+		return res;
+	case SFS_CAP_DEFRAG:
+		return sfs_defrag_r(fs, NULL);
+	case SFS_CAP_SNAPSHOT:
+		return sfs_snapshot_r(fs, name_of(a[0], name));
+	case SFS_CAP_SNAPSHOT_DELETE:
+		return sfs_snapshot_delete_r(fs, name_of(a[0], name));
+	case SFS_CAP_FSYNC:
+		return sfs_fsync_r(fs, fd);
+	case SFS_CAP_SYNC:
+		return sfs_sync_r(fs);
+	case SFS_CAP_SET_DURABILITY:
+		sfs_set_durability_r(fs, a[0], a[1]);
+		return 0;
+	case SFS_CAP_SET_COMPRESSION:
+		sfs_set_compression_r(fs, a[0]);
+		return 0;
+	case SFS_CAP_SET_DEDUP:
+		sfs_set_dedup_r(fs, a[0]);
+		return 0;
+	case SFS_CAP_SET_WRITEBACK:
+		return sfs_set_writeback_r(fs, a[0], a[1]);
+	case SFS_CAP_READ_EXTENT: {
+		sfs_extent ext;
+		return sfs_read_extent_r(fs, fd, a[0], a[1], &ext);
+	}
+	}
+	return -1;
+}
+
+static int diverged(const sfs_capture_rec *r, int res) {
+	if (r->op == SFS_CAP_FOPEN) {
+		return (res >= 0) != (r->res >= 0);
+	}
+	return res != r->res;
+}
+
+static void print_table(uint64_t elapsed) {
+	uint64_t total_bytes = 0, total_diverged = 0;
+
+	printf("%-16s %10s %9s %10s %10s %10s %12s %12s\n", "call", "count", "diverged", "MB", "p50(us)", "p99(us)", "cap p50(us)", "cap p99(us)");
+	for (int op = 0; op < SFS_CAP_NUM_OPS; op++) {
+		op_result *r = &results[op];
+		if (r->n == 0) {
+			continue;
+		}
+		printf("%-16s %10llu %9llu %10.2f %10.2f %10.2f %12.2f %12.2f\n", sfs_capture_op_name(op),
+				(unsigned long long) r->n, (unsigned long long) r->diverged, r->bytes/1e6,
+				percentile_us(r->lat_ns, r->n, 50), percentile_us(r->lat_ns, r->n, 99),
+				percentile_us(r->captured_ns, r->n, 50), percentile_us(r->captured_ns, r->n, 99));
+		total_bytes += r->bytes;
+		total_diverged += r->diverged;
+	}
+	printf("%llu calls in %.3f s: %.1f calls/s, %.2f MB/s, %llu diverged\n", (unsigned long long) calls, elapsed/1e9,
+			calls/(elapsed/1e9), total_bytes/1e6/(elapsed/1e9), (unsigned long long) total_diverged);
+}
+
+static void print_json(uint64_t elapsed, int paced) {
+	uint64_t total_bytes = 0, total_diverged = 0;
+	int first = 1;
+
+	printf("{\n  \"benchmark\": \"sfs_replay\",\n  \"paced\": %s,\n  \"calls\": [\n", paced ? "true" : "false");
+	for (int op = 0; op < SFS_CAP_NUM_OPS; op++) {
+		op_result *r = &results[op];
+		if (r->n == 0) {
+			continue;
+		}
+		printf("%s    {\"call\": \"%s\", \"count\": %llu, \"diverged\": %llu, \"bytes\": %llu, \"p50_us\": %.3f, \"p99_us\": %.3f, "
+				"\"captured_p50_us\": %.3f, \"captured_p99_us\": %.3f}", first ? "" : ",\n", sfs_capture_op_name(op),
+				(unsigned long long) r->n, (unsigned long long) r->diverged, (unsigned long long) r->bytes,
+				percentile_us(r->lat_ns, r->n, 50), percentile_us(r->lat_ns, r->n, 99),
+				percentile_us(r->captured_ns, r->n, 50), percentile_us(r->captured_ns, r->n, 99));
+		total_bytes += r->bytes;
+		total_diverged += r->diverged;
+		first = 0;
+	}
+	printf("\n  ],\n  \"total_calls\": %llu,\n  \"seconds\": %.6f,\n  \"calls_per_sec\": %.1f,\n  \"mb_per_sec\": %.3f,\n  \"diverged\": %llu\n}\n",
+			(unsigned long long) calls, elapsed/1e9, calls/(elapsed/1e9), total_bytes/1e6/(elapsed/1e9), (unsigned long long) total_diverged);
+}
+
+int main(int argc, char **argv) {
+	int json = 0, paced = 0, keep = 0;
+	const char *model_spec = NULL;
+	disk_model model;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "jpkm:")) != -1) {
+		switch (opt) {
+		case 'j': json = 1; break;
+		case 'p': paced = 1; break;
+		case 'k': keep = 1; break;
+		case 'm': model_spec = optarg; break;
+		default:
+			fprintf(stderr, "usage: %s [-j] [-p] [-k] [-m model] capture\n", argv[0]);
+			return 2;
+		}
+	}
+	if (optind != argc - 1) {
+		fprintf(stderr, "usage: %s [-j] [-p] [-k] [-m model] capture\n", argv[0]);
+		return 2;
+	}
+	if (model_spec != NULL) {
+		if (disk_parse_model(model_spec, &model) != 0) {
+			fprintf(stderr, "sfs_replay: bad device model \"%s\"\n", model_spec);
+			return 2;
+		}
+		disk_set_model(&model);
+	}
+
+	FILE *in = fopen(argv[optind], "rb");
+	sfs_capture_header h;
+	if (in == NULL) {
+		fprintf(stderr, "sfs_replay: cannot open %s\n", argv[optind]);
+		return 1;
+	}
+	if (fread(&h, sizeof(h), 1, in) != 1 || h.magic != SFS_CAPTURE_MAGIC || h.version != SFS_CAPTURE_VERSION
+			|| h.record_size != sizeof(sfs_capture_rec)) {
+		fprintf(stderr, "sfs_replay: %s is not a version %d sfs capture\n", argv[optind], SFS_CAPTURE_VERSION);
+		return 1;
+	}
+	for (int i = 0; i < REPLAY_MAX_INSTANCES; i++) {
+		instances[i].id = -1;
+	}
+	srand(1);
+
+	sfs_capture_rec r;
+	uint64_t t0 = now_ns();
+	while (fread(&r, sizeof(r), 1, in) == 1) {
+		replay_instance *inst = find_instance(r.instance);
+		int bytes;
+		if (r.op >= SFS_CAP_NUM_OPS || inst == NULL) {
+			continue;
+		}
+		if (paced && now_ns() < t0 + r.start_ns) {
+			struct timespec until;
+			uint64_t at = t0 + r.start_ns;
+			until.tv_sec = at/1000000000ull;
+			until.tv_nsec = at%1000000000ull;
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL);
+		}
+		uint64_t t = now_ns();
+		int res = replay(inst, &r, &bytes);
+		record(r.op, now_ns() - t, r.dur_ns, diverged(&r, res), bytes);
+		calls++;
+	}
+	uint64_t elapsed = now_ns() - t0;
+	fclose(in);
+
+	for (int i = 0; i < REPLAY_MAX_INSTANCES; i++) {
+		if (instances[i].id != -1 && instances[i].fs != NULL) {
+			sfs_unmount(instances[i].fs);
+		}
+	}
+	if (!keep) {
+		char path[64];
+		for (int i = 0; i < REPLAY_MAX_IMAGES; i++) {
+			if (image_seen[i]) {
+				image_path(path, sizeof(path), i);
+				unlink(path);
+			}
+		}
+		for (int i = 0; i <= UINT16_MAX; i++) {
+			if (lazy_seen[i]) {
+				lazy_path(path, sizeof(path), i);
+				unlink(path);
+			}
+		}
+	}
+
+	for (int op = 0; op < SFS_CAP_NUM_OPS; op++) {
+		if (results[op].n == 0) {
+			continue;
+		}
+		qsort(results[op].lat_ns, results[op].n, sizeof(uint64_t), cmp_u64);
+		qsort(results[op].captured_ns, results[op].n, sizeof(uint64_t), cmp_u64);
+	}
+	if (json) {
+		print_json(elapsed, paced);
+	} else {
+		print_table(elapsed);
+	}
+	return 0;
+}
@@ -0,0 +1,148 @@
+// counters and Prometheus text output for sfs_get_stats / sfs_format_stats
+
+#include "sfs_stats.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static const char *op_names[SFS_NUM_OPS] = {
+	"mksfs", "getnextfilename", "getfilesize", "fopen", "fclose",
+	"fread", "fwrite", "fseek", "remove", "fsync", "sync", "lseek",
+	"fcompress", "snapshot", "snapshot_delete", "clone", "copy_range", "freadv",
+	"fwritev", "pread", "pwrite", "mmap", "munmap", "defrag", "read_extent",
+};
+
+static const char *region_names[SFS_NUM_REGIONS] = {
+	"superblock", "inode_table", "bitmap", "directory", "data", "indirect", "refcount",
+	"checksum", "snapshot",
+};
+
+const char *sfs_op_name(sfs_op op) {
+	return (op >= 0 && op < SFS_NUM_OPS) ? op_names[op] : "unknown";
+}
+
+const char *sfs_region_name(sfs_region region) {
+	return (region >= 0 && region < SFS_NUM_REGIONS) ? region_names[region] : "unknown";
+}
+
+uint64_t stats_now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+void stats_record_op(sfs_stats *stats, sfs_op op, uint64_t start_ns, int failed, int bytes) {
+	sfs_op_stats *s = &stats->ops[op];
+	uint64_t ns = stats_now_ns() - start_ns;
+	uint64_t us = ns/1000;
+
+	// bucket i holds calls under 2^i us
+	int bucket = 0;
+	while (bucket < SFS_LATENCY_BUCKETS-1 && us >= (1ull << bucket)) {
+		bucket++;
+	}
+
+	s->count++;
+	s->latency_ns_sum += ns;
+	s->latency_hist[bucket]++;
+	if (failed) {
+		s->errors++;
+	}
+	if (bytes > 0) {
+		s->bytes += bytes;
+	}
+}
+
+void stats_record_io(sfs_stats *stats, sfs_region region, int nblocks, int is_write) {
+	if (is_write) {
+		stats->blocks_written[region] += nblocks;
+	} else {
+		stats->blocks_read[region] += nblocks;
+	}
+}
+
+// snprintf that keeps appending at *pos and never runs past len
+#define APPEND(...) do { \
+	int _n = snprintf(buf + (pos < len ? pos : len), pos < len ? len - pos : 0, __VA_ARGS__); \
+	if (_n > 0) pos += _n; \
+} while (0)
+
+/*
+ * Writes stats in the Prometheus text exposition format. Like snprintf,
+ * returns the full length even when buf was too small to hold all of it.
+ */
+int stats_format(const sfs_stats *stats, char *buf, int len) {
+	int pos = 0;
+
+	APPEND("# HELP sfs_calls_total Calls per public sfs_* function.\n");
+	APPEND("# TYPE sfs_calls_total counter\n");
+	for (int i = 0; i < SFS_NUM_OPS; i++) {
+		APPEND("sfs_calls_total{op=\"%s\"} %llu\n", op_names[i], (unsigned long long) stats->ops[i].count);
+	}
+	APPEND("# HELP sfs_call_errors_total Calls that returned an error.\n");
+	APPEND("# TYPE sfs_call_errors_total counter\n");
+	for (int i = 0; i < SFS_NUM_OPS; i++) {
+		APPEND("sfs_call_errors_total{op=\"%s\"} %llu\n", op_names[i], (unsigned long long) stats->ops[i].errors);
+	}
+	APPEND("# HELP sfs_call_bytes_total Bytes moved by read and write calls.\n");
+	APPEND("# TYPE sfs_call_bytes_total counter\n");
+	for (int i = 0; i < SFS_NUM_OPS; i++) {
+		APPEND("sfs_call_bytes_total{op=\"%s\"} %llu\n", op_names[i], (unsigned long long) stats->ops[i].bytes);
+	}
+
+	APPEND("# HELP sfs_call_latency_seconds Latency of public sfs_* calls.\n");
+	APPEND("# TYPE sfs_call_latency_seconds histogram\n");
+	for (int i = 0; i < SFS_NUM_OPS; i++) {
+		const sfs_op_stats *s = &stats->ops[i];
+		uint64_t cumulative = 0;
+		for (int b = 0; b < SFS_LATENCY_BUCKETS-1; b++) {
+			cumulative += s->latency_hist[b];
+			APPEND("sfs_call_latency_seconds_bucket{op=\"%s\",le=\"%g\"} %llu\n",
+					op_names[i], (double) (1ull << b)/1e6, (unsigned long long) cumulative);
+		}
+		APPEND("sfs_call_latency_seconds_bucket{op=\"%s\",le=\"+Inf\"} %llu\n", op_names[i], (unsigned long long) s->count);
+		APPEND("sfs_call_latency_seconds_sum{op=\"%s\"} %.9f\n", op_names[i], s->latency_ns_sum/1e9);
+		APPEND("sfs_call_latency_seconds_count{op=\"%s\"} %llu\n", op_names[i], (unsigned long long) s->count);
+	}
+
+	APPEND("# HELP sfs_block_reads_total Blocks read from the device by on-disk region.\n");
+	APPEND("# TYPE sfs_block_reads_total counter\n");
+	for (int r = 0; r < SFS_NUM_REGIONS; r++) {
+		APPEND("sfs_block_reads_total{region=\"%s\"} %llu\n", region_names[r], (unsigned long long) stats->blocks_read[r]);
+	}
+	APPEND("# HELP sfs_block_writes_total Blocks written to the device by on-disk region.\n");
+	APPEND("# TYPE sfs_block_writes_total counter\n");
+	for (int r = 0; r < SFS_NUM_REGIONS; r++) {
+		APPEND("sfs_block_writes_total{region=\"%s\"} %llu\n", region_names[r], (unsigned long long) stats->blocks_written[r]);
+	}
+	APPEND("# HELP sfs_free_blocks Data blocks new data can go to.\n");
+	APPEND("# TYPE sfs_free_blocks gauge\n");
+	APPEND("sfs_free_blocks %llu\n", (unsigned long long) stats->free_blocks);
+
+	APPEND("# HELP sfs_cache_hits_total Block cache lookups served from memory.\n");
+	APPEND("# TYPE sfs_cache_hits_total counter\n");
+	APPEND("sfs_cache_hits_total %llu\n", (unsigned long long) stats->cache_hits);
+	APPEND("# HELP sfs_cache_misses_total Block cache lookups that went to the device.\n");
+	APPEND("# TYPE sfs_cache_misses_total counter\n");
+	APPEND("sfs_cache_misses_total %llu\n", (unsigned long long) stats->cache_misses);
+	APPEND("# HELP sfs_syncs_total fsync/fdatasync calls issued to the disk image.\n");
+	APPEND("# TYPE sfs_syncs_total counter\n");
+	APPEND("sfs_syncs_total %llu\n", (unsigned long long) stats->syncs);
+	APPEND("# HELP sfs_dirty_blocks Cached blocks waiting for writeback.\n");
+	APPEND("# TYPE sfs_dirty_blocks gauge\n");
+	APPEND("sfs_dirty_blocks %llu\n", (unsigned long long) stats->dirty_blocks);
+	APPEND("# HELP sfs_writeback_blocks_total Blocks writeback wrote to the device.\n");
+	APPEND("# TYPE sfs_writeback_blocks_total counter\n");
+	APPEND("sfs_writeback_blocks_total %llu\n", (unsigned long long) stats->writeback_blocks);
+	APPEND("# HELP sfs_dedup_blocks_total Full block writes that shared an existing block instead of writing one.\n");
+	APPEND("# TYPE sfs_dedup_blocks_total counter\n");
+	APPEND("sfs_dedup_blocks_total %llu\n", (unsigned long long) stats->dedup_hits);
+	APPEND("# HELP sfs_checksum_errors_total Blocks read from the device that failed their checksum.\n");
+	APPEND("# TYPE sfs_checksum_errors_total counter\n");
+	APPEND("sfs_checksum_errors_total %llu\n", (unsigned long long) stats->checksum_errors);
+	APPEND("# HELP sfs_write_amplification Device bytes written per byte passed to sfs_fwrite, sfs_fwritev and sfs_pwrite.\n");
+	APPEND("# TYPE sfs_write_amplification gauge\n");
+	APPEND("sfs_write_amplification %.3f\n", stats->write_amplification);
+
+	return pos;
+}
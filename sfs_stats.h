@@ -0,0 +1,90 @@
+#ifndef _INCLUDE_SFS_STATS_H_
+#define _INCLUDE_SFS_STATS_H_
+
+#include <stdint.h>
+
+/* public calls that are counted, one sfs_op_stats each */
+typedef enum sfs_op {
+	SFS_OP_MKSFS,
+	SFS_OP_GETNEXTFILENAME,
+	SFS_OP_GETFILESIZE,
+	SFS_OP_FOPEN,
+	SFS_OP_FCLOSE,
+	SFS_OP_FREAD,
+	SFS_OP_FWRITE,
+	SFS_OP_FSEEK,
+	SFS_OP_REMOVE,
+	SFS_OP_FSYNC,
+	SFS_OP_SYNC,
+	SFS_OP_LSEEK,
+	SFS_OP_FCOMPRESS,
+	SFS_OP_SNAPSHOT,
+	SFS_OP_SNAPSHOT_DELETE,
+	SFS_OP_CLONE,
+	SFS_OP_COPY_RANGE,
+	SFS_OP_READV,
+	SFS_OP_WRITEV,
+	SFS_OP_PREAD,
+	SFS_OP_PWRITE,
+	SFS_OP_MMAP,
+	SFS_OP_MUNMAP,
+	SFS_OP_DEFRAG,
+	SFS_OP_READ_EXTENT,
+	SFS_NUM_OPS
+} sfs_op;
+
+/* where on disk a block I/O landed */
+typedef enum sfs_region {
+	SFS_REGION_SUPERBLOCK,
+	SFS_REGION_INODE_TABLE,
+	SFS_REGION_BITMAP,
+	SFS_REGION_DIRECTORY,
+	SFS_REGION_DATA,
+	SFS_REGION_INDIRECT,
+	SFS_REGION_REFCOUNT,  // refcount table and dedup index
+	SFS_REGION_CHECKSUM,
+	SFS_REGION_SNAPSHOT,  // snapshot table and the frozen metadata copies
+	SFS_NUM_REGIONS
+} sfs_region;
+
+/* latency histogram bucket i counts calls that took < 2^i microseconds,
+ * the last bucket catches everything slower */
+#define SFS_LATENCY_BUCKETS 22
+
+typedef struct sfs_op_stats {
+	uint64_t count;
+	uint64_t errors;
+	uint64_t bytes;
+	uint64_t latency_ns_sum;
+	uint64_t latency_hist[SFS_LATENCY_BUCKETS];
+} sfs_op_stats;
+
+typedef struct sfs_stats {
+	sfs_op_stats ops[SFS_NUM_OPS];
+	uint64_t blocks_read[SFS_NUM_REGIONS];
+	uint64_t blocks_written[SFS_NUM_REGIONS];
+	uint64_t free_blocks;       // data blocks new data can go to, counted from the free bitmap
+	uint64_t cache_hits;
+	uint64_t cache_misses;
+	uint64_t syncs;             // fsync/fdatasync calls that reached the device
+	uint64_t dirty_blocks;      // cached blocks waiting for writeback, see sfs_set_writeback
+	uint64_t writeback_blocks;  // blocks writeback wrote to the device
+	uint64_t dedup_hits;        // full block writes that shared an existing block
+	uint64_t checksum_errors;   // blocks read from the device that failed their checksum
+	double write_amplification; // device bytes written per byte passed to sfs_fwrite, sfs_fwritev and sfs_pwrite
+} sfs_stats;
+
+int sfs_get_stats(sfs_stats *stats);
+void sfs_reset_stats();
+int sfs_format_stats(char *buf, int len);
+
+const char *sfs_op_name(sfs_op op);
+const char *sfs_region_name(sfs_region region);
+
+/* helpers for the counting side, used by sfs_api.c */
+uint64_t stats_now_ns();
+void stats_record_op(sfs_stats *stats, sfs_op op, uint64_t start_ns, int failed, int bytes);
+void stats_record_io(sfs_stats *stats, sfs_region region, int nblocks, int is_write);
+int stats_format(const sfs_stats *stats, char *buf, int len);
+
+#endif //_INCLUDE_SFS_STATS_H_
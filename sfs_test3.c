@@ -0,0 +1,1309 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sfs_api.h"
+#include "sfs_layout.h"
+#include "sfs_capture.h"
+
+/* Checks the features that go beyond the original API, one function
+ * each. Every function starts from a freshly formatted TEST_DISK, which
+ * is removed at the end. Build with `make test3`.
+ */
+#define TEST_DISK "sfs_test3.disk"
+#define TEST_CAPTURE "sfs_test3.cap"
+
+static int error_count = 0;
+
+/* Just a random test string.
+ */
+static char test_str[] = "The quick brown fox jumps over the lazy dog.\n";
+
+/* check_contents() - reads the whole of name back and compares it with
+ * want.
+ */
+static void check_contents(sfs_t *fs, char *name, const char *want, int len)
+{
+  char *buffer;
+  int fd, readsize;
+
+  if ((buffer = malloc(len + 1)) == NULL) {
+    fprintf(stderr, "ABORT: Out of memory!\n");
+    exit(-1);
+  }
+  fd = sfs_fopen_r(fs, name);
+  sfs_fseek_r(fs, fd, 0);
+  readsize = sfs_fread_r(fs, fd, buffer, len + 1);
+  if (readsize != len) {
+    fprintf(stderr, "ERROR: %s has %d bytes, expected %d\n", name, readsize, len);
+    error_count++;
+  }
+  else if (memcmp(buffer, want, len) != 0) {
+    fprintf(stderr, "ERROR: %s does not read back what was written\n", name);
+    error_count++;
+  }
+  sfs_fclose_r(fs, fd);
+  free(buffer);
+}
+
+/* fill() - pseudo-random bytes that depend on seed, so misplaced data
+ * shows up as a mismatch and no two blocks look alike to dedup.
+ */
+static void fill(char *buf, int len, int seed)
+{
+  unsigned int x = seed * 2654435761u + 1;
+  int i;
+
+  for (i = 0; i < len; i++) {
+    x = x * 1103515245u + 12345;
+    buf[i] = (char) (x >> 16);
+  }
+}
+
+/* free_blocks() - how many data blocks are free for new data. */
+static int free_blocks(sfs_t *fs)
+{
+  sfs_stats stats;
+
+  sfs_get_stats_r(fs, &stats);
+  return (int) stats.free_blocks;
+}
+
+/* blocks_written() - data blocks written to the device so far. */
+static unsigned long long blocks_written(sfs_t *fs)
+{
+  sfs_stats stats;
+
+  sfs_get_stats_r(fs, &stats);
+  return stats.blocks_written[SFS_REGION_DATA];
+}
+
+/* Writing past the end leaves a hole: it reads as zeros, takes no
+ * blocks and SEEK_DATA/SEEK_HOLE step over it.
+ */
+static void test_sparse_files()
+{
+  static char buffer[200010];
+  sfs_t *fs;
+  int fd, before, used, i;
+
+  printf("Sparse files\n");
+  fs = sfs_mount(TEST_DISK, 1);
+  fd = sfs_fopen_r(fs, "sparse.img");
+  before = free_blocks(fs);
+
+  if (sfs_fseek_r(fs, fd, 200000) != 0) {
+    fprintf(stderr, "ERROR: seek past the end of the file failed\n");
+    error_count++;
+  }
+  if (sfs_fwrite_r(fs, fd, "hello", 5) != 5) {
+    fprintf(stderr, "ERROR: write after a hole failed\n");
+    error_count++;
+  }
+  if (sfs_getfilesize_r(fs, "sparse.img") != 200005) {
+    fprintf(stderr, "ERROR: sparse file has size %d, expected 200005\n",
+            sfs_getfilesize_r(fs, "sparse.img"));
+    error_count++;
+  }
+  /* One data block and the indirect block that points to it. */
+  used = before - free_blocks(fs);
+  if (used > 2) {
+    fprintf(stderr, "ERROR: a 5 byte write after a hole took %d blocks\n", used);
+    error_count++;
+  }
+
+  sfs_fseek_r(fs, fd, 0);
+  memset(buffer, 1, sizeof(buffer));
+  if (sfs_fread_r(fs, fd, buffer, sizeof(buffer)) != 200005) {
+    fprintf(stderr, "ERROR: short read of a sparse file\n");
+    error_count++;
+  }
+  for (i = 0; i < 200000; i++) {
+    if (buffer[i] != 0) {
+      fprintf(stderr, "ERROR: hole reads %d at offset %d\n", buffer[i], i);
+      error_count++;
+      break;
+    }
+  }
+  if (memcmp(buffer + 200000, "hello", 5) != 0) {
+    fprintf(stderr, "ERROR: data after the hole is wrong\n");
+    error_count++;
+  }
+
+  if (sfs_lseek_r(fs, fd, 0, SFS_SEEK_HOLE) != 0) {
+    fprintf(stderr, "ERROR: SEEK_HOLE did not find the hole at 0\n");
+    error_count++;
+  }
+  if (sfs_lseek_r(fs, fd, 0, SFS_SEEK_DATA) != 200000 / BLOCK_SIZE * BLOCK_SIZE) {
+    fprintf(stderr, "ERROR: SEEK_DATA did not find the block holding the data\n");
+    error_count++;
+  }
+  if (sfs_lseek_r(fs, fd, 200000, SFS_SEEK_HOLE) != 200005) {
+    fprintf(stderr, "ERROR: SEEK_HOLE did not stop at the end of the file\n");
+    error_count++;
+  }
+  if (sfs_lseek_r(fs, fd, 200005, SFS_SEEK_DATA) != -1) {
+    fprintf(stderr, "ERROR: SEEK_DATA found data past the end of the file\n");
+    error_count++;
+  }
+  sfs_fclose_r(fs, fd);
+  sfs_unmount(fs);
+
+  /* The hole survives a remount. */
+  fs = sfs_mount(TEST_DISK, 0);
+  fd = sfs_fopen_r(fs, "sparse.img");
+  sfs_fseek_r(fs, fd, 199998);
+  if (sfs_fread_r(fs, fd, buffer, 10) != 7 || memcmp(buffer, "\0\0hello", 7) != 0) {
+    fprintf(stderr, "ERROR: sparse file changed across a remount\n");
+    error_count++;
+  }
+  sfs_fclose_r(fs, fd);
+  sfs_unmount(fs);
+}
+
+/* Files of up to 52 bytes live in the inode and take no data block;
+ * growing one moves it out to blocks.
+ */
+static void test_inline_files()
+{
+  static char want[3051];
+  sfs_t *fs;
+  int fd, before, i;
+
+  printf("Inline files\n");
+  fs = sfs_mount(TEST_DISK, 1);
+  before = free_blocks(fs);
+  fd = sfs_fopen_r(fs, "tiny.cfg");
+  memcpy(want, test_str, 45);
+  if (sfs_fwrite_r(fs, fd, want, 45) != 45) {
+    fprintf(stderr, "ERROR: write of a tiny file failed\n");
+    error_count++;
+  }
+  sfs_fclose_r(fs, fd);
+  if (free_blocks(fs) != before) {
+    fprintf(stderr, "ERROR: a 45 byte file took %d blocks\n", before - free_blocks(fs));
+    error_count++;
+  }
+  check_contents(fs, "tiny.cfg", want, 45);
+
+  /* A hole inside the inline data reads as zeros. */
+  fd = sfs_fopen_r(fs, "tiny.cfg");
+  sfs_fseek_r(fs, fd, 50);
+  sfs_fwrite_r(fs, fd, "Z", 1);
+  sfs_fclose_r(fs, fd);
+  memset(want + 45, 0, 5);
+  want[50] = 'Z';
+  check_contents(fs, "tiny.cfg", want, 51);
+
+  /* Growing past the inode moves the data out to blocks. */
+  for (i = 51; i < 3051; i++) {
+    want[i] = 'a' + i % 26;
+  }
+  fd = sfs_fopen_r(fs, "tiny.cfg");
+  sfs_fseek_r(fs, fd, 51);
+  if (sfs_fwrite_r(fs, fd, want + 51, 3000) != 3000) {
+    fprintf(stderr, "ERROR: growing an inline file failed\n");
+    error_count++;
+  }
+  sfs_fclose_r(fs, fd);
+  check_contents(fs, "tiny.cfg", want, 3051);
+
+  fd = sfs_fopen_r(fs, "other.cfg");
+  sfs_fwrite_r(fs, fd, "tiny", 4);
+  sfs_fclose_r(fs, fd);
+  sfs_unmount(fs);
+
+  fs = sfs_mount(TEST_DISK, 0);
+  check_contents(fs, "other.cfg", "tiny", 4);
+  check_contents(fs, "tiny.cfg", want, 3051);
+  sfs_unmount(fs);
+}
+
+/* The partial last blocks of closed files share tail blocks, and a
+ * packed file can still be appended to or removed.
+ */
+static void test_tail_packing()
+{
+  static char want[20000];
+  char name[16];
+  int sizes[40];
+  sfs_t *fs;
+  int fd, before, used, f;
+
+  printf("Tail packing\n");
+  fs = sfs_mount(TEST_DISK, 1);
+  before = free_blocks(fs);
+  for (f = 0; f < 8; f++) {
+    sprintf(name, "small%d", f);
+    fd = sfs_fopen_r(fs, name);
+    fill(want, 100, f);
+    sfs_fwrite_r(fs, fd, want, 100);
+    sfs_fclose_r(fs, fd);
+  }
+  /* Eight 100 byte fragments fit in one tail block. */
+  used = before - free_blocks(fs);
+  if (used > 1) {
+    fprintf(stderr, "ERROR: eight 100 byte files took %d blocks\n", used);
+    error_count++;
+  }
+  for (f = 0; f < 8; f++) {
+    sprintf(name, "small%d", f);
+    fill(want, 100, f);
+    check_contents(fs, name, want, 100);
+    sfs_remove_r(fs, name);
+  }
+  if (free_blocks(fs) != before) {
+    fprintf(stderr, "ERROR: removing packed files leaked %d blocks\n", before - free_blocks(fs));
+    error_count++;
+  }
+
+  for (f = 0; f < 40; f++) {
+    sizes[f] = 100 + (f * 337) % 15000;
+    sprintf(name, "f%d", f);
+    fd = sfs_fopen_r(fs, name);
+    fill(want, sizes[f], f);
+    sfs_fwrite_r(fs, fd, want, sizes[f]);
+    sfs_fclose_r(fs, fd);
+  }
+  /* Append to some packed files and remove others. */
+  for (f = 0; f < 40; f += 3) {
+    sprintf(name, "f%d", f);
+    fd = sfs_fopen_r(fs, name);
+    fill(want, sizes[f] + 300, f);
+    sfs_fseek_r(fs, fd, sizes[f]);
+    if (sfs_fwrite_r(fs, fd, want + sizes[f], 300) != 300) {
+      fprintf(stderr, "ERROR: append to packed file %s failed\n", name);
+      error_count++;
+    }
+    sfs_fclose_r(fs, fd);
+    sizes[f] += 300;
+  }
+  for (f = 1; f < 40; f += 4) {
+    sprintf(name, "f%d", f);
+    if (sfs_remove_r(fs, name) != 0) {
+      fprintf(stderr, "ERROR: removing packed file %s failed\n", name);
+      error_count++;
+    }
+    sizes[f] = -1;
+  }
+  sfs_unmount(fs);
+
+  fs = sfs_mount(TEST_DISK, 0);
+  for (f = 0; f < 40; f++) {
+    if (sizes[f] >= 0) {
+      sprintf(name, "f%d", f);
+      fill(want, sizes[f], f);
+      check_contents(fs, name, want, sizes[f]);
+    }
+  }
+  sfs_unmount(fs);
+}
+
+/* Full clusters of a file flagged with sfs_fcompress are compressed when
+ * it is closed, and read and overwrite as before.
+ */
+static void test_compression()
+{
+  static char want[100000];
+  char patch[5000];
+  sfs_t *fs;
+  int fd, before, used, i;
+
+  printf("Compression\n");
+  for (i = 0; i < sizeof(want); i++) {
+    want[i] = test_str[i % strlen(test_str)];
+  }
+  fs = sfs_mount(TEST_DISK, 1);
+  before = free_blocks(fs);
+  fd = sfs_fopen_r(fs, "app.log");
+  if (sfs_fcompress_r(fs, fd, 1) != 0) {
+    fprintf(stderr, "ERROR: sfs_fcompress failed\n");
+    error_count++;
+  }
+  sfs_fwrite_r(fs, fd, want, sizeof(want));
+  sfs_fclose_r(fs, fd);
+  used = before - free_blocks(fs);
+  if (used >= (int) sizeof(want) / BLOCK_SIZE / 2) {
+    fprintf(stderr, "ERROR: %d bytes of text compressed to %d blocks\n", (int) sizeof(want), used);
+    error_count++;
+  }
+  check_contents(fs, "app.log", want, sizeof(want));
+
+  /* Overwrite inside a compressed cluster and across clusters. */
+  memset(patch, 'Z', sizeof(patch));
+  fd = sfs_fopen_r(fs, "app.log");
+  sfs_fseek_r(fs, fd, 10000);
+  sfs_fwrite_r(fs, fd, patch, sizeof(patch));
+  sfs_fseek_r(fs, fd, 50000);
+  sfs_fwrite_r(fs, fd, patch, 100);
+  memcpy(want + 10000, patch, sizeof(patch));
+  memcpy(want + 50000, patch, 100);
+  check_contents(fs, "app.log", want, sizeof(want));
+  sfs_fclose_r(fs, fd);
+
+  /* Without the flag the same data takes a block per block. */
+  before = free_blocks(fs);
+  fd = sfs_fopen_r(fs, "plain.log");
+  sfs_fwrite_r(fs, fd, want, 50 * BLOCK_SIZE);
+  sfs_fclose_r(fs, fd);
+  used = before - free_blocks(fs);
+  if (used < 50) {
+    fprintf(stderr, "ERROR: an unflagged file took only %d blocks for 50\n", used);
+    error_count++;
+  }
+  sfs_unmount(fs);
+
+  fs = sfs_mount(TEST_DISK, 0);
+  check_contents(fs, "app.log", want, sizeof(want));
+  check_contents(fs, "plain.log", want, 50 * BLOCK_SIZE);
+  sfs_unmount(fs);
+}
+
+/* With dedup on, full blocks already on disk are shared rather than
+ * written again. A shared block is copied when one file changes it and
+ * freed only when the last file using it lets go.
+ */
+static void test_dedup()
+{
+  static char want[8 * 1024], changed[8 * 1024];
+  char name[16];
+  sfs_stats stats;
+  sfs_t *fs;
+  int fd, first, f;
+
+  printf("Deduplication\n");
+  fill(want, sizeof(want), 1);
+  fs = sfs_mount(TEST_DISK, 1);
+  sfs_set_dedup_r(fs, 1);
+  fd = sfs_fopen_r(fs, "copy0");
+  sfs_fwrite_r(fs, fd, want, sizeof(want));
+  sfs_fclose_r(fs, fd);
+  first = free_blocks(fs);
+  sfs_reset_stats_r(fs);
+  for (f = 1; f < 20; f++) {
+    sprintf(name, "copy%d", f);
+    fd = sfs_fopen_r(fs, name);
+    sfs_fwrite_r(fs, fd, want, sizeof(want));
+    sfs_fclose_r(fs, fd);
+  }
+  sfs_get_stats_r(fs, &stats);
+  if (stats.dedup_hits != 19 * sizeof(want) / BLOCK_SIZE) {
+    fprintf(stderr, "ERROR: %llu dedup hits for 19 copies of %d blocks\n",
+            (unsigned long long) stats.dedup_hits, (int) sizeof(want) / BLOCK_SIZE);
+    error_count++;
+  }
+  if (free_blocks(fs) != first) {
+    fprintf(stderr, "ERROR: 19 identical copies took %d blocks\n", first - free_blocks(fs));
+    error_count++;
+  }
+
+  /* Changing a shared block gives the writer a copy of its own. */
+  memcpy(changed, want, sizeof(changed));
+  memcpy(changed + 100, "XYZ", 3);
+  fd = sfs_fopen_r(fs, "copy3");
+  sfs_fseek_r(fs, fd, 100);
+  sfs_fwrite_r(fs, fd, "XYZ", 3);
+  sfs_fclose_r(fs, fd);
+  check_contents(fs, "copy3", changed, sizeof(changed));
+  check_contents(fs, "copy4", want, sizeof(want));
+
+  /* The blocks stay until the last copy goes. */
+  for (f = 0; f < 19; f++) {
+    sprintf(name, "copy%d", f);
+    sfs_remove_r(fs, name);
+  }
+  sfs_unmount(fs);
+  fs = sfs_mount(TEST_DISK, 0);
+  check_contents(fs, "copy19", want, sizeof(want));
+  sfs_remove_r(fs, "copy19");
+  if (free_blocks(fs) != first + sizeof(want) / BLOCK_SIZE) {
+    fprintf(stderr, "ERROR: removing every copy leaked %d blocks\n",
+            first + (int) sizeof(want) / BLOCK_SIZE - free_blocks(fs));
+    error_count++;
+  }
+  sfs_unmount(fs);
+}
+
+/* Every block carries a CRC32C; a block changed behind the filesystem's
+ * back is caught when it is read and never handed out as file data.
+ */
+static void test_checksums()
+{
+  static char want[20 * 1024], buffer[20 * 1024];
+  sfs_stats stats;
+  sfs_t *fs;
+  FILE *image;
+  char *disk;
+  long len, at;
+  int fd, readsize;
+
+  printf("Checksums\n");
+  fill(want, sizeof(want), 7);
+  fs = sfs_mount(TEST_DISK, 1);
+  fd = sfs_fopen_r(fs, "data.bin");
+  sfs_fwrite_r(fs, fd, want, sizeof(want));
+  sfs_fclose_r(fs, fd);
+  sfs_unmount(fs);
+
+  /* Flip one byte of the file's fifth block in the image. */
+  if ((image = fopen(TEST_DISK, "r+b")) == NULL) {
+    fprintf(stderr, "ABORT: cannot open %s\n", TEST_DISK);
+    exit(-1);
+  }
+  fseek(image, 0, SEEK_END);
+  len = ftell(image);
+  if ((disk = malloc(len)) == NULL) {
+    fprintf(stderr, "ABORT: Out of memory!\n");
+    exit(-1);
+  }
+  fseek(image, 0, SEEK_SET);
+  if (fread(disk, 1, len, image) != len) {
+    fprintf(stderr, "ERROR: cannot read %s\n", TEST_DISK);
+    error_count++;
+  }
+  for (at = 0; at + BLOCK_SIZE <= len; at += BLOCK_SIZE) {
+    if (memcmp(disk + at, want + 4 * BLOCK_SIZE, BLOCK_SIZE) == 0) {
+      break;
+    }
+  }
+  if (at + BLOCK_SIZE > len) {
+    fprintf(stderr, "ERROR: file data not found in the image\n");
+    error_count++;
+  }
+  else {
+    fseek(image, at + 100, SEEK_SET);
+    fputc(disk[at + 100] ^ 0x40, image);
+  }
+  fclose(image);
+  free(disk);
+
+  fs = sfs_mount(TEST_DISK, 0);
+  fd = sfs_fopen_r(fs, "data.bin");
+  sfs_fseek_r(fs, fd, 0);
+  readsize = sfs_fread_r(fs, fd, buffer, sizeof(buffer));
+  sfs_get_stats_r(fs, &stats);
+  /* The read stops short of the bad block. */
+  if (readsize < 0 || readsize > 4 * BLOCK_SIZE || memcmp(buffer, want, readsize) != 0) {
+    fprintf(stderr, "ERROR: read of a corrupted file returned %d bytes\n", readsize);
+    error_count++;
+  }
+  if (stats.checksum_errors == 0) {
+    fprintf(stderr, "ERROR: a corrupted block passed its checksum\n");
+    error_count++;
+  }
+  sfs_fclose_r(fs, fd);
+  sfs_unmount(fs);
+}
+
+/* A snapshot keeps showing the files as they were when it was taken
+ * while the live tree changes, holds the blocks it needs until it is
+ * deleted and cannot be changed through.
+ */
+static void test_snapshots()
+{
+  static char want[40000], changed[40000];
+  sfs_t *fs, *snap;
+  int fd, before, held;
+
+  printf("Snapshots\n");
+  fill(want, sizeof(want), 11);
+  memcpy(changed, want, sizeof(changed));
+  fill(changed + 10000, 5000, 12);
+  fs = sfs_mount(TEST_DISK, 1);
+  fd = sfs_fopen_r(fs, "big.bin");
+  sfs_fwrite_r(fs, fd, want, sizeof(want));
+  sfs_fclose_r(fs, fd);
+  fd = sfs_fopen_r(fs, "gone.bin");
+  sfs_fwrite_r(fs, fd, want, 20000);
+  sfs_fclose_r(fs, fd);
+
+  if (sfs_snapshot_r(fs, "s1") != 0) {
+    fprintf(stderr, "ERROR: sfs_snapshot failed\n");
+    error_count++;
+  }
+  if (sfs_snapshot_r(fs, "s1") == 0) {
+    fprintf(stderr, "ERROR: two snapshots with the same name\n");
+    error_count++;
+  }
+  before = free_blocks(fs);
+
+  /* Change the live tree. */
+  fd = sfs_fopen_r(fs, "big.bin");
+  sfs_fseek_r(fs, fd, 10000);
+  sfs_fwrite_r(fs, fd, changed + 10000, 5000);
+  sfs_fclose_r(fs, fd);
+  sfs_remove_r(fs, "gone.bin");
+  check_contents(fs, "big.bin", changed, sizeof(changed));
+  if (sfs_getfilesize_r(fs, "gone.bin") >= 0) {
+    fprintf(stderr, "ERROR: removed file still in the live tree\n");
+    error_count++;
+  }
+  /* Removing a file the snapshot holds frees nothing. */
+  held = before - free_blocks(fs);
+  if (held < 5) {
+    fprintf(stderr, "ERROR: overwriting held blocks took only %d new blocks\n", held);
+    error_count++;
+  }
+
+  snap = sfs_mount_snapshot(TEST_DISK, "s1");
+  if (snap == NULL) {
+    fprintf(stderr, "ERROR: cannot mount snapshot s1\n");
+    error_count++;
+  }
+  else {
+    check_contents(snap, "big.bin", want, sizeof(want));
+    check_contents(snap, "gone.bin", want, 20000);
+    fd = sfs_fopen_r(snap, "big.bin");
+    if (sfs_fwrite_r(snap, fd, "x", 1) != 0) {
+      fprintf(stderr, "ERROR: wrote to a file in a snapshot\n");
+      error_count++;
+    }
+    if (sfs_remove_r(snap, "gone.bin") == 0) {
+      fprintf(stderr, "ERROR: removed a file from a snapshot\n");
+      error_count++;
+    }
+    sfs_unmount(snap);
+  }
+  if (sfs_mount_snapshot(TEST_DISK, "nope") != NULL) {
+    fprintf(stderr, "ERROR: mounted a snapshot that does not exist\n");
+    error_count++;
+  }
+
+  /* Deleting the snapshot gives back what only it held. */
+  before = free_blocks(fs);
+  if (sfs_snapshot_delete_r(fs, "s1") != 0) {
+    fprintf(stderr, "ERROR: sfs_snapshot_delete failed\n");
+    error_count++;
+  }
+  if (free_blocks(fs) < before + 20 + 5) {
+    fprintf(stderr, "ERROR: deleting the snapshot freed only %d blocks\n", free_blocks(fs) - before);
+    error_count++;
+  }
+  if (sfs_mount_snapshot(TEST_DISK, "s1") != NULL) {
+    fprintf(stderr, "ERROR: mounted a deleted snapshot\n");
+    error_count++;
+  }
+  check_contents(fs, "big.bin", changed, sizeof(changed));
+  sfs_unmount(fs);
+}
+
+/* sfs_clone shares the source's blocks; whichever file writes to a shared
+ * block first gets a copy of its own, so neither sees the other's changes.
+ */
+static void test_clone()
+{
+  static char want[30 * 1024], src_changed[30 * 1024], dst_changed[30 * 1024];
+  sfs_t *fs;
+  int fd, before, used;
+
+  printf("Clones\n");
+  fill(want, sizeof(want), 21);
+  fs = sfs_mount(TEST_DISK, 1);
+  fd = sfs_fopen_r(fs, "src.bin");
+  sfs_fwrite_r(fs, fd, want, sizeof(want));
+  sfs_fclose_r(fs, fd);
+
+  before = free_blocks(fs);
+  if (sfs_clone_r(fs, "src.bin", "dst.bin") != 0) {
+    fprintf(stderr, "ERROR: sfs_clone failed\n");
+    error_count++;
+  }
+  /* At most an indirect block of its own, besides the refcount table
+   * and dedup index the first shared block sets up.
+   */
+  used = before - free_blocks(fs);
+  if (used > 3) {
+    fprintf(stderr, "ERROR: cloning a 30 block file took %d blocks\n", used);
+    error_count++;
+  }
+  check_contents(fs, "dst.bin", want, sizeof(want));
+
+  memcpy(dst_changed, want, sizeof(want));
+  fill(dst_changed + 2000, 3000, 22);
+  fd = sfs_fopen_r(fs, "dst.bin");
+  sfs_fseek_r(fs, fd, 2000);
+  sfs_fwrite_r(fs, fd, dst_changed + 2000, 3000);
+  sfs_fclose_r(fs, fd);
+  memcpy(src_changed, want, sizeof(want));
+  fill(src_changed + 20000, 100, 23);
+  fd = sfs_fopen_r(fs, "src.bin");
+  sfs_fseek_r(fs, fd, 20000);
+  sfs_fwrite_r(fs, fd, src_changed + 20000, 100);
+  sfs_fclose_r(fs, fd);
+  check_contents(fs, "src.bin", src_changed, sizeof(want));
+  check_contents(fs, "dst.bin", dst_changed, sizeof(want));
+
+  /* The clone outlives its source. */
+  sfs_remove_r(fs, "src.bin");
+  sfs_unmount(fs);
+  fs = sfs_mount(TEST_DISK, 0);
+  check_contents(fs, "dst.bin", dst_changed, sizeof(want));
+  if (sfs_clone_r(fs, "missing", "other") == 0) {
+    fprintf(stderr, "ERROR: cloned a file that does not exist\n");
+    error_count++;
+  }
+  sfs_unmount(fs);
+}
+
+/* sfs_copy_range copies between open files inside the image without
+ * moving either rwptr. Block aligned ranges share the source's blocks.
+ */
+static void test_copy_range()
+{
+  static char src[100 * 1024], want[100 * 1024];
+  sfs_t *fs;
+  int fd, dst, before, used, res;
+  char ch;
+
+  printf("Range copies\n");
+  fill(src, sizeof(src), 31);
+  fs = sfs_mount(TEST_DISK, 1);
+  fd = sfs_fopen_r(fs, "src.bin");
+  sfs_fwrite_r(fs, fd, src, sizeof(src));
+  dst = sfs_fopen_r(fs, "dst.bin");
+  sfs_fseek_r(fs, fd, 5);
+
+  /* Aligned: the whole blocks are shared, not written. */
+  before = free_blocks(fs);
+  res = sfs_copy_range_r(fs, fd, 0, dst, 0, 50 * 1024);
+  if (res != 50 * 1024) {
+    fprintf(stderr, "ERROR: aligned copy returned %d\n", res);
+    error_count++;
+  }
+  used = before - free_blocks(fs);
+  if (used > 4) {
+    fprintf(stderr, "ERROR: an aligned copy of 50 blocks took %d blocks\n", used);
+    error_count++;
+  }
+  if (sfs_fread_r(fs, fd, &ch, 1) != 1 || ch != src[5]) {
+    fprintf(stderr, "ERROR: sfs_copy_range moved the source's rwptr\n");
+    error_count++;
+  }
+  memcpy(want, src, 50 * 1024);
+
+  /* Unaligned ranges are copied byte for byte. */
+  res = sfs_copy_range_r(fs, fd, 17, dst, 50 * 1024 + 5, 30000);
+  if (res != 30000) {
+    fprintf(stderr, "ERROR: unaligned copy returned %d\n", res);
+    error_count++;
+  }
+  memset(want + 50 * 1024, 0, 5);
+  memcpy(want + 50 * 1024 + 5, src + 17, 30000);
+
+  /* A copy stops at the end of the source. */
+  res = sfs_copy_range_r(fs, fd, sizeof(src) - 100, dst, 90 * 1024, 5000);
+  if (res != 100) {
+    fprintf(stderr, "ERROR: copy past the end of the source returned %d, expected 100\n", res);
+    error_count++;
+  }
+  memset(want + 50 * 1024 + 5 + 30000, 0, 90 * 1024 - (50 * 1024 + 5 + 30000));
+  memcpy(want + 90 * 1024, src + sizeof(src) - 100, 100);
+  if (sfs_copy_range_r(fs, fd, 0, fd, 10 * 1024, 20 * 1024) != -1) {
+    fprintf(stderr, "ERROR: copy between overlapping ranges of one file succeeded\n");
+    error_count++;
+  }
+  sfs_fclose_r(fs, dst);
+
+  /* Writing the copy leaves the source alone. */
+  dst = sfs_fopen_r(fs, "dst.bin");
+  sfs_fseek_r(fs, dst, 1000);
+  sfs_fwrite_r(fs, dst, "QQ", 2);
+  memcpy(want + 1000, "QQ", 2);
+  sfs_fclose_r(fs, dst);
+  sfs_fclose_r(fs, fd);
+  check_contents(fs, "src.bin", src, sizeof(src));
+  check_contents(fs, "dst.bin", want, 90 * 1024 + 100);
+  sfs_unmount(fs);
+}
+
+/* sfs_fwritev and sfs_freadv move data to and from several buffers in
+ * one call, as if the segments were one buffer, and advance the rwptr.
+ */
+static void test_vectored_io()
+{
+  static char want[12000], buffer[12000];
+  struct iovec iov[4];
+  sfs_stats stats;
+  sfs_t *fs;
+  int fd, res;
+  char ch;
+
+  printf("Vectored I/O\n");
+  fill(want, sizeof(want), 41);
+  fs = sfs_mount(TEST_DISK, 1);
+  fd = sfs_fopen_r(fs, "vec.bin");
+  sfs_reset_stats_r(fs);
+  iov[0].iov_base = want;
+  iov[0].iov_len = 100;
+  iov[1].iov_base = want + 100;
+  iov[1].iov_len = 0;
+  iov[2].iov_base = want + 100;
+  iov[2].iov_len = 5000;
+  iov[3].iov_base = want + 5100;
+  iov[3].iov_len = sizeof(want) - 5100;
+  res = sfs_fwritev_r(fs, fd, iov, 4);
+  if (res != sizeof(want)) {
+    fprintf(stderr, "ERROR: sfs_fwritev wrote %d bytes, expected %d\n", res, (int) sizeof(want));
+    error_count++;
+  }
+  if (sfs_fwrite_r(fs, fd, "!", 1) != 1 || sfs_getfilesize_r(fs, "vec.bin") != sizeof(want) + 1) {
+    fprintf(stderr, "ERROR: sfs_fwritev did not move the rwptr to the end\n");
+    error_count++;
+  }
+
+  sfs_fseek_r(fs, fd, 0);
+  memset(buffer, 0, sizeof(buffer));
+  iov[0].iov_base = buffer;
+  iov[0].iov_len = 3000;
+  iov[1].iov_base = buffer + 3000;
+  iov[1].iov_len = 1;
+  iov[2].iov_base = buffer + 3001;
+  iov[2].iov_len = sizeof(buffer) - 3001;
+  res = sfs_freadv_r(fs, fd, iov, 3);
+  if (res != sizeof(buffer) || memcmp(buffer, want, sizeof(want)) != 0) {
+    fprintf(stderr, "ERROR: sfs_freadv read %d bytes back wrong\n", res);
+    error_count++;
+  }
+  if (sfs_fread_r(fs, fd, &ch, 1) != 1 || ch != '!') {
+    fprintf(stderr, "ERROR: sfs_freadv did not move the rwptr\n");
+    error_count++;
+  }
+  sfs_get_stats_r(fs, &stats);
+  if (stats.ops[SFS_OP_WRITEV].count != 1 || stats.ops[SFS_OP_READV].count != 1
+      || stats.ops[SFS_OP_WRITEV].bytes != sizeof(want)) {
+    fprintf(stderr, "ERROR: vectored calls were not counted as such\n");
+    error_count++;
+  }
+  sfs_fclose_r(fs, fd);
+  sfs_unmount(fs);
+}
+
+/* sfs_pread and sfs_pwrite work at the offset they are given and leave
+ * the descriptor's rwptr where it was.
+ */
+static void test_positional_io()
+{
+  static char want[100 * 1024], buffer[100 * 1024];
+  sfs_t *fs;
+  int fd;
+
+  printf("Positional I/O\n");
+  fill(want, sizeof(want), 51);
+  fs = sfs_mount(TEST_DISK, 1);
+  fd = sfs_fopen_r(fs, "pos.bin");
+  if (sfs_pwrite_r(fs, fd, want, 30, 0) != 30
+      || sfs_pwrite_r(fs, fd, want + 30, sizeof(want) - 30, 30) != sizeof(want) - 30) {
+    fprintf(stderr, "ERROR: sfs_pwrite failed\n");
+    error_count++;
+  }
+  if (sfs_pwrite_r(fs, fd, "x", 1, -1) != 0) {
+    fprintf(stderr, "ERROR: sfs_pwrite at a negative offset succeeded\n");
+    error_count++;
+  }
+  /* The rwptr of the new file is still at 0. */
+  if (sfs_fread_r(fs, fd, buffer, 5) != 5 || memcmp(buffer, want, 5) != 0) {
+    fprintf(stderr, "ERROR: sfs_pwrite moved the rwptr\n");
+    error_count++;
+  }
+
+  if (sfs_pread_r(fs, fd, buffer, sizeof(buffer), 0) != sizeof(buffer)
+      || memcmp(buffer, want, sizeof(want)) != 0) {
+    fprintf(stderr, "ERROR: sfs_pread of the whole file is wrong\n");
+    error_count++;
+  }
+  if (sfs_pread_r(fs, fd, buffer, 1000, 50000) != 1000 || memcmp(buffer, want + 50000, 1000) != 0) {
+    fprintf(stderr, "ERROR: sfs_pread in the middle of the file is wrong\n");
+    error_count++;
+  }
+  if (sfs_pread_r(fs, fd, buffer, 1000, sizeof(want) - 10) != 10) {
+    fprintf(stderr, "ERROR: sfs_pread did not stop at the end of the file\n");
+    error_count++;
+  }
+  if (sfs_pread_r(fs, fd, buffer, 10, sizeof(want)) != 0) {
+    fprintf(stderr, "ERROR: sfs_pread at the end of the file returned data\n");
+    error_count++;
+  }
+  if (sfs_fread_r(fs, fd, buffer, 5) != 5 || memcmp(buffer, want + 5, 5) != 0) {
+    fprintf(stderr, "ERROR: sfs_pread moved the rwptr\n");
+    error_count++;
+  }
+
+  /* Writing past the end leaves a hole. */
+  sfs_pwrite_r(fs, fd, "hole", 4, 150 * 1024);
+  if (sfs_getfilesize_r(fs, "pos.bin") != 150 * 1024 + 4) {
+    fprintf(stderr, "ERROR: sfs_pwrite past the end gave size %d\n", sfs_getfilesize_r(fs, "pos.bin"));
+    error_count++;
+  }
+  memset(buffer, 1, 10);
+  if (sfs_pread_r(fs, fd, buffer, 10, 120 * 1024) != 10 || buffer[0] != 0 || buffer[9] != 0) {
+    fprintf(stderr, "ERROR: hole left by sfs_pwrite does not read as zeros\n");
+    error_count++;
+  }
+  sfs_fclose_r(fs, fd);
+  sfs_unmount(fs);
+}
+
+/* sfs_mmap hands out a range of a file as memory that stays readable
+ * until sfs_munmap, also after the file is closed.
+ */
+static void test_mmap()
+{
+  static char want[100 * 1024];
+  const char *frame, *image, *copy, *tiny;
+  sfs_t *fs;
+  int fd, other;
+
+  printf("Mapped files\n");
+  fill(want, sizeof(want), 61);
+  fs = sfs_mount(TEST_DISK, 1);
+  fd = sfs_fopen_r(fs, "map.bin");
+  sfs_fwrite_r(fs, fd, want, 11 * 1024);
+  other = sfs_fopen_r(fs, "other.bin");
+  sfs_fwrite_r(fs, other, want, 3000);
+  sfs_fclose_r(fs, other);
+  sfs_fwrite_r(fs, fd, want + 11 * 1024, sizeof(want) - 11 * 1024);
+
+  /* Inside one block, over contiguous blocks and over scattered ones. */
+  frame = sfs_mmap_r(fs, fd, 100, 500);
+  image = sfs_mmap_r(fs, fd, 1000, 8000);
+  copy = sfs_mmap_r(fs, fd, 0, sizeof(want));
+  if (frame == NULL || memcmp(frame, want + 100, 500) != 0) {
+    fprintf(stderr, "ERROR: view inside one block is wrong\n");
+    error_count++;
+  }
+  if (image == NULL || memcmp(image, want + 1000, 8000) != 0) {
+    fprintf(stderr, "ERROR: view over contiguous blocks is wrong\n");
+    error_count++;
+  }
+  if (copy == NULL || memcmp(copy, want, sizeof(want)) != 0) {
+    fprintf(stderr, "ERROR: view over the whole file is wrong\n");
+    error_count++;
+  }
+  if (sfs_mmap_r(fs, fd, 0, sizeof(want) + 1) != NULL || sfs_mmap_r(fs, fd, -1, 1) != NULL) {
+    fprintf(stderr, "ERROR: mapped a range outside the file\n");
+    error_count++;
+  }
+
+  /* A view stays valid after the file is closed. */
+  sfs_fclose_r(fs, fd);
+  if (image != NULL && memcmp(image, want + 1000, 8000) != 0) {
+    fprintf(stderr, "ERROR: view changed when the file was closed\n");
+    error_count++;
+  }
+  if (sfs_munmap_r(fs, frame) != 0 || sfs_munmap_r(fs, image) != 0 || sfs_munmap_r(fs, copy) != 0) {
+    fprintf(stderr, "ERROR: sfs_munmap failed\n");
+    error_count++;
+  }
+  if (sfs_munmap_r(fs, frame) != -1) {
+    fprintf(stderr, "ERROR: unmapped a view twice\n");
+    error_count++;
+  }
+
+  fd = sfs_fopen_r(fs, "tiny.txt");
+  sfs_fwrite_r(fs, fd, "hello", 5);
+  tiny = sfs_mmap_r(fs, fd, 1, 3);
+  if (tiny == NULL || memcmp(tiny, "ell", 3) != 0) {
+    fprintf(stderr, "ERROR: view of an inline file is wrong\n");
+    error_count++;
+  }
+  /* Unmounting drops the views still out. */
+  sfs_unmount(fs);
+}
+
+/* sfs_defrag moves fragmented files into runs of blocks next to each
+ * other and leaves what they read back alone.
+ */
+static void test_defrag()
+{
+  static char want[6][40 * 1024];
+  sfs_defrag_report report;
+  char name[16];
+  int fds[6];
+  sfs_t *fs;
+  int f, off, moved, n, steps, fragmented, runs;
+
+  printf("Defragmentation\n");
+  fs = sfs_mount(TEST_DISK, 1);
+  for (f = 0; f < 6; f++) {
+    fill(want[f], sizeof(want[f]), 70 + f);
+    sprintf(name, "frag%d", f);
+    fds[f] = sfs_fopen_r(fs, name);
+  }
+  /* Interleaved appends scatter every file over the disk. */
+  for (off = 0; off < sizeof(want[0]); off += BLOCK_SIZE) {
+    for (f = 0; f < 6; f++) {
+      sfs_fwrite_r(fs, fds[f], want[f] + off, BLOCK_SIZE);
+    }
+  }
+  for (f = 0; f < 6; f++) {
+    sfs_fclose_r(fs, fds[f]);
+  }
+  sfs_remove_r(fs, "frag2");
+
+  /* Each call moves a few files; the first one sees the mess. */
+  moved = sfs_defrag_r(fs, &report);
+  fragmented = report.fragmented_before;
+  runs = report.runs_before;
+  for (steps = 1; steps < 20 && (n = sfs_defrag_r(fs, &report)) > 0; steps++) {
+    moved += n;
+  }
+  if (moved <= 0 || fragmented < 5 || report.fragmented_after != 0
+      || report.runs_after >= runs || report.blocks_moved != 0) {
+    fprintf(stderr, "ERROR: sfs_defrag moved %d files in %d calls, %d of %d still fragmented\n",
+            moved, steps, report.fragmented_after, report.files);
+    error_count++;
+  }
+  for (f = 0; f < 6; f++) {
+    if (f != 2) {
+      sprintf(name, "frag%d", f);
+      check_contents(fs, name, want[f], sizeof(want[f]));
+    }
+  }
+  /* Nothing left to do once a call moved nothing. */
+  if (sfs_defrag_r(fs, &report) != 0 || report.blocks_moved != 0) {
+    fprintf(stderr, "ERROR: a finished sfs_defrag moved %d blocks\n", report.blocks_moved);
+    error_count++;
+  }
+  sfs_unmount(fs);
+
+  fs = sfs_mount(TEST_DISK, 0);
+  for (f = 0; f < 6; f++) {
+    if (f != 2) {
+      sprintf(name, "frag%d", f);
+      check_contents(fs, name, want[f], sizeof(want[f]));
+    }
+  }
+  sfs_unmount(fs);
+}
+
+/* A capture records every call in order with its arguments and result,
+ * and sfs_replay runs it again to the same results. sfs_replay is looked
+ * for in the current directory, where `make test3` builds it.
+ */
+static void test_capture_replay()
+{
+  static const int expected[] = {
+    SFS_CAP_MOUNT, SFS_CAP_FOPEN, SFS_CAP_FWRITE, SFS_CAP_PWRITE, SFS_CAP_FSEEK,
+    SFS_CAP_FREAD, SFS_CAP_FCLOSE, SFS_CAP_GETFILESIZE, SFS_CAP_REMOVE, SFS_CAP_UNMOUNT
+  };
+  static char want[5000], buffer[5000];
+  sfs_capture_header header;
+  sfs_capture_rec rec;
+  char line[256];
+  FILE *in;
+  sfs_t *fs;
+  int fd, n, diverged, status;
+
+  printf("Capture and replay\n");
+  fill(want, sizeof(want), 81);
+  unlink(TEST_CAPTURE);
+  if (sfs_capture_start(TEST_CAPTURE) != 0) {
+    fprintf(stderr, "ERROR: cannot start a capture\n");
+    error_count++;
+    return;
+  }
+  fs = sfs_mount(TEST_DISK, 1);
+  fd = sfs_fopen_r(fs, "cap.bin");
+  sfs_fwrite_r(fs, fd, want, sizeof(want));
+  sfs_pwrite_r(fs, fd, want, 100, 6000);
+  sfs_fseek_r(fs, fd, 0);
+  sfs_fread_r(fs, fd, buffer, sizeof(buffer));
+  sfs_fclose_r(fs, fd);
+  sfs_getfilesize_r(fs, "cap.bin");
+  sfs_remove_r(fs, "cap.bin");
+  sfs_unmount(fs);
+  sfs_capture_stop();
+
+  if ((in = fopen(TEST_CAPTURE, "rb")) == NULL) {
+    fprintf(stderr, "ERROR: capture file %s missing\n", TEST_CAPTURE);
+    error_count++;
+    return;
+  }
+  if (fread(&header, sizeof(header), 1, in) != 1 || header.magic != SFS_CAPTURE_MAGIC
+      || header.record_size != sizeof(sfs_capture_rec)) {
+    fprintf(stderr, "ERROR: capture file has a bad header\n");
+    error_count++;
+  }
+  n = 0;
+  while (fread(&rec, sizeof(rec), 1, in) == 1) {
+    if (n >= sizeof(expected) / sizeof(expected[0]) || rec.op != expected[n]) {
+      fprintf(stderr, "ERROR: capture record %d is %s\n", n, sfs_capture_op_name(rec.op));
+      error_count++;
+      break;
+    }
+    if ((rec.op == SFS_CAP_FWRITE && (rec.arg[0] != sizeof(want) || rec.res != sizeof(want)))
+        || (rec.op == SFS_CAP_PWRITE && (rec.arg[0] != 100 || rec.arg[1] != 6000))
+        || (rec.op == SFS_CAP_GETFILESIZE && rec.res != 6100)) {
+      fprintf(stderr, "ERROR: capture record %d (%s) has the wrong arguments or result\n",
+              n, sfs_capture_op_name(rec.op));
+      error_count++;
+    }
+    n++;
+  }
+  fclose(in);
+  if (n != sizeof(expected) / sizeof(expected[0])) {
+    fprintf(stderr, "ERROR: capture holds %d records, expected %d\n",
+            n, (int) (sizeof(expected) / sizeof(expected[0])));
+    error_count++;
+  }
+
+  /* Every replayed call returns what it returned in the capture. */
+  diverged = -1;
+  if ((in = popen("./sfs_replay -j " TEST_CAPTURE, "r")) != NULL) {
+    while (fgets(line, sizeof(line), in) != NULL) {
+      sscanf(line, " \"diverged\": %d", &diverged);
+    }
+    status = pclose(in);
+    if (status != 0 || diverged != 0) {
+      fprintf(stderr, "ERROR: sfs_replay exited with %d and %d diverged calls\n", status, diverged);
+      error_count++;
+    }
+  }
+  else {
+    fprintf(stderr, "ERROR: cannot run ./sfs_replay\n");
+    error_count++;
+  }
+  unlink(TEST_CAPTURE);
+}
+
+/* Small appends wait in the descriptor's append buffer. Seeking, closing
+ * and removing the file deal with what is buffered.
+ */
+static void test_append_buffer()
+{
+  static char want[4000];
+  unsigned long long before;
+  int empty;
+  sfs_t *fs;
+  int fd, i;
+
+  printf("Append buffer\n");
+  fill(want, sizeof(want), 91);
+  fs = sfs_mount(TEST_DISK, 1);
+  empty = free_blocks(fs);
+  fd = sfs_fopen_r(fs, "log.txt");
+  sfs_fwrite_r(fs, fd, want, 2100);
+
+  /* Ten 30 byte appends that stay inside the last block write nothing yet. */
+  before = blocks_written(fs);
+  for (i = 0; i < 10; i++) {
+    if (sfs_fwrite_r(fs, fd, want + 2100 + i * 30, 30) != 30) {
+      fprintf(stderr, "ERROR: small append failed\n");
+      error_count++;
+    }
+  }
+  if (blocks_written(fs) != before) {
+    fprintf(stderr, "ERROR: small appends wrote %llu blocks\n", blocks_written(fs) - before);
+    error_count++;
+  }
+  if (sfs_getfilesize_r(fs, "log.txt") != 2400) {
+    fprintf(stderr, "ERROR: size with buffered appends is %d, expected 2400\n",
+            sfs_getfilesize_r(fs, "log.txt"));
+    error_count++;
+  }
+  /* Seeking writes the buffer out in one block write. */
+  sfs_fseek_r(fs, fd, 0);
+  if (blocks_written(fs) != before + 1) {
+    fprintf(stderr, "ERROR: seek wrote %llu blocks, expected 1\n", blocks_written(fs) - before);
+    error_count++;
+  }
+  check_contents(fs, "log.txt", want, 2400);
+
+  /* So does closing. check_contents() closed the descriptor, opening the
+   * file again lands at its end.
+   */
+  fd = sfs_fopen_r(fs, "log.txt");
+  before = blocks_written(fs);
+  for (i = 0; i < 10; i++) {
+    sfs_fwrite_r(fs, fd, want + 2400 + i * 30, 30);
+  }
+  sfs_fclose_r(fs, fd);
+  if (blocks_written(fs) == before) {
+    fprintf(stderr, "ERROR: close left appends in the buffer\n");
+    error_count++;
+  }
+  check_contents(fs, "log.txt", want, 2700);
+
+  /* Removing a file drops its buffer instead of writing it into the next
+   * file that gets the descriptor.
+   */
+  fd = sfs_fopen_r(fs, "log.txt");
+  sfs_fwrite_r(fs, fd, "stale", 5);
+  if (sfs_remove_r(fs, "log.txt") != 0) {
+    fprintf(stderr, "ERROR: removing a file with buffered appends failed\n");
+    error_count++;
+  }
+  if (free_blocks(fs) != empty) {
+    fprintf(stderr, "ERROR: remove left %d blocks in use\n", empty - free_blocks(fs));
+    error_count++;
+  }
+  fd = sfs_fopen_r(fs, "next.txt");
+  sfs_fwrite_r(fs, fd, want, 100);
+  sfs_fclose_r(fs, fd);
+  check_contents(fs, "next.txt", want, 100);
+  sfs_unmount(fs);
+
+  fs = sfs_mount(TEST_DISK, 0);
+  if (sfs_getfilesize_r(fs, "log.txt") >= 0) {
+    fprintf(stderr, "ERROR: removed file came back after a remount\n");
+    error_count++;
+  }
+  check_contents(fs, "next.txt", want, 100);
+  sfs_unmount(fs);
+}
+
+/* Writeback holds written blocks dirty in the cache; sfs_fsync and
+ * sfs_sync write them out.
+ */
+static void test_writeback()
+{
+  static char first[20000], second[20000];
+  sfs_stats stats;
+  sfs_t *fs;
+  int fd;
+
+  printf("Writeback\n");
+  fill(first, sizeof(first), 101);
+  fill(second, sizeof(second), 102);
+  fs = sfs_mount(TEST_DISK, 1);
+  /* an expiry far longer than the test keeps the thread out of the way */
+  if (sfs_set_writeback_r(fs, 90, 600000) != 0) {
+    fprintf(stderr, "ERROR: sfs_set_writeback failed\n");
+    error_count++;
+  }
+
+  fd = sfs_fopen_r(fs, "first.bin");
+  sfs_fwrite_r(fs, fd, first, sizeof(first));
+  sfs_get_stats_r(fs, &stats);
+  if (stats.dirty_blocks == 0) {
+    fprintf(stderr, "ERROR: writeback left no dirty blocks\n");
+    error_count++;
+  }
+  if (sfs_fsync_r(fs, fd) != 0) {
+    fprintf(stderr, "ERROR: sfs_fsync failed\n");
+    error_count++;
+  }
+  sfs_get_stats_r(fs, &stats);
+  if (stats.dirty_blocks != 0 || stats.writeback_blocks == 0) {
+    fprintf(stderr, "ERROR: sfs_fsync left %llu dirty blocks, wrote back %llu\n",
+            (unsigned long long) stats.dirty_blocks,
+            (unsigned long long) stats.writeback_blocks);
+    error_count++;
+  }
+  sfs_fclose_r(fs, fd);
+
+  fd = sfs_fopen_r(fs, "second.bin");
+  sfs_fwrite_r(fs, fd, second, sizeof(second));
+  sfs_fclose_r(fs, fd);
+  sfs_get_stats_r(fs, &stats);
+  if (stats.dirty_blocks == 0) {
+    fprintf(stderr, "ERROR: writeback left no dirty blocks\n");
+    error_count++;
+  }
+  if (sfs_sync_r(fs) != 0) {
+    fprintf(stderr, "ERROR: sfs_sync failed\n");
+    error_count++;
+  }
+  sfs_get_stats_r(fs, &stats);
+  if (stats.dirty_blocks != 0) {
+    fprintf(stderr, "ERROR: sfs_sync left %llu dirty blocks\n",
+            (unsigned long long) stats.dirty_blocks);
+    error_count++;
+  }
+  sfs_unmount(fs);
+
+  fs = sfs_mount(TEST_DISK, 0);
+  check_contents(fs, "first.bin", first, sizeof(first));
+  check_contents(fs, "second.bin", second, sizeof(second));
+  sfs_unmount(fs);
+}
+
+/* sfs_read_extent hands out contiguous plain blocks in place, where a
+ * pread on the image reads what sfs_pread does; everything else has to
+ * go through sfs_pread.
+ */
+static void test_read_extent()
+{
+  static char want[10 * BLOCK_SIZE], direct[10 * BLOCK_SIZE], through[10 * BLOCK_SIZE];
+  sfs_extent ext;
+  sfs_t *fs;
+  int fd, n;
+
+  printf("Read extent\n");
+  fill(want, sizeof(want), 111);
+  fs = sfs_mount(TEST_DISK, 1);
+  fd = sfs_fopen_r(fs, "plain.bin");
+  sfs_fwrite_r(fs, fd, want, sizeof(want));
+
+  n = sfs_read_extent_r(fs, fd, 100, 8000, &ext);
+  if (n != 8000 || ext.length != 8000 || !ext.in_place) {
+    fprintf(stderr, "ERROR: extent of a contiguous file is %d bytes, in place %d\n", n, ext.in_place);
+    error_count++;
+  }
+  else if (pread(ext.image_fd, direct, ext.length, ext.image_offset) != ext.length
+           || sfs_pread_r(fs, fd, through, ext.length, 100) != ext.length
+           || memcmp(direct, through, ext.length) != 0
+           || memcmp(direct, want + 100, ext.length) != 0) {
+    fprintf(stderr, "ERROR: image at the extent differs from sfs_pread\n");
+    error_count++;
+  }
+  /* the extent never runs past the end of the file */
+  if (sfs_read_extent_r(fs, fd, sizeof(want) - 240, 5000, &ext) != 240 || ext.length != 240) {
+    fprintf(stderr, "ERROR: extent at the end is %d bytes, expected 240\n", ext.length);
+    error_count++;
+  }
+  if (sfs_read_extent_r(fs, fd, sizeof(want), 5000, &ext) != 0) {
+    fprintf(stderr, "ERROR: extent past the end is not empty\n");
+    error_count++;
+  }
+  sfs_fclose_r(fs, fd);
+
+  /* an inline file lives in its inode */
+  fd = sfs_fopen_r(fs, "inline.txt");
+  sfs_fwrite_r(fs, fd, test_str, 20);
+  n = sfs_read_extent_r(fs, fd, 0, 5000, &ext);
+  if (n != 20 || ext.in_place) {
+    fprintf(stderr, "ERROR: inline extent is %d bytes, in place %d\n", n, ext.in_place);
+    error_count++;
+  }
+  sfs_fclose_r(fs, fd);
+
+  /* a hole ends where the first written block starts */
+  fd = sfs_fopen_r(fs, "hole.bin");
+  sfs_fseek_r(fs, fd, 8 * BLOCK_SIZE);
+  sfs_fwrite_r(fs, fd, want, BLOCK_SIZE);
+  n = sfs_read_extent_r(fs, fd, 0, sizeof(want), &ext);
+  if (n != 8 * BLOCK_SIZE || ext.in_place) {
+    fprintf(stderr, "ERROR: hole extent is %d bytes, in place %d\n", n, ext.in_place);
+    error_count++;
+  }
+  sfs_fclose_r(fs, fd);
+  sfs_unmount(fs);
+}
+
+int
+main(int argc, char **argv)
+{
+  test_sparse_files();
+  test_inline_files();
+  test_tail_packing();
+  test_compression();
+  test_dedup();
+  test_checksums();
+  test_snapshots();
+  test_clone();
+  test_copy_range();
+  test_vectored_io();
+  test_positional_io();
+  test_mmap();
+  test_defrag();
+  test_capture_replay();
+  test_append_buffer();
+  test_writeback();
+  test_read_extent();
+
+  unlink(TEST_DISK);
+  fprintf(stderr, "Test program exiting with %d errors\n", error_count);
+  return (error_count);
+}
@@ -0,0 +1,169 @@
+// in-process trace ring buffer and Chrome trace JSON export
+
+#include "sfs_trace.h"
+#include "sfs_stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#define TRACE_RING_SIZE (1 << 16) // events kept, oldest are overwritten
+#define TRACE_RING_MASK (TRACE_RING_SIZE - 1)
+
+typedef struct trace_event {
+	uint64_t seq;       // index+1 once the slot is fully written, 0 while in progress
+	uint64_t ts_ns;
+	uint64_t dur_ns;
+	int64_t a;
+	int64_t b;
+	int64_t c;
+	uint32_t tid;
+	uint16_t type;
+	uint16_t id;
+} trace_event;
+
+int sfs_trace_on = 0;
+static trace_event *ring = NULL;
+static uint64_t ring_head = 0;   // next index to hand out, only ever incremented
+static uint64_t trace_epoch_ns = 0;
+static __thread uint32_t cached_tid = 0;
+static char *dump_path = NULL;
+
+uint64_t trace_now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+static uint32_t current_tid() {
+	if (cached_tid == 0) {
+		cached_tid = (uint32_t) syscall(SYS_gettid);
+	}
+	return cached_tid;
+}
+
+/*
+ * Claims a slot with one atomic increment, so any number of threads can
+ * record at once without a lock. The seq store is the publish step: a
+ * reader only trusts a slot whose seq matches the index it expects.
+ */
+void trace_record(sfs_trace_type type, int id, int64_t a, int64_t b, int64_t c, uint64_t start_ns) {
+	trace_event *r = __atomic_load_n(&ring, __ATOMIC_ACQUIRE);
+	if (r == NULL) {
+		return;
+	}
+	uint64_t now = trace_now_ns();
+	uint64_t idx = __atomic_fetch_add(&ring_head, 1, __ATOMIC_RELAXED);
+	trace_event *ev = &r[idx & TRACE_RING_MASK];
+
+	__atomic_store_n(&ev->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	ev->ts_ns = start_ns != 0 ? start_ns : now;
+	ev->dur_ns = start_ns != 0 ? now - start_ns : 0;
+	ev->a = a;
+	ev->b = b;
+	ev->c = c;
+	ev->tid = current_tid();
+	ev->type = type;
+	ev->id = id;
+	__atomic_store_n(&ev->seq, idx + 1, __ATOMIC_RELEASE);
+}
+
+void sfs_trace_enable(int on) {
+	if (on && ring == NULL) {
+		trace_event *r = calloc(TRACE_RING_SIZE, sizeof(trace_event));
+		if (r == NULL) {
+			return;
+		}
+		trace_epoch_ns = trace_now_ns();
+		__atomic_store_n(&ring, r, __ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&sfs_trace_on, on ? 1 : 0, __ATOMIC_RELEASE);
+}
+
+void sfs_trace_reset() {
+	if (ring != NULL) {
+		memset(ring, 0, TRACE_RING_SIZE*sizeof(trace_event));
+	}
+	__atomic_store_n(&ring_head, 0, __ATOMIC_RELEASE);
+	trace_epoch_ns = trace_now_ns();
+}
+
+static double rel_us(uint64_t ns) {
+	return ns >= trace_epoch_ns ? (ns - trace_epoch_ns)/1000.0 : 0;
+}
+
+/*
+ * Writes the events still held in the ring as a Chrome trace: API calls
+ * become B/E pairs and block I/O becomes complete (X) events nested in them.
+ * Returns the number of events written or -1 if the file can't be opened.
+ */
+int sfs_trace_dump_chrome(const char *path) {
+	FILE *out = fopen(path, "w");
+	if (out == NULL) {
+		return -1;
+	}
+	uint64_t head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+	uint64_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+	int pid = getpid();
+	int written = 0;
+
+	fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	for (uint64_t i = first; ring != NULL && i < head; i++) {
+		trace_event *slot = &ring[i & TRACE_RING_MASK];
+		uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		trace_event ev = *slot;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (seq != i + 1 || __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) {
+			continue; // overwritten or still being written
+		}
+		fprintf(out, "%s", written > 0 ? ",\n" : "");
+		switch (ev.type) {
+		case SFS_EV_ENTER:
+			fprintf(out, "{\"name\":\"%s\",\"cat\":\"api\",\"ph\":\"B\",\"ts\":%.3f,\"pid\":%d,\"tid\":%u,"
+					"\"args\":{\"a\":%lld,\"b\":%lld,\"c\":%lld}}",
+					sfs_op_name(ev.id), rel_us(ev.ts_ns), pid, ev.tid, (long long) ev.a, (long long) ev.b, (long long) ev.c);
+			break;
+		case SFS_EV_EXIT:
+			fprintf(out, "{\"name\":\"%s\",\"cat\":\"api\",\"ph\":\"E\",\"ts\":%.3f,\"pid\":%d,\"tid\":%u,"
+					"\"args\":{\"result\":%lld}}",
+					sfs_op_name(ev.id), rel_us(ev.ts_ns), pid, ev.tid, (long long) ev.a);
+			break;
+		default:
+			fprintf(out, "{\"name\":\"%s %s\",\"cat\":\"io\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u,"
+					"\"args\":{\"block\":%lld,\"nblocks\":%lld}}",
+					ev.type == SFS_EV_READ ? "read" : "write", sfs_region_name(ev.id),
+					rel_us(ev.ts_ns), ev.dur_ns/1000.0, pid, ev.tid, (long long) ev.a, (long long) ev.b);
+			break;
+		}
+		written++;
+	}
+	fprintf(out, "\n]}\n");
+	fclose(out);
+	return written;
+}
+
+static void dump_at_exit() {
+	if (dump_path != NULL) {
+		sfs_trace_dump_chrome(dump_path);
+	}
+}
+
+static void init_from_env_once() {
+	char *path = getenv("SFS_TRACE");
+	if (path == NULL || path[0] == '\0') {
+		return;
+	}
+	dump_path = strdup(path);
+	sfs_trace_enable(1);
+	atexit(dump_at_exit);
+}
+
+// every mount calls this, possibly from several threads at once
+void trace_init_from_env() {
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_once(&once, init_from_env_once);
+}
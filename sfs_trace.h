@@ -0,0 +1,78 @@
+#ifndef _INCLUDE_SFS_TRACE_H_
+#define _INCLUDE_SFS_TRACE_H_
+
+#include <stdint.h>
+
+/*
+ * Tracing for the sfs API and block layer.
+ *
+ * Every probe point is a USDT probe (provider "sfs") when <sys/sdt.h> is
+ * available, so bpftrace can attach to e.g. usdt:./binary:sfs:fread_entry
+ * without rebuilding. Independently, sfs_trace_enable(1) records events into
+ * an in-process lock-free ring buffer that sfs_trace_dump_chrome() writes out
+ * as Chrome trace JSON (chrome://tracing, Perfetto). Disabled, a probe costs
+ * a nop for USDT and one predictable branch for the ring buffer.
+ *
+ * Setting SFS_TRACE=<file> in the environment enables the ring buffer at
+ * mksfs and dumps it to <file> at exit.
+ */
+
+#if !defined(SFS_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define SFS_HAVE_USDT 1
+#endif
+#endif
+
+#ifdef SFS_HAVE_USDT
+#define SFS_USDT1(name, a) DTRACE_PROBE1(sfs, name, a)
+#define SFS_USDT2(name, a, b) DTRACE_PROBE2(sfs, name, a, b)
+#define SFS_USDT3(name, a, b, c) DTRACE_PROBE3(sfs, name, a, b, c)
+#else
+#define SFS_USDT1(name, a) do {} while (0)
+#define SFS_USDT2(name, a, b) do {} while (0)
+#define SFS_USDT3(name, a, b, c) do {} while (0)
+#endif
+
+typedef enum sfs_trace_type {
+	SFS_EV_ENTER,    // API call started, id = sfs_op, a/b/c = arguments
+	SFS_EV_EXIT,     // API call returned, id = sfs_op, a = result
+	SFS_EV_READ,     // block read span, id = sfs_region, a = block, b = count
+	SFS_EV_WRITE,    // block write span, same fields as SFS_EV_READ
+} sfs_trace_type;
+
+extern int sfs_trace_on;
+
+void trace_record(sfs_trace_type type, int id, int64_t a, int64_t b, int64_t c, uint64_t start_ns);
+
+#define SFS_TRACE_ENTER(name, op, a, b) do { \
+	SFS_USDT2(name##_entry, a, b); \
+	if (__builtin_expect(sfs_trace_on, 0)) trace_record(SFS_EV_ENTER, op, a, b, 0, 0); \
+} while (0)
+
+// for calls with a third argument worth keeping, e.g. sfs_lseek
+#define SFS_TRACE_ENTER3(name, op, a, b, c) do { \
+	SFS_USDT3(name##_entry, a, b, c); \
+	if (__builtin_expect(sfs_trace_on, 0)) trace_record(SFS_EV_ENTER, op, a, b, c, 0); \
+} while (0)
+
+#define SFS_TRACE_EXIT(name, op, res) do { \
+	SFS_USDT1(name##_return, res); \
+	if (__builtin_expect(sfs_trace_on, 0)) trace_record(SFS_EV_EXIT, op, res, 0, 0, 0); \
+} while (0)
+
+// block I/O spans are recorded once they finish; start_ns comes from trace_now_ns()
+#define SFS_TRACE_IO(name, type, region, block, nblocks, start_ns) do { \
+	SFS_USDT3(name, region, block, nblocks); \
+	if (__builtin_expect(sfs_trace_on, 0)) trace_record(type, region, block, nblocks, 0, start_ns); \
+} while (0)
+
+#define SFS_TRACE_START() (__builtin_expect(sfs_trace_on, 0) ? trace_now_ns() : 0)
+
+uint64_t trace_now_ns();
+void sfs_trace_enable(int on);
+void sfs_trace_reset();
+int sfs_trace_dump_chrome(const char *path);
+void trace_init_from_env();
+
+#endif //_INCLUDE_SFS_TRACE_H_